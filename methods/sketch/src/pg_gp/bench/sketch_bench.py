@@ -0,0 +1,308 @@
+#!/usr/bin/env python
+#
+# Accuracy and throughput benchmark for the MADlib sketch aggregates.
+#
+# Generates synthetic int8 columns (uniform, Zipfian, and adversarial ones)
+# in temporary tables, and for each sketch and column reports
+#   - rows/s:   rows aggregated per second into the sketch
+#   - ns/row:   cost per row over a plain count(v) of the same table
+#   - bytes:    size of the finished sketch
+#   - merge_us: time to merge one partial sketch, from --parts of them
+#   - error:    the error of the sketch against the exact answer, and of
+#               the sketch merged from the partial ones
+# Timings are the best of --repeat runs.  The data is reproducible for a
+# given --seed (in Greenplum, for a given number of segments), so runs
+# before and after a change to the sketches can be compared.
+#
+# Usage: sketch_bench.py --help
+
+import sys
+import os
+import time
+import argparse
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                '..', '..', '..', '..', '..'))
+try:
+    from madpy.madpack import configyml
+except ImportError:
+    sys.stderr.write("unable to import madpy. Please check your $PYTHONPATH\n")
+    sys.exit(1)
+
+#
+# Data sets: SQL expressions for a column v of int8, given the number of
+# distinct values d and the Zipf exponent s.
+#
+ZIPF = "floor(power(1 + random() * (power({d} + 1.0, 1 - {s}) - 1), " \
+       "1 / (1 - {s})))::int8"
+DATASETS = [
+    # every value equally likely
+    ('uniform', "floor(random() * {d})::int8", False),
+    # value i has frequency proportional to i^-s
+    ('zipf', ZIPF, False),
+    # Zipfian, arriving in sorted order: each value is seen in one run,
+    # the worst order for sketches that evict infrequent values
+    ('sorted', ZIPF, True),
+    # uniform values in the high 32 bits: only a good hash spreads them
+    ('strided', "(floor(random() * {d})::int8 * 4294967296)", False),
+]
+
+#
+# Error metrics.  {sk} is a table holding one sketch s, {truth} the exact
+# (v, n) counts of the data, {ranges} ten (lo, hi) ranges of about equal
+# count, {rows} the number of rows, {k} the number of frequent values.
+#
+DCOUNT_ERR = ("dcount rel err",
+    """SELECT abs({m}.{est}(s) - T.d) / T.d
+         FROM {sk}, (SELECT count(*)::float8 AS d FROM {truth}) AS T""")
+CM_COUNT_ERR = ("count rel err, top k",
+    """SELECT avg(abs({m}.cmsketch_estimate_count(s, T.v) - T.n)::float8 / T.n)
+         FROM {sk}, (SELECT v, n FROM {truth} ORDER BY n DESC, v LIMIT {k}) AS T""")
+CM_RANGE_ERR = ("rangecount err / rows",
+    """SELECT avg(abs({m}.cmsketch_estimate_rangecount(s, R.lo, R.hi)
+                      - (SELECT sum(n) FROM {truth} WHERE v BETWEEN R.lo AND R.hi)))
+              / {rows}
+         FROM {sk}, {ranges} AS R""")
+CM_CENTILE_ERR = ("centile rank err",
+    """SELECT avg(greatest(0, C.lt / {rows} - C.c / 100.0,
+                              C.c / 100.0 - C.le / {rows}))
+         FROM (SELECT c,
+                      coalesce((SELECT sum(n) FROM {truth} WHERE v < e), 0) AS lt,
+                      coalesce((SELECT sum(n) FROM {truth} WHERE v <= e), 0) AS le
+                 FROM (SELECT c, {m}.cmsketch_estimate_centile(s, c) AS e
+                         FROM {sk}, generate_series(10, 90, 10) AS G(c)) AS E
+              ) AS C""")
+MFV_EST = """SELECT h[i][0]::int8 AS v, h[i][1]::float8 AS n
+               FROM (SELECT {m}.mfvsketch_estimate_histogram(s) AS h FROM {sk}) AS S,
+                    generate_series(0, {k} - 1) AS G(i)
+              WHERE h[i][0] IS NOT NULL"""
+MFV_RECALL_ERR = ("1 - recall of top k",
+    """SELECT 1 - count(*)::float8 / {k}
+         FROM (""" + MFV_EST + """) AS E,
+              (SELECT v FROM {truth} ORDER BY n DESC, v LIMIT {k}) AS T
+        WHERE E.v = T.v""")
+MFV_COUNT_ERR = ("count rel err",
+    """SELECT avg(abs(E.n - T.n) / T.n)
+         FROM (""" + MFV_EST + """) AS E, {truth} AS T
+        WHERE E.v = T.v""")
+
+#
+# Sketches: name, aggregate building a storable sketch, aggregate merging
+# stored sketches, error metrics.  The CountMin variants have the same
+# shape, so that their update modes can be compared.
+#
+SKETCHES = [
+    ('fmsketch', "{m}.fmsketch(v)", "{m}.fmsketch_union",
+     [(DCOUNT_ERR[0], DCOUNT_ERR[1].replace('{est}', 'fmsketch_estimate'))]),
+    ('hllsketch', "{m}.hllsketch(v)", "{m}.hllsketch_union",
+     [(DCOUNT_ERR[0], DCOUNT_ERR[1].replace('{est}', 'hllsketch_estimate'))]),
+    ('cmsketch', "{m}.cmsketch(v, 0.003, 0.001, 'countmin')", "{m}.cmsketch_union",
+     [CM_COUNT_ERR, CM_RANGE_ERR, CM_CENTILE_ERR]),
+    ('cmsketch:conservative', "{m}.cmsketch(v, 0.003, 0.001, 'conservative')",
+     "{m}.cmsketch_union", [CM_COUNT_ERR, CM_RANGE_ERR, CM_CENTILE_ERR]),
+    ('cmsketch:countsketch', "{m}.cmsketch(v, 0.003, 0.001, 'countsketch')",
+     "{m}.cmsketch_union", [CM_COUNT_ERR, CM_RANGE_ERR, CM_CENTILE_ERR]),
+    ('mfvsketch', "{m}.mfvsketch(v, {k})", "{m}.mfvsketch_union",
+     [MFV_RECALL_ERR, MFV_COUNT_ERR]),
+    ('mfvsketch:conservative', "{m}.mfvsketch(v, {k}, 0.003, 0.001, 'conservative')",
+     "{m}.mfvsketch_union", [MFV_RECALL_ERR, MFV_COUNT_ERR]),
+]
+
+COLUMNS = ['sketch', 'dataset', 'rows/s', 'ns/row', 'bytes', 'merge_us',
+           'metric', 'error', 'merged']
+
+
+#
+# Arguments
+#
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="Measure throughput, size, merge cost and error of the "
+                    "MADlib sketch aggregates on synthetic data.")
+    parser.add_argument('-c', '--conf', default=None,
+                        help="directory of the Config.yml holding the database "
+                             "connection (default: madpy)")
+    parser.add_argument('--schema', default=None,
+                        help="schema of MADlib (default: target_schema of Config.yml)")
+    parser.add_argument('--rows', type=int, default=1000000,
+                        help="rows per data set (default: %(default)s)")
+    parser.add_argument('--distinct', type=int, default=100000,
+                        help="number of possible values (default: %(default)s)")
+    parser.add_argument('--zipf', type=float, default=1.1,
+                        help="exponent of the Zipfian data sets (default: %(default)s)")
+    parser.add_argument('-k', type=int, default=10,
+                        help="number of frequent values (default: %(default)s)")
+    parser.add_argument('--parts', type=int, default=16,
+                        help="partial sketches to merge (default: %(default)s)")
+    parser.add_argument('--repeat', type=int, default=3,
+                        help="runs of each timing, of which the best is reported "
+                             "(default: %(default)s)")
+    parser.add_argument('--seed', type=float, default=0.42,
+                        help="seed of the data, between -1 and 1 (default: %(default)s)")
+    parser.add_argument('--datasets', default=','.join(d[0] for d in DATASETS),
+                        help="comma-separated data sets (default: %(default)s)")
+    parser.add_argument('--sketches', default=None,
+                        help="comma-separated sketches (default: all of %s)"
+                             % ','.join(s[0] for s in SKETCHES))
+    parser.add_argument('--csv', action='store_true',
+                        help="print comma-separated values instead of a table")
+    args = parser.parse_args()
+    if args.seed < -1 or args.seed > 1:
+        parser.error("--seed must be between -1 and 1")
+    if args.zipf == 1:
+        parser.error("--zipf must not be 1")
+    for name in args.datasets.split(','):
+        if name not in [d[0] for d in DATASETS]:
+            parser.error("unknown data set: " + name)
+    if args.sketches:
+        for name in args.sketches.split(','):
+            if name not in [s[0] for s in SKETCHES]:
+                parser.error("unknown sketch: " + name)
+    return args
+
+
+#
+# Database access, configured as for madpack
+#
+def connect(conf_dir):
+    # the methods need not be installed alongside, so skip their dependencies
+    conf = configyml.get_config(conf_dir, True)
+    api = conf['dbapi2']
+    try:
+        dbapi2 = __import__(api, globals(), locals(), [''])
+    except ImportError:
+        dbapi2 = __import__(api[api.rfind('.') + 1:], globals(), locals(), [''])
+    con_args = {}
+    for arg in conf['connect_args']:
+        arg = arg.replace("'", "").replace('"', '').replace(' ', '')
+        equal_sign = arg.find('=')
+        if equal_sign == -1:
+            raise ValueError("missing '=' in connect_args parameter: " + arg)
+        con_args[arg[:equal_sign]] = arg[equal_sign + 1:]
+    return dbapi2.connect(**con_args), conf['target_schema']
+
+
+## run a statement, and return the first column of its first row if any
+def query(cur, sql):
+    cur.execute(sql)
+    if cur.description is None:
+        return None
+    row = cur.fetchone()
+    return row[0] if row else None
+
+
+## the best time of repeated runs of a query
+def timed(cur, sql, repeat):
+    best = None
+    for i in range(repeat):
+        start = time.time()
+        cur.execute(sql)
+        cur.fetchall()
+        elapsed = time.time() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+## make the data set, its exact counts and its ranges of about equal count
+def make_dataset(cur, name, expr, ordered, args):
+    data, truth, ranges = ('bench_data_' + name, 'bench_truth_' + name,
+                           'bench_ranges_' + name)
+    expr = expr.format(d=args.distinct, s=args.zipf)
+    query(cur, "SELECT setseed(%r)" % args.seed)
+    if ordered:
+        query(cur, """CREATE TEMP TABLE %s AS
+                      SELECT row_number() OVER (ORDER BY v) AS id, v
+                        FROM (SELECT %s AS v FROM generate_series(1, %d)) AS G
+                       ORDER BY id""" % (data, expr, args.rows))
+    else:
+        query(cur, """CREATE TEMP TABLE %s AS
+                      SELECT i::int8 AS id, %s AS v
+                        FROM generate_series(1, %d) AS G(i)""" % (data, expr, args.rows))
+    query(cur, """CREATE TEMP TABLE %s AS
+                  SELECT v, count(*) AS n FROM %s GROUP BY v""" % (truth, data))
+    query(cur, """CREATE TEMP TABLE %s AS
+                  SELECT min(v) AS lo, max(v) AS hi
+                    FROM (SELECT v, ntile(10) OVER (ORDER BY v) AS b FROM %s) AS B
+                   GROUP BY b""" % (ranges, data))
+    query(cur, "ANALYZE %s" % data)
+    return data, truth, ranges
+
+
+## measure one sketch on one data set, and return the rows of the report
+def bench(cur, sketch, dataset, tables, args, schema):
+    name, build, union, metrics = sketch
+    data, truth, ranges = tables
+    build = build.format(m=schema, k=args.k)
+    union = union.format(m=schema)
+
+    scan = timed(cur, "SELECT count(v) FROM %s" % data, args.repeat)
+    agg = timed(cur, "SELECT octet_length(%s::bytea) FROM %s" % (build, data),
+                args.repeat)
+
+    for t in ['bench_sketch', 'bench_parts', 'bench_merged']:
+        query(cur, "DROP TABLE IF EXISTS %s" % t)
+    query(cur, "CREATE TEMP TABLE bench_sketch AS SELECT %s AS s FROM %s"
+               % (build, data))
+    nbytes = query(cur, "SELECT octet_length(s::bytea) FROM bench_sketch")
+    query(cur, """CREATE TEMP TABLE bench_parts AS
+                  SELECT mod(id, %d) AS p, %s AS s FROM %s GROUP BY 1"""
+               % (args.parts, build, data))
+    merge = timed(cur, "SELECT octet_length(%s(s)::bytea) FROM bench_parts" % union,
+                  args.repeat)
+    query(cur, "CREATE TEMP TABLE bench_merged AS SELECT %s(s) AS s FROM bench_parts"
+               % union)
+
+    rows = []
+    for metric, sql in metrics:
+        errs = []
+        for sk in ['bench_sketch', 'bench_merged']:
+            errs.append(query(cur, sql.format(m=schema, sk=sk, truth=truth,
+                                              ranges=ranges, rows=float(args.rows),
+                                              k=args.k)))
+        rows.append([name, dataset, args.rows / agg, (agg - scan) * 1e9 / args.rows,
+                     nbytes, merge * 1e6 / args.parts, metric] + errs)
+    return rows
+
+
+def format_row(row, csv):
+    cells = []
+    for v in row:
+        if isinstance(v, float):
+            cells.append('%.4g' % v)
+        elif v is None:
+            cells.append('')
+        else:
+            cells.append(str(v))
+    if csv:
+        return ','.join(cells)
+    widths = [22, 8, 10, 8, 9, 9, 22, 10, 10]
+    return ' '.join(c.ljust(w) if i in (0, 1, 6) else c.rjust(w)
+                    for i, (c, w) in enumerate(zip(cells, widths)))
+
+
+def main():
+    args = parse_args()
+    conf_dir = args.conf or os.path.join(os.path.dirname(configyml.__file__), '..')
+    dbconn, schema = connect(conf_dir)
+    schema = args.schema or schema
+    sketches = [s for s in SKETCHES
+                if not args.sketches or s[0] in args.sketches.split(',')]
+
+    cur = dbconn.cursor()
+    print(format_row(COLUMNS, args.csv))
+    for dataset, expr, ordered in DATASETS:
+        if dataset not in args.datasets.split(','):
+            continue
+        tables = make_dataset(cur, dataset, expr, ordered, args)
+        for sketch in sketches:
+            for row in bench(cur, sketch, dataset, tables, args, schema):
+                print(format_row(row, args.csv))
+                sys.stdout.flush()
+    # everything lives in temporary tables of this transaction
+    dbconn.rollback()
+    dbconn.close()
+
+
+if __name__ == '__main__':
+    main()
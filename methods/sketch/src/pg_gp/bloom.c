@@ -0,0 +1,360 @@
+/*!
+ * \file bloom.c
+ *
+ * \brief Bloom filter implementation
+ */
+/*!
+ * \implementation
+ * A Bloom filter is an array of m bits in which each value sets k bits,
+ * picked by k hash functions.  A value whose k bits are all set may be in
+ * the set, with a false positive probability of about
+ * (1 - e^(-kn/m))^k after n distinct values; a value with any bit clear is
+ * certainly not.  For n expected values and a false positive probability
+ * p, the filter takes m = -n ln(p) / ln(2)^2 bits and k = (m/n) ln(2)
+ * hash functions, which leaves about half the bits set.
+ *
+ * The k bit positions come from the two 64-bit halves h1, h2 of the
+ * sketch hash of a value, as h1 + i*h2 for i = 0..k-1 (Kirsch and
+ * Mitzenmacher), each scaled to [0, m) by a multiply and shift rather than
+ * a division.  A probe therefore costs one hash and at most k cache line
+ * reads.  Filters with the same m, k and input type are unioned by OR-ing
+ * their bits.
+ *
+ * \literature
+ * [1] B. Bloom.  Space/Time Trade-offs in Hash Coding with Allowable
+ *     Errors.  CACM 13(7), 1970.
+ * [2] A. Kirsch and M. Mitzenmacher.  Less Hashing, Same Performance:
+ *     Building a Better Bloom Filter.  ESA 2006.
+ */
+
+#include "postgres.h"
+#include "utils/elog.h"
+#include "utils/memutils.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include <math.h>
+
+/*! largest number of bits: positions are scaled from 32 bits of hash */
+#define BLOOM_MAX_BITS   (UINT64CONST(1) << 32)
+#define BLOOM_MAX_HASHES 32
+
+/*!
+ * \internal
+ * \brief transition value struct for Bloom filters, also used as the
+ * serialized <c>bloom_filter</c> type.
+ *
+ * It is followed by the nbits bits of the filter, as uint64 words.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;      /*! SKETCH_MAGIC_BLOOM */
+    int32  hashver;    /*! SKETCH_HASH_* version used to build the filter */
+    uint64 nbits;      /*! number of bits, a multiple of 64 */
+    Oid    typOid;     /*! Oid of the data type of the values */
+    uint32 nhashes;    /*! number of bits set by each value */
+} bloomtransval;
+
+/*!
+ * the transval follows the varlena header after padding that aligns it,
+ * and the bits after it, in memory
+ */
+#define BLOOM_TRANSVAL(blob) ((bloomtransval *)((char *)(blob) + MAXALIGN(VARHDRSZ)))
+#define BLOOM_BITS(t) ((uint64 *)((char *)(t) + MAXALIGN(sizeof(bloomtransval))))
+/*! size of a Bloom transval of nbits bits */
+#define BLOOM_TRANSVAL_SZ(nbits) \
+    (MAXALIGN(VARHDRSZ) + MAXALIGN(sizeof(bloomtransval)) + (nbits)/CHAR_BIT)
+
+/*!
+ * \internal
+ * \brief a filter argument that was stored out of line, kept detoasted
+ * across the calls of bloom_contains that probe it
+ * \endinternal
+ */
+typedef struct {
+    bytea *filter;     /*! the detoasted filter */
+    Size   ptrlen;     /*! length of the toast pointer it was fetched by */
+    char   ptr[1];     /*! the toast pointer, which identifies the stored value */
+} bloomcache;
+
+Datum __bloom_trans(PG_FUNCTION_ARGS);
+Datum __bloom_merge(PG_FUNCTION_ARGS);
+Datum __bloom_final(PG_FUNCTION_ARGS);
+Datum bloom_contains(PG_FUNCTION_ARGS);
+bytea *bloom_new(int64, float8, Oid);
+void   bloom_check(bytea *);
+bool   bloom_test_c(bloomtransval *, uint64 *);
+
+/*!
+ * allocate an empty Bloom filter sized for a number of values and a
+ * false positive probability
+ * \param expected_n the expected number of distinct values
+ * \param fpp the false positive probability at expected_n values
+ * \param typOid the type of the values
+ */
+bytea *bloom_new(int64 expected_n, float8 fpp, Oid typOid)
+{
+    float8         bits, hashes;
+    uint64         nbits;
+    bytea         *blob;
+    bloomtransval *transval;
+
+    if (expected_n < 1)
+        elog(ERROR,
+             "Bloom filter expected number of values must be positive, was "
+             INT64_FORMAT, expected_n);
+    if (!(fpp > 0 && fpp < 1))
+        elog(ERROR,
+             "Bloom filter false positive probability must be between 0 and 1, was %g",
+             fpp);
+
+    bits = ceil(-(float8)expected_n * log(fpp) / (M_LN2 * M_LN2));
+    if (bits > BLOOM_MAX_BITS
+        || BLOOM_TRANSVAL_SZ(bits) > MaxAllocSize)
+        elog(ERROR,
+             "Bloom filter for " INT64_FORMAT " values with false positive probability %g is too large",
+             expected_n, fpp);
+    /* whole words */
+    nbits = ((uint64)bits + 63) & ~UINT64CONST(63);
+    hashes = rint((float8)nbits / expected_n * M_LN2);
+
+    blob = (bytea *)palloc0(BLOOM_TRANSVAL_SZ(nbits));
+    SET_VARSIZE(blob, BLOOM_TRANSVAL_SZ(nbits));
+    transval = BLOOM_TRANSVAL(blob);
+    transval->magic = SKETCH_MAGIC_BLOOM;
+    transval->hashver = SKETCH_HASH_CURRENT;
+    transval->nbits = nbits;
+    transval->typOid = typOid;
+    transval->nhashes = (uint32)Max(1, Min(hashes, BLOOM_MAX_HASHES));
+    return blob;
+}
+
+/*!
+ * sanity-check a serialized Bloom filter, which may have come from a table.
+ * \param blob a bytea holding a bloomtransval
+ */
+void bloom_check(bytea *blob)
+{
+    bloomtransval *transval = BLOOM_TRANSVAL(blob);
+
+    if (VARSIZE(blob) < BLOOM_TRANSVAL_SZ(0))
+        elog(ERROR, "invalid Bloom filter");
+    sketch_require_tag((char *)transval, sizeof(bloomtransval),
+                       SKETCH_MAGIC_BLOOM, "Bloom filter");
+    if (transval->nbits == 0 || transval->nbits > BLOOM_MAX_BITS
+        || transval->nbits % 64 != 0
+        || transval->nhashes < 1 || transval->nhashes > BLOOM_MAX_HASHES
+        || VARSIZE(blob) != BLOOM_TRANSVAL_SZ(transval->nbits))
+        elog(ERROR, "invalid Bloom filter");
+}
+
+/*!
+ * the i'th bit position of a hash in a filter of nbits bits: the top 32
+ * bits of h1 + i*h2, scaled to [0, nbits)
+ */
+#define BLOOM_BIT(hash, i, nbits) \
+    ((((hash)[0] + (uint64)(i)*(hash)[1]) >> 32) * (nbits) >> 32)
+
+/*!
+ * whether all the bits of a hash are set in a filter
+ * \param transval the filter
+ * \param hash the SKETCH_HASHLEN-byte hash of the value, as two uint64s
+ */
+bool bloom_test_c(bloomtransval *transval, uint64 *hash)
+{
+    uint64 *bits = BLOOM_BITS(transval);
+    uint64  b;
+    uint32  i;
+
+    for (i = 0; i < transval->nhashes; i++) {
+        b = BLOOM_BIT(hash, i, transval->nbits);
+        if (!(bits[b / 64] & (UINT64CONST(1) << (b % 64))))
+            return false;
+    }
+    return true;
+}
+
+PG_FUNCTION_INFO_V1(__bloom_trans);
+
+/*!
+ * UDA transition function for bloom_build: args are the transval, the
+ * value, the expected number of values and the false positive probability.
+ */
+Datum __bloom_trans(PG_FUNCTION_ARGS)
+{
+    bytea          *transblob = PG_GETARG_BYTEA_P(0);
+    bloomtransval  *transval;
+    sketch_typinfo *typinfo;
+    uint64          hash[SKETCH_HASHLEN/sizeof(uint64)];
+    uint64         *bits;
+    uint64          b;
+    uint32          i;
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* ignore NULL inputs */
+    if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
+    /* the input type never changes between calls, so it's looked up once */
+    typinfo = sketch_arg_typinfo(fcinfo, 1);
+
+    /* initialize if this is the first call */
+    if (VARSIZE(transblob) <= VARHDRSZ) {
+        if (PG_ARGISNULL(2) || PG_ARGISNULL(3))
+            elog(ERROR, "NULL expected number of values or false positive probability passed to bloom_build");
+        transblob = bloom_new(PG_GETARG_INT64(2), PG_GETARG_FLOAT8(3),
+                              typinfo->typOid);
+    }
+
+    transval = BLOOM_TRANSVAL(transblob);
+    bits = BLOOM_BITS(transval);
+    sketch_hash_contents(PG_GETARG_DATUM(1), typinfo->typLen, typinfo->typByVal,
+                         transval->hashver, (uint8 *)hash);
+    for (i = 0; i < transval->nhashes; i++) {
+        b = BLOOM_BIT(hash, i, transval->nbits);
+        bits[b / 64] |= UINT64CONST(1) << (b % 64);
+    }
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+PG_FUNCTION_INFO_V1(__bloom_merge);
+
+/*!
+ * Greenplum "prefunc" to combine Bloom filters from multiple machines,
+ * and transition function of the bloom_union aggregate.  Inside an
+ * aggregate the second filter is OR-ed into the first in place.
+ */
+Datum __bloom_merge(PG_FUNCTION_ARGS)
+{
+    bytea         *transblob1 = PG_GETARG_SKETCH_P(0);
+    bytea         *transblob2 = PG_GETARG_SKETCH_P(1);
+    bloomtransval *transval1, *transval2;
+    uint64        *bits1, *bits2;
+    uint64         i;
+
+    /* deal with the case where one or both items is the initial value of '' */
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    bloom_check(transblob1);
+    bloom_check(transblob2);
+    transval1 = BLOOM_TRANSVAL(transblob1);
+    transval2 = BLOOM_TRANSVAL(transblob2);
+    if (transval1->hashver != transval2->hashver)
+        elog(ERROR,
+             "cannot merge Bloom filters built with different hash functions: %d, %d",
+             transval1->hashver, transval2->hashver);
+    if (transval1->typOid != transval2->typOid)
+        elog(ERROR,
+             "cannot merge Bloom filters over different types: %u, %u",
+             transval1->typOid, transval2->typOid);
+    if (transval1->nbits != transval2->nbits
+        || transval1->nhashes != transval2->nhashes)
+        elog(ERROR,
+             "cannot merge Bloom filters of different sizes: "
+             UINT64_FORMAT " bits with %u hashes, " UINT64_FORMAT " bits with %u hashes",
+             transval1->nbits, transval1->nhashes,
+             transval2->nbits, transval2->nhashes);
+
+    if (!(fcinfo->context && IsA(fcinfo->context, AggState))) {
+        /* allocate a new transval as a copy of transblob1 */
+        bytea *newblob = (bytea *)palloc(VARSIZE(transblob1));
+
+        memcpy(newblob, transblob1, VARSIZE(transblob1));
+        transblob1 = newblob;
+        transval1 = BLOOM_TRANSVAL(transblob1);
+    }
+    bits1 = BLOOM_BITS(transval1);
+    bits2 = BLOOM_BITS(transval2);
+    for (i = 0; i < transval1->nbits / 64; i++)
+        bits1[i] |= bits2[i];
+    PG_RETURN_DATUM(PointerGetDatum(transblob1));
+}
+
+PG_FUNCTION_INFO_V1(__bloom_final);
+
+/*! UDA final function producing a storable bloom_filter */
+Datum __bloom_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    /* nothing was ever aggregated */
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+    PG_RETURN_BYTEA_P(transblob);
+}
+
+/*!
+ * the filter argument of bloom_contains.  A filter stored out of line is
+ * fetched on the first call and kept for the following calls with the same
+ * toast pointer, e.g. when it comes from a subquery, so that a probe does
+ * not fetch the whole filter again.
+ * \param fcinfo the call info of bloom_contains
+ * \param typinfo the type information cached for the call site
+ */
+static bytea *bloom_arg_filter(FunctionCallInfo fcinfo, sketch_typinfo *typinfo)
+{
+    struct varlena *raw = (struct varlena *)DatumGetPointer(PG_GETARG_DATUM(0));
+    bloomcache     *cache = (bloomcache *)typinfo->extra;
+    MemoryContext   oldcontext;
+    Size            ptrlen;
+
+    if (!VARATT_IS_EXTERNAL(raw))
+        return PG_GETARG_SKETCH_P(0);
+
+    ptrlen = VARSIZE_ANY(raw);
+    if (cache != NULL && cache->ptrlen == ptrlen
+        && memcmp(cache->ptr, raw, ptrlen) == 0)
+        return cache->filter;
+
+    if (cache != NULL) {
+        pfree(cache->filter);
+        pfree(cache);
+    }
+    oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+    cache = (bloomcache *)palloc(offsetof(bloomcache, ptr) + ptrlen);
+    cache->ptrlen = ptrlen;
+    memcpy(cache->ptr, raw, ptrlen);
+    cache->filter = (bytea *)PG_DETOAST_DATUM(PointerGetDatum(raw));
+    MemoryContextSwitchTo(oldcontext);
+    typinfo->extra = cache;
+    return cache->filter;
+}
+
+PG_FUNCTION_INFO_V1(bloom_contains);
+
+/*!
+ * scalar function testing whether a value may be in a stored bloom_filter.
+ * False means it is certainly not.
+ */
+Datum bloom_contains(PG_FUNCTION_ARGS)
+{
+    sketch_typinfo *typinfo = sketch_arg_typinfo(fcinfo, 1);
+    bytea          *blob = bloom_arg_filter(fcinfo, typinfo);
+    bloomtransval  *transval = BLOOM_TRANSVAL(blob);
+    uint64          hash[SKETCH_HASHLEN/sizeof(uint64)];
+
+    bloom_check(blob);
+    if (transval->typOid != typinfo->typOid)
+        elog(ERROR,
+             "Bloom filter built over type %u; argument over type %u",
+             transval->typOid, typinfo->typOid);
+
+    sketch_hash_contents(PG_GETARG_DATUM(1), typinfo->typLen, typinfo->typByVal,
+                         transval->hashver, (uint8 *)hash);
+    PG_RETURN_BOOL(bloom_test_c(transval, hash));
+}
@@ -4,11 +4,19 @@
  * \brief CountMin sketch implementation
  *
  * \implementation
- * The basic CountMin sketch is a set of DEPTH arrays, each with NUMCOUNTERS counters.
+ * The basic CountMin sketch is a set of depth arrays, each with width counters.
  * The idea is that each of those arrays is used as an independent random trial of the
- * same process: for all the values x in a set, each holds counts of h_i(x) mod NUMCOUNTERS for a different random hash function h_i.
+ * same process: for all the values x in a set, each holds counts of h_i(x) mod width for a different random hash function h_i.
  * Estimates of the count of some value x are based on the <i>minimum</i> counter h_i(x) across
- * the DEPTH arrays (hence the name CountMin.)
+ * the depth arrays (hence the name CountMin.)
+ *
+ * The shape of the sketch is chosen per aggregate call from the requested error
+ * bounds (see cm_shape), defaulting to 8 arrays of 1024 counters, and is kept in
+ * the transition value so that merges and estimators can honour it.
+ * So is its update mode (see CM_MODE_COUNTMIN): a conservative update, which
+ * only raises the smallest of the counters of a value, or a Count-Sketch,
+ * which adds to them with random signs and takes their median, get more
+ * accuracy out of the same counters than the basic sketch on skewed data.
  *
  * Let's call the process described above "sketching" the x's.  To support range
  * lookups, we repeat the basic CountMin sketching process INT64BITS times as follows.
@@ -21,6 +29,20 @@
  * dyadic ranges ({[14-15] as 7 in range 2, [16-31] as 1 in range 16, [32-47] as 2 in range 16, [48-48] as 48 in range 1}).
  * Dyadic ranges are similarly useful for histogramming, order stats, etc.
  *
+ * Most dyadic ranges hold few distinct values: the values x/(2^i) of a column
+ * spanning [lo, hi] take at most (hi-lo)/2^i + 1 distinct values.  So each range
+ * starts out counting its values exactly, in a small array that grows as
+ * needed, and only becomes a sketch when that array would be bigger than one.
+ * Exact ranges cost no hashing, and they make the transition value scale with
+ * the spread of the data rather than always holding RANGES full sketches.
+ * Counters are 32 bits until the number of values counted could overflow them.
+ *
+ * Values are sketched by int64 keys that order as they do (see cm_key_of):
+ * integers are their own keys, floats and numerics their IEEE bits with the
+ * negative ones flipped, and dates and timestamps their internal counts.
+ * Values of other types have no such key.  They are hashed and counted in
+ * dyadic range 0 alone, which answers point counts but not ranges.
+ *
  * The results of the estimators below generally have guarantees of the form
  * "the answer is within \epsilon of the true answer with probability 1-\delta."
  */
@@ -29,8 +51,11 @@
 #include "utils/array.h"
 #include "utils/elog.h"
 #include "utils/builtins.h"
+#include "utils/date.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/numeric.h"
+#include "utils/timestamp.h"
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
@@ -38,17 +63,18 @@
 #include "countmin.h"
 
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
 
-PG_FUNCTION_INFO_V1(__cmsketch_int8_trans);
+PG_FUNCTION_INFO_V1(__cmsketch_trans);
 
 /*
  * This is the UDF interface.  It does sanity checks and preps values
  * for the interesting logic in countmin_dyadic_trans_c
  */
-Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS)
+Datum __cmsketch_trans(PG_FUNCTION_ARGS)
 {
     bytea *     transblob = NULL;
-    cmtransval *transval;
 
     /*
      * This function makes destructive updates to its arguments.
@@ -67,24 +93,480 @@ Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS)
     /* get the provided element, being careful in case it's NULL */
     if (!PG_ARGISNULL(1)) {
         transblob = cmsketch_check_transval(fcinfo, true);
-        transval = (cmtransval *)(VARDATA(transblob));
 
-        /* the following line modifies the contents of transval, and hence transblob */
-        countmin_dyadic_trans_c(transval, PG_GETARG_DATUM(1));
+        /* the following line modifies the contents of transblob, or reallocates it */
+        transblob = countmin_dyadic_trans_c(transblob, PG_GETARG_DATUM(1));
         PG_RETURN_DATUM(PointerGetDatum(transblob));
     }
     else PG_RETURN_DATUM(PointerGetDatum(PG_GETARG_BYTEA_P(0)));
 }
 
+PG_FUNCTION_INFO_V1(__cmsketch_shape_trans);
+
+/*
+ * Transition function for sketches with caller-chosen error bounds:
+ * args are the transval, the value, epsilon and delta, and optionally
+ * the update mode (see cm_mode).
+ */
+Datum __cmsketch_shape_trans(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = PG_GETARG_BYTEA_P(0);
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
+    if (!CM_TRANSVAL_INITIALIZED(transblob)) {
+        int mode = CM_MODE_COUNTMIN;
+
+        if (PG_ARGISNULL(2) || PG_ARGISNULL(3))
+            elog(ERROR, "NULL epsilon or delta passed to cmsketch");
+        if (PG_NARGS() > 4) {
+            if (PG_ARGISNULL(4))
+                elog(ERROR, "NULL mode passed to cmsketch");
+            mode = cm_mode(PG_GETARG_TEXT_P(4));
+        }
+        transblob = cmsketch_init_transval(get_fn_expr_argtype(fcinfo->flinfo, 1),
+                                           cm_shape(PG_GETARG_FLOAT8(2),
+                                                    PG_GETARG_FLOAT8(3)),
+                                           mode);
+        ((cmtransval *)VARDATA(transblob))->nargs = -1;
+    }
+
+    transblob = countmin_dyadic_trans_c(transblob, PG_GETARG_DATUM(1));
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+PG_FUNCTION_INFO_V1(__cmsketch_inv_trans);
+
+/*
+ * Inverse transition function, for the moving-aggregate mode of window
+ * aggregates: takes back a value added by __cmsketch_trans or
+ * __cmsketch_shape_trans, and has the same args.  The counters of the
+ * 'countmin' and 'countsketch' modes are sums, and are decremented exactly.
+ * A conservative update cannot be undone, so we return NULL, which makes
+ * the executor aggregate the window frame again from scratch.
+ */
+Datum __cmsketch_inv_trans(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = PG_GETARG_BYTEA_P(0);
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    int64       val;
+    uint8       hash[SKETCH_HASHLEN];
+    uint64      key;
+    uint32      j;
+    uint32      nranges = RANGES;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+    if (!CM_TRANSVAL_INITIALIZED(transblob))
+        elog(ERROR, "cannot remove a value from an empty CountMin sketch");
+    if (transval->mode == CM_MODE_CONSERVATIVE)
+        PG_RETURN_NULL();
+
+    if (transval->keys == CM_KEYS_HASHED) {
+        /* only dyadic range 0 counts the value, by its hash */
+        nranges = 1;
+        val = 0;
+    }
+    else
+        val = cm_key_of(PG_GETARG_DATUM(1), transval->typOid);
+    for (j = 0; j < nranges; j++) {
+        countmin counters = cm_range_counters(transval, j);
+
+        key = CM_KEY(val >> j);
+        if (transval->ranges[j].span == CM_SKETCHED) {
+            if (transval->keys == CM_KEYS_HASHED)
+                cm_hash_value(transval, PG_GETARG_DATUM(1), hash);
+            else
+                cm_hash_key(val >> j, transval->hashver, hash);
+            cmsketch_add_hash(counters, hash, -1);
+        }
+        else if (key >= transval->ranges[j].base
+                 && key - transval->ranges[j].base < transval->ranges[j].span)
+            CM_ADD_COUNTER(counters, key - transval->ranges[j].base, -1);
+        else
+            elog(ERROR,
+                 "cannot remove a value from a CountMin sketch that never counted it");
+    }
+    transval->total--;
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+/*!
+ * choose the dimensions of a sketch from its error bounds: counts are
+ * overestimated by at most epsilon times the total count, with probability
+ * at least 1-delta.  The width is rounded up to a power of 2, so that a
+ * column can be taken straight from the bits of the hash.
+ * \param epsilon the relative error, between 0 and 1
+ * \param delta the failure probability, between 0 and 1
+ */
+cmshape cm_shape(float8 epsilon, float8 delta)
+{
+    cmshape shape;
+    float8  width, depth;
+
+    if (!(epsilon > 0 && epsilon < 1))
+        elog(ERROR, "CountMin epsilon must be between 0 and 1, was %g", epsilon);
+    if (!(delta > 0 && delta < 1))
+        elog(ERROR, "CountMin delta must be between 0 and 1, was %g", delta);
+
+    width = ceil(M_E / epsilon);
+    depth = ceil(log(1.0 / delta));
+    if (width > CM_MAX_WIDTH)
+        elog(ERROR, "CountMin epsilon must be at least %g, was %g",
+             M_E / CM_MAX_WIDTH, epsilon);
+    if (depth > CM_MAX_DEPTH)
+        elog(ERROR, "CountMin delta must be at least %g, was %g",
+             exp(-CM_MAX_DEPTH), delta);
+
+    shape.depth = (uint32) depth;
+    for (shape.width = 1; shape.width < width; shape.width <<= 1) ;
+    return shape;
+}
+
+/*!
+ * parse the update mode of a sketch: 'countmin', 'conservative' or
+ * 'countsketch' (see CM_MODE_COUNTMIN)
+ * \param modename the name of the mode
+ */
+int cm_mode(text *modename)
+{
+    char *name = text_to_cstring(modename);
+    int   mode;
+
+    if (pg_strcasecmp(name, "countmin") == 0)
+        mode = CM_MODE_COUNTMIN;
+    else if (pg_strcasecmp(name, "conservative") == 0)
+        mode = CM_MODE_CONSERVATIVE;
+    else if (pg_strcasecmp(name, "countsketch") == 0)
+        mode = CM_MODE_COUNTSKETCH;
+    else
+        elog(ERROR,
+             "CountMin mode must be 'countmin', 'conservative' or 'countsketch', was '%s'",
+             name);
+    pfree(name);
+    return mode;
+}
+
+/*!
+ * how cmsketch keys the values of a type (see CM_KEYS_HASHED)
+ * \param typOid the type of the values
+ */
+int cm_key_kind(Oid typOid)
+{
+    switch (typOid) {
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+            return CM_KEYS_INTEGER;
+        case FLOAT4OID:
+        case FLOAT8OID:
+        case NUMERICOID:
+            return CM_KEYS_FLOAT;
+        case DATEOID:
+            return CM_KEYS_DATE;
+        case TIMESTAMPOID:
+            return CM_KEYS_TIMESTAMP;
+        case TIMESTAMPTZOID:
+            return CM_KEYS_TIMESTAMPTZ;
+        default:
+            return CM_KEYS_HASHED;
+    }
+}
+
+/*!
+ * the key of a float: its IEEE bits, with the other bits of negative
+ * numbers flipped so that they order as signed integers.  -0 is 0, and all
+ * NaNs are one key above infinity, as they sort in Postgres.
+ */
+static int64 cm_float_key(float8 x)
+{
+    int64 bits;
+
+    if (isnan(x))
+        return INT64CONST(0x7FF8000000000000);
+    if (x == 0)
+        return 0;
+    memcpy(&bits, &x, sizeof(bits));
+    return (bits < 0) ? bits ^ INT64CONST(0x7FFFFFFFFFFFFFFF) : bits;
+}
+
+/*! the float of a key made by cm_float_key */
+static float8 cm_key_float(int64 key)
+{
+    float8 x;
+
+    if (key < 0)
+        key ^= INT64CONST(0x7FFFFFFFFFFFFFFF);
+    memcpy(&x, &key, sizeof(x));
+    return x;
+}
+
+/*!
+ * the float8 nearest to the value with a given key.  These order as the
+ * keys do, so quantile sketches of them give back keys via cm_float8_key.
+ * \param key the key
+ * \param keys the CM_KEYS_* kind of the key, not CM_KEYS_HASHED
+ */
+float8 cm_key_float8(int64 key, int keys)
+{
+#ifdef HAVE_INT64_TIMESTAMP
+    if (keys == CM_KEYS_FLOAT)
+#else
+    if (keys == CM_KEYS_FLOAT || keys == CM_KEYS_TIMESTAMP
+        || keys == CM_KEYS_TIMESTAMPTZ)
+#endif
+        return cm_key_float(key);
+    return (float8)key;
+}
+
+/*!
+ * the key nearest to a float8: the inverse of cm_key_float8
+ * \param x the float8
+ * \param keys the CM_KEYS_* kind of the key, not CM_KEYS_HASHED
+ */
+int64 cm_float8_key(float8 x, int keys)
+{
+#ifdef HAVE_INT64_TIMESTAMP
+    if (keys == CM_KEYS_FLOAT)
+#else
+    if (keys == CM_KEYS_FLOAT || keys == CM_KEYS_TIMESTAMP
+        || keys == CM_KEYS_TIMESTAMPTZ)
+#endif
+        return cm_float_key(x);
+    /* the extremes of int64 don't round-trip through float8 */
+    if (isnan(x) || x >= (float8)MAX_INT64)
+        return MAX_INT64;
+    if (x <= (float8)MIN_INT64)
+        return MIN_INT64;
+    return (int64)rint(x);
+}
+
+/*!
+ * the int64 key of a value, which orders as the values do.  Numerics are
+ * keyed by their nearest float8, so those that round to the same float8
+ * share a key.
+ * \param dat the value
+ * \param typOid its type, which must not be keyed by CM_KEYS_HASHED
+ */
+int64 cm_key_of(Datum dat, Oid typOid)
+{
+    switch (typOid) {
+        case INT2OID:
+            return DatumGetInt16(dat);
+        case INT4OID:
+            return DatumGetInt32(dat);
+        case INT8OID:
+            return DatumGetInt64(dat);
+        case FLOAT4OID:
+            return cm_float_key(DatumGetFloat4(dat));
+        case FLOAT8OID:
+            return cm_float_key(DatumGetFloat8(dat));
+        case NUMERICOID:
+            return cm_float_key(DatumGetFloat8(DirectFunctionCall1(numeric_float8,
+                                                                   dat)));
+        case DATEOID:
+            return DatumGetDateADT(dat);
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+#ifdef HAVE_INT64_TIMESTAMP
+            return DatumGetTimestamp(dat);
+#else
+            return cm_float_key(DatumGetTimestamp(dat));
+#endif
+        default:
+            elog(ERROR, "cmsketch cannot order values of type %s",
+                 format_type_be(typOid));
+            return 0;
+    }
+}
+
+/*!
+ * the value of a type with a given key: the inverse of cm_key_of
+ * \param key the key
+ * \param typOid the type of the value, which must not be keyed by CM_KEYS_HASHED
+ */
+Datum cm_key_value(int64 key, Oid typOid)
+{
+    switch (typOid) {
+        case INT2OID:
+            if (key < SHRT_MIN || key > SHRT_MAX)
+                elog(ERROR, "value " INT64_FORMAT " out of range for type smallint", key);
+            return Int16GetDatum((int16)key);
+        case INT4OID:
+            if (key < INT_MIN || key > INT_MAX)
+                elog(ERROR, "value " INT64_FORMAT " out of range for type integer", key);
+            return Int32GetDatum((int32)key);
+        case INT8OID:
+            return Int64GetDatum(key);
+        case FLOAT4OID:
+            return Float4GetDatum((float4)cm_key_float(key));
+        case FLOAT8OID:
+            return Float8GetDatum(cm_key_float(key));
+        case NUMERICOID:
+            return DirectFunctionCall1(float8_numeric,
+                                       Float8GetDatum(cm_key_float(key)));
+        case DATEOID:
+            return DateADTGetDatum((DateADT)key);
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+#ifdef HAVE_INT64_TIMESTAMP
+            return TimestampGetDatum((Timestamp)key);
+#else
+            return TimestampGetDatum((Timestamp)cm_key_float(key));
+#endif
+        default:
+            elog(ERROR, "cmsketch cannot order values of type %s",
+                 format_type_be(typOid));
+            return (Datum)0;
+    }
+}
+
+/*!
+ * the key of an argument of an estimator, for looking it up in a sketch.
+ * The argument must have the same kind of keys as the sketch, except that
+ * integers can be looked up in sketches of floats.
+ * \param transval the sketch
+ * \param dat the argument
+ * \param typOid the type of the argument
+ */
+int64 cm_arg_key(cmtransval *transval, Datum dat, Oid typOid)
+{
+    int kind = cm_key_kind(typOid);
+
+    if (transval->keys == CM_KEYS_HASHED)
+        elog(ERROR, "CountMin sketch over type %s does not order its values",
+             format_type_be(transval->typOid));
+    if (kind == transval->keys)
+        return cm_key_of(dat, typOid);
+    if (kind == CM_KEYS_INTEGER && transval->keys == CM_KEYS_FLOAT)
+        return cm_float_key((float8)cm_key_of(dat, typOid));
+    elog(ERROR, "sketch computed over type %s; argument of type %s",
+         format_type_be(transval->typOid), format_type_be(typOid));
+    return 0;
+}
+
+/*!
+ * hash a value of a type keyed by CM_KEYS_HASHED.  Varlena values are
+ * detoasted first, so that their bytes do not depend on how they were stored.
+ * \param transval the sketch
+ * \param dat the value, of the sketch's type
+ * \param hash caller-provided buffer of SKETCH_HASHLEN bytes
+ */
+void cm_hash_value(cmtransval *transval, Datum dat, uint8 *hash)
+{
+    if (transval->typLen == -1)
+        dat = PointerGetDatum(PG_DETOAST_DATUM(dat));
+    sketch_hash_value(dat, transval->typLen, transval->typByVal,
+                      transval->hashver, hash);
+}
+
+/*!
+ * \internal
+ * \brief the layout of cm sketches built before sketches were tagged
+ *
+ * cmsketch(int8) returned this transval as a bytea, so it may have been
+ * stored: CM_DEFAULT_DEPTH rows of CM_DEFAULT_WIDTH 64-bit counters for
+ * each dyadic range, all sketched, with keys hashed by md5.
+ * \endinternal
+ */
+typedef struct {
+    Datum  args[MAXARGS];
+    int    nargs;
+    Oid    typOid;
+    Oid    outFuncOid;
+    uint64 sketches[RANGES][CM_DEFAULT_DEPTH][CM_DEFAULT_WIDTH];
+} cmlegacytransval;
+
+/*!
+ * convert a cm sketch built before sketches were tagged into a cmtransval
+ * whose ranges are all sketched with SKETCH_HASH_MD5.  Its counters keep
+ * their places, since hash_counters picks the same ones for that shape.
+ * \param blob a cmlegacytransval packed in a bytea
+ */
+static bytea *cm_from_legacy(bytea *blob)
+{
+    cmlegacytransval *old = (cmlegacytransval *)VARDATA(blob);
+    cmshape     shape = CM_DEFAULT_SHAPE;
+    cmrange     ranges[RANGES];
+    cmtransval *transval;
+    bytea *     newblob;
+    uint64      total = 0;
+    uint32      i;
+
+    if (old->typOid != INT8OID)
+        elog(ERROR, "not a valid cm_sketch: untagged sketch over type %u",
+             old->typOid);
+
+    newblob = cmsketch_init_transval(INT8OID, shape, CM_MODE_COUNTMIN);
+    for (i = 0; i < RANGES; i++) {
+        ranges[i].span = CM_SKETCHED;
+        ranges[i].base = 0;
+    }
+    newblob = cm_relayout(newblob, ranges, true);
+    transval = (cmtransval *)VARDATA(newblob);
+    transval->hashver = SKETCH_HASH_MD5;
+    /* the carried args only mattered to the aggregate that built it */
+    transval->nargs = -1;
+    memcpy(transval->counters, old->sketches, sizeof(old->sketches));
+    /* every value was counted once in each row of range 0 */
+    for (i = 0; i < CM_DEFAULT_WIDTH; i++)
+        total += old->sketches[0][0][i];
+    transval->total = total;
+    return newblob;
+}
+
+/*!
+ * check the tag of a cmsketch transval, which may be a stored cm_sketch.
+ * Sketches stored before they were tagged have the fixed size of a
+ * cmlegacytransval, and are converted so that they still estimate and merge.
+ * \param transblob a cmsketch transval packed in a bytea
+ * \returns the transval, converted if it was untagged
+ */
+bytea *cmsketch_check_tag(bytea *transblob)
+{
+    /* the initial value of the aggregates */
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        return transblob;
+    if (sketch_check_tag(VARDATA(transblob), VARSIZE(transblob) - VARHDRSZ,
+                         SKETCH_MAGIC_CM, "cm_sketch")) {
+        if (!CM_TRANSVAL_INITIALIZED(transblob))
+            elog(ERROR, "not a valid cm_sketch: too short");
+        return transblob;
+    }
+    if (VARSIZE(transblob) == VARHDRSZ + sizeof(cmlegacytransval))
+        return cm_from_legacy(transblob);
+    elog(ERROR,
+         "not a valid cm_sketch: it has neither the tag of one nor the size of one built before sketches were tagged");
+    return NULL;
+}
+
 /*!
  * check if the transblob is not initialized, and do so if not
  * \param transblob a cmsketch transval packed in a bytea
  */
 bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
 {
-    bytea *     transblob = PG_GETARG_BYTEA_P(0);
+    bytea *     transblob = cmsketch_check_tag(PG_GETARG_BYTEA_P(0));
     cmtransval *transval;
-    Oid         element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
 
     /*
      * an uninitialized transval should be a datum smaller than sizeof(cmtransval).
@@ -92,7 +574,10 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
      */
     if (!CM_TRANSVAL_INITIALIZED(transblob)) {
         /* XXX would be nice to pfree the existing transblob, but pfree complains. */
-        transblob = cmsketch_init_transval(element_type);
+        cmshape     shape = CM_DEFAULT_SHAPE;
+
+        transblob = cmsketch_init_transval(get_fn_expr_argtype(fcinfo->flinfo, 1),
+                                           shape, CM_MODE_COUNTMIN);
         transval = (cmtransval *)VARDATA(transblob);
 
         if (initargs) {
@@ -102,15 +587,15 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
             if (nargs - 2 > MAXARGS)
                 elog(
                     ERROR,
-                    "no more than %d additional arguments should be passed to __cmsketch_int8_trans",
+                    "no more than %d additional arguments should be passed to __cmsketch_trans",
                     MAXARGS);
             transval->nargs = nargs - 2;
             for (i = 2; i < nargs; i++) {
                 if (PG_ARGISNULL(i))
                     elog(ERROR,
-                         "NULL parameter %d passed to __cmsketch_int8_trans",
+                         "NULL parameter %d passed to __cmsketch_trans",
                          i);
-                transval->args[i-2] = PG_GETARG_DATUM(i);
+                transval->args[i-2] = PG_GETARG_INT64(i);
             }
         }
         else transval->nargs = -1;
@@ -118,66 +603,347 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
     return(transblob);
 }
 
-bytea *cmsketch_init_transval(Oid typOid)
+bytea *cmsketch_init_transval(Oid typOid, cmshape shape, int mode)
 {
     bool        typIsVarlena;
     cmtransval *transval;
+    bytea *     transblob;
+
+    if ((float8)RANGES * CM_SKETCH_SZ(shape) + sizeof(cmtransval) + VARHDRSZ
+        > MaxAllocSize)
+        elog(ERROR,
+             "CountMin sketch of %u x %u counters is too large; use a larger epsilon or delta",
+             shape.depth, shape.width);
 
-    /* allocate and zero out a transval via palloc0 */
-    bytea *     transblob = (bytea *)palloc0(CM_TRANSVAL_SZ);
-    SET_VARSIZE(transblob, CM_TRANSVAL_SZ);
+    /*
+     * allocate and zero out a transval via palloc0.  It starts out with
+     * no counters: every range is an empty exact range.
+     */
+    transblob = (bytea *)palloc0(CM_TRANSVAL_SZ(false, 0));
+    SET_VARSIZE(transblob, CM_TRANSVAL_SZ(false, 0));
 
     transval = (cmtransval *)VARDATA(transblob);
+    transval->shape = shape;
+    transval->mode = mode;
     transval->typOid = typOid;
+    transval->keys = cm_key_kind(typOid);
+    transval->magic = SKETCH_MAGIC_CM;
+    transval->hashver = SKETCH_HASH_CURRENT;
     getTypeOutputInfo(transval->typOid,
                       &(transval->outFuncOid),
                       &typIsVarlena);
+    get_typlenbyval(typOid, &transval->typLen, &transval->typByVal);
     return(transblob);
 }
 
 /*!
  * perform multiple sketch insertions, one for each dyadic range (from 0 up to RANGES-1).
- * * \param transval the cmsketch transval
- * * \param inputi the value to be inserted
+ * Ranges that count exactly are first grown to cover the value, and the
+ * counters are widened to 64 bits before the total count could overflow them.
+ * Values of types without keys are only counted, by their hash, in a
+ * sketch for range 0.
+ * * \param transblob the cmsketch transval, packed in a bytea
+ * * \param input the value to be inserted
+ * \returns the transval, which is reallocated if its layout had to change
  */
-void countmin_dyadic_trans_c(cmtransval *transval, Datum input)
+bytea *countmin_dyadic_trans_c(bytea *transblob, Datum input)
 {
-    uint32 j;
-    
-    if (transval->typOid != INT8OID)
-        elog(ERROR, "cmsketch can only compute ranges for int64");
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    cmrange     ranges[RANGES];
+    int64       val;
+    bool        widen = !transval->wide
+                        && transval->total >= CM_NARROW_LIMIT(transval->mode);
+    bool        relayout = widen;
+    uint8       hash[SKETCH_HASHLEN];
+    uint64      key;
+    uint32      j;
+
+    if (transval->keys == CM_KEYS_HASHED) {
+        if (relayout || transval->ranges[0].span != CM_SKETCHED) {
+            memcpy(ranges, transval->ranges, sizeof(ranges));
+            ranges[0].span = CM_SKETCHED;
+            ranges[0].base = 0;
+            transblob = cm_relayout(transblob, ranges, transval->wide || widen);
+            transval = (cmtransval *)VARDATA(transblob);
+        }
+        cm_hash_value(transval, input, hash);
+        cmsketch_add_hash(cm_range_counters(transval, 0), hash, 1);
+        transval->total++;
+        return transblob;
+    }
+
+    val = cm_key_of(input, transval->typOid);
+    for (j = 0; j < RANGES; j++) {
+        key = CM_KEY(val >> j);
+        ranges[j] = cm_range_cover(transval, j, key, key);
+        if (ranges[j].span != transval->ranges[j].span
+            || ranges[j].base != transval->ranges[j].base)
+            relayout = true;
+    }
+    if (relayout) {
+        transblob = cm_relayout(transblob, ranges, transval->wide || widen);
+        transval = (cmtransval *)VARDATA(transblob);
+    }
 
     for (j = 0; j < RANGES; j++) {
-        countmin_trans_c(transval->sketches[j], input, 
-                         transval->outFuncOid, transval->typOid);
-        /* now divide by 2 for the next dyadic range */
-        input = Int64GetDatum(DatumGetInt64(input) >> 1);
+        /* the value divided by 2^j is the key for dyadic range j */
+        countmin counters = cm_range_counters(transval, j);
+
+        if (transval->ranges[j].span == CM_SKETCHED) {
+            cm_hash_key(val >> j, transval->hashver, hash);
+            cmsketch_add_hash(counters, hash, 1);
+        }
+        else
+            CM_ADD_COUNTER(counters,
+                           CM_KEY(val >> j) - transval->ranges[j].base, 1);
+    }
+    transval->total++;
+    return transblob;
+}
+
+/*!
+ * the layout dyadic range i needs to also count the keys lo..hi.  An exact
+ * range grows to at least double its span, with the slack on the side it
+ * grew toward, and turns into a sketch once the keys it counts would need
+ * more counters than one.
+ * \param transval a cmsketch transval
+ * \param i the dyadic range
+ * \param lo the smallest key to cover
+ * \param hi the largest key to cover
+ */
+cmrange cm_range_cover(cmtransval *transval, int i, uint64 lo, uint64 hi)
+{
+    cmrange r = transval->ranges[i];
+    Size    sketchsz = CM_SKETCH_COUNTERS(transval->shape);
+    bool    down = false;
+    uint64  needed, span, first, last;
+
+    if (r.span == CM_SKETCHED)
+        return r;
+    if (r.span > 0 && lo >= r.base && hi <= r.base + r.span - 1)
+        return r;
+    if (cm_range_extent(transval, i, &first, &last)) {
+        down = (lo < first);
+        lo = Min(lo, first);
+        hi = Max(hi, last);
+    }
+
+    /* one less than the number of keys, so that it cannot overflow */
+    needed = hi - lo;
+    if (needed >= sketchsz) {
+        r.span = CM_SKETCHED;
+        r.base = 0;
+        return r;
     }
+    span = Max(needed + 1, Min((uint64)r.span * 2, (uint64)sketchsz));
+    if (down)
+        r.base = (hi < span - 1) ? 0 : hi - (span - 1);
+    else
+        r.base = (lo > MAX_UINT64 - (span - 1)) ? MAX_UINT64 - (span - 1) : lo;
+    r.span = (uint32)span;
+    return r;
+}
+
+/*!
+ * find the smallest and largest keys with nonzero counts in an exact range
+ * \param transval a cmsketch transval
+ * \param i the dyadic range, which must not be sketched
+ * \param lo set to the smallest key counted
+ * \param hi set to the largest key counted
+ * \returns false if the range is empty
+ */
+bool cm_range_extent(cmtransval *transval, int i, uint64 *lo, uint64 *hi)
+{
+    cmrange  r = transval->ranges[i];
+    countmin counters = cm_range_counters(transval, i);
+    uint32   first, last;
+
+    for (first = 0; first < r.span; first++)
+        if (CM_GET_COUNTER(counters, first) != 0)
+            break;
+    if (first == r.span)
+        return false;
+    for (last = r.span - 1; last > first; last--)
+        if (CM_GET_COUNTER(counters, last) != 0)
+            break;
+    *lo = r.base + first;
+    *hi = r.base + last;
+    return true;
+}
+
+/*!
+ * copy a cmsketch transval into a new one with the given layout, which must
+ * cover the old one, and counter width
+ * \param transblob the transval, packed in a bytea
+ * \param ranges the layout of each range; the offsets are assigned here
+ * \param wide whether the new counters are 64 bits
+ */
+bytea *cm_relayout(bytea *transblob, cmrange *ranges, bool wide)
+{
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    cmtransval *newval;
+    bytea *     newblob;
+    Size        sketchsz = CM_SKETCH_COUNTERS(transval->shape);
+    Size        ncounters = 0;
+    int         i;
+
+    for (i = 0; i < RANGES; i++) {
+        ranges[i].offset = ncounters;
+        ncounters += (ranges[i].span == CM_SKETCHED) ? sketchsz : ranges[i].span;
+    }
+
+    newblob = (bytea *)palloc0(CM_TRANSVAL_SZ(wide, ncounters));
+    SET_VARSIZE(newblob, CM_TRANSVAL_SZ(wide, ncounters));
+    newval = (cmtransval *)VARDATA(newblob);
+    memcpy(newval, transval, sizeof(cmtransval));
+    newval->wide = wide;
+    newval->ncounters = ncounters;
+    memcpy(newval->ranges, ranges, sizeof(newval->ranges));
+
+    for (i = 0; i < RANGES; i++)
+        cm_range_add(newval, i, transval);
+    return newblob;
+}
+
+/*!
+ * add the counts of dyadic range i of one transval into another, whose
+ * range i must cover it.  Exact counts added into a sketch are hashed
+ * once per distinct key.
+ * \param dst the transval to add into
+ * \param i the dyadic range
+ * \param src the transval to add from
+ */
+void cm_range_add(cmtransval *dst, int i, cmtransval *src)
+{
+    cmrange  from = src->ranges[i];
+    cmrange  to = dst->ranges[i];
+    countmin fromcnt = cm_range_counters(src, i);
+    countmin tocnt = cm_range_counters(dst, i);
+    uint8    hash[SKETCH_HASHLEN];
+    uint64   cnt;
+    Size     k, n;
+
+    if (from.span == CM_SKETCHED) {
+        n = CM_SKETCH_COUNTERS(src->shape);
+        if (fromcnt.wide && tocnt.wide)
+            for (k = 0; k < n; k++)
+                ((uint64 *)tocnt.counters)[k] += ((uint64 *)fromcnt.counters)[k];
+        else if (!fromcnt.wide && !tocnt.wide)
+            for (k = 0; k < n; k++)
+                ((uint32 *)tocnt.counters)[k] += ((uint32 *)fromcnt.counters)[k];
+        else if (src->mode == CM_MODE_COUNTSKETCH)
+            for (k = 0; k < n; k++)
+                CM_ADD_COUNTER(tocnt, k, CM_GET_SIGNED(fromcnt, k));
+        else
+            for (k = 0; k < n; k++)
+                CM_ADD_COUNTER(tocnt, k, CM_GET_COUNTER(fromcnt, k));
+        return;
+    }
+
+    for (k = 0; k < from.span; k++) {
+        if ((cnt = CM_GET_COUNTER(fromcnt, k)) == 0)
+            continue;
+        if (to.span == CM_SKETCHED) {
+            cm_hash_key(CM_UNKEY(from.base + k), dst->hashver, hash);
+            cmsketch_add_hash(tocnt, hash, cnt);
+        }
+        else
+            CM_ADD_COUNTER(tocnt, from.base + k - to.base, cnt);
+    }
+}
+
+/*!
+ * the counters of dyadic range i: a sketch if the range is sketched,
+ * else the exact counts of its keys base..base+span-1
+ */
+countmin cm_range_counters(cmtransval *transval, int i)
+{
+    return cm_sketch_of((char *)transval->counters
+                        + (Size)transval->ranges[i].offset
+                        * CM_COUNTER_SZ(transval->wide),
+                        transval->shape, transval->wide, transval->mode);
+}
+
+/*!
+ * the approximate count of a key in dyadic range i
+ * \param transval a cmsketch transval
+ * \param i the dyadic range
+ * \param val the value, already divided by 2^i
+ */
+int64 cm_range_count(cmtransval *transval, int i, int64 val)
+{
+    cmrange r = transval->ranges[i];
+    uint64  key = CM_KEY(val);
+    uint8   hash[SKETCH_HASHLEN];
+
+    if (r.span == CM_SKETCHED) {
+        cm_hash_key(val, transval->hashver, hash);
+        return cmsketch_count_hash(cm_range_counters(transval, i), hash);
+    }
+    if (key < r.base || key - r.base >= r.span)
+        return 0;
+    return CM_GET_COUNTER(cm_range_counters(transval, i), key - r.base);
+}
+
+/*!
+ * whether any dyadic range of a transval is sketched, rather than exact
+ */
+static bool cm_any_sketched(cmtransval *transval)
+{
+    uint32 i;
+
+    for (i = 0; i < RANGES; i++)
+        if (transval->ranges[i].span == CM_SKETCHED)
+            return true;
+    return false;
+}
+
+/*!
+ * wrap counters stored in a transval as a countmin sketch
+ */
+countmin cm_sketch_of(void *counters, cmshape shape, bool wide, int mode)
+{
+    countmin sketch;
+
+    sketch.counters = counters;
+    sketch.shape = shape;
+    sketch.wide = wide;
+    sketch.mode = mode;
+    return sketch;
 }
 
 /*!
  * Main loop of Cormode and Muthukrishnan's sketching algorithm, for setting counters in
- * sketches at a single "dyadic range". For each call, we want to use DEPTH independent
- * hash functions.  We do this by using a single md5 hash function, and taking
- * successive 16-bit runs of the result as independent hash outputs.
+ * sketches at a single "dyadic range". For each call, we want to use depth independent
+ * hash functions.  We do this by using a single 128-bit hash function, and taking
+ * successive runs of the result as independent hash outputs (see hash_counters).
  * \param sketch the current countmin sketch
  * \param dat the datum to be inserted
- * \param outFuncOid Oid of the PostgreSQL function to convert dat to a string
- * \param typOid Oid of the Postgres type for dat
+ * \param typLen the length of dat's type, cached by the caller
+ * \param typByVal the byval flag of dat's type, cached by the caller
+ * \param hashver the SKETCH_HASH_* version the sketch is built with
+ * \param hash caller-provided buffer of SKETCH_HASHLEN bytes; on return it
+ *        holds the hash of dat, so callers can probe the sketch without rehashing
  */
-Datum countmin_trans_c(countmin sketch, Datum dat, Oid outFuncOid, Oid typOid)
+void countmin_trans_c(countmin sketch, Datum dat, int16 typLen, bool typByVal,
+                      int hashver, uint8 *hash)
 {
-    bytea *nhash;
-    // char *input;
-
-    nhash = sketch_md5_bytea(dat, typOid);
+    sketch_hash_value(dat, typLen, typByVal, hashver, hash);
+    cmsketch_add_hash(sketch, hash, 1);
+}
 
-    /*
-     * iterate through all sketches, incrementing the counters indicated by the hash
-     * we don't care about return value here, so 3rd (initialization) argument is arbitrary.
-     */
-    (void)hash_counters_iterate(nhash, sketch, 0, &increment_counter);
-    return(PointerGetDatum(nhash));
+/*!
+ * hash a key of a dyadic range.  Keys are int64, so we hash their 8 bytes
+ * directly: this matches sketch_hash_datum on an int8 Datum, without its
+ * type lookups or the palloc that Int64GetDatum does where int8 is passed
+ * by reference.
+ * \param val the value, already divided by 2^i for dyadic range i
+ * \param hashver the SKETCH_HASH_* version the sketch was built with
+ * \param hash caller-provided buffer of SKETCH_HASHLEN bytes
+ */
+void cm_hash_key(int64 val, int hashver, uint8 *hash)
+{
+    sketch_hash_bytes(&val, sizeof(int64), hashver, hash);
 }
 
 /*
@@ -203,9 +969,7 @@ Datum __cmsketch_count_final(PG_FUNCTION_ARGS)
     cmtransval *sketch = (cmtransval *)VARDATA(blob);
     if (!CM_TRANSVAL_INITIALIZED(blob))
         PG_RETURN_NULL();
-    PG_RETURN_DATUM(cmsketch_count_c(sketch->sketches[0],
-                                     sketch->args[0], sketch->outFuncOid,
-                                     sketch->typOid));
+    PG_RETURN_INT64(cm_range_count(sketch, 0, sketch->args[0]));
 }
 
 /*!
@@ -218,8 +982,8 @@ Datum __cmsketch_rangecount_final(PG_FUNCTION_ARGS)
     cmtransval *sketch = (cmtransval *)VARDATA(blob);
     if (!CM_TRANSVAL_INITIALIZED(blob))
         PG_RETURN_NULL();
-    PG_RETURN_INT64(cmsketch_rangecount_c(sketch, DatumGetInt64(sketch->args[0]),
-                                          DatumGetInt64(sketch->args[1])));
+    PG_RETURN_INT64(cmsketch_rangecount_c(sketch, sketch->args[0],
+                                          sketch->args[1]));
 }
 
 /*!
@@ -238,7 +1002,7 @@ Datum __cmsketch_centile_final(PG_FUNCTION_ARGS)
     if (total == 0) {
         PG_RETURN_NULL();
     }
-    PG_RETURN_INT64(cmsketch_centile_c(sketch, DatumGetInt64(sketch->args[0]),
+    PG_RETURN_INT64(cmsketch_centile_c(sketch, sketch->args[0],
                                        total));
 }
 
@@ -271,26 +1035,29 @@ Datum __cmsketch_dhist_final(PG_FUNCTION_ARGS)
     cmtransval *sketch = (cmtransval *)VARDATA(blob);
     if (!CM_TRANSVAL_INITIALIZED(blob))
         PG_RETURN_NULL();
-    PG_RETURN_INT64(cmsketch_depth_histogram_c(sketch,
-                                               DatumGetInt64(sketch->args[0])));
+    PG_RETURN_DATUM(cmsketch_depth_histogram_c(sketch, sketch->args[0]));
 }
 
 /*!
- * Greenplum "prefunc" to combine sketches from multiple machines
+ * Greenplum "prefunc" to combine sketches from multiple machines.
+ * Also the transition function of cmsketch_union, where the second
+ * argument is a stored cm_sketch.  Inside an aggregate we add into the
+ * first argument in place, unless its ranges must grow to cover those of
+ * the second; otherwise we work on a copy of it.
  */
 PG_FUNCTION_INFO_V1(__cmsketch_merge);
 Datum __cmsketch_merge(PG_FUNCTION_ARGS)
 {
-    bytea *     counterblob1 = PG_GETARG_BYTEA_P(0);
-    bytea *     counterblob2 = PG_GETARG_BYTEA_P(1);
+    bytea *     counterblob1 = cmsketch_check_tag(PG_GETARG_BYTEA_P(0));
+    bytea *     counterblob2 = cmsketch_check_tag(PG_GETARG_BYTEA_P(1));
     cmtransval *transval1 = (cmtransval *)VARDATA(counterblob1);
     cmtransval *transval2 = (cmtransval *)VARDATA(counterblob2);
     cmtransval *newtrans;
-    countmin *  sketches2 = (countmin *)
-                            ((cmtransval *)(VARDATA(counterblob2)))->sketches;
     bytea *     newblob;
-    countmin *  newsketches;
-    uint32      i, j, k;
+    cmrange     ranges[RANGES];
+    uint64      lo, hi;
+    bool        wide, relayout;
+    uint32      i;
     int         sz;
 
     /* make sure they're initialized! */
@@ -299,28 +1066,86 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
         /* if both are empty can return one of them */
         PG_RETURN_DATUM(PointerGetDatum(counterblob1));
     else if (!CM_TRANSVAL_INITIALIZED(counterblob1)) {
-        elog(NOTICE, "typOid is %d", transval2->typOid);
-        counterblob1 = cmsketch_init_transval(transval2->typOid);
+        counterblob1 = cmsketch_init_transval(transval2->typOid,
+                                              transval2->shape, transval2->mode);
         transval1 = (cmtransval *)VARDATA(counterblob1);
+        transval1->nargs = -1;
+    }
+    else if (!CM_TRANSVAL_INITIALIZED(counterblob2))
+        /* nothing to add in */
+        PG_RETURN_DATUM(PointerGetDatum(counterblob1));
+
+    /*
+     * Sketched ranges only add up if they were built with the same hash
+     * function, but exact ranges can be hashed with either.  So a sketch
+     * without sketched ranges takes on the hash function of the other one,
+     * and a legacy md5 sketch merges with a new one that counted few keys.
+     */
+    if (transval1->hashver != transval2->hashver) {
+        if (cm_any_sketched(transval1) && cm_any_sketched(transval2))
+            elog(ERROR,
+                 "cannot merge CountMin sketches built with different hash functions (versions %d and %d); rebuild one of them from its data",
+                 transval1->hashver, transval2->hashver);
+        if (cm_any_sketched(transval2)) {
+            if (!(fcinfo->context && IsA(fcinfo->context, AggState))) {
+                newblob = (bytea *)palloc(VARSIZE(counterblob1));
+                memcpy(newblob, counterblob1, VARSIZE(counterblob1));
+                counterblob1 = newblob;
+                transval1 = (cmtransval *)VARDATA(counterblob1);
+            }
+            transval1->hashver = transval2->hashver;
+        }
     }
-    else if (!CM_TRANSVAL_INITIALIZED(counterblob2)) {
-        elog(NOTICE, "typOid is %d", transval1->typOid);
-        counterblob2 = cmsketch_init_transval(transval1->typOid);
-        transval2 = (cmtransval *)VARDATA(counterblob2);
+    if (!CM_SHAPE_EQ(transval1->shape, transval2->shape))
+        elog(ERROR,
+             "cannot merge CountMin sketches of different dimensions: %ux%u, %ux%u",
+             transval1->shape.depth, transval1->shape.width,
+             transval2->shape.depth, transval2->shape.width);
+    if (transval1->mode != transval2->mode)
+        elog(ERROR,
+             "cannot merge CountMin sketches with different modes: %d, %d",
+             transval1->mode, transval2->mode);
+    if (transval1->keys != transval2->keys
+        || (transval1->keys == CM_KEYS_HASHED
+            && transval1->typOid != transval2->typOid))
+        elog(ERROR,
+             "cannot merge CountMin sketches of types %s and %s",
+             format_type_be(transval1->typOid),
+             format_type_be(transval2->typOid));
+
+    /* grow the ranges of counterblob1 to cover the keys of counterblob2 */
+    wide = transval1->wide || transval2->wide
+           || transval1->total + transval2->total > CM_NARROW_LIMIT(transval1->mode);
+    relayout = (wide != transval1->wide);
+    for (i = 0; i < RANGES; i++) {
+        ranges[i] = transval1->ranges[i];
+        if (transval2->ranges[i].span == CM_SKETCHED) {
+            ranges[i].span = CM_SKETCHED;
+            ranges[i].base = 0;
+        }
+        else if (cm_range_extent(transval2, i, &lo, &hi))
+            ranges[i] = cm_range_cover(transval1, i, lo, hi);
+        if (ranges[i].span != transval1->ranges[i].span
+            || ranges[i].base != transval1->ranges[i].base)
+            relayout = true;
     }
 
-    sz = VARSIZE(counterblob1);
-    /* allocate a new transval as a copy of counterblob1 */
-    newblob = (bytea *)palloc(sz);
-    memcpy(newblob, counterblob1, sz);
+    if (relayout)
+        newblob = cm_relayout(counterblob1, ranges, wide);
+    else if (fcinfo->context && IsA(fcinfo->context, AggState))
+        newblob = counterblob1;
+    else {
+        sz = VARSIZE(counterblob1);
+        /* allocate a new transval as a copy of counterblob1 */
+        newblob = (bytea *)palloc(sz);
+        memcpy(newblob, counterblob1, sz);
+    }
     newtrans = (cmtransval *)(VARDATA(newblob));
-    newsketches = (countmin *)(newtrans)->sketches;
 
     /* add in values from counterblob2 */
     for (i = 0; i < RANGES; i++)
-        for (j = 0; j < DEPTH; j++)
-            for (k = 0; k < NUMCOUNTERS; k++)
-                newsketches[i][j][k] += sketches2[i][j][k];
+        cm_range_add(newtrans, i, transval2);
+    newtrans->total += transval2->total;
 
     if (newtrans->nargs == -1) {
         /* transfer in the args from the other input */
@@ -339,41 +1164,190 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
  */
 
 /*!
- * match sketch type to scalar arg type
+ * the key of a scalar arg in the sketch, or NULL if the arg is NULL
+ * (see cm_arg_key)
+ */
+#define CM_ARGKEY(sketch, arg_offset, key) \
+    do { \
+        if (PG_ARGISNULL(arg_offset)) PG_RETURN_NULL(); \
+        (key) = cm_arg_key(sketch, PG_GETARG_DATUM(arg_offset), \
+                           get_fn_expr_argtype(fcinfo->flinfo, arg_offset)); \
+    } while (0)
+
+/*! histograms are computed for integers only */
+#define CM_CHECK_INTEGER(sketch, func) \
+    if ((sketch)->keys != CM_KEYS_INTEGER) \
+        elog(ERROR, "%s is only defined for sketches of integers, not of type %s", \
+             func, format_type_be((sketch)->typOid))
+
+PG_FUNCTION_INFO_V1(cmsketch_estimate_count);
+/*!
+ * scalar function taking a stored cm_sketch and a value,
+ * returning the approximate count of that value.  Sketches of types
+ * without keys look up the hash of the value, which must be of their type.
  */
-#define CM_CHECKARG(sketch, arg_offset) \
-    if (PG_ARGISNULL(arg_offset)) PG_RETURN_NULL(); \
-    if (sketch->typOid != get_fn_expr_argtype(fcinfo->flinfo, arg_offset)) { \
-        elog( \
-            ERROR, \
-            "sketch computed over type " INT64_FORMAT \
-            "; argument %d over type " INT64_FORMAT ".", \
-            (int64)sketch->typOid, \
-            arg_offset, \
-            (int64)get_fn_expr_argtype(fcinfo->flinfo, arg_offset)); \
-        PG_RETURN_NULL(); \
+Datum cmsketch_estimate_count(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = cmsketch_check_transval(fcinfo, false);
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    Oid         argtype = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    uint8       hash[SKETCH_HASHLEN];
+    int64       key;
+
+    if (transval->keys == CM_KEYS_HASHED) {
+        if (PG_ARGISNULL(1))
+            PG_RETURN_NULL();
+        if (argtype != transval->typOid)
+            elog(ERROR, "sketch computed over type %s; argument of type %s",
+                 format_type_be(transval->typOid), format_type_be(argtype));
+        if (transval->ranges[0].span != CM_SKETCHED)
+            PG_RETURN_INT64(0);
+        cm_hash_value(transval, PG_GETARG_DATUM(1), hash);
+        PG_RETURN_INT64(cmsketch_count_hash(cm_range_counters(transval, 0),
+                                            hash));
     }
+    CM_ARGKEY(transval, 1, key);
+    PG_RETURN_INT64(cm_range_count(transval, 0, key));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_estimate_rangecount);
+/*!
+ * scalar function taking a stored cm_sketch and a range <c>[low, hi]</c>,
+ * returning the approximate number of values in that range
+ */
+Datum cmsketch_estimate_rangecount(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = cmsketch_check_transval(fcinfo, false);
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    int64       lo, hi;
+
+    CM_ARGKEY(transval, 1, lo);
+    CM_ARGKEY(transval, 2, hi);
+    PG_RETURN_DATUM(cmsketch_rangecount_c(transval, lo, hi));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_estimate_centile);
+/*!
+ * scalar function taking a stored cm_sketch and a centile between 1 and 99,
+ * returning the approximate value at that centile
+ */
+Datum cmsketch_estimate_centile(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = cmsketch_check_tag(PG_GETARG_BYTEA_P(0));
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    int64       total;
+
+    if (!CM_TRANSVAL_INITIALIZED(transblob))
+        PG_RETURN_NULL();
+    if (transval->keys != CM_KEYS_INTEGER)
+        elog(ERROR,
+             "CountMin sketch over type %s needs a value of that type as third argument of cmsketch_estimate_centile",
+             format_type_be(transval->typOid));
+    total = cmsketch_rangecount_c(transval, MIN_INT64, MAX_INT64);     /* count(*) */
+    if (total == 0)
+        PG_RETURN_NULL();
+    PG_RETURN_DATUM(cmsketch_centile_c(transval, PG_GETARG_INT32(1), total));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_estimate_centile_value);
+/*!
+ * scalar function taking a stored cm_sketch, a centile between 1 and 99,
+ * and a value of the sketched type (only its type is used, so it may be
+ * NULL), returning the approximate value of that type at that centile
+ */
+Datum cmsketch_estimate_centile_value(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob;
+    cmtransval *transval;
+    Oid         typOid = get_fn_expr_argtype(fcinfo->flinfo, 2);
+    int64       total;
+
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+        PG_RETURN_NULL();
+    transblob = cmsketch_check_tag(PG_GETARG_BYTEA_P(0));
+    transval = (cmtransval *)VARDATA(transblob);
+    if (!CM_TRANSVAL_INITIALIZED(transblob))
+        PG_RETURN_NULL();
+    if (transval->keys == CM_KEYS_HASHED
+        || cm_key_kind(typOid) != transval->keys)
+        elog(ERROR, "cannot estimate a centile of type %s from a CountMin sketch over type %s",
+             format_type_be(typOid), format_type_be(transval->typOid));
+    total = cmsketch_rangecount_c(transval, MIN_INT64, MAX_INT64);     /* count(*) */
+    if (total == 0)
+        PG_RETURN_NULL();
+    PG_RETURN_DATUM(cm_key_value(cmsketch_centile_c(transval, PG_GETARG_INT32(1),
+                                                    total),
+                                 typOid));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_estimate_depth_histogram);
+/*!
+ * scalar function taking a stored cm_sketch and a number of buckets,
+ * returning an equi-depth histogram
+ */
+Datum cmsketch_estimate_depth_histogram(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = cmsketch_check_tag(PG_GETARG_BYTEA_P(0));
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+
+    if (!CM_TRANSVAL_INITIALIZED(transblob))
+        PG_RETURN_NULL();
+    CM_CHECK_INTEGER(transval, "cmsketch_estimate_depth_histogram");
+    PG_RETURN_DATUM(cmsketch_depth_histogram_c(transval, PG_GETARG_INT32(1)));
+}
 
 /*!
  * get the approximate count of objects with value arg
  * \param sketch a countmin sketch
  * \param arg the Datum we want to find the count of
- * \param funcOid the Postgres function that converts arg to a string
+ * \param typLen the length of arg's type
+ * \param typByVal the byval flag of arg's type
+ * \param hashver the SKETCH_HASH_* version the sketch was built with
  */
-int64 cmsketch_count_c(countmin sketch, Datum arg, Oid funcOid, Oid typOid)
+int64 cmsketch_count_c(countmin sketch, Datum arg, int16 typLen, bool typByVal,
+                       int hashver)
 {
-    bytea *nhash;
+    uint8 hash[SKETCH_HASHLEN];
 
-    /* get the md5 hash of the argument. */
-    nhash = sketch_md5_bytea(arg, typOid);
-    return(cmsketch_count_md5_datum(sketch, nhash, funcOid));
+    /* get the hash of the argument. */
+    sketch_hash_value(arg, typLen, typByVal, hashver, hash);
+    return(cmsketch_count_hash(sketch, hash));
 }
 
-int64 cmsketch_count_md5_datum(countmin sketch, bytea *md5_bytea, Oid funcOid)
+/*!
+ * get the approximate count of objects with a given, already computed, hash:
+ * the smallest of its counters, or for a Count-Sketch the median of its
+ * signed counters, which is never taken below zero
+ * \param hash the SKETCH_HASHLEN-byte hash of the value
+ */
+int64 cmsketch_count_hash(countmin sketch, uint8 *hash)
 {
-    /* iterate through the sketches, finding the min counter associated with this hash */
-    return(hash_counters_iterate(md5_bytea, sketch, INT64_MAX,
-                                          &min_counter));
+    Size   idx[CM_MAX_DEPTH];
+    int64  vals[CM_MAX_DEPTH];
+    uint32 negative = hash_counters(hash, sketch, idx);
+    uint32 depth = sketch.shape.depth;
+    uint32 i, j;
+    int64  v, est;
+
+    if (sketch.mode != CM_MODE_COUNTSKETCH) {
+        est = INT64_MAX;
+        for (i = 0; i < depth; i++)
+            est = Min(est, (int64)CM_GET_COUNTER(sketch, idx[i]));
+        return est;
+    }
+
+    /* insertion sort of the signed counters: there are at most CM_MAX_DEPTH */
+    for (i = 0; i < depth; i++) {
+        v = CM_GET_SIGNED(sketch, idx[i]);
+        if (negative & ((uint32)1 << i))
+            v = -v;
+        for (j = i; j > 0 && vals[j - 1] > v; j--)
+            vals[j] = vals[j - 1];
+        vals[j] = v;
+    }
+    est = (depth % 2) ? vals[depth / 2]
+                      : vals[depth/2 - 1] + (vals[depth / 2] - vals[depth/2 - 1]) / 2;
+    return Max(est, 0);
 }
 
 /*!
@@ -421,9 +1395,7 @@ Datum cmsketch_rangecount_c(cmtransval *transval, int64 bot, int64 top)
             dyad = safe_log2(width);
             countval = r.spans[i][0] >> dyad;
         }
-        val = cmsketch_count_c(transval->sketches[dyad],
-                               (Datum) countval,
-                               transval->outFuncOid, transval->typOid);
+        val = cm_range_count(transval, dyad, countval);
         cursum += val;
     }
     PG_RETURN_DATUM(cursum);
@@ -567,48 +1539,76 @@ void find_ranges_internal(int64 bot, int64 top, int power, rangelist *r)
 }
 
 /*!
- * find the approximate centile in a cm sketch by binary search in the domain of values
+ * find the approximate centile in a cm sketch
  * \param transval the current transition value
  * \param intcentile the centile to return
  * \param total the total count of items
  */
 Datum cmsketch_centile_c(cmtransval *transval, int intcentile, int64 total)
 {
-    uint  i;
-    int64 higuess,loguess,curguess,curcount;
-    int64 centile_cnt;
-
+    int64 centile_cnt, value;
 
     if (intcentile <= 0 || intcentile >= 100)
         elog(ERROR,
              "centiles must be between 1-99 inclusive, was %d",
              intcentile);
 
-
     centile_cnt = (int64)(total * (float8)intcentile/100.0);
+    cmsketch_rank_values_c(transval, &centile_cnt, 1, &value);
+    return(value);
+}
 
-    for (i = 0, loguess = MIN_INT64, higuess = MAX_INT64, curguess = 0;
-         (i < INT64BITS - 1) && ((uint64)higuess-(uint64)loguess > 1);
-         i++) {
-        curcount = cmsketch_rangecount_c(transval, MIN_INT64, curguess);
-        if (curcount == centile_cnt)
-            break;
-        if (curcount > centile_cnt) {
-            /* overshot */
-            higuess = curguess;
-            curguess = loguess + (curguess - loguess) / 2;
-        }
-        else {
-            /* undershot */
-            loguess = curguess;
-            curguess = higuess - (higuess - curguess) / 2;
+/*!
+ * find the values at several ranks in one top-down pass over the dyadic
+ * ranges.  For each rank r we descend from range RANGES-1 to range 0,
+ * going to the upper half of the current dyadic interval whenever the
+ * count of its lower half, plus everything to its left, is below r.
+ * The descents for ascending ranks share their prefixes, so the count of
+ * the last interval looked up in each range is remembered.
+ * \param transval the current transition value
+ * \param ranks the ranks to look up, in ascending order
+ * \param nranks the number of ranks
+ * \param values set to the smallest value whose estimated count of values
+ *        at or below it reaches each rank
+ */
+void cmsketch_rank_values_c(cmtransval *transval, const int64 *ranks,
+                            int nranks, int64 *values)
+{
+    int64 memokey[RANGES];
+    int64 memocnt[RANGES];
+    bool  memoized[RANGES];
+    int64 key, below, cnt, rank;
+    int   i, j;
+
+    memset(memoized, 0, sizeof(memoized));
+    for (i = 0; i < nranks; i++) {
+        /* every value has at least rank 1 */
+        rank = Max(ranks[i], 1);
+        /* the top range splits the domain into negatives (-1) and the rest (0) */
+        key = 0;
+        below = 0;
+        for (j = RANGES - 1; j >= 0; j--) {
+            int64 left = (j == RANGES - 1) ? -1 : key * 2;
+
+            if (memoized[j] && memokey[j] == left)
+                cnt = memocnt[j];
+            else {
+                cnt = cm_range_count(transval, j, left);
+                memokey[j] = left;
+                memocnt[j] = cnt;
+                memoized[j] = true;
+            }
+            if (below + cnt >= rank)
+                key = left;
+            else {
+                below += cnt;
+                key = left + 1;
+            }
         }
+        values[i] = key;
     }
-    return(curguess);
 }
 
-
-
 PG_FUNCTION_INFO_V1(cmsketch_width_histogram);
 /*!
  * scalar function taking a sketch, min, max, and number of buckets.
@@ -619,13 +1619,13 @@ Datum cmsketch_width_histogram(PG_FUNCTION_ARGS)
 {
     bytea *     transblob = cmsketch_check_transval(fcinfo, false);
     cmtransval *transval = (cmtransval *)VARDATA(transblob);
-    int64       min = PG_GETARG_INT64(1);
-    int64       max = PG_GETARG_INT64(2);
+    int64       min, max;
     int         buckets = PG_GETARG_INT32(3);
     Datum       retval;
 
-    CM_CHECKARG(transval, 1);
-    CM_CHECKARG(transval, 2);
+    CM_CHECK_INTEGER(transval, "cmsketch_width_histogram");
+    CM_ARGKEY(transval, 1, min);
+    CM_ARGKEY(transval, 2, max);
     if (PG_ARGISNULL(3)) PG_RETURN_NULL();
 
     retval = cmsketch_width_histogram_c(transval, min, max, buckets);
@@ -675,7 +1675,7 @@ Datum cmsketch_width_histogram_c(cmtransval *transval,
     /*
      * Get info about element type
      */
-    get_type_io_data(transval->typOid, IOFunc_output,
+    get_type_io_data(INT8OID, IOFunc_output,
                      &typlen, &typbyval,
                      &typalign, &typdelim,
                      &typioparam, &typiofunc);
@@ -690,7 +1690,7 @@ Datum cmsketch_width_histogram_c(cmtransval *transval,
                                 2,
                                 dims,
                                 lbs,
-                                transval->typOid,
+                                INT8OID,
                                 typlen,
                                 typbyval,
                                 typalign);
@@ -709,6 +1709,7 @@ Datum cmsketch_depth_histogram_c(cmtransval *transval, int64 buckets)
     ArrayType *retval;
     int64      binlo;
     Datum      histo[buckets][3];
+    int64      ranks[buckets], centiles[buckets];
     int        dims[2], lbs[2];
     int64      total = cmsketch_rangecount_c(transval, MIN_INT64, MAX_INT64);
     int16      typlen;
@@ -719,10 +1720,21 @@ Datum cmsketch_depth_histogram_c(cmtransval *transval, int64 buckets)
     Oid        typiofunc;
 
     step = Max(trunc(100 / (float8)buckets), 1);
+
+    /* find all the bucket boundaries in one pass */
+    for (i = 0; i + 1 < buckets; i++) {
+        if ((i+1)*step >= 100)
+            elog(ERROR,
+                 "centiles must be between 1-99 inclusive, was " INT64_FORMAT,
+                 (int64)((i+1)*step));
+        ranks[i] = (int64)(total * (float8)((i+1)*step)/100.0);
+    }
+    cmsketch_rank_values_c(transval, ranks, buckets - 1, centiles);
+
     for (i = nextbucket = 0, binlo = MIN_INT64; i < buckets; i++) {
         uint64 centile;
         if (i < buckets - 1) {
-            centile = cmsketch_centile_c(transval, (i+1)*step, total);
+            centile = centiles[i];
             if (i > 0 && centile <= histo[nextbucket-1][1])
                 /* next centile is lower than previous; skip */
                 continue;
@@ -747,7 +1759,7 @@ Datum cmsketch_depth_histogram_c(cmtransval *transval, int64 buckets)
     /*
      * Get info about element type
      */
-    get_type_io_data(transval->typOid, IOFunc_output,
+    get_type_io_data(INT8OID, IOFunc_output,
                      &typlen, &typbyval,
                      &typalign, &typdelim,
                      &typioparam, &typiofunc);
@@ -762,7 +1774,7 @@ Datum cmsketch_depth_histogram_c(cmtransval *transval, int64 buckets)
                                 2,
                                 dims,
                                 lbs,
-                                transval->typOid,
+                                INT8OID,
                                 typlen,
                                 typbyval,
                                 typalign);
@@ -777,100 +1789,124 @@ PG_FUNCTION_INFO_V1(cmsketch_dump);
  */
 Datum cmsketch_dump(PG_FUNCTION_ARGS)
 {
-    bytea *   transblob = (bytea *)PG_GETARG_BYTEA_P(0);
-    countmin *sketches;
-    char *    newblob = (char *)palloc(10240);
-    uint32    i, j, k, c;
-
-    sketches = ((cmtransval *)VARDATA(transblob))->sketches;
-    for (i=0, c=0; i < RANGES; i++)
-        for (j=0; j < DEPTH; j++)
-            for(k=0; k < NUMCOUNTERS; k++) {
-                if (sketches[i][j][k] != 0)
-                    c += sprintf(&newblob[c], "[(%d,%d,%d):" INT64_FORMAT
-                                 "], ", i, j, k, sketches[i][j][k]);
-                if (c > 10000) break;
-            }
+    bytea *     transblob = cmsketch_check_tag(PG_GETARG_BYTEA_P(0));
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    countmin    counters;
+    char *      newblob = (char *)palloc(10240);
+    uint32      i, c;
+    Size        k, n;
+
+    for (i=0, c=0; i < RANGES && c <= 10000; i++) {
+        counters = cm_range_counters(transval, i);
+        n = (transval->ranges[i].span == CM_SKETCHED)
+            ? CM_SKETCH_COUNTERS(transval->shape) : transval->ranges[i].span;
+        for (k=0; k < n && c <= 10000; k++)
+            if (CM_GET_COUNTER(counters, k) != 0)
+                c += sprintf(&newblob[c], "[(%u,%u):" INT64_FORMAT "], ",
+                             i, (uint32)k, (int64)CM_GET_COUNTER(counters, k));
+    }
     newblob[c] = '\0';
     PG_RETURN_NULL();
 }
 
 
 /*!
- * for each row of the sketch, use the 16 bits starting at 2^i mod NUMCOUNTERS,
- * and invoke the lambda on those 16 bits (which may destructively modify counters).
- * \param hashval the MD5 hashed value that we take 16 bits at a time
+ * find the counter that a hash picks in each row of the sketch: row i
+ * takes the next slice of the hash bits mod width.
+ * Slices are 16 bits wide, or 32 bits for rows wider than 65536 counters.
+ * A Count-Sketch takes the sign of each counter from the top bit of its
+ * slice, so it needs 32-bit slices for rows wider than 32768 counters.
+ * The 128-bit hash covers 8 rows of 16-bit slices; bigger sketches extend it
+ * with further 128-bit blocks, each a hash of the original hash under a new seed.
+ * \param hashval the SKETCH_HASHLEN-byte hash value that we take apart
  * \param sketch the cmsketch
- * \param initial the initialized return value
- * \param lambdaptr the function to invoke on each 16 bits
- */
-int64 hash_counters_iterate(bytea *hashval,
-                            countmin sketch, /* width is DEPTH*NUMCOUNTERS */
-                            int64 initial,
-                            int64 (*lambdaptr)(uint32,
-                                               uint32,
-                                               countmin,
-                                               int64))
-{
-    uint32         i, col;
-    char          *c;
+ * \param idx set to the index of the counter picked in each row
+ * \returns a bitmask of the rows whose counter a Count-Sketch subtracts
+ * from, rather than adds to; 0 for other modes
+ */
+uint32 hash_counters(uint8 *hashval, countmin sketch, Size *idx)
+{
+    cmshape        shape = sketch.shape;
+    bool           signs = (sketch.mode == CM_MODE_COUNTSKETCH);
+    uint8          stream[CM_MAX_DEPTH*sizeof(uint32)];
+    uint32         i, k, slice;
+    uint8         *c = hashval;
+    size_t         slicelen = (shape.width > (signs ? CM_SHORT_SLICE_WIDTH/2
+                                                    : CM_SHORT_SLICE_WIDTH))
+                              ? sizeof(uint32) : sizeof(uint16);
     unsigned short twobytes;
-    int64          retval = initial;
+    uint32         fourbytes;
+    uint32         negative = 0;
+
+    if (shape.depth*slicelen > SKETCH_HASHLEN) {
+        memcpy(stream, hashval, SKETCH_HASHLEN);
+        for (k = 1; k*SKETCH_HASHLEN < shape.depth*slicelen; k++)
+            murmurhash3_x64_128(hashval, SKETCH_HASHLEN, k,
+                                stream + k*SKETCH_HASHLEN);
+        c = stream;
+    }
 
-    /*
-     * XXX WARNING: are there problems with unaligned access here?
-     * XXX I was using copies rather than casting, which was inefficient,
-     * XXX but I was hoping memmove would deal with unaligned access in a portable way.
-     * XXX However the deref of 2 bytes seems to work OK.
-     */
-    for (i = 0, c = (char *)VARDATA(hashval); 
-         i < DEPTH; 
-         i++, c += 2) {
-        // memmove((void *)&twobytes, c, 2);
-        twobytes = *(unsigned short *)c;
-        col = twobytes % NUMCOUNTERS;
-        retval = (*lambdaptr)(i, col, sketch, retval);
+    /* memcpy of 2 or 4 bytes compiles to a plain load, and is safe if unaligned */
+    for (i = 0; i < shape.depth; i++, c += slicelen) {
+        if (slicelen == sizeof(uint16)) {
+            memcpy(&twobytes, c, sizeof(uint16));
+            slice = twobytes;
+        }
+        else {
+            memcpy(&fourbytes, c, sizeof(uint32));
+            slice = fourbytes;
+        }
+        if (signs && (slice >> (slicelen*CHAR_BIT - 1)))
+            negative |= (uint32)1 << i;
+        /* width is a power of 2 */
+        idx[i] = (Size)i*shape.width + (slice & (shape.width - 1));
     }
-    return retval;
+    return negative;
 }
 
 /*!
- * destructive increment lambda for hash_counters_iterate.
- * transval and return val not of particular interest here.
- * \param i which row to update
- * \param col which column to update
+ * add cnt occurrences of the value with a given hash to a sketch,
+ * following the update rule of its mode
  * \param sketch the sketch
- * \param transval we don't need transval here, but its part of the
- * lambda interface for hash_counters_iterate
+ * \param hash the SKETCH_HASHLEN-byte hash of the value
+ * \param cnt the number of occurrences, which is positive, or negative to
+ *        take back occurrences added before (except in conservative mode)
  */
-
-int64 increment_counter(uint32 i,
-                        uint32 col,
-                        countmin sketch,
-                        int64 transval)
+void cmsketch_add_hash(countmin sketch, uint8 *hash, int64 cnt)
 {
-    int64 oldval = sketch[i][col];
-    if (sketch[i][col] == (INT64_MAX))
-        elog(ERROR, "maximum count exceeded in sketch");
-    sketch[i][col] = oldval + 1;
+    Size   idx[CM_MAX_DEPTH];
+    uint32 negative = hash_counters(hash, sketch, idx);
+    uint32 i;
+    int64  least, cur;
+
+    if (sketch.mode == CM_MODE_COUNTSKETCH) {
+        /* no counter can exceed the total count, in either direction */
+        for (i = 0; i < sketch.shape.depth; i++)
+            CM_ADD_COUNTER(sketch, idx[i],
+                           (negative & ((uint32)1 << i)) ? -cnt : cnt);
+        return;
+    }
 
-    /* return the incremented value, though unlikely anyone cares. */
-    return oldval+1;
-}
+    if (sketch.mode == CM_MODE_COUNTMIN) {
+        for (i = 0; i < sketch.shape.depth; i++) {
+            /* narrow counters are widened before the total count could overflow them */
+            if (sketch.wide && cnt > 0
+                && ((uint64 *)sketch.counters)[idx[i]] > (uint64)(INT64_MAX - cnt))
+                elog(ERROR, "maximum count exceeded in sketch");
+            CM_ADD_COUNTER(sketch, idx[i], cnt);
+        }
+        return;
+    }
 
-/*!
- * running minimum lambda for hash_counters_iterate
- * \param i which row to examine
- * \param col which column to examine
- * \param sketch the sketch
- * \param transval smallest counter so far
- * lambda interface for hash_counters_iterate
- */
-int64 min_counter(uint32 i,
-                  uint32 col,
-                  countmin sketch,
-                  int64 transval)
-{
-    int64 thisval = sketch[i][col];
-    return (thisval < transval) ? thisval : transval;
+    /* conservative update: raise the counters below the new estimate to it */
+    least = INT64_MAX;
+    for (i = 0; i < sketch.shape.depth; i++)
+        least = Min(least, (int64)CM_GET_COUNTER(sketch, idx[i]));
+    if (sketch.wide && least > INT64_MAX - cnt)
+        elog(ERROR, "maximum count exceeded in sketch");
+    for (i = 0; i < sketch.shape.depth; i++) {
+        cur = CM_GET_COUNTER(sketch, idx[i]);
+        if (cur < least + cnt)
+            CM_ADD_COUNTER(sketch, idx[i], least + cnt - cur);
+    }
 }
@@ -8,9 +8,11 @@
 #define _COUNTMIN_H_
 #define INT64BITS (sizeof(int64)*CHAR_BIT)
 #define RANGES INT64BITS
-#define DEPTH 8 /* magic tuning value: number of hash functions */
-/* #define NUMCOUNTERS 65535 */
-#define NUMCOUNTERS 1024  /* another magic tuning value: modulus of hash functions */
+#define CM_DEFAULT_DEPTH 8     /* default number of hash functions: delta = e^-8 */
+#define CM_DEFAULT_WIDTH 1024  /* default counters per hash function: epsilon = e/1024 */
+#define CM_MAX_DEPTH 32        /* limits delta to e^-32 */
+#define CM_MAX_WIDTH (1U << 31)
+#define CM_SHORT_SLICE_WIDTH 65536 /* widest row addressable by 16 hash bits */
 
 #ifdef INT64_IS_BUSTED
 #define MAX_INT64 (INT64CONST(0x7FFFFFFF) - 1)
@@ -26,37 +28,149 @@
 #define MIN_UINT64 (0)
 
 
+/*!
+ * \brief the dimensions of a CountMin sketch
+ *
+ * Chosen per sketch from the requested error bounds (see cm_shape):
+ * an estimate is within epsilon*N of the true count with probability
+ * 1-delta when width >= e/epsilon and depth >= ln(1/delta).
+ */
+typedef struct {
+    uint32 depth;   /*! number of hash functions, i.e. rows */
+    uint32 width;   /*! counters per row, always a power of 2 */
+} cmshape;
+
+#define CM_DEFAULT_SHAPE {CM_DEFAULT_DEPTH, CM_DEFAULT_WIDTH}
+#define CM_SHAPE_EQ(a, b) ((a).depth == (b).depth && (a).width == (b).width)
+
+/*!
+ * how a sketch is updated and read (see cm_mode).  Only sketches with the
+ * same mode can be merged.
+ *
+ * CM_MODE_COUNTMIN adds each value to one counter per row, and estimates
+ * its count as the smallest of them.  CM_MODE_CONSERVATIVE only raises the
+ * counters that would otherwise fall below the new estimate, which leaves
+ * less collision noise in the others: estimates are still never too low,
+ * and on skewed data are much closer.  CM_MODE_COUNTSKETCH adds the value
+ * to each counter with a sign taken from its hash, and estimates its count
+ * as the median of the signed counters: this is unbiased, but the estimate
+ * can be too low as well as too high.
+ */
+#define CM_MODE_COUNTMIN 0
+#define CM_MODE_CONSERVATIVE 1
+#define CM_MODE_COUNTSKETCH 2
+
 /*!
  * \brief the CountMin sketch array
  *
- * a CountMin sketch is a set of DEPTH arrays of NUMCOUNTERS each.
+ * a CountMin sketch is a set of depth arrays of width counters each,
+ * stored row by row.
  * It's like a "counting Bloom Filter" where instead of just hashing to
- * DEPTH bitmaps, we count up hash-collisions in DEPTH counter arrays
+ * depth bitmaps, we count up hash-collisions in depth counter arrays.
+ * This struct points at counters stored inside a transition value.
  */
-typedef uint64 countmin[DEPTH][NUMCOUNTERS];
+typedef struct {
+    void *  counters; /*! depth*width counters */
+    cmshape shape;    /*! dimensions of the sketch */
+    bool    wide;     /*! counters are uint64 if true, else uint32 */
+    int     mode;     /*! CM_MODE_* update rule */
+} countmin;
+
+/*! number of counters, and bytes of 64-bit counters, in a sketch of a given shape */
+#define CM_SKETCH_COUNTERS(shape) ((Size)(shape).depth * (Size)(shape).width)
+#define CM_SKETCH_SZ(shape) (CM_SKETCH_COUNTERS(shape) * sizeof(uint64))
+
+#define CM_COUNTER_SZ(wide) ((wide) ? sizeof(uint64) : sizeof(uint32))
+#define CM_GET_COUNTER(s, idx) \
+    ((s).wide ? ((uint64 *)(s).counters)[idx] \
+              : (uint64)((uint32 *)(s).counters)[idx])
+/*! a counter of a Count-Sketch, which may be negative */
+#define CM_GET_SIGNED(s, idx) \
+    ((s).wide ? (int64)((uint64 *)(s).counters)[idx] \
+              : (int64)((int32 *)(s).counters)[idx])
+#define CM_ADD_COUNTER(s, idx, n) \
+    do { \
+        if ((s).wide) ((uint64 *)(s).counters)[idx] += (n); \
+        else ((uint32 *)(s).counters)[idx] += (uint32)(n); \
+    } while (0)
+
+/*! largest total count that 32-bit counters are guaranteed to hold */
+#define CM_NARROW_MAX ((uint64)0xFFFFFFFF)
+/*! the same for the counters of a sketch with the given mode, which are signed for a Count-Sketch */
+#define CM_NARROW_LIMIT(mode) \
+    ((mode) == CM_MODE_COUNTSKETCH ? (CM_NARROW_MAX >> 1) : CM_NARROW_MAX)
 
 #define MAXARGS 3
 
+/*!
+ * how cmsketch maps the values of a type to the int64 keys of its dyadic
+ * ranges (see cm_key_kind).  Keys preserve the order of the values, so
+ * ranges of values are ranges of keys.  Types without such a key are hashed
+ * into dyadic range 0, and can only be counted, not ranged.  Integers of
+ * any width share keys, as do float4, float8 and numeric.
+ */
+#define CM_KEYS_HASHED 0
+#define CM_KEYS_INTEGER 1
+#define CM_KEYS_FLOAT 2
+#define CM_KEYS_DATE 3
+#define CM_KEYS_TIMESTAMP 4
+#define CM_KEYS_TIMESTAMPTZ 5
+
+/*!
+ * \internal
+ * \brief one dyadic range of a cmsketch
+ *
+ * A range starts out counting its keys exactly, in an array of span
+ * counters for the keys base..base+span-1 that grows by doubling.  Once that
+ * array would need more counters than a sketch it is folded into one.
+ * Keys are the int64 values shifted down to the range, mapped to uint64 by
+ * CM_KEY so that the arithmetic on base and span cannot overflow.
+ * \endinternal
+ */
+typedef struct {
+    uint64 base;    /*! smallest key counted exactly */
+    uint32 span;    /*! number of keys counted exactly, or CM_SKETCHED */
+    uint32 offset;  /*! index of the range's first counter in cmtransval.counters */
+} cmrange;
+
+#define CM_SKETCHED (~(uint32)0)
+#define CM_KEY(v) ((uint64)(v) ^ (UINT64CONST(1) << 63))
+#define CM_UNKEY(k) ((int64)((k) ^ (UINT64CONST(1) << 63)))
+
 /*!
  * \internal
  * \brief the transition value struct for CM sketches
  *
- * Holds the sketch counters
- * and a cache of handy metadata that we'll reuse across calls
+ * Holds the counters of the RANGES dyadic ranges
+ * and a cache of handy metadata that we'll reuse across calls.
+ * Counters are 32 bits wide until the total count could overflow them,
+ * and are then all widened to 64 bits.
  * \endinternal
  */
 typedef struct {
-    Datum args[MAXARGS];  /*! carry along additional args for finalizer */
+    uint32 magic;         /*! SKETCH_MAGIC_CM, see sketch_check_tag */
+    int32 hashver;        /*! SKETCH_HASH_* version used to build the sketch */
+    int64 args[MAXARGS];  /*! carry along additional args for finalizer, as keys */
     int nargs;            /*! number of args being carried for finalizer */
+    int mode;             /*! CM_MODE_* update rule of the sketched ranges */
+    int keys;             /*! CM_KEYS_* mapping of the values to keys */
     Oid typOid;     /*! oid of the data type we are sketching */
     Oid outFuncOid; /*! oid of the OutFunc for that data type */
-    countmin sketches[RANGES];
+    int16 typLen;   /*! length of that data type */
+    bool typByVal;  /*! whether that data type is passed by value */
+    cmshape shape;  /*! dimensions of the sketched ranges */
+    uint64 total;   /*! number of values counted */
+    bool   wide;    /*! whether counters are 64 bits */
+    uint32 ncounters;        /*! number of counters over all ranges */
+    cmrange ranges[RANGES];  /*! layout of each dyadic range */
+    uint64 counters[0];      /*! the counters of all ranges, back to back */
 } cmtransval;
 
-/*! base size of a cmtransval */
-#define CM_TRANSVAL_SZ (VARHDRSZ + sizeof(cmtransval))
+/*! size of a cmtransval holding the given number of counters */
+#define CM_TRANSVAL_SZ(wide, ncounters) \
+    (VARHDRSZ + sizeof(cmtransval) + (Size)(ncounters)*CM_COUNTER_SZ(wide))
 
-#define CM_TRANSVAL_INITIALIZED(t) (VARSIZE(t) >= CM_TRANSVAL_SZ)
+#define CM_TRANSVAL_INITIALIZED(t) (VARSIZE(t) >= VARHDRSZ + sizeof(cmtransval))
 
 
 /*!
@@ -92,6 +206,7 @@ typedef struct {
  */
 typedef struct {
     unsigned offset;  /*! memory offset to the value */
+    uint32 tag;       /*! hash tag of the value, see MFV_HASH_TAG */
     uint64 cnt;   /*! counter */
 } offsetcnt;
 
@@ -102,24 +217,46 @@ typedef struct {
  *
  * Holds a single
  * countmin sketch (no dyadic ranges) and an array of Most Frequent Values.
- * We are flexible with the number of mfvs, as well as the type.
+ * We are flexible with the number of mfvs, the sketch shape, and the type.
  * Hence at the end of this struct is an array mfv[max_mfvs] of offsetcnt entries,
- * followed by an array of Postgres text objects with the output formats of
- * the mfvs.
+ * followed by an index over the mfvs (see MFV_HEAP and MFV_SLOTS),
+ * followed by the sketch counters (see MFV_SKETCH), followed by an array of
+ * Postgres text objects with the output formats of the mfvs.
  * Each mfv entry contains an offset from the top of the structure where
  * we can find a Postgres text object holding the output format of a
  * frequent value.
+ *
+ * A sketch built with a half-life counts each value with a weight that
+ * doubles every half-life of its time (forward decay), so that the counts
+ * decay exponentially as of the latest time seen.  A value at the landmark
+ * time weighs 2^MFV_DECAY_BITS, and the landmark moves forward, halving
+ * every count as it passes each half-life, before the weights could
+ * overflow the counters.  Landmarks are whole multiples of the half-life,
+ * so sketches with the same half-life merge by shifting.
+ *
+ * The index has two parts.  A min-heap of mfv positions ordered by count
+ * (with the inverse map from mfv to heap position) finds the value to evict
+ * in O(1), and an open-addressing hash table of nslots entries, each holding
+ * an mfv position plus one (0 is empty), finds a stored value without a scan.
  * \endinternal
  */
 typedef struct {
+    uint32 magic;         /*! SKETCH_MAGIC_MFV, see sketch_check_tag */
+    int32 hashver;        /*! SKETCH_HASH_* version used to build the sketch */
     unsigned max_mfvs;    /*! number of frequent values */
     unsigned next_mfv;    /*! index of next mfv to insert into */
     unsigned next_offset; /*! next memory offset to insert into */
+    unsigned nslots;      /*! size of the hash table, a power of two */
     Oid typOid;           /*! Oid of the type being counted */
     int typLen;           /*! Length of the data type */
     bool typByVal;        /*! Whether type is by value or by reference */
     Oid outFuncOid;       /*! Oid of the outfunc for this type */
-    countmin sketch;      /*! a single countmin sketch */
+    int mode;             /*! CM_MODE_* update rule of the countmin sketch */
+    cmshape shape;        /*! dimensions of the countmin sketch */
+    float8 halflife;      /*! half-life of the counts, or 0 if they do not decay */
+    float8 landmark;      /*! time at which a value weighs 2^MFV_DECAY_BITS */
+    float8 latest;        /*! latest time counted */
+    uint64 weight;        /*! sum of the decayed weights, which bounds the counters */
     /*!
      * type-independent collection of Most Frequent Values
      * Holds an array of (counter,offset) pairs, which by
@@ -129,8 +266,38 @@ typedef struct {
     offsetcnt mfvs[0];
 } mfvtransval;
 
+/*! a decaying sketch counts a value at its landmark time as 2^MFV_DECAY_BITS */
+#define MFV_DECAY_BITS 16
+/*! half-lives past its landmark after which a decaying sketch moves it */
+#define MFV_DECAY_RANGE 8
+
+/*! hash table size for i mfvs: a power of two, at most half full */
+#define MFV_NSLOTS(i) ((uint32)2 << safe_log2(2*(int64)(i) - 1))
+
 /*! base size of an MFV transval */
-#define MFV_TRANSVAL_SZ(i) (VARHDRSZ + sizeof(mfvtransval) + i*sizeof(offsetcnt))
+#define MFV_TRANSVAL_SZ(i, nslots, shape) (VARHDRSZ + sizeof(mfvtransval) + \
+                                           (i)*sizeof(offsetcnt) + \
+                                           (2*(i) + (nslots))*sizeof(uint32) + \
+                                           CM_SKETCH_SZ(shape))
+
+#define MFV_TRANSVAL_INITIALIZED(t) (VARSIZE(t) > VARHDRSZ + sizeof(mfvtransval))
+
+/*! the hash tag of a value: the last 32 bits of its sketch hash */
+#define MFV_HASH_TAG(hash) \
+    ((uint32)(hash)[SKETCH_HASHLEN-4] | (uint32)(hash)[SKETCH_HASHLEN-3] << 8 \
+     | (uint32)(hash)[SKETCH_HASHLEN-2] << 16 | (uint32)(hash)[SKETCH_HASHLEN-1] << 24)
+
+/*! the min-heap of mfv positions, which follows the mfvs array */
+#define MFV_HEAP(transval) ((uint32 *)((transval)->mfvs + (transval)->max_mfvs))
+/*! heap position of each mfv */
+#define MFV_HEAPPOS(transval) (MFV_HEAP(transval) + (transval)->max_mfvs)
+/*! the hash table over the mfvs */
+#define MFV_SLOTS(transval) (MFV_HEAPPOS(transval) + (transval)->max_mfvs)
+
+/*! the countmin sketch, which follows the index; its counters are 64 bits */
+#define MFV_SKETCH(transval) \
+    cm_sketch_of(MFV_SLOTS(transval) + (transval)->nslots, (transval)->shape, \
+                 true, (transval)->mode)
 
 /*! free space remaining for text values */
 #define MFV_TRANSVAL_CAPACITY(transblob) (VARSIZE(transblob) - VARHDRSZ - \
@@ -138,58 +305,90 @@ typedef struct {
                                           next_offset)
                                           
 /* countmin aggregate protos */
-Datum  countmin_trans_c(countmin, Datum, Oid, Oid);
+cmshape cm_shape(float8, float8);
+int    cm_mode(text *);
+int    cm_key_kind(Oid);
+int64  cm_key_of(Datum, Oid);
+Datum  cm_key_value(int64, Oid);
+float8 cm_key_float8(int64, int);
+int64  cm_float8_key(float8, int);
+int64  cm_arg_key(cmtransval *, Datum, Oid);
+void   cm_hash_value(cmtransval *, Datum, uint8 *);
+countmin cm_sketch_of(void *, cmshape, bool, int);
+void   countmin_trans_c(countmin, Datum, int16, bool, int, uint8 *);
+void   cm_hash_key(int64, int, uint8 *);
+bytea *cmsketch_check_tag(bytea *);
 bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool);
-bytea *cmsketch_init_transval(Oid);
-void   countmin_dyadic_trans_c(cmtransval *, Datum);
+bytea *cmsketch_init_transval(Oid, cmshape, int);
+bytea *countmin_dyadic_trans_c(bytea *, Datum);
+cmrange cm_range_cover(cmtransval *, int, uint64, uint64);
+bool   cm_range_extent(cmtransval *, int, uint64 *, uint64 *);
+bytea *cm_relayout(bytea *, cmrange *, bool);
+void   cm_range_add(cmtransval *, int, cmtransval *);
+countmin cm_range_counters(cmtransval *, int);
+int64  cm_range_count(cmtransval *, int, int64);
 
 /* countmin scalar function protos */
-int64  cmsketch_count_c(countmin, Datum, Oid, Oid);
-int64  cmsketch_count_md5_datum(countmin, bytea *, Oid);
+int64  cmsketch_count_c(countmin, Datum, int16, bool, int);
+int64  cmsketch_count_hash(countmin, uint8 *);
 Datum  cmsketch_rangecount_c(cmtransval *, int64, int64);
 Datum  cmsketch_centile_c(cmtransval *, int, int64);
+void   cmsketch_rank_values_c(cmtransval *, const int64 *, int, int64 *);
 Datum  cmsketch_width_histogram_c(cmtransval *, int64, int64, int64);
 Datum  cmsketch_depth_histogram_c(cmtransval *, int64);
 void   find_ranges(int64, int64, rangelist *);
 void   find_ranges_internal(int64, int64, int, rangelist *);
 
-/* hash_counters_iterate and its lambdas */
-int64  hash_counters_iterate(bytea *, countmin, int64, int64 (*lambdaptr)(
-                                 uint32,
-                                 uint32,
-                                 countmin,
-                                 int64));
-
-int64  increment_counter(uint32, uint32, countmin, int64);
-int64  min_counter(uint32, uint32, countmin, int64);
+/* the counters picked by a hash, and their updates */
+uint32 hash_counters(uint8 *, countmin, Size *);
+void   cmsketch_add_hash(countmin, uint8 *, int64);
 
 /* MFV protos */
-bytea *mfv_transval_append(bytea *, Datum);
-int    mfv_find(bytea *, Datum);
-bytea *mfv_transval_replace(bytea *, Datum, int);
+bytea *mfv_transval_append(bytea *, Datum, uint32);
+int    mfv_find(bytea *, Datum, uint32);
+bytea *mfv_transval_replace(bytea *, Datum, int, uint32);
+bytea *mfv_transval_offer(bytea *, Datum, uint32, uint64);
+bytea *mfv_transval_count(bytea *, Datum, int64);
+void   mfv_decay_to(mfvtransval *, float8);
+float8 mfv_decayed_count(mfvtransval *, uint64);
 bytea *mfv_transval_insert_at(bytea *, Datum, uint32);
 void *mfv_transval_getval(bytea *, uint32);
-bytea *mfv_init_transval(int, Oid);
+bytea *mfv_init_transval(int, Oid, cmshape, int);
 bytea *mfvsketch_merge_c(bytea *, bytea *);
+void   mfv_check_tag(bytea *);
 void   mfv_copy_datum(bytea *, int, Datum);
+void   mfv_index_insert(mfvtransval *, uint32);
+void   mfv_index_delete(mfvtransval *, uint32);
+void   mfv_index_rebuild(mfvtransval *);
+void   mfv_set_count(mfvtransval *, uint32, uint64);
 int cnt_cmp_desc(const void *i, const void *j);
 
 
 /* UDF protos */
-Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS);
+Datum __cmsketch_trans(PG_FUNCTION_ARGS);
+Datum __cmsketch_shape_trans(PG_FUNCTION_ARGS);
+Datum __cmsketch_inv_trans(PG_FUNCTION_ARGS);
 Datum cmsketch_width_histogram(PG_FUNCTION_ARGS);
 Datum cmsketch_dhistogram(PG_FUNCTION_ARGS);
 Datum __cmsketch_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_merge(PG_FUNCTION_ARGS);
 Datum cmsketch_dump(PG_FUNCTION_ARGS);
+Datum cmsketch_estimate_count(PG_FUNCTION_ARGS);
+Datum cmsketch_estimate_rangecount(PG_FUNCTION_ARGS);
+Datum cmsketch_estimate_centile(PG_FUNCTION_ARGS);
+Datum cmsketch_estimate_centile_value(PG_FUNCTION_ARGS);
+Datum cmsketch_estimate_depth_histogram(PG_FUNCTION_ARGS);
 Datum __cmsketch_count_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_rangecount_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_centile_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_median_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_dhist_final(PG_FUNCTION_ARGS);
 Datum __mfvsketch_trans(PG_FUNCTION_ARGS);
+Datum __mfvsketch_inv_trans(PG_FUNCTION_ARGS);
+Datum __mfvsketch_decayed_trans(PG_FUNCTION_ARGS);
 Datum __mfvsketch_final(PG_FUNCTION_ARGS);
 Datum __mfvsketch_merge(PG_FUNCTION_ARGS);
+Datum __mfvsketch_union_trans(PG_FUNCTION_ARGS);
 
 #endif /* _COUNTMIN_H_ */
 
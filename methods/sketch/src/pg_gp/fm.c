@@ -30,7 +30,6 @@
 #include "utils/elog.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
-#include "libpq/md5.h"
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
@@ -42,7 +41,7 @@ PG_MODULE_MAGIC;
 #endif
 
 #define NMAP 256
-#define FMSKETCH_SZ (VARHDRSZ + NMAP*(MD5_HASHLEN_BITS)/CHAR_BIT)
+#define FMSKETCH_SZ (VARHDRSZ + NMAP*(SKETCH_HASHLEN_BITS)/CHAR_BIT)
 
 /*!
  * For FM, empirically, estimates seem to fall below 1% error around 12k
@@ -54,8 +53,7 @@ PG_MODULE_MAGIC;
  * initial size for a sortasort: we'll guess at 8 bytes per datum.
  * sortasort will grow dynamically if we guessed too low
  */
-#define SORTASORT_INITIAL_STORAGE  sizeof(sortasort) + MINVALS*sizeof(uint32) + \
-    8*MINVALS
+#define SORTASORT_INITIAL_STORAGE  SORTASORT_SZ(MINVALS, 8*MINVALS)
 
 typedef enum {SMALL, BIG} fmstatus;
 
@@ -71,6 +69,8 @@ typedef enum {SMALL, BIG} fmstatus;
  * \endinternal
  */
 typedef struct {
+    uint32   magic;      /*! SKETCH_MAGIC_FM, see sketch_check_tag */
+    int32    hashver;    /*! SKETCH_HASH_* version used to build the sketch */
     fmstatus status;
     Oid      typOid;
     Oid      funcOid;
@@ -84,9 +84,14 @@ Datum __fmsketch_count_distinct_c(bytea *);
 Datum __fmsketch_trans(PG_FUNCTION_ARGS);
 Datum __fmsketch_count_distinct(PG_FUNCTION_ARGS);
 Datum __fmsketch_merge(PG_FUNCTION_ARGS);
+Datum __fmsketch_union_trans(PG_FUNCTION_ARGS);
+Datum __fmsketch_final(PG_FUNCTION_ARGS);
 void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out);
 bytea *fmsketch_sortasort_insert(bytea *, Datum, size_t);
 bytea *fm_new(fmtransval *);
+static void fm_insert_bytes(fmtransval *, const void *, size_t);
+static void fm_load_sortasort(bytea *, sortasort *);
+static void fm_check_tag(bytea *);
 
 PG_FUNCTION_INFO_V1(__fmsketch_trans);
 
@@ -95,15 +100,12 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
 {
     bytea *     transblob = (bytea *)PG_GETARG_BYTEA_P(0);
     fmtransval *transval;
-    Oid         element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    Oid         element_type;
     Oid         funcOid;
     bool        typIsVarlena;
     Datum       retval;
     Datum       inval;
 
-    if (!OidIsValid(element_type))
-        elog(ERROR, "could not determine data type of input");
-
     /*
      * This is Postgres boilerplate for UDFs that modify the data in their own context.
      * Such UDFs can only be correctly called in an agg context since regular scalar
@@ -136,7 +138,13 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
             SET_VARSIZE(transblob, blobsz);
             transval = (fmtransval *)VARDATA(transblob);
 
+            /* look the type up once; later calls use the transval's copy */
+            element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+            if (!OidIsValid(element_type))
+                elog(ERROR, "could not determine data type of input");
             transval->typOid = element_type;
+            transval->magic = SKETCH_MAGIC_FM;
+            transval->hashver = SKETCH_HASH_CURRENT;
             /* figure out the outfunc for this type */
             getTypeOutputInfo(element_type, &funcOid, &typIsVarlena);
             get_typlenbyval(element_type, &(transval->typLen), &(transval->typByVal));
@@ -175,7 +183,6 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
         else if (transval->status == SMALL
                  && ((sortasort *)(transval->storage))->num_vals ==
                  MINVALS) {
-            int        i;
             sortasort  *s = (sortasort *)(transval->storage);
             bytea      *newblob = fm_new(transval);
             
@@ -185,14 +192,12 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
              * "catch up" on the past as if we were doing FM from the beginning:
              * apply the FM sketching algorithm to each value previously stored in the sortasort
              */
-            for (i = 0; i < MINVALS; i++)
-                __fmsketch_trans_c(newblob, 
-                                   PointerExtractDatum(SORTASORT_GETVAL(s,i), s->typByVal));
+            fm_load_sortasort(newblob, s);
 
             /*
-             * XXXX would like to pfree the old transblob, but the memory allocator doesn't like it
-             * XXXX Meanwhile we know that this memory "leak" is of fixed size and will get
-             * XXXX deallocated "soon" when the memory context is destroyed.
+             * We must not pfree the old transblob ourselves: once we return a
+             * different pointer, the executor frees the previous transition
+             * value, so the SMALL storage is released after this call.
              */
             /* drop through to insert the current datum in "BIG" mode */
             transblob = newblob;
@@ -241,7 +246,8 @@ bytea *fm_new(fmtransval *template)
 
 /*!
  * Main logic of Flajolet and Martin's sketching algorithm.
- * For each call, we get an md5 hash of the value passed in.
+ * For each call, we get a 128-bit hash of the value passed in, using the
+ * hash function version recorded in the transval.
  * First we use the hash as a random number to choose one of
  * the NMAP bitmaps at random to update.
  * Then we find the position "rmost" of the rightmost 1 bit in the hashed value.
@@ -252,20 +258,30 @@ bytea *fm_new(fmtransval *template)
 Datum __fmsketch_trans_c(bytea *transblob, Datum indat)
 {
     fmtransval * transval = (fmtransval *) VARDATA(transblob);
+
+    fm_insert_bytes(transval,
+                    DatumExtractPointer(indat, transval->typByVal),
+                    ExtractDatumLen(indat, transval->typLen, transval->typByVal));
+    return PointerGetDatum(transblob);
+}
+
+/*!
+ * Apply the FM algorithm to a value given by its marshalled bytes.
+ * The type's length and byval flag come from the transval, so no catalog
+ * lookups are needed per value.
+ * \param transval a BIG transval
+ * \param datp pointer to the bytes of the value
+ * \param len number of bytes, as returned by ExtractDatumLen
+ */
+static void fm_insert_bytes(fmtransval *transval, const void *datp, size_t len)
+{
     bytea *      bitmaps = (bytea *)transval->storage;
     uint64       index;
-    uint8 *      c;
+    uint64       hash[SKETCH_HASHLEN/sizeof(uint64)]; /* uint64 for alignment */
+    uint8 *      c = (uint8 *)hash;
     int          rmost;
-    Datum        result;
-    // char        *hex;
-    bytea       *hashed;
 
-    hashed = sketch_md5_bytea(indat, transval->typOid);
-    c = (uint8 *)VARDATA(hashed);
-    // hex = text_to_cstring((bytea *)DatumGetPointer(DirectFunctionCall2(binary_encode, PointerGetDatum(hashed),
-    //                       CStringGetTextDatum("hex"))));
-    // elog(NOTICE, "md5(%s), len %d: %s", text_to_cstring((bytea *)PointerGetDatum(indat)),
-    //      VARSIZE((bytea *)PointerGetDatum(indat)), hex);
+    sketch_hash_bytes(datp, len, transval->hashver, c);
 
     /*
      * During the insertion we insert each element
@@ -277,17 +293,49 @@ Datum __fmsketch_trans_c(bytea *transblob, Datum indat)
     /*
      * Find index of the rightmost non-0 bit.  Turn on that bit (from left!) in the sketch.
      */
-    rmost = rightmost_one(c, 1, MD5_HASHLEN_BITS, 0);
+    rmost = rightmost_one(c, 1, SKETCH_HASHLEN_BITS, 0);
 
     /*
      * last argument must be the index of the bit position from the right.
      * i.e. position 0 is the rightmost.
      * so to set the bit at rmost from the left, we subtract from the total number of bits.
      */
-    result =
-        array_set_bit_in_place(bitmaps, NMAP, MD5_HASHLEN_BITS, index,
-                               (MD5_HASHLEN_BITS - 1) - rmost);
-    return PointerGetDatum(transblob);
+    array_set_bit_in_place(bitmaps, NMAP, SKETCH_HASHLEN_BITS, index,
+                           (SKETCH_HASHLEN_BITS - 1) - rmost);
+}
+
+/*!
+ * Bulk-load the values stored in a SMALL transval's sortasort into the
+ * bitmaps of a BIG transval.  The sortasort holds each value's marshalled
+ * bytes, so they are hashed in place without rebuilding Datums.
+ * \param transblob a BIG transval packed into a bytea
+ * \param s the sortasort of a SMALL transval over the same type
+ */
+static void fm_load_sortasort(bytea *transblob, sortasort *s)
+{
+    fmtransval *transval = (fmtransval *)VARDATA(transblob);
+    size_t      i;
+
+    for (i = 0; i < s->num_vals; i++) {
+        char *v = SORTASORT_GETVAL(s, i);
+
+        fm_insert_bytes(transval, v,
+                        (s->typLen > 0) ? (size_t)s->typLen
+                        : ExtractDatumLen(PointerGetDatum(v), s->typLen, false));
+    }
+}
+
+/*!
+ * check the tag of a nonempty FM transval, which may be a stored fm_sketch.
+ * FM sketches could not be stored before they were tagged, so there are
+ * no untagged ones to accept.
+ */
+static void fm_check_tag(bytea *transblob)
+{
+    sketch_require_tag(VARDATA(transblob), VARSIZE(transblob) - VARHDRSZ,
+                       SKETCH_MAGIC_FM, "fm_sketch");
+    if (VARSIZE(transblob) < VARHDRSZ + sizeof(fmtransval))
+        elog(ERROR, "not a valid fm_sketch: too short");
 }
 
 PG_FUNCTION_INFO_V1(__fmsketch_count_distinct);
@@ -300,6 +348,7 @@ Datum __fmsketch_count_distinct(PG_FUNCTION_ARGS)
     if (VARSIZE((PG_GETARG_BYTEA_P(0))) == VARHDRSZ)
         /* nothing was ever aggregated! */
         return (0);
+    fm_check_tag(PG_GETARG_BYTEA_P(0));
 
     /* if status is not BIG then get count from sortasort */
     if (transval->status == SMALL)
@@ -325,7 +374,7 @@ Datum __fmsketch_count_distinct_c(bytea *bitmaps)
     uint32        S = 0;
     static double phi = 0.77351;     /*
                                       * the magic constant
-                                      * char out[NMAP*MD5_HASHLEN_BITS];
+                                      * char out[NMAP*SKETCH_HASHLEN_BITS];
                                       */
     int    i;
     uint32 lz;
@@ -333,7 +382,7 @@ Datum __fmsketch_count_distinct_c(bytea *bitmaps)
     for (i = 0; i < NMAP; i++)
     {
         lz = leftmost_zero((uint8 *)VARDATA(
-                               bitmaps), NMAP, MD5_HASHLEN_BITS, i);
+                               bitmaps), NMAP, SKETCH_HASHLEN_BITS, i);
         S = S + lz;
     }
 
@@ -370,15 +419,31 @@ Datum __fmsketch_merge(PG_FUNCTION_ARGS)
         PG_RETURN_DATUM(PointerGetDatum(transblob1));
     }
 
+    fm_check_tag(transblob1);
+    fm_check_tag(transblob2);
     transval1 = (fmtransval *)VARDATA(transblob1);
     transval2 = (fmtransval *)VARDATA(transblob2);
 
+    if (transval1->typOid != transval2->typOid)
+        elog(ERROR,
+             "cannot merge FM sketches over different types: %u, %u",
+             transval1->typOid, transval2->typOid);
+
     if (transval1->status == BIG && transval2->status == BIG) {
-        /* easy case: merge two FM sketches via bitwise OR. */
         fmtransval *newval;
+
+        /*
+         * easy case: merge two FM sketches via bitwise OR.  Their bits
+         * cannot be rehashed, so both must come from the same hash function.
+         */
+        if (transval1->hashver != transval2->hashver)
+            elog(ERROR,
+                 "cannot merge FM sketches built with different hash functions (versions %d and %d); rebuild one of them from its data",
+                 transval1->hashver, transval2->hashver);
         tblob_big = fm_new(transval1);
         newval = (fmtransval *)VARDATA(tblob_big);
-        big_or(transblob1, transblob2, (bytea *)newval->storage);
+        big_or((bytea *)transval1->storage, (bytea *)transval2->storage,
+               (bytea *)newval->storage);
         PG_RETURN_DATUM(PointerGetDatum(tblob_big));
     }
     else if (transval1->status == SMALL && transval2->status == SMALL) {
@@ -394,10 +459,8 @@ Datum __fmsketch_merge(PG_FUNCTION_ARGS)
         if (sortabig->num_vals + sortashort->num_vals <=
             sortabig->capacity) {
             /*
-             * we have room in sortabig
-             * one could imagine a more efficient (merge-based) sortasort merge,
-             * but for now we just copy the values from the smaller sortasort into
-             * the bigger one.
+             * we have room in sortabig, so just copy the values from the
+             * smaller sortasort into the bigger one.
              */
             for (i = 0; i < sortashort->num_vals; i++) {
                 Datum the_val = PointerExtractDatum(SORTASORT_GETVAL(sortashort,i),
@@ -415,7 +478,9 @@ Datum __fmsketch_merge(PG_FUNCTION_ARGS)
 
     /*
      * if we got here, then at most one transval is BIG, i.e. one or both transvals is SMALL.
-     * need to form an FM sketch and populate with the SMALL transval(s)
+     * need to form an FM sketch and populate with the SMALL transval(s).
+     * SMALL transvals hold raw values, so they get re-hashed with whatever
+     * hash function the BIG sketch was built with.
      */
     if (transval1->status == SMALL && transval2->status == SMALL)
         tblob_big = fm_new(transval1);
@@ -423,27 +488,27 @@ Datum __fmsketch_merge(PG_FUNCTION_ARGS)
         tblob_big =
             (transval1->status == BIG) ? transblob1 : transblob2;
 
-    if (transval1->status == SMALL) {
-        s1 = (sortasort *)(transval1->storage);
-        for(i = 0; i < s1->num_vals; i++) {
-            __fmsketch_trans_c(tblob_big, PointerExtractDatum(SORTASORT_GETVAL(s1,i),
-                                                              transval1->typByVal));
-        }
-    }
-    if (transval2->status == SMALL) {
-        s2 = (sortasort *)(transval2->storage);
-        for(i = 0; i < s2->num_vals; i++) {
-            __fmsketch_trans_c(tblob_big, PointerExtractDatum(SORTASORT_GETVAL(s2,i),
-                                                              transval1->typByVal));
-        }
-    }
+    if (transval1->status == SMALL)
+        fm_load_sortasort(tblob_big, (sortasort *)(transval1->storage));
+    if (transval2->status == SMALL)
+        fm_load_sortasort(tblob_big, (sortasort *)(transval2->storage));
     PG_RETURN_DATUM(PointerGetDatum(tblob_big));
 }
 
-/*! OR of two big bitmaps, for gathering sketches computed in parallel. */
+/*!
+ * OR of two big bitmaps, for gathering sketches computed in parallel.
+ * \param bitmap1 the FM bitmaps of one sketch
+ * \param bitmap2 the FM bitmaps of another sketch of the same size
+ * \param out preallocated bitmaps of the same size to hold the result
+ */
 void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out)
 {
-    uint32  i;
+    uint8 * b1 = (uint8 *)VARDATA(bitmap1);
+    uint8 * b2 = (uint8 *)VARDATA(bitmap2);
+    uint8 * o = (uint8 *)VARDATA(out);
+    size_t  n = VARSIZE(bitmap1) - VARHDRSZ;
+    size_t  i;
+    uint64  w1, w2;
 
     if (VARSIZE(bitmap1) != VARSIZE(bitmap2))
         elog(ERROR,
@@ -451,14 +516,72 @@ void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out)
              VARSIZE(bitmap1),
              VARSIZE(bitmap2));
 
-    out = (bytea *)palloc(VARSIZE(bitmap1));
-    SET_VARSIZE(out, VARSIZE(bitmap1));
+    /*
+     * OR 64 bits at a time.  Varlena data is not necessarily 8-byte
+     * aligned, so words go through memcpy, which compiles to plain loads.
+     */
+    for (i = 0; i + sizeof(uint64) <= n; i += sizeof(uint64)) {
+        memcpy(&w1, b1 + i, sizeof(uint64));
+        memcpy(&w2, b2 + i, sizeof(uint64));
+        w1 |= w2;
+        memcpy(o + i, &w1, sizeof(uint64));
+    }
+    for (; i < n; i++)
+        o[i] = b1[i] | b2[i];
 
-    /* could probably be more efficient doing this 32 or 64 bits at a time */
-    for (i=0; i < VARSIZE(bitmap1) - VARHDRSZ; i+=8)
-        ((char *)(VARDATA(out)))[i] = ((char *)(VARDATA(bitmap1)))[i] |
-                                      ((char *)(VARDATA(bitmap2)))[i];
+}
+
+PG_FUNCTION_INFO_V1(__fmsketch_union_trans);
 
+/*!
+ * UDA transition function for fmsketch_union: merge a stored fm_sketch
+ * into the running transval.
+ * __fmsketch_merge may insert into either of its arguments, so we hand it
+ * a private copy of the stored sketch rather than the tuple's own datum.
+ */
+Datum __fmsketch_union_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = (bytea *)PG_GETARG_BYTEA_P(0);
+    bytea *sketchblob = (bytea *)PG_GETARG_BYTEA_P_COPY(1);
+
+    PG_RETURN_DATUM(DirectFunctionCall2(__fmsketch_merge,
+                                        PointerGetDatum(transblob),
+                                        PointerGetDatum(sketchblob)));
+}
+
+PG_FUNCTION_INFO_V1(__fmsketch_final);
+
+/*!
+ * UDA final function returning the FM transval itself as an fm_sketch, so
+ * it can be stored and later merged with fmsketch_union.
+ * A SMALL transval is returned without the unused tail of its sortasort
+ * storage; fmsketch_sortasort_insert grows it again if more values arrive.
+ */
+Datum __fmsketch_final(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = (bytea *)PG_GETARG_BYTEA_P(0);
+    fmtransval *transval;
+    sortasort * s;
+    bytea *     newblob;
+    size_t      newsize;
+
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        /* nothing was ever aggregated! */
+        PG_RETURN_NULL();
+
+    transval = (fmtransval *)VARDATA(transblob);
+    if (transval->status != SMALL)
+        PG_RETURN_BYTEA_P(transblob);
+
+    s = (sortasort *)transval->storage;
+    newsize = VARHDRSZ + sizeof(fmtransval)
+              + SORTASORT_SZ(s->capacity, s->storage_cur);
+    newblob = (bytea *)palloc(newsize);
+    memcpy(newblob, transblob, newsize);
+    SET_VARSIZE(newblob, newsize);
+    ((sortasort *)((fmtransval *)VARDATA(newblob))->storage)->storage_sz =
+        s->storage_cur;
+    PG_RETURN_BYTEA_P(newblob);
 }
 
 /*!
@@ -496,10 +619,8 @@ bytea *fmsketch_sortasort_insert(bytea *transblob, Datum dat, size_t len)
          */
 
         new_storage_sz = s_in->storage_sz*2 + len;
-        /* XXX THIS POINTER ARITHMETIC SHOULD BE HIDDEN BY A MACRO IN THE SORTASORT LIBRARY! */
-        newsize = VARHDRSZ + sizeof(fmtransval) + sizeof(sortasort)
-                  + s_in->capacity*sizeof(s_in->dir[0]) +
-                  new_storage_sz;
+        newsize = VARHDRSZ + sizeof(fmtransval)
+                  + SORTASORT_SZ(s_in->capacity, new_storage_sz);
         newblob = (bytea *)palloc(newsize);
         memcpy(newblob, transblob, VARSIZE(transblob));
         SET_VARSIZE(newblob, newsize);
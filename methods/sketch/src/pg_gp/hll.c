@@ -0,0 +1,557 @@
+/*!
+ * \file hll.c
+ *
+ * \brief HyperLogLog sketch implementation
+ */
+/*!
+ * \implementation
+ * A HyperLogLog (HLL) sketch keeps m = 2^p small "registers".  Each value is
+ * hashed to 64 bits: the first p bits choose a register, and the register
+ * remembers the largest "rank" (position of the leftmost 1 bit) seen among the
+ * remaining bits.  The harmonic mean of 2^register across all registers
+ * estimates the number of distinct values.  Like FM sketches, HLL sketches
+ * merge by taking the max of corresponding registers, so they parallelize
+ * trivially and can be stored and unioned later.
+ *
+ * Like our FM sketches we special-case small inputs, but rather than
+ * keeping the raw values we keep a sorted "sparse" list of (index, rank)
+ * pairs computed at a much higher precision of HLL_SPARSE_PRECISION bits,
+ * and estimate from it via linear counting.  Once the sparse list would take
+ * more space than the registers, the sketch is converted to a "dense" array
+ * of 6-bit registers.
+ *
+ * Dense sketches are estimated with Ertl's improved raw estimator, which
+ * corrects the bias of the original HLL estimator at small and large
+ * cardinalities without empirical lookup tables.
+ *
+ * See the papers mentioned below for details.
+ *
+ * \literature
+ * [1] P. Flajolet, E. Fusy, O. Gandouet and F. Meunier.  HyperLogLog: the
+ *     analysis of a near-optimal cardinality estimation algorithm.  AofA 2007.
+ * [2] S. Heule, M. Nunkesser and A. Hall.  HyperLogLog in Practice:
+ *     Algorithmic Engineering of a State of The Art Cardinality Estimation
+ *     Algorithm.  EDBT 2013.
+ * [3] O. Ertl.  New cardinality estimation algorithms for HyperLogLog
+ *     sketches.  arXiv:1702.01284, 2017.
+ */
+
+#include "postgres.h"
+#include "utils/elog.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "hll.h"
+#include <math.h>
+
+/*! number of leading zero bits in a 64-bit word */
+static inline int hll_clz64(uint64 w)
+{
+    int n = 0;
+
+    if (w == 0)
+        return 64;
+    while (!(w & (UINT64CONST(1) << 63))) {
+        w <<= 1;
+        n++;
+    }
+    return n;
+}
+
+/*! read register i of a dense sketch */
+static inline uint8 hll_get_register(uint8 *regs, uint32 i)
+{
+    uint32 bit = i*HLL_REGISTER_BITS;
+    uint32 byte = bit / CHAR_BIT;
+    uint32 shift = bit % CHAR_BIT;
+    uint32 v = regs[byte];
+
+    /* a register straddles two bytes iff it doesn't fit in the first one */
+    if (shift + HLL_REGISTER_BITS > CHAR_BIT)
+        v |= ((uint32)regs[byte+1]) << CHAR_BIT;
+    return (v >> shift) & HLL_RANK_MASK;
+}
+
+/*! raise register i of a dense sketch to rank, if rank is bigger */
+static inline void hll_update_register(uint8 *regs, uint32 i, uint8 rank)
+{
+    uint32 bit = i*HLL_REGISTER_BITS;
+    uint32 byte = bit / CHAR_BIT;
+    uint32 shift = bit % CHAR_BIT;
+
+    if (rank <= hll_get_register(regs, i))
+        return;
+    regs[byte] = (regs[byte] & ~(HLL_RANK_MASK << shift)) | (rank << shift);
+    if (shift + HLL_REGISTER_BITS > CHAR_BIT)
+        regs[byte+1] = (regs[byte+1] & ~(HLL_RANK_MASK >> (CHAR_BIT - shift)))
+                       | (rank >> (CHAR_BIT - shift));
+}
+
+/*!
+ * map a sparse entry down to the register index and rank it would have
+ * had in a dense sketch of precision p.
+ * The index bits dropped by the coarser precision become the leading bits
+ * of the rank's bit string.
+ */
+static inline void hll_sparse_to_dense(uint32 entry, int p, uint32 *idx,
+                                       uint8 *rank)
+{
+    uint32 sidx = entry >> HLL_REGISTER_BITS;
+    int    extra = HLL_SPARSE_PRECISION - p;
+    uint32 low = sidx & (((uint32)1 << extra) - 1);
+
+    *idx = sidx >> extra;
+    if (low != 0)
+        *rank = extra - (64 - hll_clz64(low)) + 1;
+    else
+        *rank = extra + (entry & HLL_RANK_MASK);
+}
+
+/*!
+ * allocate a new HLL transval
+ * \param precision log2 of the number of registers
+ * \param typOid the type to be sketched
+ * \param hashver the SKETCH_HASH_* version to build the sketch with
+ * \param encoding HLL_SPARSE or HLL_DENSE
+ * \param nentries room for this many sparse entries (ignored if DENSE)
+ */
+bytea *hll_new(int precision, Oid typOid, int hashver, hllencoding encoding,
+               uint32 nentries)
+{
+    size_t       sz;
+    bytea       *blob;
+    hlltransval *transval;
+
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+        elog(ERROR, "HLL precision must be between %d and %d, was %d",
+             HLL_MIN_PRECISION, HLL_MAX_PRECISION, precision);
+
+    if (encoding == HLL_DENSE)
+        sz = HLL_TRANSVAL_SZ(HLL_DENSE_BYTES(precision));
+    else
+        sz = HLL_TRANSVAL_SZ(nentries*sizeof(uint32));
+
+    /* use palloc0 so that all registers start at 0 */
+    blob = (bytea *)palloc0(sz);
+    SET_VARSIZE(blob, sz);
+    transval = (hlltransval *)VARDATA(blob);
+    transval->magic = SKETCH_MAGIC_HLL;
+    transval->hashver = hashver;
+    transval->typOid = typOid;
+    transval->precision = precision;
+    transval->encoding = encoding;
+    transval->nsparse = 0;
+    return blob;
+}
+
+/*!
+ * convert a SPARSE sketch into a newly allocated DENSE one
+ * \param blob a bytea holding a SPARSE hlltransval
+ */
+bytea *hll_to_dense(bytea *blob)
+{
+    hlltransval *transval = (hlltransval *)VARDATA(blob);
+    bytea       *newblob = hll_new(transval->precision, transval->typOid,
+                                   transval->hashver, HLL_DENSE, 0);
+    uint8       *regs = (uint8 *)((hlltransval *)VARDATA(newblob))->data;
+    uint32      *entries = (uint32 *)transval->data;
+    uint32       i, idx;
+    uint8        rank;
+
+    for (i = 0; i < transval->nsparse; i++) {
+        hll_sparse_to_dense(entries[i], transval->precision, &idx, &rank);
+        hll_update_register(regs, idx, rank);
+    }
+    /* XXX can't pfree the old transblob */
+    return newblob;
+}
+
+/*!
+ * add a hashed value to an HLL sketch.
+ * Dense sketches are updated in place; a sparse sketch may be reallocated
+ * to grow, or converted to dense.
+ * \param blob a bytea holding an hlltransval
+ * \param hash 64 bits of hash of the value
+ */
+bytea *hll_insert_hash(bytea *blob, uint64 hash)
+{
+    hlltransval *transval = (hlltransval *)VARDATA(blob);
+    uint32      *entries;
+    uint32       entry, key;
+    uint32       capacity;
+    int          lo, hi;
+
+    if (transval->encoding == HLL_DENSE) {
+        int p = transval->precision;
+        hll_update_register((uint8 *)transval->data, hash >> (64 - p),
+                            hll_clz64((hash << p) | ((uint64)1 << (p - 1))) + 1);
+        return blob;
+    }
+
+    /*
+     * rank over the bits after the sparse index.  OR-ing in a sentinel bit
+     * caps it at 64 - HLL_SPARSE_PRECISION + 1 for an all-zero suffix.
+     */
+    entry = (uint32)(hash >> (64 - HLL_SPARSE_PRECISION)) << HLL_REGISTER_BITS;
+    entry |= hll_clz64((hash << HLL_SPARSE_PRECISION)
+                       | ((uint64)1 << (HLL_SPARSE_PRECISION - 1))) + 1;
+    key = entry >> HLL_REGISTER_BITS;
+
+    /* binary search for the index in the sorted entries */
+    entries = (uint32 *)transval->data;
+    lo = 0;
+    hi = (int)transval->nsparse - 1;
+    while (lo <= hi) {
+        int    mid = lo + (hi - lo)/2;
+        uint32 midkey = entries[mid] >> HLL_REGISTER_BITS;
+
+        if (midkey == key) {
+            if (entry > entries[mid])
+                entries[mid] = entry;
+            return blob;
+        }
+        else if (midkey < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    /* not found: insert at lo, growing or going dense if we're full */
+    capacity = (VARSIZE(blob) - HLL_TRANSVAL_SZ(0)) / sizeof(uint32);
+    if (transval->nsparse == capacity) {
+        bytea *newblob;
+
+        if (capacity >= HLL_SPARSE_MAX(transval->precision))
+            return hll_insert_hash(hll_to_dense(blob), hash);
+
+        capacity = Min(2*capacity, HLL_SPARSE_MAX(transval->precision));
+        newblob = (bytea *)palloc(HLL_TRANSVAL_SZ(capacity*sizeof(uint32)));
+        memcpy(newblob, blob, HLL_TRANSVAL_SZ(transval->nsparse*sizeof(uint32)));
+        SET_VARSIZE(newblob, HLL_TRANSVAL_SZ(capacity*sizeof(uint32)));
+        /* XXX can't pfree the old transblob */
+        blob = newblob;
+        transval = (hlltransval *)VARDATA(blob);
+        entries = (uint32 *)transval->data;
+    }
+    memmove(&entries[lo+1], &entries[lo],
+            (transval->nsparse - lo)*sizeof(uint32));
+    entries[lo] = entry;
+    transval->nsparse++;
+    return blob;
+}
+
+PG_FUNCTION_INFO_V1(__hllsketch_trans);
+
+/*!
+ * UDA transition function for the hllsketch aggregates.
+ * An optional third argument gives the precision of the sketch.
+ */
+Datum __hllsketch_trans(PG_FUNCTION_ARGS)
+{
+    bytea       *transblob = PG_GETARG_BYTEA_P(0);
+    hlltransval *transval;
+    sketch_typinfo *typinfo;
+    uint64       hash[SKETCH_HASHLEN/sizeof(uint64)];
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* ignore NULL inputs */
+    if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
+    /* the input type never changes between calls, so it's looked up once */
+    typinfo = sketch_arg_typinfo(fcinfo, 1);
+
+    /* initialize if this is the first call */
+    if (VARSIZE(transblob) <= VARHDRSZ) {
+        int precision = HLL_DEFAULT_PRECISION;
+
+        if (PG_NARGS() > 2 && !PG_ARGISNULL(2))
+            precision = PG_GETARG_INT32(2);
+        transblob = hll_new(precision, typinfo->typOid, SKETCH_HASH_CURRENT,
+                            HLL_SPARSE, HLL_SPARSE_INITIAL);
+    }
+    transval = (hlltransval *)VARDATA(transblob);
+
+    sketch_hash_contents(PG_GETARG_DATUM(1), typinfo->typLen, typinfo->typByVal,
+                         transval->hashver, (uint8 *)hash);
+    PG_RETURN_DATUM(PointerGetDatum(hll_insert_hash(transblob, hash[0])));
+}
+
+/*!
+ * sanity-check a serialized HLL sketch, which may have come from a table.
+ * \param blob a bytea holding an hlltransval
+ */
+void hll_check(bytea *blob)
+{
+    hlltransval *transval = (hlltransval *)VARDATA(blob);
+
+    sketch_require_tag(VARDATA(blob), VARSIZE(blob) - VARHDRSZ,
+                       SKETCH_MAGIC_HLL, "HLL sketch");
+    if (VARSIZE(blob) < HLL_TRANSVAL_SZ(0)
+        || transval->precision < HLL_MIN_PRECISION
+        || transval->precision > HLL_MAX_PRECISION
+        || (transval->encoding == HLL_DENSE
+            && VARSIZE(blob) != HLL_TRANSVAL_SZ(HLL_DENSE_BYTES(transval->precision)))
+        || (transval->encoding == HLL_SPARSE
+            && VARSIZE(blob) < HLL_TRANSVAL_SZ(transval->nsparse*sizeof(uint32)))
+        || (transval->encoding != HLL_DENSE && transval->encoding != HLL_SPARSE))
+        elog(ERROR, "invalid HLL sketch");
+}
+
+/*!
+ * merge two HLL sketches.
+ * \param blob1 a bytea holding an hlltransval
+ * \param blob2 a bytea holding an hlltransval
+ * \param inplace true if blob1 may be modified and returned
+ */
+bytea *hll_merge_c(bytea *blob1, bytea *blob2, bool inplace)
+{
+    hlltransval *transval1, *transval2, *newval;
+    bytea       *newblob;
+    uint32      *entries;
+    uint32       i, idx;
+    uint8        rank;
+
+    hll_check(blob1);
+    hll_check(blob2);
+    transval1 = (hlltransval *)VARDATA(blob1);
+    transval2 = (hlltransval *)VARDATA(blob2);
+
+    if (transval1->hashver != transval2->hashver)
+        elog(ERROR,
+             "cannot merge HLL sketches built with different hash functions: %d, %d",
+             transval1->hashver, transval2->hashver);
+    if (transval1->precision != transval2->precision)
+        elog(ERROR,
+             "cannot merge HLL sketches of different precisions: %d, %d",
+             transval1->precision, transval2->precision);
+    if (transval1->typOid != transval2->typOid)
+        elog(ERROR,
+             "cannot merge HLL sketches computed over different types: %u, %u",
+             transval1->typOid, transval2->typOid);
+
+    /* make sure the DENSE one, if any, is on the left */
+    if (transval1->encoding == HLL_SPARSE && transval2->encoding == HLL_DENSE) {
+        bytea       *tmpblob = blob1;
+        hlltransval *tmpval = transval1;
+
+        blob1 = blob2;
+        transval1 = transval2;
+        blob2 = tmpblob;
+        transval2 = tmpval;
+        inplace = false;
+    }
+
+    if (transval1->encoding == HLL_DENSE) {
+        uint8 *regs;
+
+        if (inplace)
+            newblob = blob1;
+        else {
+            newblob = (bytea *)palloc(VARSIZE(blob1));
+            memcpy(newblob, blob1, VARSIZE(blob1));
+        }
+        regs = (uint8 *)((hlltransval *)VARDATA(newblob))->data;
+
+        if (transval2->encoding == HLL_DENSE)
+            for (i = 0; i < ((uint32)1 << transval1->precision); i++)
+                hll_update_register(regs, i,
+                                    hll_get_register((uint8 *)transval2->data, i));
+        else {
+            entries = (uint32 *)transval2->data;
+            for (i = 0; i < transval2->nsparse; i++) {
+                hll_sparse_to_dense(entries[i], transval1->precision, &idx, &rank);
+                hll_update_register(regs, idx, rank);
+            }
+        }
+        return newblob;
+    }
+
+    /* both SPARSE: sort-merge the entries, keeping the max rank per index */
+    newblob = hll_new(transval1->precision, transval1->typOid,
+                      transval1->hashver, HLL_SPARSE,
+                      transval1->nsparse + transval2->nsparse);
+    newval = (hlltransval *)VARDATA(newblob);
+    {
+        uint32 *e1 = (uint32 *)transval1->data;
+        uint32 *e2 = (uint32 *)transval2->data;
+        uint32  j = 0, k = 0, n = 0;
+
+        entries = (uint32 *)newval->data;
+        while (j < transval1->nsparse || k < transval2->nsparse) {
+            if (k == transval2->nsparse
+                || (j < transval1->nsparse
+                    && (e1[j] >> HLL_REGISTER_BITS) < (e2[k] >> HLL_REGISTER_BITS)))
+                entries[n++] = e1[j++];
+            else if (j == transval1->nsparse
+                     || (e2[k] >> HLL_REGISTER_BITS) < (e1[j] >> HLL_REGISTER_BITS))
+                entries[n++] = e2[k++];
+            else {
+                entries[n++] = Max(e1[j], e2[k]);
+                j++;
+                k++;
+            }
+        }
+        newval->nsparse = n;
+    }
+    if (newval->nsparse > HLL_SPARSE_MAX(newval->precision))
+        return hll_to_dense(newblob);
+    return newblob;
+}
+
+PG_FUNCTION_INFO_V1(__hllsketch_merge);
+
+/*!
+ * Greenplum "prefunc" to combine HLL sketches from multiple machines,
+ * and transition function of the hllsketch_union aggregate.
+ */
+Datum __hllsketch_merge(PG_FUNCTION_ARGS)
+{
+    bytea *transblob1 = PG_GETARG_BYTEA_P(0);
+    bytea *transblob2 = PG_GETARG_BYTEA_P(1);
+    bool   inagg = (fcinfo->context &&
+                    (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+                     || IsA(fcinfo->context, WindowAggState)
+    #endif
+                    ));
+
+    /* deal with the case where one or both items is the initial value of '' */
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    PG_RETURN_DATUM(PointerGetDatum(hll_merge_c(transblob1, transblob2, inagg)));
+}
+
+PG_FUNCTION_INFO_V1(__hllsketch_final);
+
+/*!
+ * UDA final function producing a storable hll_sketch: the transval
+ * without any unused sparse space.
+ */
+Datum __hllsketch_final(PG_FUNCTION_ARGS)
+{
+    bytea       *transblob = PG_GETARG_BYTEA_P(0);
+    hlltransval *transval = (hlltransval *)VARDATA(transblob);
+    bytea       *retval;
+    size_t       sz;
+
+    /* nothing was ever aggregated */
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+
+    if (transval->encoding == HLL_DENSE)
+        PG_RETURN_BYTEA_P(transblob);
+
+    sz = HLL_TRANSVAL_SZ(transval->nsparse*sizeof(uint32));
+    retval = (bytea *)palloc(sz);
+    memcpy(retval, transblob, sz);
+    SET_VARSIZE(retval, sz);
+    PG_RETURN_BYTEA_P(retval);
+}
+
+/*!
+ * estimate the number of distinct values in an HLL sketch
+ * \param transval the sketch
+ */
+float8 hll_estimate_c(hlltransval *transval)
+{
+    int    p = transval->precision;
+    int    q = 64 - p;
+    double m = (double)((uint32)1 << p);
+    uint32 counts[64 + 2];
+    uint32 i;
+    int    k;
+    double x, y, z, zprev;
+
+    if (transval->encoding == HLL_SPARSE) {
+        /* linear counting over the 2^HLL_SPARSE_PRECISION sparse registers */
+        double msparse = (double)((uint32)1 << HLL_SPARSE_PRECISION);
+
+        return msparse * log(msparse / (msparse - transval->nsparse));
+    }
+
+    /* histogram of register values */
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < ((uint32)1 << p); i++)
+        counts[hll_get_register((uint8 *)transval->data, i)]++;
+    if (counts[0] == (uint32)m)
+        return 0;
+
+    /* z = m*tau(1 - counts[q+1]/m), see Ertl [3], Algorithm 6 */
+    x = 1.0 - counts[q+1]/m;
+    z = 0;
+    if (x != 0.0 && x != 1.0) {
+        y = 1.0;
+        z = 1.0 - x;
+        do {
+            x = sqrt(x);
+            zprev = z;
+            y *= 0.5;
+            z -= (1 - x)*(1 - x)*y;
+        } while (zprev != z);
+        z /= 3;
+    }
+    z *= m;
+
+    for (k = q; k >= 1; k--)
+        z = 0.5*(z + counts[k]);
+
+    /* z += m*sigma(counts[0]/m); counts[0] < m, so sigma converges */
+    x = counts[0]/m;
+    y = 1.0;
+    zprev = 0;
+    {
+        double s = x;
+
+        while (s != zprev) {
+            x *= x;
+            zprev = s;
+            s += x*y;
+            y += y;
+        }
+        z += m*s;
+    }
+
+    /* alpha_inf = 1/(2 ln 2) */
+    return (0.5/log(2.0)) * m * m / z;
+}
+
+PG_FUNCTION_INFO_V1(__hllsketch_dcount_final);
+
+/*! UDA final function to get count(distinct) out of an HLL sketch */
+Datum __hllsketch_dcount_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    /* nothing was ever aggregated! */
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_INT64(0);
+
+    PG_RETURN_INT64((int64)rint(hll_estimate_c((hlltransval *)VARDATA(transblob))));
+}
+
+PG_FUNCTION_INFO_V1(hllsketch_estimate);
+
+/*! scalar function to get count(distinct) out of a stored hll_sketch */
+Datum hllsketch_estimate(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    hll_check(blob);
+    PG_RETURN_INT64((int64)rint(hll_estimate_c((hlltransval *)VARDATA(blob))));
+}
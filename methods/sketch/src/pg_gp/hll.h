@@ -0,0 +1,62 @@
+/*!
+ * \file hll.h
+ *
+ * \brief header file for HyperLogLog sketches
+ */
+
+#ifndef _HLL_H_
+#define _HLL_H_
+
+#define HLL_DEFAULT_PRECISION  14 /*! 16K registers, about 0.8% standard error */
+#define HLL_MIN_PRECISION      4
+#define HLL_MAX_PRECISION      18
+#define HLL_SPARSE_PRECISION   25 /*! index bits of sparse entries */
+#define HLL_REGISTER_BITS      6
+#define HLL_RANK_MASK          ((1 << HLL_REGISTER_BITS) - 1)
+#define HLL_SPARSE_INITIAL     64 /*! initial number of sparse entries */
+
+/*! bytes in the packed registers of a dense sketch of precision p */
+#define HLL_DENSE_BYTES(p) ((((uint32)1 << (p))*HLL_REGISTER_BITS + CHAR_BIT - 1) \
+                            / CHAR_BIT)
+/*! max number of sparse entries before we switch to the dense encoding */
+#define HLL_SPARSE_MAX(p) (HLL_DENSE_BYTES(p) / sizeof(uint32))
+/*! size of an HLL transval whose data takes sz bytes */
+#define HLL_TRANSVAL_SZ(sz) (VARHDRSZ + sizeof(hlltransval) + (sz))
+
+typedef enum {HLL_SPARSE, HLL_DENSE} hllencoding;
+
+/*!
+ * \internal
+ * \brief transition value struct for HLL sketches, also used as the
+ * serialized <c>hll_sketch</c> type.
+ *
+ * In SPARSE mode data is a sorted array of nsparse uint32 entries, each
+ * holding a HLL_SPARSE_PRECISION-bit register index followed by a 6-bit rank;
+ * there may be unused room at the end.
+ * In DENSE mode data holds 2^precision packed 6-bit registers.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;      /*! SKETCH_MAGIC_HLL */
+    int32  hashver;    /*! SKETCH_HASH_* version used to build the sketch */
+    Oid    typOid;     /*! Oid of the data type we are sketching */
+    uint32 nsparse;    /*! number of entries in a SPARSE sketch */
+    uint8  precision;  /*! log2 of the number of registers */
+    uint8  encoding;   /*! an hllencoding */
+    uint16 reserved;
+    char   data[0];
+} hlltransval;
+
+Datum __hllsketch_trans(PG_FUNCTION_ARGS);
+Datum __hllsketch_merge(PG_FUNCTION_ARGS);
+Datum __hllsketch_final(PG_FUNCTION_ARGS);
+Datum __hllsketch_dcount_final(PG_FUNCTION_ARGS);
+Datum hllsketch_estimate(PG_FUNCTION_ARGS);
+bytea *hll_new(int, Oid, int, hllencoding, uint32);
+bytea *hll_insert_hash(bytea *, uint64);
+bytea *hll_to_dense(bytea *);
+bytea *hll_merge_c(bytea *, bytea *, bool);
+void   hll_check(bytea *);
+float8 hll_estimate_c(hlltransval *);
+
+#endif /* _HLL_H_ */
@@ -0,0 +1,551 @@
+/*!
+ * \file kll.c
+ *
+ * \brief KLL quantile sketch implementation
+ */
+/*!
+ * \implementation
+ * A KLL sketch summarizes a stream of numbers in a stack of "compactors".
+ * Compactor h holds items that each stand for 2^h input values.  New values
+ * go into compactor 0.  When the sketch is full, the lowest compactor that
+ * has reached its capacity is sorted, and every other item of it (starting
+ * at a random offset of 0 or 1) is promoted to the compactor above, while the
+ * rest are discarded.  This keeps the total weight of the sketch equal to the
+ * number of values seen, and makes the rank of any value off by at most a
+ * few multiples of 2^h per compaction, in either direction with equal
+ * probability.  Compactor capacities shrink geometrically by a factor of 2/3
+ * going down from the top one, which has capacity k, so a sketch holds about
+ * 3k items however many values it summarizes.  With the default k = 200 the
+ * normalized rank error is about 1.7%.
+ *
+ * Two sketches merge by concatenating their compactors level by level and
+ * compacting until the result fits again, so the error of a merged sketch is
+ * the same as if all values had been fed into a single sketch.  Quantiles and
+ * CDF values are read off the items sorted by value, weighted by 2^h.
+ *
+ * The random offsets come from a generator seeded with a fixed constant and
+ * kept in the sketch, so a given sequence of inputs and merges always yields
+ * the same sketch.
+ *
+ * \literature
+ * [1] Z. Karnin, K. Lang and E. Liberty.  Optimal Quantile Approximation in
+ *     Streams.  FOCS 2016.
+ * [2] E. Liberty and others.  Apache DataSketches KLL sketch.
+ *     https://datasketches.apache.org/
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/lsyscache.h"
+#include "catalog/pg_type.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "kll.h"
+#include <math.h>
+
+/*!
+ * compare float8s the way Postgres sorts them: NaN is equal to itself and
+ * larger than everything else
+ */
+int kll_float8_cmp(float8 a, float8 b)
+{
+    if (isnan(a))
+        return isnan(b) ? 0 : 1;
+    if (isnan(b))
+        return -1;
+    return (a > b) - (a < b);
+}
+
+/*! support function to sort float8s with qsort */
+int kll_cmp(const void *a, const void *b)
+{
+    return kll_float8_cmp(*(const float8 *)a, *(const float8 *)b);
+}
+
+static int kll_item_cmp(const void *a, const void *b)
+{
+    return kll_float8_cmp(((const kllitem *)a)->value,
+                          ((const kllitem *)b)->value);
+}
+
+/*!
+ * capacity of a compactor depth levels below the top one,
+ * ceil(k*(2/3)^depth) but at least KLL_MIN_CAPACITY.  Integer arithmetic
+ * keeps sketches identical across platforms.
+ */
+static uint32 kll_level_capacity(int k, uint32 depth)
+{
+    uint32 cap = k;
+
+    while (depth-- > 0 && cap > KLL_MIN_CAPACITY)
+        cap = (2*cap + 2)/3;
+    return Max(cap, KLL_MIN_CAPACITY);
+}
+
+/*! total capacity of the compactors of a sketch with nlevels levels */
+uint32 kll_max_size(int k, uint32 nlevels)
+{
+    uint32 total = 0;
+    uint32 depth;
+
+    for (depth = 0; depth < nlevels; depth++)
+        total += kll_level_capacity(k, depth);
+    return total;
+}
+
+/*! a random bit, the offset of the next compaction (xorshift64*) */
+static inline int kll_coin(klltransval *transval)
+{
+    uint64 x = transval->rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    transval->rng = x;
+    return (int)((x * UINT64CONST(2685821657736338717)) >> 63);
+}
+
+/*!
+ * allocate a new, empty KLL sketch
+ * \param k the capacity of the top compactor
+ * \param capacity the number of items to make room for
+ */
+bytea *kll_new(int k, uint32 capacity)
+{
+    bytea       *blob;
+    klltransval *transval;
+
+    if (k < KLL_MIN_K || k > KLL_MAX_K)
+        elog(ERROR, "quantile_sketch accuracy parameter must be between %d and %d, was %d",
+             KLL_MIN_K, KLL_MAX_K, k);
+
+    blob = (bytea *)palloc0(KLL_TRANSVAL_SZ(capacity));
+    SET_VARSIZE(blob, KLL_TRANSVAL_SZ(capacity));
+    transval = KLL_TRANSVAL(blob);
+    transval->magic = SKETCH_MAGIC_KLL;
+    transval->k = k;
+    transval->nlevels = 1;
+    transval->capacity = capacity;
+    transval->maxsize = kll_max_size(k, 1);
+    transval->rng = KLL_RNG_SEED;
+    transval->levels[0] = transval->levels[1] = capacity;
+    return blob;
+}
+
+/*!
+ * copy a sketch into one with room for a different number of items
+ * \param blob a bytea holding a klltransval
+ * \param capacity the number of items to make room for, at least the
+ * number held
+ */
+bytea *kll_resize(bytea *blob, uint32 capacity)
+{
+    klltransval *transval = KLL_TRANSVAL(blob);
+    klltransval *newval;
+    bytea       *newblob;
+    uint32       size = KLL_SIZE(transval);
+    uint32       shift = capacity - transval->capacity;
+    uint32       h;
+
+    newblob = (bytea *)palloc(KLL_TRANSVAL_SZ(capacity));
+    SET_VARSIZE(newblob, KLL_TRANSVAL_SZ(capacity));
+    newval = KLL_TRANSVAL(newblob);
+    memcpy(newval, transval, sizeof(klltransval));
+    newval->capacity = capacity;
+    /* unsigned arithmetic takes care of shrinking */
+    for (h = 0; h <= newval->nlevels; h++)
+        newval->levels[h] += shift;
+    memcpy(KLL_ITEMS(newval) + newval->levels[0],
+           KLL_ITEMS(transval) + transval->levels[0], size*sizeof(float8));
+    return newblob;
+}
+
+/*!
+ * halve compactor h into compactor h+1.  If the compactor holds an odd
+ * number of items, its first item stays behind.
+ */
+static void kll_compact_level(klltransval *transval, uint32 h)
+{
+    float8 *items = KLL_ITEMS(transval);
+    uint32  beg = transval->levels[h];
+    uint32  end = transval->levels[h + 1];
+    uint32  odd = (end - beg) % 2;
+    uint32  half = (end - beg - odd)/2;
+    int     offset = kll_coin(transval);
+    uint32  i, l;
+
+    qsort(items + beg + odd, end - beg - odd, sizeof(float8), kll_cmp);
+
+    /*
+     * Promote every other item to just below compactor h+1.  Going from the
+     * top down, no item is overwritten before it has been read.
+     */
+    for (i = half; i-- > 0; )
+        items[beg + odd + half + i] = items[beg + odd + 2*i + offset];
+    transval->levels[h + 1] = end - half;
+
+    /* move what's left of compactors 0..h up against it */
+    memmove(items + transval->levels[0] + half, items + transval->levels[0],
+            (beg + odd - transval->levels[0])*sizeof(float8));
+    for (l = 0; l <= h; l++)
+        transval->levels[l] += half;
+}
+
+/*!
+ * compact a sketch until its compactors hold no more than their capacity,
+ * less some room to spare, and make sure there is room for that many more
+ * items.
+ * \param blob a bytea holding a klltransval
+ * \param room number of items to leave room for
+ */
+bytea *kll_compress(bytea *blob, uint32 room)
+{
+    klltransval *transval = KLL_TRANSVAL(blob);
+
+    while (KLL_SIZE(transval) + room > transval->maxsize) {
+        uint32 h;
+
+        /* the lowest compactor at capacity; there must be one */
+        for (h = 0; h < transval->nlevels; h++)
+            if (KLL_LEVEL_SIZE(transval, h)
+                >= kll_level_capacity(transval->k, transval->nlevels - 1 - h))
+                break;
+        Assert(h < transval->nlevels);
+
+        if (h == transval->nlevels - 1) {
+            /* compacting the top one needs a new, empty level above it */
+            if (transval->nlevels == KLL_MAX_LEVELS)
+                elog(ERROR, "quantile_sketch overflow");
+            transval->nlevels++;
+            transval->levels[transval->nlevels] = transval->capacity;
+            transval->maxsize = kll_max_size(transval->k, transval->nlevels);
+        }
+        kll_compact_level(transval, h);
+    }
+
+    if (transval->capacity < transval->maxsize)
+        blob = kll_resize(blob, transval->maxsize);
+    return blob;
+}
+
+/*!
+ * add a value to a sketch
+ * \param blob a bytea holding a klltransval
+ * \param value the value
+ */
+bytea *kll_insert(bytea *blob, float8 value)
+{
+    klltransval *transval = KLL_TRANSVAL(blob);
+
+    if (KLL_SIZE(transval) >= transval->maxsize
+        || transval->levels[0] == 0) {
+        blob = kll_compress(blob, 1);
+        transval = KLL_TRANSVAL(blob);
+    }
+
+    if (transval->n == 0 || kll_float8_cmp(value, transval->min) < 0)
+        transval->min = value;
+    if (transval->n == 0 || kll_float8_cmp(value, transval->max) > 0)
+        transval->max = value;
+    transval->n++;
+    KLL_ITEMS(transval)[--transval->levels[0]] = value;
+    return blob;
+}
+
+PG_FUNCTION_INFO_V1(__kllsketch_trans);
+
+/*!
+ * UDA transition function for the quantile_sketch aggregates.
+ * An optional third argument gives the capacity k of the top compactor.
+ */
+Datum __kllsketch_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* initialize if this is the first call */
+    if (VARSIZE(transblob) <= VARHDRSZ) {
+        int k = KLL_DEFAULT_K;
+
+        if (PG_NARGS() > 2 && !PG_ARGISNULL(2))
+            k = PG_GETARG_INT32(2);
+        transblob = kll_new(k, kll_max_size(k, 1));
+    }
+
+    PG_RETURN_DATUM(PointerGetDatum(kll_insert(transblob,
+                                               PG_GETARG_FLOAT8(1))));
+}
+
+/*!
+ * sanity-check a serialized KLL sketch, which may have come from a table.
+ * \param blob a bytea holding a klltransval
+ */
+void kll_check(bytea *blob)
+{
+    klltransval *transval = KLL_TRANSVAL(blob);
+    uint64       weight = 0;
+    uint32       h;
+
+    if (VARSIZE(blob) < KLL_TRANSVAL_SZ(0))
+        elog(ERROR, "invalid quantile_sketch");
+    sketch_require_magic((char *)transval, sizeof(klltransval),
+                         SKETCH_MAGIC_KLL, "kll_sketch");
+    if (VARSIZE(blob) != KLL_TRANSVAL_SZ(transval->capacity)
+        || transval->k < KLL_MIN_K || transval->k > KLL_MAX_K
+        || transval->nlevels < 1 || transval->nlevels > KLL_MAX_LEVELS
+        || transval->levels[transval->nlevels] != transval->capacity)
+        elog(ERROR, "invalid quantile_sketch");
+    for (h = 0; h < transval->nlevels; h++) {
+        if (transval->levels[h] > transval->levels[h + 1])
+            elog(ERROR, "invalid quantile_sketch");
+        weight += (uint64)KLL_LEVEL_SIZE(transval, h) << h;
+    }
+    if (weight != transval->n || transval->n == 0)
+        elog(ERROR, "invalid quantile_sketch");
+}
+
+/*!
+ * merge two KLL sketches into a new one
+ * \param blob1 a bytea holding a klltransval
+ * \param blob2 a bytea holding a klltransval
+ */
+bytea *kll_merge_c(bytea *blob1, bytea *blob2)
+{
+    klltransval *transval1 = KLL_TRANSVAL(blob1);
+    klltransval *transval2 = KLL_TRANSVAL(blob2);
+    klltransval *newval;
+    bytea       *newblob;
+    uint32       nlevels = Max(transval1->nlevels, transval2->nlevels);
+    uint32       size = KLL_SIZE(transval1) + KLL_SIZE(transval2);
+    uint32       pos;
+    int          k = Min(transval1->k, transval2->k);
+    int          h;
+
+    newblob = kll_new(k, Max(size, kll_max_size(k, nlevels)));
+    newval = KLL_TRANSVAL(newblob);
+    newval->nlevels = nlevels;
+    newval->maxsize = kll_max_size(k, nlevels);
+    newval->n = transval1->n + transval2->n;
+    newval->min = kll_float8_cmp(transval1->min, transval2->min) <= 0
+                  ? transval1->min : transval2->min;
+    newval->max = kll_float8_cmp(transval1->max, transval2->max) >= 0
+                  ? transval1->max : transval2->max;
+    newval->rng = transval1->rng ^ (transval2->rng << 1 | transval2->rng >> 63);
+
+    /* concatenate the compactors level by level, from the top down */
+    pos = newval->capacity;
+    newval->levels[nlevels] = pos;
+    for (h = nlevels - 1; h >= 0; h--) {
+        if ((uint32)h < transval2->nlevels) {
+            pos -= KLL_LEVEL_SIZE(transval2, h);
+            memcpy(KLL_ITEMS(newval) + pos,
+                   KLL_ITEMS(transval2) + transval2->levels[h],
+                   KLL_LEVEL_SIZE(transval2, h)*sizeof(float8));
+        }
+        if ((uint32)h < transval1->nlevels) {
+            pos -= KLL_LEVEL_SIZE(transval1, h);
+            memcpy(KLL_ITEMS(newval) + pos,
+                   KLL_ITEMS(transval1) + transval1->levels[h],
+                   KLL_LEVEL_SIZE(transval1, h)*sizeof(float8));
+        }
+        newval->levels[h] = pos;
+    }
+
+    return kll_compress(newblob, 0);
+}
+
+PG_FUNCTION_INFO_V1(__kllsketch_merge);
+
+/*!
+ * Greenplum "prefunc" to combine KLL sketches from multiple machines,
+ * and transition function of the quantile_sketch_union aggregate.
+ */
+Datum __kllsketch_merge(PG_FUNCTION_ARGS)
+{
+    bytea *transblob1 = PG_GETARG_SKETCH_P(0);
+    bytea *transblob2 = PG_GETARG_SKETCH_P(1);
+
+    /* deal with the case where one or both items is the initial value of '' */
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    kll_check(transblob1);
+    kll_check(transblob2);
+    PG_RETURN_DATUM(PointerGetDatum(kll_merge_c(transblob1, transblob2)));
+}
+
+PG_FUNCTION_INFO_V1(__kllsketch_final);
+
+/*!
+ * UDA final function producing a storable kll_sketch: the transval
+ * without any free space.
+ */
+Datum __kllsketch_final(PG_FUNCTION_ARGS)
+{
+    bytea       *transblob = PG_GETARG_BYTEA_P(0);
+    klltransval *transval = KLL_TRANSVAL(transblob);
+
+    /* nothing was ever aggregated */
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+
+    if (transval->levels[0] == 0)
+        PG_RETURN_BYTEA_P(transblob);
+    PG_RETURN_BYTEA_P(kll_resize(transblob, KLL_SIZE(transval)));
+}
+
+/*!
+ * the items of a sketch with their weights, sorted by value
+ * \param transval the sketch
+ * \param nitems set to the number of items
+ */
+kllitem *kll_sorted_items(klltransval *transval, uint32 *nitems)
+{
+    kllitem *items = (kllitem *)palloc(Max(KLL_SIZE(transval), 1)*sizeof(kllitem));
+    uint32   h, i, n = 0;
+
+    for (h = 0; h < transval->nlevels; h++)
+        for (i = transval->levels[h]; i < transval->levels[h + 1]; i++) {
+            items[n].value = KLL_ITEMS(transval)[i];
+            items[n].weight = (uint64)1 << h;
+            n++;
+        }
+    qsort(items, n, sizeof(kllitem), kll_item_cmp);
+    *nitems = n;
+    return items;
+}
+
+/*!
+ * estimate a quantile: like percentile_disc, the first value whose
+ * cumulative weight reaches fraction of the values summarized
+ * \param transval the sketch
+ * \param items its items, from kll_sorted_items
+ * \param nitems the number of items
+ * \param fraction the quantile, between 0 and 1
+ */
+float8 kll_quantile_c(klltransval *transval, kllitem *items, uint32 nitems,
+                      float8 fraction)
+{
+    float8 target = fraction * transval->n;
+    uint64 cum = 0;
+    uint32 i;
+
+    if (fraction < 0 || fraction > 1 || isnan(fraction))
+        elog(ERROR, "quantile fraction must be between 0 and 1, was %g",
+             fraction);
+
+    /* the extremes are known exactly */
+    if (fraction == 0)
+        return transval->min;
+    if (fraction == 1)
+        return transval->max;
+    for (i = 0; i < nitems - 1; i++) {
+        cum += items[i].weight;
+        if ((float8)cum >= target)
+            break;
+    }
+    return items[i].value;
+}
+
+PG_FUNCTION_INFO_V1(kllsketch_quantile);
+
+/*! scalar function estimating a quantile of a stored kll_sketch */
+Datum kllsketch_quantile(PG_FUNCTION_ARGS)
+{
+    bytea       *blob = PG_GETARG_SKETCH_P(0);
+    klltransval *transval = KLL_TRANSVAL(blob);
+    kllitem     *items;
+    uint32       nitems;
+
+    kll_check(blob);
+    items = kll_sorted_items(transval, &nitems);
+    PG_RETURN_FLOAT8(kll_quantile_c(transval, items, nitems,
+                                    PG_GETARG_FLOAT8(1)));
+}
+
+PG_FUNCTION_INFO_V1(kllsketch_quantiles);
+
+/*!
+ * scalar function estimating an array of quantiles of a stored kll_sketch,
+ * sorting the sketch only once.  NULL fractions give NULL quantiles.
+ */
+Datum kllsketch_quantiles(PG_FUNCTION_ARGS)
+{
+    bytea       *blob = PG_GETARG_SKETCH_P(0);
+    ArrayType   *fractions = PG_GETARG_ARRAYTYPE_P(1);
+    klltransval *transval = KLL_TRANSVAL(blob);
+    kllitem     *items;
+    uint32       nitems;
+    Datum       *elems;
+    bool        *nulls;
+    int          nelems, i;
+    int          dims[1], lbs[1];
+    int16        typlen;
+    bool         typbyval;
+    char         typalign;
+
+    kll_check(blob);
+    if (ARR_NDIM(fractions) > 1)
+        elog(ERROR, "quantile fractions must be a one-dimensional array");
+
+    get_typlenbyvalalign(FLOAT8OID, &typlen, &typbyval, &typalign);
+    deconstruct_array(fractions, FLOAT8OID, typlen, typbyval, typalign,
+                      &elems, &nulls, &nelems);
+
+    items = kll_sorted_items(transval, &nitems);
+    for (i = 0; i < nelems; i++)
+        if (!nulls[i])
+            elems[i] = Float8GetDatum(kll_quantile_c(transval, items, nitems,
+                                                     DatumGetFloat8(elems[i])));
+
+    dims[0] = nelems;
+    lbs[0] = nelems > 0 ? ARR_LBOUND(fractions)[0] : 1;
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls, nelems > 0 ? 1 : 0,
+                                             dims, lbs, FLOAT8OID, typlen,
+                                             typbyval, typalign));
+}
+
+PG_FUNCTION_INFO_V1(kllsketch_cdf);
+
+/*!
+ * scalar function estimating the fraction of the values in a stored
+ * kll_sketch that are less than or equal to a given value
+ */
+Datum kllsketch_cdf(PG_FUNCTION_ARGS)
+{
+    bytea       *blob = PG_GETARG_SKETCH_P(0);
+    float8       value = PG_GETARG_FLOAT8(1);
+    klltransval *transval = KLL_TRANSVAL(blob);
+    uint64       weight = 0;
+    uint32       h, i;
+
+    kll_check(blob);
+
+    /* the extremes are known exactly */
+    if (kll_float8_cmp(value, transval->min) < 0)
+        PG_RETURN_FLOAT8(0.0);
+    if (kll_float8_cmp(value, transval->max) >= 0)
+        PG_RETURN_FLOAT8(1.0);
+
+    for (h = 0; h < transval->nlevels; h++)
+        for (i = transval->levels[h]; i < transval->levels[h + 1]; i++)
+            if (kll_float8_cmp(KLL_ITEMS(transval)[i], value) <= 0)
+                weight += (uint64)1 << h;
+    PG_RETURN_FLOAT8((float8)weight / transval->n);
+}
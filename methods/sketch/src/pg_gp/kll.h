@@ -0,0 +1,83 @@
+/*!
+ * \file kll.h
+ *
+ * \brief header file for KLL quantile sketches
+ */
+
+#ifndef _KLL_H_
+#define _KLL_H_
+
+#define KLL_DEFAULT_K      200 /*! about 1.7% normalized rank error */
+#define KLL_MIN_K          8
+#define KLL_MAX_K          65535
+#define KLL_MIN_CAPACITY   8 /*! smallest capacity of any compactor */
+#define KLL_MAX_LEVELS     60
+#define KLL_RNG_SEED       UINT64CONST(0x9E3779B97F4A7C15)
+
+/*!
+ * \internal
+ * \brief transition value struct for KLL sketches, also used as the
+ * serialized <c>kll_sketch</c> type.
+ *
+ * It is followed by an array of capacity float8 items.  Compactor h holds
+ * the items from levels[h] up to levels[h+1], so compactor 0 comes first and
+ * levels[nlevels] == capacity.  The items before levels[0] are free space,
+ * which new values fill from the back.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;       /*! SKETCH_MAGIC_KLL */
+    int32  k;           /*! capacity of the top compactor */
+    uint32 nlevels;     /*! number of compactors, at least 1 */
+    uint32 capacity;    /*! number of items there is room for */
+    uint32 maxsize;     /*! number of items the compactors may hold in total */
+    uint64 n;           /*! number of values summarized */
+    uint64 rng;         /*! state of the generator of compaction offsets */
+    float8 min;         /*! smallest value summarized */
+    float8 max;         /*! largest value summarized */
+    uint32 levels[KLL_MAX_LEVELS + 1];
+} klltransval;
+
+/*!
+ * the transval follows the varlena header after padding that aligns it,
+ * and the items after it, in memory
+ */
+#define KLL_TRANSVAL(blob) ((klltransval *)((char *)(blob) + MAXALIGN(VARHDRSZ)))
+#define KLL_ITEMS(t) ((float8 *)((char *)(t) + MAXALIGN(sizeof(klltransval))))
+/*! size of a KLL transval with room for capacity items */
+#define KLL_TRANSVAL_SZ(capacity) \
+    (MAXALIGN(VARHDRSZ) + MAXALIGN(sizeof(klltransval)) + (capacity)*sizeof(float8))
+/*! number of items held by all the compactors */
+#define KLL_SIZE(t) ((t)->capacity - (t)->levels[0])
+/*! number of items held by compactor h */
+#define KLL_LEVEL_SIZE(t, h) ((t)->levels[(h) + 1] - (t)->levels[h])
+
+/*!
+ * \internal
+ * \brief an item of a sketch with the number of values it stands for
+ * \endinternal
+ */
+typedef struct {
+    float8 value;
+    uint64 weight;
+} kllitem;
+
+Datum __kllsketch_trans(PG_FUNCTION_ARGS);
+Datum __kllsketch_merge(PG_FUNCTION_ARGS);
+Datum __kllsketch_final(PG_FUNCTION_ARGS);
+Datum kllsketch_quantile(PG_FUNCTION_ARGS);
+Datum kllsketch_quantiles(PG_FUNCTION_ARGS);
+Datum kllsketch_cdf(PG_FUNCTION_ARGS);
+int    kll_float8_cmp(float8, float8);
+int    kll_cmp(const void *, const void *);
+uint32 kll_max_size(int, uint32);
+bytea *kll_new(int, uint32);
+bytea *kll_resize(bytea *, uint32);
+bytea *kll_compress(bytea *, uint32);
+bytea *kll_insert(bytea *, float8);
+bytea *kll_merge_c(bytea *, bytea *);
+void   kll_check(bytea *);
+kllitem *kll_sorted_items(klltransval *, uint32 *);
+float8 kll_quantile_c(klltransval *, kllitem *, uint32, float8);
+
+#endif /* _KLL_H_ */
@@ -11,8 +11,16 @@
  As a result it's not limited to integers, and the implementation works
  for any Postgres data type.
 
+ The frequent values are indexed inside the transition value: a hash table
+ keyed on the sketch hash of each value finds an input among the stored
+ values without scanning them, and a min-heap on their counts gives the
+ value to evict, so each row costs O(log k) for k frequent values.
 
- The parallel method (<c>mfvsketch_quick_histogram</c>) is a heuristic with no
+
+ The parallel method (<c>mfvsketch_quick_histogram</c>) merges the sketches
+ of the segments: it adds up their CountMin counters, recounts the frequent
+ values of every segment with the merged counters, and keeps the top ones.
+ This is a heuristic with no
  such guarantees, but it will likely work well in most cases.  As an example
  of a case where it will fail, consider a scenario where the top <i>n</i> values on node 1 are very infrequent on
  node 2, and the top <i>n</i> values on node 2 are infrequent on node 1.  But the <i>n</i>+1'th value
@@ -33,6 +41,7 @@
 #include "utils/elog.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/numeric.h"
 #include "utils/typcache.h"
 #include "nodes/execnodes.h"
@@ -43,22 +52,21 @@
 #include "funcapi.h"
 
 #include <ctype.h>
+#include <math.h>
 
 PG_FUNCTION_INFO_V1(__mfvsketch_trans);
 
 /*!
  *  transition function to maintain a CountMin sketch with
- *  Most-Frequent Values
+ *  Most-Frequent Values.  Optional 4th and 5th arguments give the
+ *  epsilon and delta of the sketch (see cm_shape), and an optional 6th
+ *  its update mode (see cm_mode).
  */
 Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
 {
     bytea *      transblob = PG_GETARG_BYTEA_P(0);
     Datum        newdatum  = PG_GETARG_DATUM(1);
     int          max_mfvs  = PG_GETARG_INT32(2);
-    mfvtransval *transval;
-    uint64       tmpcnt;
-    int          i;
-    Datum        md5_datum;
 
     /*
      * This function makes destructive updates to its arguments.
@@ -74,51 +82,236 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
              "destructive pass by reference outside agg");
 
     /* initialize if this is first call */
-    if (VARSIZE(transblob) <= sizeof(MFV_TRANSVAL_SZ(0))) {
-        Oid typOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
-        transblob = mfv_init_transval(max_mfvs, typOid);
+    if (!MFV_TRANSVAL_INITIALIZED(transblob)) {
+        Oid     typOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+        cmshape shape = CM_DEFAULT_SHAPE;
+        int     mode = CM_MODE_COUNTMIN;
+
+        if (PG_NARGS() > 3) {
+            if (PG_ARGISNULL(3) || PG_ARGISNULL(4))
+                elog(ERROR, "NULL epsilon or delta passed to mfvsketch");
+            shape = cm_shape(PG_GETARG_FLOAT8(3), PG_GETARG_FLOAT8(4));
+        }
+        if (PG_NARGS() > 5) {
+            if (PG_ARGISNULL(5))
+                elog(ERROR, "NULL mode passed to mfvsketch");
+            mode = cm_mode(PG_GETARG_TEXT_P(5));
+        }
+        transblob = mfv_init_transval(max_mfvs, typOid, shape, mode);
     }
 
     /* ignore NULL inputs */
     if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
         PG_RETURN_DATUM(PointerGetDatum(transblob));
 
+    PG_RETURN_DATUM(PointerGetDatum(mfv_transval_count(transblob, newdatum, 1)));
+}
+
+PG_FUNCTION_INFO_V1(__mfvsketch_inv_trans);
+
+/*!
+ *  inverse transition function, for the moving-aggregate mode of window
+ *  aggregates: takes back a value added by __mfvsketch_trans, with the
+ *  same args.  The value is subtracted from the countmin sketch and, if
+ *  it is one of the mfvs, its count is lowered.  Values that were evicted
+ *  or never stored are not brought back until they are seen again, so
+ *  over a sliding window the mfvs can miss a value that became frequent
+ *  only as other values left the window, much as with
+ *  mfvsketch_quick_histogram.  A conservative update cannot be undone:
+ *  we return NULL, which makes the executor aggregate the window frame
+ *  again from scratch.
+ */
+Datum __mfvsketch_inv_trans(PG_FUNCTION_ARGS)
+{
+    bytea *      transblob = PG_GETARG_BYTEA_P(0);
+    mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+   #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+   #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+    if (!MFV_TRANSVAL_INITIALIZED(transblob))
+        elog(ERROR, "cannot remove a value from an empty mfv sketch");
+    if (transval->mode == CM_MODE_CONSERVATIVE || transval->halflife > 0)
+        PG_RETURN_NULL();
+
+    PG_RETURN_DATUM(PointerGetDatum(mfv_transval_count(transblob,
+                                                       PG_GETARG_DATUM(1),
+                                                       -1)));
+}
+
+PG_FUNCTION_INFO_V1(__mfvsketch_decayed_trans);
+
+/*!
+ *  transition function of the decaying mfv sketch: args are the transval,
+ *  the value, the number of mfvs, the time of the value and the half-life
+ *  of the counts, in the same units (e.g. seconds since the epoch).
+ *  Each value is counted with a weight that doubles every half-life of
+ *  its time; see mfvtransval.  Values so much older than the landmark
+ *  that their weight rounds to 0 are not counted.
+ */
+Datum __mfvsketch_decayed_trans(PG_FUNCTION_ARGS)
+{
+    bytea *      transblob = PG_GETARG_BYTEA_P(0);
+    mfvtransval *transval;
+    cmshape      shape = CM_DEFAULT_SHAPE;
+    float8       t, halflife, age;
+    int64        weight;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+   #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+   #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* initialize if this is first call */
+    if (!MFV_TRANSVAL_INITIALIZED(transblob)) {
+        if (PG_ARGISNULL(4))
+            elog(ERROR, "NULL half-life passed to mfvsketch_decayed");
+        halflife = PG_GETARG_FLOAT8(4);
+        if (!(halflife > 0) || isinf(halflife))
+            elog(ERROR,
+                 "MFV sketch half-life must be positive and finite, was %g",
+                 halflife);
+        transblob = mfv_init_transval(PG_GETARG_INT32(2),
+                                      get_fn_expr_argtype(fcinfo->flinfo, 1),
+                                      shape, CM_MODE_COUNTMIN);
+        ((mfvtransval *)VARDATA(transblob))->halflife = halflife;
+    }
+
+    /* ignore NULL inputs */
+    if (PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
     transval = (mfvtransval *)VARDATA(transblob);
-    /* insert into the countmin sketch */
-    md5_datum = countmin_trans_c(transval->sketch,
-                                newdatum,
-                                transval->outFuncOid,
-                                transval->typOid);
-
-    tmpcnt = cmsketch_count_md5_datum(transval->sketch,
-                                      (bytea *)DatumGetPointer(md5_datum),
-                                      transval->outFuncOid);
-    i = mfv_find(transblob, newdatum);
-
-    if (i > -1) {
-        transval->mfvs[i].cnt = tmpcnt;
+    halflife = transval->halflife;
+    t = PG_GETARG_FLOAT8(3);
+    if (isinf(t) || isnan(t))
+        elog(ERROR, "MFV sketch times must be finite, was %g", t);
+
+    if (transval->weight == 0) {
+        /* nothing counted yet: start at the half-life boundary before t */
+        transval->landmark = floor(t / halflife) * halflife;
+        transval->latest = t;
     }
-    else {
-        /* try to insert as either a new or replacement entry */
-        for (i = 0; i < (int)transval->max_mfvs; i++) {
-            if ((i == (int)transval->next_mfv)) {
-                /* room for new */
-                transblob = mfv_transval_append(transblob, newdatum);
-                transval = (mfvtransval *)VARDATA(transblob);
-                transval->mfvs[i].cnt = tmpcnt;
-                break;
-            }
-            else if (transval->mfvs[i].cnt < tmpcnt) {
-                /* arg beats this mfv */
-                transblob = mfv_transval_replace(transblob, newdatum, i);
-                transval = (mfvtransval *)VARDATA(transblob);
-                transval->mfvs[i].cnt = tmpcnt;
-                break;
-            }
-            /* else this is not a frequent value */
-        }
+    else if ((t - transval->landmark) / halflife >= MFV_DECAY_RANGE)
+        mfv_decay_to(transval, floor(t / halflife) * halflife);
+
+    for (;;) {
+        age = (t - transval->landmark) / halflife;
+        weight = (int64)rint(pow(2.0, MFV_DECAY_BITS + age));
+        if (weight == 0)
+            PG_RETURN_DATUM(PointerGetDatum(transblob));
+        if (transval->weight <= (uint64)(INT64_MAX - weight))
+            break;
+        /* halve the counts before they could overflow */
+        mfv_decay_to(transval, transval->landmark + halflife);
     }
-    PG_RETURN_DATUM(PointerGetDatum(transblob));
+    transval->weight += weight;
+    transval->latest = Max(transval->latest, t);
+    PG_RETURN_DATUM(PointerGetDatum(mfv_transval_count(transblob,
+                                                       PG_GETARG_DATUM(1),
+                                                       weight)));
+}
+
+/*!
+ * count a value cnt more times in the mfvsketch: add it to the countmin
+ * sketch, and update its count if it is one of the mfvs, or else offer it.
+ * A negative cnt takes back occurrences counted before, and never adds
+ * the value to the mfvs.
+ * \param transblob the transition value packed into a bytea
+ * \param dat the value
+ * \param cnt the number of occurrences, or their weight
+ */
+bytea *mfv_transval_count(bytea *transblob, Datum dat, int64 cnt)
+{
+    mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
+    uint64       tmpcnt;
+    uint32       tag;
+    int          i;
+    uint8        hash[SKETCH_HASHLEN];
+
+    /*
+     * hash, compare and store varlena values in their plain, uncompressed
+     * form, so that a value finds its mfv however it was stored
+     */
+    if (transval->typLen == -1)
+        dat = PointerGetDatum(PG_DETOAST_DATUM(dat));
+    sketch_hash_value(dat, transval->typLen, transval->typByVal,
+                      transval->hashver, hash);
+    cmsketch_add_hash(MFV_SKETCH(transval), hash, cnt);
+
+    tmpcnt = cmsketch_count_hash(MFV_SKETCH(transval), hash);
+    tag = MFV_HASH_TAG(hash);
+    i = mfv_find(transblob, dat, tag);
+
+    if (i > -1)
+        mfv_set_count(transval, i, tmpcnt);
+    else if (cnt > 0)
+        transblob = mfv_transval_offer(transblob, dat, tag, tmpcnt);
+    return(transblob);
+}
+
+/*!
+ * divide a count by 2^k, keeping the sign of the counters of a Count-Sketch
+ */
+static uint64 mfv_decay_shift(uint64 cnt, int64 k, bool sign)
+{
+    if (k >= 64)
+        return 0;
+    return sign ? (uint64)((int64)cnt >> k) : cnt >> k;
+}
+
+/*!
+ * move the landmark of a decaying mfv sketch forward to a later multiple
+ * of its half-life, halving its counts for every half-life it moves
+ * \param transval an mfv transval with a half-life
+ * \param landmark the new landmark
+ */
+void mfv_decay_to(mfvtransval *transval, float8 landmark)
+{
+    float8   halflives = rint((landmark - transval->landmark) / transval->halflife);
+    int64    k = (halflives >= 64) ? 64 : (int64)halflives;
+    bool     sign = (transval->mode == CM_MODE_COUNTSKETCH);
+    uint64  *counters = (uint64 *)MFV_SKETCH(transval).counters;
+    Size     n = CM_SKETCH_COUNTERS(transval->shape);
+    Size     j;
+    uint32   i;
+
+    if (k <= 0)
+        return;
+    for (j = 0; j < n; j++)
+        counters[j] = mfv_decay_shift(counters[j], k, sign);
+    for (i = 0; i < transval->next_mfv; i++)
+        transval->mfvs[i].cnt = mfv_decay_shift(transval->mfvs[i].cnt, k, false);
+    transval->weight = mfv_decay_shift(transval->weight, k, false);
+    transval->landmark = landmark;
+    /* counts may have become equal, which changes their heap order */
+    mfv_index_rebuild(transval);
+}
+
+/*!
+ * the count reported for a counter of an mfv sketch: decayed as of the
+ * latest time counted if the sketch has a half-life
+ * \param transval an mfv transval
+ * \param cnt the counter
+ */
+float8 mfv_decayed_count(mfvtransval *transval, uint64 cnt)
+{
+    if (transval->halflife == 0)
+        return (float8)cnt;
+    return ldexp((float8)cnt, -MFV_DECAY_BITS)
+           / pow(2.0, (transval->latest - transval->landmark) / transval->halflife);
 }
 
 /*!
@@ -130,44 +323,176 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
  * at offset 0!
  * \param blob a bytea holding an mfv transval
  * \param val the datum to search for
+ * \param tag the hash tag of the datum (see MFV_HASH_TAG)
  */
-int mfv_find(bytea *blob, Datum val)
+int mfv_find(bytea *blob, Datum val, uint32 tag)
 {
     mfvtransval *transval = (mfvtransval *)VARDATA(blob);
-    unsigned     i;
-    uint32       len;
+    uint32 *     slots = MFV_SLOTS(transval);
+    uint32       mask = transval->nslots - 1;
+    uint32       s;
+    uint32       len = ExtractDatumLen(val, transval->typLen, transval->typByVal);
     void *       datp;
-    Datum        iDat;
     void        *valp = DatumExtractPointer(val, transval->typByVal);
 
-    /* look for existing entry for this value */
-    for (i = 0; i < transval->next_mfv; i++) {
-        /* if they're the same */
+    /* linear probing from the home slot of the tag */
+    for (s = tag & mask; slots[s] != 0; s = (s + 1) & mask) {
+        unsigned i = slots[s] - 1;
+
+        if (transval->mfvs[i].tag != tag)
+            continue;
         datp = mfv_transval_getval(blob,i);
-        iDat = PointerExtractDatum(datp, transval->typByVal);
+        if (ExtractDatumLen(PointerExtractDatum(datp, transval->typByVal),
+                            transval->typLen, transval->typByVal) == len
+            && !memcmp(datp, valp, len))
+            /* arg is an mfv */
+            return(i);
+    }
+    return(-1);
+}
+
+/*!
+ * add mfv <c>i</c>, whose tag is already set, to the hash table
+ * \param transval an mfv transval
+ * \param i the position of the mfv
+ */
+void mfv_index_insert(mfvtransval *transval, uint32 i)
+{
+    uint32 *slots = MFV_SLOTS(transval);
+    uint32  mask = transval->nslots - 1;
+    uint32  s;
 
-        if ((len = ExtractDatumLen(iDat, transval->typLen, transval->typByVal))
-            == ExtractDatumLen(val, transval->typLen, transval->typByVal)) {
-            if (!memcmp(datp, valp, len))
-                /* arg is an mfv */
-                return(i);
+    for (s = transval->mfvs[i].tag & mask; slots[s] != 0; s = (s + 1) & mask)
+        ;
+    slots[s] = i + 1;
+}
+
+/*!
+ * remove mfv <c>i</c> from the hash table.  Later entries of its probe run
+ * are shifted back into the gap, so lookups never need tombstones.
+ * \param transval an mfv transval
+ * \param i the position of the mfv
+ */
+void mfv_index_delete(mfvtransval *transval, uint32 i)
+{
+    uint32 *slots = MFV_SLOTS(transval);
+    uint32  mask = transval->nslots - 1;
+    uint32  s, t, home;
+
+    for (s = transval->mfvs[i].tag & mask; slots[s] != i + 1; s = (s + 1) & mask)
+        if (slots[s] == 0)
+            elog(ERROR, "frequent value %u missing from mfv sketch index", i);
+
+    for (t = s;;) {
+        slots[s] = 0;
+        for (;;) {
+            t = (t + 1) & mask;
+            if (slots[t] == 0)
+                return;
+            home = transval->mfvs[slots[t] - 1].tag & mask;
+            /* entries whose home lies cyclically in (s, t] stay put */
+            if (s <= t ? (s < home && home <= t) : (s < home || home <= t))
+                continue;
+            break;
         }
+        slots[s] = slots[t];
+        s = t;
     }
-    return(-1);
+}
+
+/*!
+ * heap order on mfvs: by count, then by position, so that among equally
+ * frequent values the earliest one is evicted first
+ */
+#define MFV_HEAP_LESS(transval, a, b) \
+    ((transval)->mfvs[a].cnt < (transval)->mfvs[b].cnt \
+     || ((transval)->mfvs[a].cnt == (transval)->mfvs[b].cnt && (a) < (b)))
+
+/*!
+ * restore the heap property around heap position <c>h</c>,
+ * moving it up or down as needed
+ */
+static void mfv_heap_fix(mfvtransval *transval, uint32 h)
+{
+    uint32 *heap = MFV_HEAP(transval);
+    uint32 *pos = MFV_HEAPPOS(transval);
+    uint32  n = transval->next_mfv;
+    uint32  i = heap[h];
+    uint32  c;
+
+    /* sift up */
+    while (h > 0 && MFV_HEAP_LESS(transval, i, heap[(h - 1) / 2])) {
+        heap[h] = heap[(h - 1) / 2];
+        pos[heap[h]] = h;
+        h = (h - 1) / 2;
+    }
+    /* sift down */
+    while ((c = 2*h + 1) < n) {
+        if (c + 1 < n && MFV_HEAP_LESS(transval, heap[c + 1], heap[c]))
+            c++;
+        if (!MFV_HEAP_LESS(transval, heap[c], i))
+            break;
+        heap[h] = heap[c];
+        pos[heap[h]] = h;
+        h = c;
+    }
+    heap[h] = i;
+    pos[i] = h;
+}
+
+/*!
+ * set the count of mfv <c>i</c> and reposition it in the heap
+ * \param transval an mfv transval
+ * \param i the position of the mfv
+ * \param cnt its new count
+ */
+void mfv_set_count(mfvtransval *transval, uint32 i, uint64 cnt)
+{
+    transval->mfvs[i].cnt = cnt;
+    mfv_heap_fix(transval, MFV_HEAPPOS(transval)[i]);
+}
+
+/*!
+ * rebuild the hash table and heap after the mfvs array has been
+ * reordered or recounted
+ * \param transval an mfv transval
+ */
+void mfv_index_rebuild(mfvtransval *transval)
+{
+    uint32 *heap = MFV_HEAP(transval);
+    uint32 *pos = MFV_HEAPPOS(transval);
+    uint32  i;
+
+    memset(MFV_SLOTS(transval), 0, transval->nslots*sizeof(uint32));
+    for (i = 0; i < transval->next_mfv; i++) {
+        mfv_index_insert(transval, i);
+        heap[i] = pos[i] = i;
+    }
+    for (i = transval->next_mfv / 2; i > 0; i--)
+        mfv_heap_fix(transval, i - 1);
 }
 
 /*!
  * Initialize an mfv sketch
  * \param max_mfvs the number of "bins" in the histogram
  * \param typOid the type ID for the column
+ * \param shape the dimensions of the countmin sketch
+ * \param mode the CM_MODE_* update rule of the countmin sketch
  */
-bytea *mfv_init_transval(int max_mfvs, Oid typOid)
+bytea *mfv_init_transval(int max_mfvs, Oid typOid, cmshape shape, int mode)
 {
     int          initial_size;
+    uint32       nslots;
     bool         typIsVarLen;
     bytea *      transblob;
     mfvtransval *transval;
 
+    if (max_mfvs < 1)
+        elog(ERROR,
+             "number of most frequent values must be positive, was %d",
+             max_mfvs);
+    nslots = MFV_NSLOTS(max_mfvs);
+
     /*
      * initialize mfvtransval, using palloc0 to zero it out.
      * if typlen is positive (fixed), size chosen accurately.
@@ -178,14 +503,28 @@ bytea *mfv_init_transval(int max_mfvs, Oid typOid)
     else /* guess */
         initial_size = max_mfvs*16;
 
-    transblob = (bytea *)palloc0(MFV_TRANSVAL_SZ(max_mfvs) + initial_size);
+    if ((float8)CM_SKETCH_SZ(shape)
+        + max_mfvs*(sizeof(offsetcnt) + 2*sizeof(uint32))
+        + nslots*sizeof(uint32) + initial_size
+        > MaxAllocSize)
+        elog(ERROR,
+             "MFV sketch of %u x %u counters is too large; use a larger epsilon or delta",
+             shape.depth, shape.width);
+
+    transblob = (bytea *)palloc0(MFV_TRANSVAL_SZ(max_mfvs, nslots, shape)
+                                 + initial_size);
 
-    SET_VARSIZE(transblob, MFV_TRANSVAL_SZ(max_mfvs) + initial_size);
+    SET_VARSIZE(transblob, MFV_TRANSVAL_SZ(max_mfvs, nslots, shape) + initial_size);
     transval = (mfvtransval *)VARDATA(transblob);
     transval->max_mfvs = max_mfvs;
     transval->next_mfv = 0;
-    transval->next_offset = MFV_TRANSVAL_SZ(max_mfvs)-VARHDRSZ;
+    transval->nslots = nslots;
+    transval->next_offset = MFV_TRANSVAL_SZ(max_mfvs, nslots, shape)-VARHDRSZ;
+    transval->shape = shape;
+    transval->mode = mode;
     transval->typOid = typOid;
+    transval->magic = SKETCH_MAGIC_MFV;
+    transval->hashver = SKETCH_HASH_CURRENT;
     getTypeOutputInfo(transval->typOid,
                       &(transval->outFuncOid),
                       &(typIsVarLen));
@@ -214,7 +553,8 @@ void *mfv_transval_getval(bytea *blob, uint32 i)
              "attempt to get frequent value at illegal index %d in mfv sketch",
              i);
     if (tvp->mfvs[i].offset > VARSIZE(blob) - VARHDRSZ
-        || tvp->mfvs[i].offset < MFV_TRANSVAL_SZ(tvp->max_mfvs)-VARHDRSZ)
+        || tvp->mfvs[i].offset < MFV_TRANSVAL_SZ(tvp->max_mfvs, tvp->nslots,
+                                                 tvp->shape)-VARHDRSZ)
         elog(ERROR, "illegal offset %u in mfv sketch", tvp->mfvs[i].offset);
     if (tvp->mfvs[i].offset  + ExtractDatumLen(dat, tvp->typLen, tvp->typByVal)
         > VARSIZE(blob) - VARHDRSZ)
@@ -292,34 +632,43 @@ bytea *mfv_transval_insert_at(bytea *transblob, Datum dat, uint32 i)
 }
 
 /*!
- * insert a value into the mfvsketch
+ * insert a value into the mfvsketch.  It goes into the hash table and
+ * at the bottom of the heap with a zero count; set its count with
+ * mfv_set_count.
  * \param transblob the transition value packed into a bytea
  * \param dat the value to be inserted
+ * \param tag the hash tag of the value
  */
-bytea *mfv_transval_append(bytea *transblob, Datum dat)
+bytea *mfv_transval_append(bytea *transblob, Datum dat, uint32 tag)
 {
     mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
     bytea *      retval;
+    uint32       i = transval->next_mfv;
 
     if (transval->next_mfv == transval->max_mfvs) {
         elog(ERROR, "attempt to append to a full mfv sketch");
     }
-    retval = mfv_transval_insert_at(transblob,
-                                    dat,
-                                    transval->next_mfv);
-    (((mfvtransval *)VARDATA(retval))->next_mfv)++;
+    retval = mfv_transval_insert_at(transblob, dat, i);
+    transval = (mfvtransval *)VARDATA(retval);
+    transval->mfvs[i].tag = tag;
+    transval->mfvs[i].cnt = 0;
+    mfv_index_insert(transval, i);
+    MFV_HEAP(transval)[i] = MFV_HEAPPOS(transval)[i] = i;
+    transval->next_mfv++;
 
     return(retval);
 }
 
 /*!
- * replace the value at position i of the mfvsketch with dat
+ * replace the value at position i of the mfvsketch with dat, keeping
+ * its count and its place in the heap
  *
  * \param transblob the transition value packed into a bytea
  * \param dat the value to be inserted
  * \param i the position to replace
+ * \param tag the hash tag of the value
  */
-bytea *mfv_transval_replace(bytea *transblob, Datum dat, int i)
+bytea *mfv_transval_replace(bytea *transblob, Datum dat, int i, uint32 tag)
 {
     /*
      * if new value is smaller than old, we overwrite at the old offset.
@@ -332,11 +681,48 @@ bytea *mfv_transval_replace(bytea *transblob, Datum dat, int i)
     Datum        oldDat = PointerExtractDatum(tmpp, transval->typByVal);
     size_t       oldLen = ExtractDatumLen(oldDat, transval->typLen, transval->typByVal);
 
-    if (datumLen <= oldLen) {
+    mfv_index_delete(transval, i);
+    if (datumLen <= oldLen)
         mfv_copy_datum(transblob, i, dat);
-        return transblob;
+    else {
+        transblob = mfv_transval_insert_at(transblob, dat, i);
+        transval = (mfvtransval *)VARDATA(transblob);
+    }
+    transval->mfvs[i].tag = tag;
+    mfv_index_insert(transval, i);
+    return(transblob);
+}
+
+/*!
+ * offer a value that is not yet stored in the mfvsketch: it is appended
+ * if there is room, else it replaces the least frequent mfv if it beats it
+ *
+ * \param transblob the transition value packed into a bytea
+ * \param dat the value to be offered
+ * \param tag the hash tag of the value
+ * \param cnt the count of the value
+ */
+bytea *mfv_transval_offer(bytea *transblob, Datum dat, uint32 tag, uint64 cnt)
+{
+    mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
+    uint32       i;
+
+    if (transval->next_mfv < transval->max_mfvs) {
+        /* room for new */
+        i = transval->next_mfv;
+        transblob = mfv_transval_append(transblob, dat, tag);
     }
-    else return(mfv_transval_insert_at(transblob, dat, i));
+    else if (transval->mfvs[MFV_HEAP(transval)[0]].cnt < cnt) {
+        /* dat beats the least frequent mfv, at the top of the heap */
+        i = MFV_HEAP(transval)[0];
+        transblob = mfv_transval_replace(transblob, dat, i, tag);
+    }
+    else
+        /* not a frequent value */
+        return(transblob);
+
+    mfv_set_count((mfvtransval *)VARDATA(transblob), i, cnt);
+    return(transblob);
 }
 
 PG_FUNCTION_INFO_V1(__mfvsketch_final);
@@ -346,11 +732,15 @@ PG_FUNCTION_INFO_V1(__mfvsketch_final);
  */
 Datum __mfvsketch_final(PG_FUNCTION_ARGS)
 {
-    bytea *      transblob = PG_GETARG_BYTEA_P(0);
+    /*
+     * we sort the mfvs in place below, so work on a copy: this is also
+     * called on stored mfv_sketch values by mfvsketch_estimate_histogram
+     */
+    bytea *      transblob = PG_GETARG_BYTEA_P_COPY(0);
     mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
     ArrayType *  retval;
     uint32       i;
-    Datum        histo[transval->max_mfvs][2];
+    Datum *      histo;
     int          dims[2], lbs[2];
     /* Oid     typInput, typIOParam; */
     Oid          outFuncOid;
@@ -364,12 +754,15 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
 
 
     if (PG_ARGISNULL(0)) PG_RETURN_NULL();
-    if (VARSIZE(transblob) < MFV_TRANSVAL_SZ(0)) PG_RETURN_NULL();
+    if (VARSIZE(transblob) <= VARHDRSZ) PG_RETURN_NULL();
+    mfv_check_tag(transblob);
 
     transval = (mfvtransval *)VARDATA(transblob);
+    histo = (Datum *)palloc(2*Max(transval->next_mfv, 1)*sizeof(Datum));
 
     qsort(transval->mfvs, transval->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
-    getTypeOutputInfo(INT8OID,
+    /* decayed counts are fractional */
+    getTypeOutputInfo(transval->halflife > 0 ? FLOAT8OID : INT8OID,
                       &outFuncOid,
                       &typIsVarlena);
 
@@ -378,11 +771,14 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
         Datum curval = PointerExtractDatum(tmpp, transval->typByVal);
         char *countbuf =
             OidOutputFunctionCall(outFuncOid,
-                                  Int64GetDatum(transval->mfvs[i].cnt));
+                                  transval->halflife > 0
+                                  ? Float8GetDatum(mfv_decayed_count(transval,
+                                                                     transval->mfvs[i].cnt))
+                                  : Int64GetDatum(transval->mfvs[i].cnt));
         char *valbuf = OidOutputFunctionCall(transval->outFuncOid, curval);
         
-        histo[i][0] = PointerGetDatum(cstring_to_text(valbuf));
-        histo[i][1] = PointerGetDatum(cstring_to_text(countbuf));
+        histo[2*i] = PointerGetDatum(cstring_to_text(valbuf));
+        histo[2*i + 1] = PointerGetDatum(cstring_to_text(countbuf));
         pfree(countbuf);
         pfree(valbuf);
     }
@@ -398,7 +794,7 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
     dims[0] = i;
     dims[1] = 2;
     lbs[0] = lbs[1] = 0;
-    retval = construct_md_array((Datum *)histo,
+    retval = construct_md_array(histo,
                                 NULL,
                                 2,
                                 dims,
@@ -412,6 +808,20 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
 
 
 
+/*!
+ * check the tag of a nonempty MFV transval, which may be a stored
+ * mfv_sketch.  MFV sketches could not be stored before they were tagged,
+ * so there are no untagged ones to accept.
+ * \param transblob an mfv transval stored inside a bytea
+ */
+void mfv_check_tag(bytea *transblob)
+{
+    sketch_require_tag(VARDATA(transblob), VARSIZE(transblob) - VARHDRSZ,
+                       SKETCH_MAGIC_MFV, "mfv_sketch");
+    if (!MFV_TRANSVAL_INITIALIZED(transblob))
+        elog(ERROR, "not a valid mfv_sketch: too short");
+}
+
 /*!
  * support function to sort by count
  * \param i an offsetcnt object cast to a (void *)
@@ -422,7 +832,8 @@ int cnt_cmp_desc(const void *i, const void *j)
     offsetcnt *o = (offsetcnt *)i;
     offsetcnt *p = (offsetcnt *)j;
 
-    return (p->cnt - o->cnt);
+    /* the counts are 64-bit, so don't return their difference as an int */
+    return (p->cnt > o->cnt) - (p->cnt < o->cnt);
 }
 
 
@@ -439,12 +850,26 @@ Datum __mfvsketch_merge(PG_FUNCTION_ARGS)
     PG_RETURN_DATUM(PointerGetDatum(mfvsketch_merge_c(transblob1, transblob2)));
 }
 
+/*!
+ * UDA transition function for mfvsketch_union: merge a stored mfv_sketch
+ * into the running transval.
+ */
+PG_FUNCTION_INFO_V1(__mfvsketch_union_trans);
+Datum __mfvsketch_union_trans(PG_FUNCTION_ARGS)
+{
+    bytea * transblob = (bytea *)PG_GETARG_BYTEA_P(0);
+    bytea * sketchblob = (bytea *)PG_GETARG_BYTEA_P(1);
+
+    PG_RETURN_DATUM(PointerGetDatum(mfvsketch_merge_c(transblob, sketchblob)));
+}
+
 /*!
  * implementation of the merge of two mfv sketches.  we
  * first merge the embedded countmin sketches to get the
  * sums of the counts, and then use those sums to pick the
- * top values for the resulting histogram.  We overwrite
- * the first argument and return it.
+ * top values for the resulting histogram among the values of
+ * both arguments.  We overwrite the first argument and return it;
+ * the second is left unchanged.
  * \param transblob1 an mfv transval stored inside a bytea
  * \param transblob2 another mfv transval in a bytea
  */
@@ -452,70 +877,112 @@ bytea *mfvsketch_merge_c(bytea *transblob1, bytea *transblob2)
 {
     mfvtransval *transval1 = (mfvtransval *)VARDATA(transblob1);
     mfvtransval *transval2 = (mfvtransval *)VARDATA(transblob2);
-    uint32       i, j;
+    uint64      *sketch1, *sketch2;
+    int64        shift;
+    Size         ncounters;
+    uint32       i;
+    uint8        hash[SKETCH_HASHLEN];
 
     /* handle uninitialized args */
-    if (VARSIZE(transblob1) <= sizeof(MFV_TRANSVAL_SZ(0))
-        && VARSIZE(transblob2) <= sizeof(MFV_TRANSVAL_SZ(0)))
+    if (VARSIZE(transblob2) <= VARHDRSZ)
         return(transblob1);
-    else if (VARSIZE(transblob1) <= sizeof(MFV_TRANSVAL_SZ(0))) {
-        transblob1 = mfv_init_transval(transval2->max_mfvs, transval2->typOid);
+    mfv_check_tag(transblob2);
+    if (VARSIZE(transblob1) > VARHDRSZ)
+        mfv_check_tag(transblob1);
+    else {
+        transblob1 = mfv_init_transval(transval2->max_mfvs, transval2->typOid,
+                                       transval2->shape, transval2->mode);
         transval1 = (mfvtransval *)VARDATA(transblob1);
+        transval1->halflife = transval2->halflife;
     }
-    else if (VARSIZE(transblob2) <= sizeof(MFV_TRANSVAL_SZ(0))) {
-        transblob2 = mfv_init_transval(transval1->max_mfvs, transval1->typOid);
-        transval2 = (mfvtransval *)VARDATA(transblob2);
+
+    /* the counters of the sketches cannot be rehashed */
+    if (transval1->hashver != transval2->hashver)
+        elog(ERROR,
+             "cannot merge MFV sketches built with different hash functions (versions %d and %d); rebuild one of them from its data",
+             transval1->hashver, transval2->hashver);
+    if (transval1->typOid != transval2->typOid)
+        elog(ERROR,
+             "cannot merge MFV sketches over different types: %u, %u",
+             transval1->typOid, transval2->typOid);
+    if (!CM_SHAPE_EQ(transval1->shape, transval2->shape))
+        elog(ERROR,
+             "cannot merge MFV sketches of different dimensions: %ux%u, %ux%u",
+             transval1->shape.depth, transval1->shape.width,
+             transval2->shape.depth, transval2->shape.width);
+    if (transval1->mode != transval2->mode)
+        elog(ERROR,
+             "cannot merge MFV sketches with different modes: %d, %d",
+             transval1->mode, transval2->mode);
+
+    if (transval1->halflife != transval2->halflife)
+        elog(ERROR,
+             "cannot merge MFV sketches with different half-lives: %g, %g",
+             transval1->halflife, transval2->halflife);
+
+    /*
+     * bring decaying sketches to the later of their landmarks: transval1
+     * is moved, and the counters of transval2 are shifted as they are
+     * added.  Either is halved again if their sum could overflow.
+     */
+    shift = 0;
+    if (transval1->halflife > 0 && transval2->weight > 0) {
+        if (transval1->weight == 0) {
+            transval1->landmark = transval2->landmark;
+            transval1->latest = transval2->latest;
+        }
+        else if (transval2->landmark > transval1->landmark)
+            mfv_decay_to(transval1, transval2->landmark);
+        shift = (int64)Min(rint((transval1->landmark - transval2->landmark)
+                                / transval1->halflife), 64);
+        while (transval1->weight > (uint64)INT64_MAX
+                                   - mfv_decay_shift(transval2->weight, shift, false)) {
+            mfv_decay_to(transval1, transval1->landmark + transval1->halflife);
+            shift++;
+        }
+        transval1->weight += mfv_decay_shift(transval2->weight, shift, false);
+        transval1->latest = Max(transval1->latest, transval2->latest);
     }
 
-    /* combine sketches */
-    for (i = 0; i < DEPTH; i++)
-        for (j = 0; j < NUMCOUNTERS; j++)
-            transval1->sketch[i][j] += transval2->sketch[i][j];
+    /* combine sketches; the counters of a Count-Sketch add as two's complement */
+    sketch1 = (uint64 *)MFV_SKETCH(transval1).counters;
+    sketch2 = (uint64 *)MFV_SKETCH(transval2).counters;
+    ncounters = CM_SKETCH_COUNTERS(transval1->shape);
+    for (i = 0; i < ncounters; i++)
+        sketch1[i] += mfv_decay_shift(sketch2[i], shift,
+                                      transval1->mode == CM_MODE_COUNTSKETCH);
 
-    /* recompute the counts using the merged sketch */
+    /* recompute the counts of transval1 using the merged sketch */
     for (i = 0; i < transval1->next_mfv; i++) {
         void *tmpp = mfv_transval_getval(transblob1,i);
         Datum dat = PointerExtractDatum(tmpp, transval1->typByVal);
 
-        transval1->mfvs[i].cnt = cmsketch_count_c(transval1->sketch,
-                                                  dat,
-                                                  transval1->outFuncOid,
-                                                  transval1->typOid);
-    }
-    for (i = 0; i < transval2->next_mfv; i++) {
-        void *tmpp = mfv_transval_getval(transblob2,i);
-        Datum dat = PointerExtractDatum(tmpp, transval2->typByVal);
-
-        transval2->mfvs[i].cnt = cmsketch_count_c(transval2->sketch,
+        transval1->mfvs[i].cnt = cmsketch_count_c(MFV_SKETCH(transval1),
                                                   dat,
-                                                  transval2->outFuncOid,
-                                                  transval2->typOid);
+                                                  transval1->typLen,
+                                                  transval1->typByVal,
+                                                  transval1->hashver);
     }
+    mfv_index_rebuild(transval1);
 
-    /* now take maxes on mfvs in a sort-merge style, copying into transval1  */
-    qsort(transval1->mfvs, transval1->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
-    qsort(transval2->mfvs, transval2->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
-
-    /* scan through transval1, replace as we find bigger things in transval2 */
-    for (i = j = 0;
-         j < transval2->next_mfv && i < transval1->max_mfvs;
-         i++) {
-        void *tmpp = mfv_transval_getval(transblob2, j);
-        Datum jDatum = PointerExtractDatum(tmpp, transval2->typByVal);
-
-        if (i == transval1->next_mfv && (mfv_find(transblob1, jDatum) == -1)
-            /* && i < transval1->max_mfvs from for loop */) {
-            transblob1 = mfv_transval_append(transblob1, jDatum);
-            transval1 = (mfvtransval *)VARDATA(transblob1);
-            j++;
-        }
-        else if (transval1->mfvs[i].cnt < transval2->mfvs[j].cnt
-                 && mfv_find(transblob1, jDatum) == -1) {
-            /* copy into transval1 and advance both  */
-            transblob1 = mfv_transval_replace(transblob1, jDatum, i);
-            transval1 = (mfvtransval *)VARDATA(transblob1);
-            j++;
-        }
+    /*
+     * offer the values of transval2 that transval1 lacks, with their merged
+     * counts, exactly as the transition function offers a new row.  Stored
+     * values are already detoasted, see mfv_transval_count.
+     */
+    for (i = 0; i < transval2->next_mfv; i++) {
+        void * tmpp = mfv_transval_getval(transblob2, i);
+        Datum  dat = PointerExtractDatum(tmpp, transval2->typByVal);
+        uint32 tag = transval2->mfvs[i].tag;
+
+        if (mfv_find(transblob1, dat, tag) > -1)
+            continue;
+        sketch_hash_value(dat, transval1->typLen, transval1->typByVal,
+                          transval1->hashver, hash);
+        transblob1 = mfv_transval_offer(transblob1, dat, tag,
+                                        cmsketch_count_hash(MFV_SKETCH(transval1),
+                                                            hash));
+        transval1 = (mfvtransval *)VARDATA(transblob1);
     }
     return(transblob1);
 }
@@ -0,0 +1,487 @@
+/*!
+ * \file profile.c
+ *
+ * \brief Single-pass profiles of all the columns of a table
+ */
+/*!
+ * \implementation
+ * profile_row aggregates whole rows, and keeps for every column the counts
+ * of its values and NULLs, an HLL sketch of its values for count(distinct),
+ * and for types that cmsketch orders (see cm_key_kind) the smallest and
+ * largest keys, the sum of the values of numeric types and a KLL sketch of
+ * the values as float8s for the median.  Each value is hashed only once,
+ * and that hash feeds the HLL sketch; the key computed for the min and max
+ * feeds the KLL sketch.
+ *
+ * All the state lives in one transval "arena": a header, one profilecol
+ * per column, then the sketches of the columns at the offsets recorded in
+ * their profilecols.  The HLL sketches are dense from the start and the KLL
+ * sketches have room for PROFILE_KLL_LEVELS levels, so none of them is
+ * reallocated while rows are aggregated, and a column takes about 9KB
+ * whatever the number of rows.  Should a KLL sketch still outgrow its room,
+ * the arena is rebuilt around the bigger sketch.
+ */
+
+#include "postgres.h"
+#include "access/heapam.h"
+#include "access/htup.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/elog.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/typcache.h"
+#include "catalog/pg_type.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "countmin.h"
+#include "hll.h"
+#include "kll.h"
+#include <math.h>
+
+#define PROFILE_HLL_PRECISION 12  /*! 4K registers, about 1.6% standard error */
+#define PROFILE_KLL_K         KLL_DEFAULT_K
+#define PROFILE_KLL_LEVELS    24  /*! room for about 2^24*k values */
+#define PROFILE_NATTS         9   /*! number of attributes of profile_column */
+
+/*!
+ * \internal
+ * \brief statistics of a column, and the offsets of its sketches
+ * \endinternal
+ */
+typedef struct {
+    NameData attname;   /*! name of the column */
+    Oid      typOid;    /*! Oid of its type */
+    int16    typLen;    /*! length of the type */
+    bool     typByVal;  /*! whether the type is passed by value */
+    uint8    keys;      /*! CM_KEYS_* kind of its keys */
+    int64    count;     /*! number of non-NULL values */
+    int64    min;       /*! key of the smallest value, if ordered */
+    int64    max;       /*! key of the largest value, if ordered */
+    float8   sum;       /*! sum of the values of integer and float types */
+    uint32   hll;       /*! offset of the HLL sketch from the top of the blob */
+    uint32   kll;       /*! offset of the KLL sketch, 0 if not ordered */
+} profilecol;
+
+/*!
+ * \internal
+ * \brief transition value struct for profile_row, followed by the sketches
+ * of its columns
+ * \endinternal
+ */
+typedef struct {
+    int64      nrows;     /*! number of rows aggregated */
+    uint32     ncols;     /*! number of columns, not counting dropped ones */
+    uint32     reserved;
+    profilecol cols[0];
+} profiletransval;
+
+/*! the transval follows the varlena header after padding that aligns it */
+#define PROFILE_TRANSVAL(blob) \
+    ((profiletransval *)((char *)(blob) + MAXALIGN(VARHDRSZ)))
+/*! offset of the first sketch from the top of a blob with ncols columns */
+#define PROFILE_SKETCHES_OFFSET(ncols) \
+    (MAXALIGN(VARHDRSZ) \
+     + MAXALIGN(sizeof(profiletransval) + (ncols)*sizeof(profilecol)))
+/*! the sketch at an offset from the top of a blob */
+#define PROFILE_SKETCH(blob, off) ((bytea *)((char *)(blob) + (off)))
+/*! whether values of a kind of keys are summed for their mean */
+#define PROFILE_SUMMED(keys) \
+    ((keys) == CM_KEYS_INTEGER || (keys) == CM_KEYS_FLOAT)
+
+/*!
+ * \internal
+ * \brief row type information cached in fn_extra by the transition function
+ * \endinternal
+ */
+typedef struct {
+    Oid       tupType;   /*! the row type, RECORDOID for anonymous rows */
+    int32     tupTypmod; /*! and its typmod */
+    TupleDesc tupdesc;   /*! a copy of its descriptor, in fn_mcxt */
+    Datum    *values;    /*! room for the deformed attributes of a row */
+    bool     *nulls;
+} profilecache;
+
+Datum __profile_row_trans(PG_FUNCTION_ARGS);
+Datum __profile_row_merge(PG_FUNCTION_ARGS);
+Datum __profile_row_final(PG_FUNCTION_ARGS);
+bytea *profile_pack(profiletransval *, bytea **, bytea **);
+bytea *profile_new(TupleDesc);
+
+/*!
+ * build a transval from a header and the sketches of its columns, setting
+ * the offsets of the sketches in its profilecols
+ * \param header the header and profilecols of the transval
+ * \param hlls the HLL sketch of each column
+ * \param klls the KLL sketch of each column, or NULL
+ */
+bytea *profile_pack(profiletransval *header, bytea **hlls, bytea **klls)
+{
+    Size             size = PROFILE_SKETCHES_OFFSET(header->ncols);
+    Size             off;
+    bytea           *blob;
+    profiletransval *transval;
+    uint32           i;
+
+    for (i = 0; i < header->ncols; i++) {
+        size += MAXALIGN(VARSIZE(hlls[i]));
+        if (klls[i] != NULL)
+            size += MAXALIGN(VARSIZE(klls[i]));
+    }
+    if (size > MaxAllocSize)
+        elog(ERROR, "profile of %u columns is too large", header->ncols);
+
+    blob = (bytea *)palloc0(size);
+    SET_VARSIZE(blob, size);
+    transval = PROFILE_TRANSVAL(blob);
+    memcpy(transval, header,
+           sizeof(profiletransval) + header->ncols*sizeof(profilecol));
+
+    off = PROFILE_SKETCHES_OFFSET(header->ncols);
+    for (i = 0; i < header->ncols; i++) {
+        transval->cols[i].hll = off;
+        memcpy((char *)blob + off, hlls[i], VARSIZE(hlls[i]));
+        off += MAXALIGN(VARSIZE(hlls[i]));
+        transval->cols[i].kll = 0;
+        if (klls[i] != NULL) {
+            transval->cols[i].kll = off;
+            memcpy((char *)blob + off, klls[i], VARSIZE(klls[i]));
+            off += MAXALIGN(VARSIZE(klls[i]));
+        }
+    }
+    return blob;
+}
+
+/*!
+ * allocate an empty transval for rows of a type
+ * \param tupdesc the descriptor of the row type
+ */
+bytea *profile_new(TupleDesc tupdesc)
+{
+    profiletransval *header;
+    bytea          **hlls, **klls;
+    uint32           ncols = 0;
+    int              i;
+
+    header = (profiletransval *)palloc0(sizeof(profiletransval)
+                                        + tupdesc->natts*sizeof(profilecol));
+    hlls = (bytea **)palloc(Max(tupdesc->natts, 1)*sizeof(bytea *));
+    klls = (bytea **)palloc(Max(tupdesc->natts, 1)*sizeof(bytea *));
+    for (i = 0; i < tupdesc->natts; i++) {
+        profilecol *col = &header->cols[ncols];
+
+        if (tupdesc->attrs[i]->attisdropped)
+            continue;
+        namecpy(&col->attname, &tupdesc->attrs[i]->attname);
+        col->typOid = tupdesc->attrs[i]->atttypid;
+        get_typlenbyval(col->typOid, &col->typLen, &col->typByVal);
+        col->keys = cm_key_kind(col->typOid);
+        hlls[ncols] = hll_new(PROFILE_HLL_PRECISION, col->typOid,
+                              SKETCH_HASH_CURRENT, HLL_DENSE, 0);
+        klls[ncols] = (col->keys == CM_KEYS_HASHED)
+                      ? NULL
+                      : kll_new(PROFILE_KLL_K,
+                                kll_max_size(PROFILE_KLL_K, PROFILE_KLL_LEVELS));
+        ncols++;
+    }
+    header->ncols = ncols;
+    return profile_pack(header, hlls, klls);
+}
+
+/*!
+ * the row type of a row, looked up once per change of type and cached in
+ * fn_extra with room to deform rows of it
+ * \param fcinfo the call of the transition function
+ * \param rec the row
+ */
+static profilecache *profile_row_cache(FunctionCallInfo fcinfo,
+                                       HeapTupleHeader rec)
+{
+    profilecache *cache = (profilecache *)fcinfo->flinfo->fn_extra;
+    Oid           tupType = HeapTupleHeaderGetTypeId(rec);
+    int32         tupTypmod = HeapTupleHeaderGetTypMod(rec);
+    MemoryContext oldcontext;
+    int           natts;
+
+    if (cache != NULL && cache->tupType == tupType
+        && cache->tupTypmod == tupTypmod)
+        return cache;
+
+    oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+    if (cache == NULL)
+        cache = (profilecache *)palloc0(sizeof(profilecache));
+    else {
+        FreeTupleDesc(cache->tupdesc);
+        pfree(cache->values);
+        pfree(cache->nulls);
+    }
+    cache->tupdesc = lookup_rowtype_tupdesc_copy(tupType, tupTypmod);
+    natts = Max(cache->tupdesc->natts, 1);
+    cache->values = (Datum *)palloc(natts*sizeof(Datum));
+    cache->nulls = (bool *)palloc(natts*sizeof(bool));
+    MemoryContextSwitchTo(oldcontext);
+    cache->tupType = tupType;
+    cache->tupTypmod = tupTypmod;
+    fcinfo->flinfo->fn_extra = cache;
+    return cache;
+}
+
+PG_FUNCTION_INFO_V1(__profile_row_trans);
+
+/*!
+ * UDA transition function for profile_row, whose argument is a whole row
+ */
+Datum __profile_row_trans(PG_FUNCTION_ARGS)
+{
+    bytea           *transblob = PG_GETARG_BYTEA_P(0);
+    profiletransval *transval;
+    HeapTupleHeader  rec;
+    HeapTupleData    tuple;
+    TupleDesc        tupdesc;
+    profilecache    *cache;
+    uint64           hash[SKETCH_HASHLEN/sizeof(uint64)];
+    uint32           c = 0;
+    int              i;
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
+    rec = PG_GETARG_HEAPTUPLEHEADER(1);
+    cache = profile_row_cache(fcinfo, rec);
+    tupdesc = cache->tupdesc;
+    tuple.t_len = HeapTupleHeaderGetDatumLength(rec);
+    ItemPointerSetInvalid(&(tuple.t_self));
+    tuple.t_data = rec;
+    heap_deform_tuple(&tuple, tupdesc, cache->values, cache->nulls);
+
+    /* initialize if this is the first call */
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        transblob = profile_new(tupdesc);
+    transval = PROFILE_TRANSVAL(transblob);
+    transval->nrows++;
+
+    for (i = 0; i < tupdesc->natts; i++) {
+        profilecol *col;
+        Datum       dat;
+        bytea      *kll, *newkll;
+        int64       key;
+
+        if (tupdesc->attrs[i]->attisdropped)
+            continue;
+        if (c >= transval->ncols
+            || transval->cols[c].typOid != tupdesc->attrs[i]->atttypid)
+            elog(ERROR, "profile_row requires rows of a single type");
+        col = &transval->cols[c++];
+        if (cache->nulls[i])
+            continue;
+
+        /* detoast varlena values once, for the hash and the min and max keys */
+        dat = cache->values[i];
+        if (col->typLen == -1)
+            dat = PointerGetDatum(PG_DETOAST_DATUM(dat));
+        col->count++;
+        sketch_hash_contents(dat, col->typLen, col->typByVal,
+                             ((hlltransval *)VARDATA(PROFILE_SKETCH(transblob, col->hll)))->hashver,
+                             (uint8 *)hash);
+        /* dense sketches are updated in place */
+        hll_insert_hash(PROFILE_SKETCH(transblob, col->hll), hash[0]);
+
+        if (col->keys == CM_KEYS_HASHED)
+            continue;
+        key = cm_key_of(dat, col->typOid);
+        if (col->count == 1 || key < col->min)
+            col->min = key;
+        if (col->count == 1 || key > col->max)
+            col->max = key;
+        if (PROFILE_SUMMED(col->keys))
+            col->sum += cm_key_float8(key, col->keys);
+
+        kll = PROFILE_SKETCH(transblob, col->kll);
+        newkll = kll_insert(kll, cm_key_float8(key, col->keys));
+        if (newkll != kll) {
+            /* the KLL sketch outgrew its room: rebuild the arena */
+            bytea  **hlls = (bytea **)palloc(transval->ncols*sizeof(bytea *));
+            bytea  **klls = (bytea **)palloc(transval->ncols*sizeof(bytea *));
+            uint32   j;
+
+            for (j = 0; j < transval->ncols; j++) {
+                hlls[j] = PROFILE_SKETCH(transblob, transval->cols[j].hll);
+                klls[j] = transval->cols[j].kll
+                          ? PROFILE_SKETCH(transblob, transval->cols[j].kll)
+                          : NULL;
+            }
+            klls[c - 1] = newkll;
+            transblob = profile_pack(transval, hlls, klls);
+            transval = PROFILE_TRANSVAL(transblob);
+        }
+    }
+    if (c != transval->ncols)
+        elog(ERROR, "profile_row requires rows of a single type");
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+PG_FUNCTION_INFO_V1(__profile_row_merge);
+
+/*!
+ * Greenplum "prefunc" to combine the profiles of the rows on multiple
+ * machines
+ */
+Datum __profile_row_merge(PG_FUNCTION_ARGS)
+{
+    bytea           *transblob1 = PG_GETARG_BYTEA_P(0);
+    bytea           *transblob2 = PG_GETARG_BYTEA_P(1);
+    profiletransval *t1, *t2, *header;
+    bytea          **hlls, **klls;
+    uint32           i;
+
+    /* deal with the case where one or both items is the initial value of '' */
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    t1 = PROFILE_TRANSVAL(transblob1);
+    t2 = PROFILE_TRANSVAL(transblob2);
+    if (t1->ncols != t2->ncols)
+        elog(ERROR, "cannot merge profiles of %u and %u columns",
+             t1->ncols, t2->ncols);
+
+    header = (profiletransval *)palloc(sizeof(profiletransval)
+                                       + t1->ncols*sizeof(profilecol));
+    memcpy(header, t1, sizeof(profiletransval) + t1->ncols*sizeof(profilecol));
+    header->nrows += t2->nrows;
+    hlls = (bytea **)palloc(Max(t1->ncols, 1)*sizeof(bytea *));
+    klls = (bytea **)palloc(Max(t1->ncols, 1)*sizeof(bytea *));
+    for (i = 0; i < t1->ncols; i++) {
+        profilecol *col = &header->cols[i];
+        profilecol *col2 = &t2->cols[i];
+
+        if (col->typOid != col2->typOid)
+            elog(ERROR, "cannot merge profiles of columns of types %s and %s",
+                 format_type_be(col->typOid), format_type_be(col2->typOid));
+        hlls[i] = hll_merge_c(PROFILE_SKETCH(transblob1, col->hll),
+                              PROFILE_SKETCH(transblob2, col2->hll), false);
+        klls[i] = NULL;
+        if (col->keys == CM_KEYS_HASHED) {
+            col->count += col2->count;
+            continue;
+        }
+
+        /* an empty KLL sketch has no min and max to merge */
+        if (col2->count == 0)
+            klls[i] = PROFILE_SKETCH(transblob1, col->kll);
+        else if (col->count == 0)
+            klls[i] = PROFILE_SKETCH(transblob2, col2->kll);
+        else
+            klls[i] = kll_merge_c(PROFILE_SKETCH(transblob1, col->kll),
+                                  PROFILE_SKETCH(transblob2, col2->kll));
+        if (col->count == 0 || (col2->count > 0 && col2->min < col->min))
+            col->min = col2->min;
+        if (col->count == 0 || (col2->count > 0 && col2->max > col->max))
+            col->max = col2->max;
+        col->sum += col2->sum;
+        col->count += col2->count;
+    }
+    PG_RETURN_DATUM(PointerGetDatum(profile_pack(header, hlls, klls)));
+}
+
+/*!
+ * a value of a column with a given key, as text
+ * \param key the key
+ * \param typOid the type of the column
+ */
+static Datum profile_key_text(int64 key, Oid typOid)
+{
+    Oid  outFuncOid;
+    bool typIsVarlena;
+
+    getTypeOutputInfo(typOid, &outFuncOid, &typIsVarlena);
+    return PointerGetDatum(cstring_to_text(
+                               OidOutputFunctionCall(outFuncOid,
+                                                     cm_key_value(key, typOid))));
+}
+
+PG_FUNCTION_INFO_V1(__profile_row_final);
+
+/*!
+ * UDA final function for profile_row: an array with a profile_column for
+ * every column of the rows
+ */
+Datum __profile_row_final(PG_FUNCTION_ARGS)
+{
+    bytea           *transblob = PG_GETARG_BYTEA_P(0);
+    profiletransval *transval = PROFILE_TRANSVAL(transblob);
+    Oid              rowtype;
+    TupleDesc        tupdesc;
+    Datum           *elems;
+    int16            typlen;
+    bool             typbyval;
+    char             typalign;
+    uint32           i;
+
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+
+    rowtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+    if (!OidIsValid(rowtype))
+        elog(ERROR, "could not determine the result type of profile_row");
+    tupdesc = lookup_rowtype_tupdesc(rowtype, -1);
+    if (tupdesc->natts != PROFILE_NATTS)
+        elog(ERROR, "profile_row must return an array of profile_column");
+
+    elems = (Datum *)palloc(Max(transval->ncols, 1)*sizeof(Datum));
+    for (i = 0; i < transval->ncols; i++) {
+        profilecol *col = &transval->cols[i];
+        Datum       values[PROFILE_NATTS];
+        bool        nulls[PROFILE_NATTS];
+        hlltransval *hll;
+
+        memset(nulls, 0, sizeof(nulls));
+        values[0] = PointerGetDatum(cstring_to_text(NameStr(col->attname)));
+        values[1] = PointerGetDatum(cstring_to_text(format_type_be(col->typOid)));
+        values[2] = Int64GetDatum(col->count);
+        values[3] = Int64GetDatum(transval->nrows - col->count);
+        hll = (hlltransval *)VARDATA(PROFILE_SKETCH(transblob, col->hll));
+        values[4] = Int64GetDatum(col->count == 0
+                                  ? 0 : (int64)rint(hll_estimate_c(hll)));
+        if (col->keys == CM_KEYS_HASHED || col->count == 0)
+            nulls[5] = nulls[6] = nulls[7] = nulls[8] = true;
+        else {
+            bytea   *kll = PROFILE_SKETCH(transblob, col->kll);
+            kllitem *items;
+            uint32   nitems;
+            float8   median;
+
+            values[5] = profile_key_text(col->min, col->typOid);
+            values[6] = profile_key_text(col->max, col->typOid);
+            if (PROFILE_SUMMED(col->keys))
+                values[7] = Float8GetDatum(col->sum / col->count);
+            else
+                nulls[7] = true;
+            items = kll_sorted_items(KLL_TRANSVAL(kll), &nitems);
+            median = kll_quantile_c(KLL_TRANSVAL(kll), items, nitems, 0.5);
+            values[8] = profile_key_text(cm_float8_key(median, col->keys),
+                                         col->typOid);
+        }
+        elems[i] = HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+    }
+    ReleaseTupleDesc(tupdesc);
+
+    get_typlenbyvalalign(rowtype, &typlen, &typbyval, &typalign);
+    PG_RETURN_ARRAYTYPE_P(construct_array(elems, transval->ncols, rowtype,
+                                          typlen, typbyval, typalign));
+}
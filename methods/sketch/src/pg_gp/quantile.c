@@ -0,0 +1,395 @@
+/*!
+ * \file quantile.c
+ *
+ * \brief Exact quantiles refined from approximate brackets
+ */
+/*!
+ * \implementation
+ * The quantile() function in the quantile module finds exact quantiles in
+ * two scans.  The first builds a KLL sketch of the column, and brackets each
+ * requested quantile between the estimates of two nearby fractions.  The
+ * second scan is the __quantile_refine aggregate here: it counts the values
+ * below each bracket and at its two ends, and keeps only the values strictly
+ * inside some bracket.  Sorting those and indexing into them by rank gives
+ * every quantile exactly, in the manner of <c>percentile_disc</c>, as long as
+ * its rank fell into its bracket; quantiles whose bracket missed come back
+ * NULL and are retried by the caller with a wider bracket.
+ *
+ * Counting the values at the ends rather than keeping them keeps the space
+ * small even when a bracket ends at a value that fills much of the column.
+ * A value repeated inside a bracket must have been rare in the sketch, so
+ * it is rare in the column too.
+ *
+ * Brackets refined on different segments merge by adding up the counts and
+ * concatenating the kept values.
+ *
+ * Values are float8s, so the quantiles are exact among the values as
+ * float8s; bigints beyond 2^53 and numerics are rounded by the cast to
+ * float8 before they get here.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "catalog/pg_type.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "kll.h"
+#include <math.h>
+
+#define QR_VALUES_GUESS 1024 /*! initial room for values inside the brackets */
+
+/*!
+ * \internal
+ * \brief a bracket around the quantile at one fraction
+ * \endinternal
+ */
+typedef struct {
+    float8 fraction;    /*! the quantile to find */
+    float8 lo;          /*! lower end of the bracket */
+    float8 hi;          /*! upper end of the bracket */
+    uint64 below;       /*! number of values less than lo */
+    uint64 atlo;        /*! number of values equal to lo */
+    uint64 athi;        /*! number of values equal to hi, if hi > lo */
+} qrbracket;
+
+/*!
+ * \internal
+ * \brief transition value struct for refining quantiles.
+ *
+ * It is followed by nbrackets brackets, and then room for capacity values
+ * that lie strictly inside some bracket.
+ * \endinternal
+ */
+typedef struct {
+    uint64 n;           /*! number of non-NULL values seen */
+    uint32 nbrackets;   /*! number of quantiles */
+    uint32 nvalues;     /*! number of values kept */
+    uint32 capacity;    /*! number of values there is room for */
+} qrtransval;
+
+/*!
+ * the transval follows the varlena header after padding that aligns it,
+ * the brackets and the values follow it likewise
+ */
+#define QR_TRANSVAL(blob) ((qrtransval *)((char *)(blob) + MAXALIGN(VARHDRSZ)))
+#define QR_BRACKETS(t) ((qrbracket *)((char *)(t) + MAXALIGN(sizeof(qrtransval))))
+#define QR_VALUES(t) \
+    ((float8 *)((char *)QR_BRACKETS(t) + (t)->nbrackets*sizeof(qrbracket)))
+/*! size of a transval with nbrackets brackets and room for capacity values */
+#define QR_TRANSVAL_SZ(nbrackets, capacity) \
+    (MAXALIGN(VARHDRSZ) + MAXALIGN(sizeof(qrtransval)) \
+     + (Size)(nbrackets)*sizeof(qrbracket) + (Size)(capacity)*sizeof(float8))
+
+Datum __quantile_refine_trans(PG_FUNCTION_ARGS);
+Datum __quantile_refine_merge(PG_FUNCTION_ARGS);
+Datum __quantile_refine_final(PG_FUNCTION_ARGS);
+bytea *qr_new(ArrayType *, ArrayType *, ArrayType *);
+bytea *qr_make_room(bytea *, uint32);
+
+/*! the non-NULL float8s of a one-dimensional array */
+static float8 *qr_float8_array(ArrayType *arr, const char *what, int *nelems)
+{
+    Datum  *elems;
+    bool   *nulls;
+    float8 *vals;
+    int16   typlen;
+    bool    typbyval;
+    char    typalign;
+    int     i;
+
+    if (ARR_NDIM(arr) > 1)
+        elog(ERROR, "quantile %s must be a one-dimensional array", what);
+    get_typlenbyvalalign(FLOAT8OID, &typlen, &typbyval, &typalign);
+    deconstruct_array(arr, FLOAT8OID, typlen, typbyval, typalign,
+                      &elems, &nulls, nelems);
+    vals = (float8 *)palloc(Max(*nelems, 1)*sizeof(float8));
+    for (i = 0; i < *nelems; i++) {
+        if (nulls[i])
+            elog(ERROR, "quantile %s must not be NULL", what);
+        vals[i] = DatumGetFloat8(elems[i]);
+    }
+    return vals;
+}
+
+/*!
+ * Allocate a transval for the given brackets
+ * \param fractions the quantiles to find
+ * \param lows the lower ends of their brackets
+ * \param highs the upper ends of their brackets
+ */
+bytea *qr_new(ArrayType *fractions, ArrayType *lows, ArrayType *highs)
+{
+    float8     *f, *lo, *hi;
+    int         nf, nlo, nhi, i;
+    Size        size;
+    bytea      *blob;
+    qrtransval *t;
+
+    f = qr_float8_array(fractions, "fractions", &nf);
+    lo = qr_float8_array(lows, "bracket ends", &nlo);
+    hi = qr_float8_array(highs, "bracket ends", &nhi);
+    if (nlo != nf || nhi != nf)
+        elog(ERROR, "need one quantile bracket per fraction, got %d fractions "
+             "and %d, %d bracket ends", nf, nlo, nhi);
+    if ((Size)nf > MaxAllocSize/sizeof(qrbracket)
+        || QR_TRANSVAL_SZ(nf, QR_VALUES_GUESS) > MaxAllocSize)
+        elog(ERROR, "too many quantile fractions: %d", nf);
+
+    size = QR_TRANSVAL_SZ(nf, QR_VALUES_GUESS);
+    blob = (bytea *)palloc0(size);
+    SET_VARSIZE(blob, size);
+    t = QR_TRANSVAL(blob);
+    t->n = 0;
+    t->nbrackets = nf;
+    t->nvalues = 0;
+    t->capacity = QR_VALUES_GUESS;
+    for (i = 0; i < nf; i++) {
+        qrbracket *b = &QR_BRACKETS(t)[i];
+
+        if (f[i] < 0 || f[i] > 1 || isnan(f[i]))
+            elog(ERROR, "quantile fraction must be between 0 and 1, was %g",
+                 f[i]);
+        if (kll_float8_cmp(lo[i], hi[i]) > 0)
+            elog(ERROR, "quantile bracket [%g, %g] is empty", lo[i], hi[i]);
+        b->fraction = f[i];
+        b->lo = lo[i];
+        b->hi = hi[i];
+    }
+    return blob;
+}
+
+/*!
+ * make sure there is room for <c>need</c> more values.  If not, copy the
+ * transval to a new blob with the room for values doubled.
+ * \param blob a bytea holding a qrtransval
+ * \param need the number of values to add
+ */
+bytea *qr_make_room(bytea *blob, uint32 need)
+{
+    qrtransval *t = QR_TRANSVAL(blob);
+    Size        capacity;
+    bytea      *newblob;
+
+    if (t->capacity - t->nvalues >= need)
+        return blob;
+
+    capacity = 2*((Size)t->nvalues + need);
+    if (capacity > (MaxAllocSize - QR_TRANSVAL_SZ(t->nbrackets, 0))/sizeof(float8))
+        elog(ERROR, "too many values inside the quantile brackets: %u",
+             t->nvalues);
+
+    newblob = (bytea *)palloc(QR_TRANSVAL_SZ(t->nbrackets, capacity));
+    memcpy(newblob, blob, QR_TRANSVAL_SZ(t->nbrackets, t->nvalues));
+    SET_VARSIZE(newblob, QR_TRANSVAL_SZ(t->nbrackets, capacity));
+    QR_TRANSVAL(newblob)->capacity = (uint32)capacity;
+    return newblob;
+}
+
+PG_FUNCTION_INFO_V1(__quantile_refine_trans);
+
+/*!
+ * UDA transition function for __quantile_refine, whose arguments are the
+ * value, the fractions of the quantiles and the lower and upper ends of
+ * their brackets.
+ */
+Datum __quantile_refine_trans(PG_FUNCTION_ARGS)
+{
+    bytea      *transblob = PG_GETARG_BYTEA_P(0);
+    qrtransval *transval;
+    qrbracket  *brackets;
+    float8      value;
+    bool        inside = false;
+    uint32      i;
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* initialize if this is the first call */
+    if (VARSIZE(transblob) <= VARHDRSZ) {
+        if (PG_ARGISNULL(2) || PG_ARGISNULL(3) || PG_ARGISNULL(4))
+            elog(ERROR, "NULL quantile brackets passed to __quantile_refine");
+        transblob = qr_new(PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3),
+                           PG_GETARG_ARRAYTYPE_P(4));
+    }
+    if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
+    value = PG_GETARG_FLOAT8(1);
+    transval = QR_TRANSVAL(transblob);
+    brackets = QR_BRACKETS(transval);
+    transval->n++;
+    for (i = 0; i < transval->nbrackets; i++) {
+        qrbracket *b = &brackets[i];
+        int        cmp = kll_float8_cmp(value, b->lo);
+
+        if (cmp < 0)
+            b->below++;
+        else if (cmp == 0)
+            b->atlo++;
+        else if ((cmp = kll_float8_cmp(value, b->hi)) == 0)
+            b->athi++;
+        else if (cmp < 0)
+            inside = true;
+    }
+
+    /* keep the value once however many brackets it is inside */
+    if (inside) {
+        transblob = qr_make_room(transblob, 1);
+        transval = QR_TRANSVAL(transblob);
+        QR_VALUES(transval)[transval->nvalues++] = value;
+    }
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+PG_FUNCTION_INFO_V1(__quantile_refine_merge);
+
+/*!
+ * Greenplum "prefunc" to combine refined brackets from multiple machines
+ */
+Datum __quantile_refine_merge(PG_FUNCTION_ARGS)
+{
+    bytea      *transblob1 = PG_GETARG_BYTEA_P(0);
+    bytea      *transblob2 = PG_GETARG_BYTEA_P(1);
+    qrtransval *t1, *t2;
+    uint32      i;
+
+    /* deal with the case where one or both items is the initial value of '' */
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    t1 = QR_TRANSVAL(transblob1);
+    t2 = QR_TRANSVAL(transblob2);
+    if (t1->nbrackets != t2->nbrackets)
+        elog(ERROR, "cannot merge %u quantile brackets with %u",
+             t1->nbrackets, t2->nbrackets);
+    for (i = 0; i < t1->nbrackets; i++) {
+        qrbracket *b1 = &QR_BRACKETS(t1)[i];
+        qrbracket *b2 = &QR_BRACKETS(t2)[i];
+
+        if (b1->fraction != b2->fraction || kll_float8_cmp(b1->lo, b2->lo) != 0
+            || kll_float8_cmp(b1->hi, b2->hi) != 0)
+            elog(ERROR, "cannot merge different quantile brackets");
+    }
+
+    if (!(fcinfo->context && IsA(fcinfo->context, AggState))) {
+        /* allocate a new transval as a copy of transblob1 */
+        bytea *newblob = (bytea *)palloc(VARSIZE(transblob1));
+
+        memcpy(newblob, transblob1, VARSIZE(transblob1));
+        transblob1 = newblob;
+    }
+    transblob1 = qr_make_room(transblob1, t2->nvalues);
+    t1 = QR_TRANSVAL(transblob1);
+
+    t1->n += t2->n;
+    for (i = 0; i < t1->nbrackets; i++) {
+        qrbracket *b1 = &QR_BRACKETS(t1)[i];
+        qrbracket *b2 = &QR_BRACKETS(t2)[i];
+
+        b1->below += b2->below;
+        b1->atlo += b2->atlo;
+        b1->athi += b2->athi;
+    }
+    memcpy(QR_VALUES(t1) + t1->nvalues, QR_VALUES(t2),
+           t2->nvalues*sizeof(float8));
+    t1->nvalues += t2->nvalues;
+    PG_RETURN_DATUM(PointerGetDatum(transblob1));
+}
+
+/*!
+ * index of the first of n sorted values that is larger than a given value,
+ * or if <c>strict</c> is false, at least as large
+ */
+static uint32 qr_search(float8 *values, uint32 n, float8 value, bool strict)
+{
+    uint32 lo = 0, hi = n;
+
+    while (lo < hi) {
+        uint32 mid = lo + (hi - lo)/2;
+        int    cmp = kll_float8_cmp(values[mid], value);
+
+        if (cmp < 0 || (strict && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+PG_FUNCTION_INFO_V1(__quantile_refine_final);
+
+/*!
+ * UDA final function for __quantile_refine: the exact quantile at each
+ * fraction, in the manner of percentile_disc, or NULL if its bracket did
+ * not contain it
+ */
+Datum __quantile_refine_final(PG_FUNCTION_ARGS)
+{
+    bytea      *transblob = PG_GETARG_BYTEA_P(0);
+    qrtransval *transval = QR_TRANSVAL(transblob);
+    float8     *values;
+    Datum      *elems;
+    bool       *nulls;
+    int         dims[1], lbs[1];
+    int16       typlen;
+    bool        typbyval;
+    char        typalign;
+    uint32      i;
+
+    if (VARSIZE(transblob) <= VARHDRSZ || transval->n == 0)
+        PG_RETURN_NULL();
+
+    values = QR_VALUES(transval);
+    qsort(values, transval->nvalues, sizeof(float8), kll_cmp);
+
+    elems = (Datum *)palloc(Max(transval->nbrackets, 1)*sizeof(Datum));
+    nulls = (bool *)palloc(Max(transval->nbrackets, 1)*sizeof(bool));
+    for (i = 0; i < transval->nbrackets; i++) {
+        qrbracket *b = &QR_BRACKETS(transval)[i];
+        /* the smallest rank r with r >= fraction*n, as kll_quantile_c */
+        float8     rank = Max(ceil(b->fraction * transval->n), 1);
+        uint32     first, last;
+        float8     inside;
+
+        first = qr_search(values, transval->nvalues, b->lo, true);
+        last = qr_search(values, transval->nvalues, b->hi, false);
+        inside = (last > first) ? last - first : 0;
+
+        nulls[i] = false;
+        rank -= b->below;
+        if (rank <= 0)
+            nulls[i] = true;
+        else if (rank <= b->atlo)
+            elems[i] = Float8GetDatum(b->lo);
+        else if ((rank -= b->atlo) <= inside)
+            elems[i] = Float8GetDatum(values[first + (uint32)rank - 1]);
+        else if (rank - inside <= b->athi)
+            elems[i] = Float8GetDatum(b->hi);
+        else
+            nulls[i] = true;
+    }
+
+    get_typlenbyvalalign(FLOAT8OID, &typlen, &typbyval, &typalign);
+    dims[0] = transval->nbrackets;
+    lbs[0] = 1;
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls,
+                                             transval->nbrackets > 0 ? 1 : 0,
+                                             dims, lbs, FLOAT8OID, typlen,
+                                             typbyval, typalign));
+}
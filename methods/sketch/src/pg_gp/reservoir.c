@@ -0,0 +1,443 @@
+/*!
+ * \file reservoir.c
+ *
+ * \brief Uniform and weighted reservoir sampling
+ */
+/*!
+ * \implementation
+ * A reservoir sample of n rows is drawn as in Efraimidis and Spirakis'
+ * A-Res: every row gets the random key u^(1/w), for u uniform on (0,1) and
+ * w the weight of the row, and the sample is the n rows with the largest
+ * keys.  With all weights 1 this is a uniform sample without replacement.
+ * Keys are kept as ln(u)/w, which orders rows the same way without
+ * underflowing for small weights.  The rows are kept in a min-heap on
+ * their keys, so the row to evict is at the root.
+ *
+ * Once the reservoir is full, A-ExpJ draws how much weight to skip before
+ * the next row that makes it in, ln(r)/ln(T) for the smallest kept key T,
+ * and that row's key conditioned on beating T.  Rows in between cost an
+ * addition and a comparison, and only O(n log(N/n)) of N rows draw random
+ * numbers or are copied.
+ *
+ * Samples drawn on different segments are merged by keeping the n largest
+ * keys of both, which is the sample of the union.  Like Space-Saving
+ * summaries, the values are kept in the transval itself, and values that
+ * are replaced leave garbage behind until the value space runs out.
+ *
+ * \literature
+ * [1] P. Efraimidis and P. Spirakis.  Weighted Random Sampling with a
+ *     Reservoir.  Information Processing Letters 97(5), 2006.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/elog.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "catalog/pg_type.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include <math.h>
+#include <stdlib.h>
+
+#define RS_VALUE_GUESS  16 /*! initial bytes per variable-length value */
+
+/*!
+ * \internal
+ * \brief a sampled value and its key
+ * \endinternal
+ */
+typedef struct {
+    float8 key;     /*! ln(u)/w; the largest keys are kept */
+    uint32 offset;  /*! memory offset of the value from the top of the transval */
+    uint32 len;     /*! length of the value in bytes */
+} rsitem;
+
+/*!
+ * \internal
+ * \brief transition value struct for reservoir samples.
+ *
+ * It is followed by a min-heap of nitems items on their keys, with room for
+ * capacity items, and then the values, at the offsets recorded in the items.
+ * \endinternal
+ */
+typedef struct {
+    uint32 capacity;    /*! sample size, n */
+    uint32 nitems;      /*! number of sampled values */
+    uint32 next_offset; /*! next memory offset to store a value at */
+    Oid    typOid;      /*! Oid of the data type of the values */
+    int16  typLen;      /*! length of the data type */
+    bool   typByVal;    /*! whether the type is passed by value */
+    float8 skip;        /*! weight left to skip before the next insertion */
+} rstransval;
+
+/*!
+ * the transval follows the varlena header after padding that aligns it,
+ * the items and the values follow it likewise
+ */
+#define RS_TRANSVAL(blob) ((rstransval *)((char *)(blob) + MAXALIGN(VARHDRSZ)))
+#define RS_ITEMS(t) ((rsitem *)((char *)(t) + MAXALIGN(sizeof(rstransval))))
+/*! offset of the values from the top of a transval */
+#define RS_VALUES_OFFSET(capacity) \
+    (MAXALIGN(sizeof(rstransval)) + (capacity)*sizeof(rsitem))
+/*! free space remaining for values */
+#define RS_FREE_SPACE(blob) \
+    (VARSIZE(blob) - MAXALIGN(VARHDRSZ) - RS_TRANSVAL(blob)->next_offset)
+
+Datum __reservoir_trans(PG_FUNCTION_ARGS);
+Datum __reservoir_merge(PG_FUNCTION_ARGS);
+Datum __reservoir_final(PG_FUNCTION_ARGS);
+bytea *rs_new(int, Oid, Size);
+bytea *rs_make_room(bytea *, Size);
+bytea *rs_offer(bytea *, float8, const void *, uint32);
+float8 rs_uniform(void);
+void   rs_set_skip(rstransval *);
+int    rs_item_cmp(const void *, const void *);
+
+/*! a uniform random number in (0,1), drawn with random() like setseed() */
+float8 rs_uniform(void)
+{
+    uint64 bits = (((uint64)random() << 31) | (uint64)random())
+                  & ((UINT64CONST(1) << 53) - 1);
+
+    return ((float8)bits + 0.5) / (float8)(UINT64CONST(1) << 53);
+}
+
+/*! restore the heap property from item i down */
+static void rs_sift_down(rsitem *items, uint32 nitems, uint32 i)
+{
+    rsitem item = items[i];
+    uint32 child;
+
+    while ((child = 2*i + 1) < nitems) {
+        if (child + 1 < nitems && items[child + 1].key < items[child].key)
+            child++;
+        if (item.key <= items[child].key)
+            break;
+        items[i] = items[child];
+        i = child;
+    }
+    items[i] = item;
+}
+
+/*! restore the heap property from item i up */
+static void rs_sift_up(rsitem *items, uint32 i)
+{
+    rsitem item = items[i];
+
+    while (i > 0 && items[(i - 1)/2].key > item.key) {
+        items[i] = items[(i - 1)/2];
+        i = (i - 1)/2;
+    }
+    items[i] = item;
+}
+
+/*!
+ * draw the weight to skip before the next value that replaces one in a
+ * full reservoir: ln(r)/ln(T) for the smallest kept key T
+ * \param t a full rstransval
+ */
+void rs_set_skip(rstransval *t)
+{
+    t->skip = log(rs_uniform()) / RS_ITEMS(t)[0].key;
+}
+
+/*!
+ * Allocate an empty reservoir
+ * \param capacity the sample size
+ * \param typOid the type of the values
+ * \param valuebytes initial space for the values
+ */
+bytea *rs_new(int capacity, Oid typOid, Size valuebytes)
+{
+    Size        size;
+    bytea      *blob;
+    rstransval *t;
+
+    if (capacity < 1)
+        elog(ERROR, "reservoir sample size must be positive, was %d",
+             capacity);
+    if (MAXALIGN(VARHDRSZ) + (float8)RS_VALUES_OFFSET((float8)capacity)
+        + valuebytes > MaxAllocSize)
+        elog(ERROR, "reservoir sample of %d values is too large", capacity);
+
+    size = MAXALIGN(VARHDRSZ) + MAXALIGN(RS_VALUES_OFFSET(capacity)) + valuebytes;
+    blob = (bytea *)palloc0(size);
+    SET_VARSIZE(blob, size);
+    t = RS_TRANSVAL(blob);
+    t->capacity = capacity;
+    t->nitems = 0;
+    t->next_offset = MAXALIGN(RS_VALUES_OFFSET(capacity));
+    t->typOid = typOid;
+    t->typLen = get_typlen(typOid);
+    t->typByVal = get_typbyval(typOid);
+    t->skip = 0;
+    return blob;
+}
+
+/*!
+ * make sure the reservoir has room for a value of <c>need</c> bytes.  If
+ * not, copy it to a new blob with the garbage squeezed out and the space
+ * for live values doubled.
+ * \param blob a bytea holding an rstransval
+ * \param need the number of bytes needed
+ */
+bytea *rs_make_room(bytea *blob, Size need)
+{
+    rstransval *t = RS_TRANSVAL(blob);
+    Size        base = MAXALIGN(RS_VALUES_OFFSET(t->capacity));
+    Size        live = 0;
+    Size        size;
+    bytea      *newblob;
+    rstransval *newt;
+    uint32      i;
+
+    if (RS_FREE_SPACE(blob) >= need)
+        return blob;
+
+    for (i = 0; i < t->nitems; i++)
+        live += MAXALIGN(RS_ITEMS(t)[i].len);
+    need = MAXALIGN(need);
+    size = MAXALIGN(VARHDRSZ) + base + 2*(live + need);
+    if (size > MaxAllocSize)
+        elog(ERROR, "reservoir sample of %u values is too large", t->capacity);
+
+    newblob = (bytea *)palloc(size);
+    memcpy(newblob, blob, MAXALIGN(VARHDRSZ) + base);
+    SET_VARSIZE(newblob, size);
+    newt = RS_TRANSVAL(newblob);
+    newt->next_offset = base;
+    for (i = 0; i < t->nitems; i++) {
+        rsitem *item = &RS_ITEMS(newt)[i];
+
+        memcpy((char *)newt + newt->next_offset, (char *)t + item->offset,
+               item->len);
+        item->offset = newt->next_offset;
+        newt->next_offset += MAXALIGN(item->len);
+    }
+    return newblob;
+}
+
+/*!
+ * offer a value to the reservoir: it is added if the reservoir is not
+ * full, and otherwise replaces the value with the smallest key if its key
+ * is larger
+ * \param blob a bytea holding an rstransval
+ * \param key the key of the value
+ * \param valp pointer to the bytes of the value
+ * \param len length of the value
+ */
+bytea *rs_offer(bytea *blob, float8 key, const void *valp, uint32 len)
+{
+    rstransval *t = RS_TRANSVAL(blob);
+    rsitem     *item;
+    uint32      i;
+
+    if (t->nitems == t->capacity && key <= RS_ITEMS(t)[0].key)
+        return blob;
+
+    /* overwrite the evicted value in place if the new one fits, else append */
+    i = (t->nitems < t->capacity) ? t->nitems : 0;
+    if (i == t->nitems || len > RS_ITEMS(t)[i].len) {
+        blob = rs_make_room(blob, len);
+        t = RS_TRANSVAL(blob);
+        RS_ITEMS(t)[i].offset = t->next_offset;
+        t->next_offset += MAXALIGN(len);
+    }
+    item = &RS_ITEMS(t)[i];
+    memcpy((char *)t + item->offset, valp, len);
+    item->len = len;
+    item->key = key;
+    if (i == t->nitems)
+        rs_sift_up(RS_ITEMS(t), t->nitems++);
+    else
+        rs_sift_down(RS_ITEMS(t), t->nitems, 0);
+    return blob;
+}
+
+PG_FUNCTION_INFO_V1(__reservoir_trans);
+
+/*!
+ * UDA transition function for reservoir_sample, whose arguments are the
+ * value and the sample size, and weighted_reservoir_sample, whose
+ * arguments are the value, its weight and the sample size.
+ */
+Datum __reservoir_trans(PG_FUNCTION_ARGS)
+{
+    bytea          *transblob = PG_GETARG_BYTEA_P(0);
+    rstransval     *transval;
+    int             sizearg = PG_NARGS() - 1;
+    float8          weight = 1;
+    float8          key, u;
+    Datum           dat;
+    Size            len;
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* ignore NULL values, and NULL or zero weights */
+    if (PG_ARGISNULL(1) || (PG_NARGS() == 4 && PG_ARGISNULL(2)))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+    if (PG_NARGS() == 4) {
+        weight = PG_GETARG_FLOAT8(2);
+        if (!(weight >= 0) || isinf(weight))
+            elog(ERROR,
+                 "reservoir sample weights must be finite and non-negative, was %g",
+                 weight);
+        if (weight == 0)
+            PG_RETURN_DATUM(PointerGetDatum(transblob));
+    }
+
+    /* initialize if this is the first call */
+    if (VARSIZE(transblob) <= VARHDRSZ) {
+        sketch_typinfo *typinfo = sketch_arg_typinfo(fcinfo, 1);
+        int             n;
+
+        if (PG_ARGISNULL(sizearg))
+            elog(ERROR, "NULL sample size passed to reservoir sample");
+        n = PG_GETARG_INT32(sizearg);
+        transblob = rs_new(n, typinfo->typOid,
+                           (Size)Max(n, 0)*MAXALIGN(typinfo->typLen > 0
+                                                    ? typinfo->typLen
+                                                    : RS_VALUE_GUESS));
+    }
+    transval = RS_TRANSVAL(transblob);
+
+    if (transval->nitems < transval->capacity)
+        key = log(rs_uniform()) / weight;
+    else {
+        /* skip rows until the weight drawn by rs_set_skip has passed */
+        transval->skip -= weight;
+        if (transval->skip > 0)
+            PG_RETURN_DATUM(PointerGetDatum(transblob));
+        /* a key above the smallest one, T: u^(1/w) for u uniform on (T^w, 1) */
+        u = exp(RS_ITEMS(transval)[0].key * weight);
+        key = log(u + (1 - u)*rs_uniform()) / weight;
+    }
+
+    /* keep varlena values in their plain, uncompressed form */
+    dat = PG_GETARG_DATUM(1);
+    if (transval->typLen == -1)
+        dat = PointerGetDatum(PG_DETOAST_DATUM(dat));
+    len = ExtractDatumLen(dat, transval->typLen, transval->typByVal);
+    if (transval->typLen == -2)
+        len++;  /* keep the terminating NUL of a cstring */
+
+    transblob = rs_offer(transblob, key,
+                         DatumExtractPointer(dat, transval->typByVal), len);
+    transval = RS_TRANSVAL(transblob);
+    if (transval->nitems == transval->capacity)
+        rs_set_skip(transval);
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+PG_FUNCTION_INFO_V1(__reservoir_merge);
+
+/*!
+ * Greenplum "prefunc" to combine reservoir samples from multiple machines:
+ * the values with the largest keys of both are kept.
+ */
+Datum __reservoir_merge(PG_FUNCTION_ARGS)
+{
+    bytea      *transblob1 = PG_GETARG_BYTEA_P(0);
+    bytea      *transblob2 = PG_GETARG_BYTEA_P(1);
+    rstransval *t1, *t2;
+    uint32      i;
+
+    /* deal with the case where one or both items is the initial value of '' */
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    t1 = RS_TRANSVAL(transblob1);
+    t2 = RS_TRANSVAL(transblob2);
+    if (t1->typOid != t2->typOid)
+        elog(ERROR,
+             "cannot merge reservoir samples over different types: %u, %u",
+             t1->typOid, t2->typOid);
+    if (t1->capacity != t2->capacity)
+        elog(ERROR,
+             "cannot merge reservoir samples of different sizes: %u, %u",
+             t1->capacity, t2->capacity);
+
+    if (!(fcinfo->context && IsA(fcinfo->context, AggState))) {
+        /* allocate a new transval as a copy of transblob1 */
+        bytea *newblob = (bytea *)palloc(VARSIZE(transblob1));
+
+        memcpy(newblob, transblob1, VARSIZE(transblob1));
+        transblob1 = newblob;
+    }
+    for (i = 0; i < t2->nitems; i++) {
+        rsitem *item = &RS_ITEMS(t2)[i];
+
+        transblob1 = rs_offer(transblob1, item->key,
+                              (char *)t2 + item->offset, item->len);
+    }
+    t1 = RS_TRANSVAL(transblob1);
+    if (t1->nitems == t1->capacity)
+        rs_set_skip(t1);
+    PG_RETURN_DATUM(PointerGetDatum(transblob1));
+}
+
+/*! support function to sort items by decreasing key */
+int rs_item_cmp(const void *a, const void *b)
+{
+    const rsitem *x = (const rsitem *)a;
+    const rsitem *y = (const rsitem *)b;
+
+    return (x->key < y->key) - (x->key > y->key);
+}
+
+PG_FUNCTION_INFO_V1(__reservoir_final);
+
+/*!
+ * UDA final function for reservoir samples: a text array of the sampled
+ * values, in decreasing order of key, so that every prefix of the array
+ * is a sample too
+ */
+Datum __reservoir_final(PG_FUNCTION_ARGS)
+{
+    bytea      *transblob = PG_GETARG_BYTEA_P(0);
+    rstransval *transval = RS_TRANSVAL(transblob);
+    rsitem     *items;
+    Datum      *elems;
+    Oid         outFuncOid;
+    bool        typIsVarlena;
+    uint32      i;
+
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+
+    items = (rsitem *)palloc(transval->nitems*sizeof(rsitem));
+    memcpy(items, RS_ITEMS(transval), transval->nitems*sizeof(rsitem));
+    qsort(items, transval->nitems, sizeof(rsitem), rs_item_cmp);
+
+    getTypeOutputInfo(transval->typOid, &outFuncOid, &typIsVarlena);
+    elems = (Datum *)palloc(transval->nitems*sizeof(Datum));
+    for (i = 0; i < transval->nitems; i++) {
+        char  *valp = (char *)transval + items[i].offset;
+        Datum  val = 0;
+
+        if (transval->typByVal)
+            memcpy(&val, valp, items[i].len);
+        else
+            val = PointerGetDatum(valp);
+        elems[i] = PointerGetDatum(cstring_to_text(
+                                       OidOutputFunctionCall(outFuncOid, val)));
+    }
+    PG_RETURN_ARRAYTYPE_P(construct_array(elems, transval->nitems, TEXTOID,
+                                          -1, false, 'i'));
+}
@@ -62,8 +62,55 @@ success = get_op_hash_functions(eqOpr, result, NULL));
 #include "libpq/md5.h"
 #include "utils/lsyscache.h"
 
+/*
+ * Bitmaps are scanned a 64-bit word at a time.  A sketch's leftmost bit is
+ * the most significant bit of its first byte, so words are assembled
+ * big-endian; compilers turn load_be64 into a load and a byte swap.
+ * Counting bits within a word uses the compiler's builtins where we have
+ * them.
+ */
+#ifdef __GNUC__
+#define ctz64(w) ((uint32)__builtin_ctzll(w))
+#define clz64(w) ((uint32)__builtin_clzll(w))
+#else
+static uint32 ctz64(uint64 w)
+{
+    uint32 c = 0;
+
+    while (!(w & 1)) {
+        w >>= 1;
+        c++;
+    }
+    return c;
+}
+
+static uint32 clz64(uint64 w)
+{
+    uint32 c = 0;
+
+    while (!(w & (UINT64CONST(1) << 63))) {
+        w <<= 1;
+        c++;
+    }
+    return c;
+}
+#endif
+
+/*! the 4 bytes at p as a big-endian word */
+static uint32 load_be32(const uint8 *p)
+{
+    return ((uint32)p[0] << 24) | ((uint32)p[1] << 16)
+           | ((uint32)p[2] << 8) | (uint32)p[3];
+}
+
+/*! the 8 bytes at p as a big-endian word */
+static uint64 load_be64(const uint8 *p)
+{
+    return ((uint64)load_be32(p) << 32) | load_be32(p + 4);
+}
+
 /*!
- * Simple linear function to find the rightmost bit that's set to one
+ * Find the rightmost bit that's set to one
  * (i.e. the # of trailing zeros to the right).
  * \param bits a bitmap containing many fm sketches
  * \param numsketches the number of sketches in the bits variable
@@ -77,7 +124,7 @@ uint32 rightmost_one(uint8 *bits,
 {
     uint8 *s =
         &(((uint8 *)(bits))[sketchnum*sketchsz_bits/8]);
-    int    i;
+    size_t i;
     uint32 c = 0;       /* output: c will count trailing zero bits, */
 
     if (sketchsz_bits % (sizeof(uint32)*CHAR_BIT))
@@ -88,31 +135,30 @@ uint32 rightmost_one(uint8 *bits,
             (uint32)sizeof(uint32));
 
     /*
-     * loop through the chunks of bits from right to left, counting zeros.
-     * stop when we hit a 1.
-     * XXX currently we look at CHAR_BIT (8) bits at a time
-     * which would seem to avoid any 32- vs. 64-bit concerns.
-     * might be worth tuning this up to do 32 bits at a time.
+     * loop through the words of bits from right to left, counting zeros.
+     * stop when we hit a 1.  A sketch that isn't a whole number of words
+     * has its leftmost 32 bits handled on their own.
      */
-    for (i = sketchsz_bits/(CHAR_BIT) -1; i >= 0; i--)
+    for (i = sketchsz_bits/CHAR_BIT; i >= sizeof(uint64); i -= sizeof(uint64))
     {
-        uint32 v = (uint32) (s[i]);
-
-        if (!v)         /* all CHAR_BIT of these bits are 0 */
-            c += CHAR_BIT /* * sizeof(uint32) */;
-        else
-        {
-            c += ui_rightmost_one(v);
-            break;             /* we found a 1 in this value of i, so we stop looping here. */
-        }
+        uint64 v = load_be64(&s[i - sizeof(uint64)]);
+
+        if (v)
+            return c + ctz64(v);
+        c += 64;
+    }
+    if (i > 0) {
+        uint32 v = load_be32(s);
+
+        if (v)
+            return c + ui_rightmost_one(v);
+        c += 32;
     }
     return c;
 }
 
 /*!
- * Simple linear function to find the leftmost zero (# leading 1's)
- * Would be nice to unify with the previous -- e.g. a foomost_bar function
- * where foo would be left or right, and bar would be 0 or 1.
+ * Find the leftmost zero (# leading 1's)
  * \param bits a bitmap containing many fm sketches
  * \param numsketches the number of sketches in the bits variable
  * \param the size of each sketch in bits
@@ -125,9 +171,8 @@ uint32 leftmost_zero(uint8 *bits,
 {
     uint8 *  s = &(((uint8 *)bits)[sketchnum*sketchsz_bits/8]);
 
-    unsigned i;
-    uint32   c = 0;     /* output: c will count trailing zero bits, */
-    uint32   maxbyte = pow(2,8) - 1;
+    size_t   i;
+    uint32   c = 0;     /* output: c will count leading one bits, */
 
     if (sketchsz_bits % (sizeof(uint32)*8))
         elog(
@@ -142,31 +187,25 @@ uint32 leftmost_zero(uint8 *bits,
 
 
     /*
-     * loop through the chunks of bits from left to right, counting ones.
+     * loop through the words of bits from left to right, counting ones.
      * stop when we hit a 0.
      */
-    for (i = 0; i < sketchsz_bits/(CHAR_BIT); i++)
+    for (i = 0; i + sizeof(uint64) <= sketchsz_bits/CHAR_BIT;
+         i += sizeof(uint64))
     {
-        uint32 v = (uint32) s[i];
-
-        if (v == maxbyte)
-            c += CHAR_BIT /* * sizeof(uint32) */;
-        else
-        {
-            /*
-             * reverse and invert v, then do rightmost_one
-             * magic reverse from http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith32Bits
-             */
-            uint8 b =
-                ((s[i] * 0x0802LU &
-                  0x22110LU) |
-                 (s[i] * 0x8020LU &
-                  0x88440LU)) * 0x10101LU >> 16;
-            v = (uint32) b ^ 0xff;
-
-            c += ui_rightmost_one(v);
-            break;             /* we found a 1 in this value of i, so we stop looping here. */
-        }
+        uint64 v = ~load_be64(&s[i]);
+
+        if (v)
+            return c + clz64(v);
+        c += 64;
+    }
+    if (i < sketchsz_bits/CHAR_BIT) {
+        /* the last 32 bits of a sketch that isn't a whole number of words */
+        uint32 v = ~load_be32(&s[i]);
+
+        if (v)
+            return c + clz64((uint64)v << 32);
+        c += 32;
     }
     return c;
 }
@@ -221,14 +260,17 @@ Datum array_set_bit_in_place(bytea *bitmap,
 }
 
 /*!
- * Simple linear function to find the rightmost one (# trailing zeros) in an uint32.
- * Based on
+ * Find the rightmost one (# trailing zeros) in an uint32, with the
+ * compiler's builtin where we have it.  The fallback is based on
  * http://graphics.stanford.edu/~seander/bithacks.html#ZerosOnRightLinear
- * Look there for fancier ways to do this.
+ * which answers 31 for zero; the builtin path does the same.
  * \param v an integer
  */
 uint32 ui_rightmost_one(uint32 v)
 {
+#ifdef __GNUC__
+    return v ? (uint32)__builtin_ctz(v) : 31;
+#else
     uint32 c;
 
     v = (v ^ (v - 1)) >> 1;     /* Set v's trailing 0s to 1s and zero rest */
@@ -239,6 +281,7 @@ uint32 ui_rightmost_one(uint32 v)
     }
 
     return c;
+#endif
 }
 
 /*!
@@ -297,30 +340,264 @@ bit_print(uint8 *c, int numbytes)
     elog(NOTICE, "bitmap: %s", p);
 }
 
+/*! 64-bit rotate left, for murmurhash3_x64_128 */
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/*! final avalanche mix of MurmurHash3 */
+static inline uint64 fmix64(uint64 k)
+{
+    k ^= k >> 33;
+    k *= UINT64CONST(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
+/*!
+ * Austin Appleby's MurmurHash3_x64_128 (public domain).
+ * Blocks are read with memcpy, so the key needn't be aligned.
+ * \param key the bytes to hash
+ * \param len the number of bytes in key
+ * \param seed the hash seed
+ * \param out caller-provided buffer of SKETCH_HASHLEN bytes for the result
+ */
+void murmurhash3_x64_128(const void *key, size_t len, uint32 seed, uint8 *out)
+{
+    const uint8 *data = (const uint8 *)key;
+    size_t       nblocks = len / 16;
+    uint64       h1 = seed;
+    uint64       h2 = seed;
+    const uint64 c1 = UINT64CONST(0x87c37b91114253d5);
+    const uint64 c2 = UINT64CONST(0x4cf5ad432745937f);
+    const uint8 *tail;
+    uint64       k1, k2;
+    size_t       i;
+
+    /* body */
+    for (i = 0; i < nblocks; i++) {
+        memcpy(&k1, data + i*16, sizeof(uint64));
+        memcpy(&k2, data + i*16 + 8, sizeof(uint64));
+
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    /* tail */
+    tail = data + nblocks*16;
+    k1 = k2 = 0;
+    for (i = len & 15; i > 8; i--)
+        k2 ^= ((uint64)tail[i - 1]) << (8*(i - 9));
+    if ((len & 15) > 8) {
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (i = Min(len & 15, 8); i > 0; i--)
+        k1 ^= ((uint64)tail[i - 1]) << (8*(i - 1));
+    if ((len & 15) > 0) {
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    /* finalization */
+    h1 ^= (uint64)len; h2 ^= (uint64)len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    memcpy(out, &h1, sizeof(uint64));
+    memcpy(out + sizeof(uint64), &h2, sizeof(uint64));
+}
+
 /*!
- * Run the datum through an md5 hash.  No need to special-case variable-length types,
- * we'll just has their length header too.
- * The POSTGRES code for md5 returns a bytea with a textual representation of the
- * md5 result.  We then convert it back into binary.
+ * Hash a datum into SKETCH_HASHLEN bytes.  No need to special-case
+ * variable-length types, we'll just hash their length header too.
+ *
+ * The result is written into a caller-provided buffer (normally on the
+ * stack), so hashing does not allocate.
  * \param dat a Postgres Datum
  * \param typOid Postgres type Oid
- * \returns a bytea containing the hashed bytes
+ * \param hashver the hash function to use, one of the SKETCH_HASH_* values
+ * \param out buffer of at least SKETCH_HASHLEN bytes for the hash value
  */
-bytea *sketch_md5_bytea(Datum dat, Oid typOid)
+void sketch_hash_datum(Datum dat, Oid typOid, int hashver, uint8 *out)
 {
-    // according to postgres' libpq/md5.c, need 33 bytes to hold 
-    // null-terminated md5 string
-    char outbuf[MD5_HASHLEN*2+1];
-    bytea *out = palloc0(MD5_HASHLEN+VARHDRSZ);    
-    bool byval = get_typbyval(typOid);
-    int len = ExtractDatumLen(dat, get_typlen(typOid), byval);
-    void *datp = DatumExtractPointer(dat, byval);
-        
-    pg_md5_hash(datp, len, outbuf);        
-    
-    hex_to_bytes(outbuf, (uint8 *)VARDATA(out), MD5_HASHLEN*2);
-    SET_VARSIZE(out, MD5_HASHLEN+VARHDRSZ);
-    return out;
+    int16 typLen;
+    bool  typByVal;
+
+    get_typlenbyval(typOid, &typLen, &typByVal);
+    sketch_hash_value(dat, typLen, typByVal, hashver, out);
+}
+
+/*!
+ * Hash a datum whose type length and byval flag are already known, giving
+ * the same result as sketch_hash_datum.  Transition functions call this
+ * with type information cached in their transval, so hashing a row needs
+ * no catalog lookups.
+ * \param dat a Postgres Datum
+ * \param typLen the type's length (-1 for varlena, -2 for cstring)
+ * \param typByVal the type's byval flag
+ * \param hashver the hash function to use, one of the SKETCH_HASH_* values
+ * \param out buffer of at least SKETCH_HASHLEN bytes for the hash value
+ */
+void sketch_hash_value(Datum dat, int16 typLen, bool typByVal, int hashver,
+                       uint8 *out)
+{
+    sketch_hash_bytes(DatumExtractPointer(dat, typByVal),
+                      ExtractDatumLen(dat, typLen, typByVal), hashver, out);
+}
+
+/*!
+ * Hash a value on its contents.  Varlena values are hashed on their
+ * detoasted contents without the header, so that a value hashes the same
+ * whether it was stored compressed, out of line or with a short header;
+ * other values are hashed as by sketch_hash_value.
+ * \param dat a Postgres Datum
+ * \param typLen the type's length (-1 for varlena, -2 for cstring)
+ * \param typByVal the type's byval flag
+ * \param hashver the hash function to use, one of the SKETCH_HASH_* values
+ * \param out buffer of at least SKETCH_HASHLEN bytes for the hash value
+ */
+void sketch_hash_contents(Datum dat, int16 typLen, bool typByVal, int hashver,
+                          uint8 *out)
+{
+    if (typLen == -1) {
+        struct varlena *v = PG_DETOAST_DATUM_PACKED(dat);
+
+        sketch_hash_bytes(VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v), hashver, out);
+        if ((Pointer)v != DatumGetPointer(dat))
+            pfree(v);
+    }
+    else
+        sketch_hash_value(dat, typLen, typByVal, hashver, out);
+}
+
+/*!
+ * Hash the marshalled bytes of a datum into SKETCH_HASHLEN bytes, giving
+ * the same result as sketch_hash_datum on the datum itself.  Callers that
+ * already know the type's length and byval flag use this to skip the
+ * catalog lookups.
+ * \param datp pointer to the bytes of the datum
+ * \param len number of bytes, as returned by ExtractDatumLen
+ * \param hashver the hash function to use, one of the SKETCH_HASH_* values
+ * \param out buffer of at least SKETCH_HASHLEN bytes for the hash value
+ */
+void sketch_hash_bytes(const void *datp, size_t len, int hashver, uint8 *out)
+{
+    if (hashver == SKETCH_HASH_MURMUR3)
+        murmurhash3_x64_128(datp, len, 0, out);
+    else if (hashver == SKETCH_HASH_MD5) {
+        /*
+         * according to postgres' libpq/md5.c, need 33 bytes to hold
+         * null-terminated md5 string.  The postgres md5 code only provides
+         * a textual representation, so we convert it back into binary.
+         */
+        char outbuf[MD5_HASHLEN*2+1];
+
+        pg_md5_hash(datp, len, outbuf);
+        hex_to_bytes(outbuf, out, MD5_HASHLEN*2);
+    }
+    else
+        elog(ERROR, "unknown sketch hash function version %d", hashver);
+}
+
+/*!
+ * Check the tag at the start of a sketch (see SKETCH_MAGIC_FM).
+ * \param start the start of the sketch's struct
+ * \param len the number of bytes from start to the end of the sketch
+ * \param magic the SKETCH_MAGIC_* word of the expected kind of sketch
+ * \param name the name of that kind, for error messages
+ * \returns false if the sketch does not have the magic word, e.g. because
+ * it was built before sketches were tagged; a sketch that has it but was
+ * built with an unknown hash function version is an error
+ */
+bool sketch_check_tag(const char *start, Size len, uint32 magic,
+                      const char *name)
+{
+    uint32 word;
+    int32  hashver;
+
+    if (len < 2*sizeof(uint32))
+        return false;
+    memcpy(&word, start, sizeof(uint32));
+    if (word != magic)
+        return false;
+    memcpy(&hashver, start + sizeof(uint32), sizeof(int32));
+    if (hashver != SKETCH_HASH_MD5 && hashver != SKETCH_HASH_MURMUR3)
+        elog(ERROR, "%s built with unknown hash function version %d",
+             name, hashver);
+    return true;
+}
+
+/*!
+ * Check the tag at the start of a sketch of a kind that was never stored
+ * before sketches were tagged, so that a blob without the tag is an error.
+ * Arguments are as for sketch_check_tag.
+ */
+void sketch_require_tag(const char *start, Size len, uint32 magic,
+                        const char *name)
+{
+    if (!sketch_check_tag(start, len, magic, name))
+        elog(ERROR,
+             "not a valid %s: it lacks the tag of one, so it may have been built by an incompatible version",
+             name);
+}
+
+/*!
+ * Check the magic word at the start of a sketch that hashes nothing, and
+ * so has no hash function version after it.
+ * Arguments are as for sketch_check_tag.
+ */
+void sketch_require_magic(const char *start, Size len, uint32 magic,
+                          const char *name)
+{
+    uint32 word = 0;    /* no magic word is 0 */
+
+    if (len >= sizeof(uint32))
+        memcpy(&word, start, sizeof(uint32));
+    if (word != magic)
+        elog(ERROR,
+             "not a valid %s: it lacks the tag of one, so it may have been built by an incompatible version",
+             name);
+}
+
+
+/*
+ * Sketch types (e.g. hll_sketch) are stored as plain byteas; these I/O
+ * functions are shared by all of them.
+ */
+PG_FUNCTION_INFO_V1(sketch_in);
+Datum sketch_in(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(sketch_out);
+Datum sketch_out(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(sketch_recv);
+Datum sketch_recv(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(sketch_send);
+Datum sketch_send(PG_FUNCTION_ARGS);
+
+/*! input function for sketch types: the bytea text format */
+Datum sketch_in(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_DATUM(DirectFunctionCall1(byteain, PG_GETARG_DATUM(0)));
+}
+
+/*! output function for sketch types: the bytea text format */
+Datum sketch_out(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_DATUM(DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0)));
+}
+
+/*! binary input function for sketch types */
+Datum sketch_recv(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_DATUM(DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0)));
+}
+
+/*! binary output function for sketch types */
+Datum sketch_send(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_DATUM(DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0)));
 }
 
 
@@ -380,6 +657,32 @@ int4 safe_log2(int64 x)
     return out;
 }
 
+/*!
+ * Type of argument argno of a function called once per row, such as a
+ * transition function, with its length and byval flag.  The argument type
+ * of a call site never changes, so the lookups are done on the first call
+ * only and kept in fn_extra, along with anything else the caller keeps in
+ * the extra field.
+ * \param fcinfo the function's call info
+ * \param argno the argument holding the sketched values
+ */
+sketch_typinfo *sketch_arg_typinfo(FunctionCallInfo fcinfo, int argno)
+{
+    sketch_typinfo *info = (sketch_typinfo *)fcinfo->flinfo->fn_extra;
+
+    if (info == NULL) {
+        info = (sketch_typinfo *)MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                                                    sizeof(sketch_typinfo));
+        info->typOid = get_fn_expr_argtype(fcinfo->flinfo, argno);
+        if (!OidIsValid(info->typOid))
+            elog(ERROR, "could not determine data type of input");
+        get_typlenbyval(info->typOid, &info->typLen, &info->typByVal);
+        info->extra = NULL;
+        fcinfo->flinfo->fn_extra = info;
+    }
+    return info;
+}
+
 size_t ExtractDatumLen(Datum x, int len, bool byVal)
 {
     if (len > 0) 
@@ -394,3 +697,21 @@ size_t ExtractDatumLen(Datum x, int len, bool byVal)
     }
 }
 
+
+/*!
+ * A sketch whose struct follows its varlena header at MAXALIGN(VARHDRSZ),
+ * copied to aligned memory if it is not aligned.  Sketch types are declared
+ * with double alignment, but a sketch cast from a stored bytea is passed in
+ * place at the bytea's int alignment.
+ * \param blob the sketch, detoasted
+ */
+bytea *sketch_aligned(bytea *blob)
+{
+    bytea *copy;
+
+    if ((char *)MAXALIGN(blob) == (char *)blob)
+        return blob;
+    copy = (bytea *)palloc(VARSIZE(blob));
+    memcpy(copy, blob, VARSIZE(blob));
+    return copy;
+}
@@ -9,6 +9,35 @@
 #define MD5_HASHLEN 16
 #define MD5_HASHLEN_BITS 8*MD5_HASHLEN /*! md5 hash length in bits */
 
+/*! length of the hash values used by all sketches, in bytes */
+#define SKETCH_HASHLEN 16
+#define SKETCH_HASHLEN_BITS 8*SKETCH_HASHLEN /*! sketch hash length in bits */
+
+/*!
+ * Hash function versions.  Every sketch transval records the version of
+ * the hash function it was built with, so that sketches built with
+ * different hash functions are never combined, and estimators re-hash
+ * lookup values the same way the sketch was built.
+ */
+#define SKETCH_HASH_MD5      1 /*! pg_md5_hash, via its hex text output */
+#define SKETCH_HASH_MURMUR3  2 /*! MurmurHash3_x64_128 */
+#define SKETCH_HASH_CURRENT  SKETCH_HASH_MURMUR3 /*! used for new sketches */
+
+/*!
+ * Sketches that hash their values start with a tag: a magic word naming
+ * their kind, followed by the SKETCH_HASH_* version they were built with.
+ * A blob without the magic word of its kind was either built before
+ * sketches were tagged, or is not a sketch of that kind at all.  Stored
+ * sketches that hash nothing (kll_sketch) start with the magic word alone.
+ */
+#define SKETCH_MAGIC_FM      0x4D534B01 /*! fm_sketch */
+#define SKETCH_MAGIC_CM      0x4D534B02 /*! cm_sketch */
+#define SKETCH_MAGIC_MFV     0x4D534B03 /*! mfv_sketch */
+#define SKETCH_MAGIC_HLL     0x4D534B04 /*! hll_sketch */
+#define SKETCH_MAGIC_THETA   0x4D534B05 /*! theta_sketch */
+#define SKETCH_MAGIC_BLOOM   0x4D534B06 /*! bloom_filter */
+#define SKETCH_MAGIC_KLL     0x4D534B07 /*! kll_sketch */
+
 #ifndef MAXINT8LEN
 #define MAXINT8LEN              25 /*! number of chars to hold an int8 */
 #endif
@@ -19,8 +48,14 @@ uint32 leftmost_zero(uint8 *, size_t, size_t, size_t);
 uint32 ui_rightmost_one(uint32 v);
 void   hex_to_bytes(char *hex, uint8 *bytes, size_t);
 void bit_print(uint8 *c, int numbytes);
-Datum md5_cstring(char *);
-bytea *sketch_md5_bytea(Datum, Oid);
+void   sketch_hash_datum(Datum, Oid, int, uint8 *);
+void   sketch_hash_value(Datum, int16, bool, int, uint8 *);
+void   sketch_hash_contents(Datum, int16, bool, int, uint8 *);
+void   sketch_hash_bytes(const void *, size_t, int, uint8 *);
+void   murmurhash3_x64_128(const void *, size_t, uint32, uint8 *);
+bool   sketch_check_tag(const char *, Size, uint32, const char *);
+void   sketch_require_tag(const char *, Size, uint32, const char *);
+void   sketch_require_magic(const char *, Size, uint32, const char *);
 int4   safe_log2(int64);
 
 /*! macro to convert a pointer into a marshalled array of Datums into a Datum */
@@ -29,4 +64,21 @@ int4   safe_log2(int64);
 #define DatumExtractPointer(x, byVal)  (byVal ? (void *)&x : DatumGetPointer(x))
 
 size_t ExtractDatumLen(Datum x, int len, bool byVal);
+
+/*!
+ * type information about the sketched argument of a transition function,
+ * looked up on the first call and cached in fn_extra
+ */
+typedef struct {
+    Oid   typOid;
+    int16 typLen;
+    bool  typByVal;
+    void *extra;    /*! anything else the function caches, NULL at first */
+} sketch_typinfo;
+
+sketch_typinfo *sketch_arg_typinfo(FunctionCallInfo, int);
+
+bytea *sketch_aligned(bytea *);
+/*! a sketch argument whose struct is aligned after its varlena header */
+#define PG_GETARG_SKETCH_P(n) sketch_aligned(PG_GETARG_BYTEA_P(n))
 #endif /* SKETCH_SUPPORT_H */
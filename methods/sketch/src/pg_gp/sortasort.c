@@ -6,24 +6,25 @@
 
 /*!
  * A "sortasort" is a pre-marshalled *set* (no dups) of values intended for
- * append and query operations only (no deletion).  It's not a
- * particularly smart data structure.  Cuckoo hashing would be a
- * fancier solution.
+ * append and query operations only (no deletion).  Despite its name it is
+ * now an open-addressing hash set; see sortasort.h.
  */
 
 /*
  * It is structured as a header, followed by a fixed-length "directory"
  * (an array of offsets) that point to the actual Datums
- * concatenated in a variable-length array at the end of the directory.
- * The initial directory entries are sorted in ascending order of the Datums
- * they point to, but the last < SORTA_SLOP entries are left unsorted to facilitate
- * efficient insertion.  Binary Search is used on all but those last entries,
- * which must be scanned. At every k*SORTA_SLOP'th insert, the full directory is
- * sorted.
+ * concatenated in a variable-length array at the end of the structure.
+ * The directory is in insertion order, so callers can walk the values with
+ * SORTASORT_GETVAL.  Between the directory and the Datums is a table of
+ * 2*capacity hash slots, probed linearly, that map a Datum's hash to its
+ * directory position.  With the table at most half full, finding or
+ * inserting a value takes a small constant number of probes, and filling
+ * the sortasort is linear in the number of values.
  */
 #include <ctype.h>
 #include "postgres.h"
 #include "fmgr.h"
+#include "access/hash.h"
 #include "sortasort.h"
 #include "sketch_support.h"
 
@@ -46,11 +47,11 @@ sortasort_init(sortasort *s,
     s->capacity = capacity;
 
     /* storage_sz is the number of bytes available for Datums at the end. */
-    s->storage_sz = s_sz - sizeof(sortasort) - capacity*sizeof(s->dir[0]);
-    if (s_sz - sizeof(sortasort) <= capacity*sizeof(s->dir[0]))
+    if (s_sz - sizeof(sortasort) <= SORTASORT_DIR_SZ(capacity))
         elog(
             ERROR,
             "sortasort initialized too small to hold its own directory");
+    s->storage_sz = s_sz - sizeof(sortasort) - SORTASORT_DIR_SZ(capacity);
 
     s->typLen = typLen;
     s->typByVal = typByVal;
@@ -61,33 +62,37 @@ sortasort_init(sortasort *s,
 
     /* offset after the directory to do the next insertion */
     s->storage_cur = 0;
+
+    /* all hash slots start out empty */
+    memset(SORTASORT_SLOTS(s), 0,
+           SORTASORT_NSLOTS(capacity)*sizeof(s->dir[0]));
     return(s);
 }
 
-/*! comparison function for qsort_arg */
-int sorta_cmp(const void *i, const void *j, void *thunk)
+/*!
+ * probe the hash slots of s for a value
+ * \param s a sortasort
+ * \param datp pointer to the bytes of the value
+ * \param len number of bytes of the value
+ * \param slot set to the slot holding the value, or to the empty slot
+ *        where it belongs
+ * \return position in directory where item found, or -1 if not found.
+ */
+static int sortasort_probe(sortasort *s, void *datp, size_t len, size_t *slot)
 {
-    /* the "thunk" in this case is the sortasort being sorted */
-    sortasort *s = (sortasort *)thunk;
-    int        first = *(int *)i;
-    int        second = *(int *)j;
-    char      *dat1 = SORTASORT_DATA(s) + first;
-    char      *dat2 = SORTASORT_DATA(s) + second;
-    int        len = s->typLen;
-    int        shorter;
-    
-    /*
-     * we always use typByVal = true, since we've marshalled the data into place
-     */
-    if (len < 0) {
-        len = (int)ExtractDatumLen(PointerGetDatum(dat1), len, s->typByVal);
-        if ((shorter = (len - ExtractDatumLen(PointerGetDatum(dat2), len, s->typByVal))))
-            /* order by length */
-            return shorter;
-        /* else drop through */
+    unsigned *slots = SORTASORT_SLOTS(s);
+    size_t    nslots = SORTASORT_NSLOTS(s->capacity);
+    size_t    i = DatumGetUInt32(hash_any((unsigned char *)datp, (int)len)) % nslots;
+
+    /* the table is at most half full, so this always reaches an empty slot */
+    while (slots[i] != 0) {
+        if (!memcmp(SORTASORT_GETVAL(s, slots[i] - 1), datp, len))
+            break;
+        if (++i == nslots)
+            i = 0;
     }
-    /* byte ordering */
-    return memcmp(dat1, dat2, len);
+    *slot = i;
+    return (int)slots[i] - 1;
 }
 
 
@@ -100,24 +105,19 @@ int sorta_cmp(const void *i, const void *j, void *thunk)
  */
 int sortasort_try_insert(sortasort *s_in, Datum dat, int len)
 {
-    /* sanity check */
-    void *datp = DatumExtractPointer(dat, s_in->typByVal);
-    
+    void  *datp = DatumExtractPointer(dat, s_in->typByVal);
+    size_t slot;
+    int    found;
+
+    len = ExtractDatumLen(dat, len, s_in->typByVal);
+
     /* first check to see if the element is already there */
-    int found = sortasort_find(s_in, dat);
-    if (found >= 0 && found < (int)s_in->num_vals) {
+    found = sortasort_probe(s_in, datp, len, &slot);
+    if (found >= 0) {
         /* found!  just return TRUE */
         return TRUE;
     }
 
-    len = ExtractDatumLen(dat, len, s_in->typByVal);    
-    
-    /* sanity check */
-    if (found < -1 || found >= (int) s_in->num_vals)
-        elog(ERROR,
-             "invalid offset %d returned by sortasort_find",
-             found);
-
     /* we need to insert v.  return FALSE if not enough space. */
     if (s_in->storage_cur + len >= s_in->storage_sz) {
         /* caller will have to allocate a bigger one and try again */
@@ -130,32 +130,22 @@ int sortasort_try_insert(sortasort *s_in, Datum dat, int len)
 
     /*
      * copy dat to the current storage offset, put a pointer into dir,
-     * update num_vals and storage_cur
+     * point the empty hash slot at it, update num_vals and storage_cur
      */
     memcpy(SORTASORT_DATA(s_in) + s_in->storage_cur, 
            datp, 
            len);
     s_in->dir[s_in->num_vals++] = s_in->storage_cur;
+    SORTASORT_SLOTS(s_in)[slot] = s_in->num_vals;
     s_in->storage_cur += len;
     if (s_in->storage_cur > s_in->storage_sz)
         elog(ERROR, "went off the end of sortasort storage");
 
-    /* re-sort every SORTA_SLOP vals */
-    if (s_in->num_vals % SORTA_SLOP == 0)
-        qsort_arg(s_in->dir,
-                  s_in->num_vals,
-                  sizeof(s_in->dir[0]),
-                  sorta_cmp,
-                  (void *)s_in);
-
     return TRUE;
 }
 
 /*!
- * find items in a sortasort.  this involves binary search in the sorted prefix,
- * and linear search in the <SORTA_SLOP-sized suffix.
- * We assume that the sorted prefix is the
- * highest multiple of SORTA_SLOP less than s->num_vals
+ * find items in a sortasort by probing its hash slots.
  *
  * \param s a sortasort
  * \param v a value to find
@@ -165,48 +155,10 @@ int sortasort_try_insert(sortasort *s_in, Datum dat, int len)
  */
 int sortasort_find(sortasort *s, Datum dat)
 {
-    int    theguess, diff;
-    int    hi = (s->num_vals/SORTA_SLOP)*SORTA_SLOP;
-    int    themin = 0, themax = hi - 1;
-    size_t i;
-    int    addend, subtrahend;
-    size_t len = ExtractDatumLen(dat, s->typLen, s->typByVal);
-
-    /* binary search on the front of the sortasort */
-    if (themax >= (int)s->num_vals) {
-        elog(ERROR,
-             "sortasort failure: max = %d, num_vals = %zu",
-             themax,
-             s->num_vals);
-    }
-    theguess = hi / 2;
-    while (themin < themax ) {
-        if (!(diff = memcmp(SORTASORT_GETVAL(s,theguess), 
-                            DatumExtractPointer(dat, s->typByVal), 
-                            len)))
-            return theguess;
-        if (themin == themax - 1) break;
-        else if (diff < 0) {
-            /* undershot */
-            addend = (themax - theguess) / 2;
-            if (!addend) addend = 1;
-            themin = theguess;
-            theguess += addend;
-        }
-        else {
-            /* overshot */
-            subtrahend = (theguess - themin) / 2;
-            if (!subtrahend) subtrahend = 1;
-            themax = theguess;
-            theguess -= subtrahend;
-        }
-    }
+    size_t slot;
 
-    /* if we got here, continue with a naive linear search on the tail */
-    for (i = hi; i < s->num_vals; i++)
-        if (!memcmp(SORTASORT_GETVAL(s, i), 
-                    DatumExtractPointer(dat, s->typByVal), 
-                    len))
-            return i;
-    return -1;
+    return sortasort_probe(s,
+                           DatumExtractPointer(dat, s->typByVal),
+                           ExtractDatumLen(dat, s->typLen, s->typByVal),
+                           &slot);
 }
@@ -3,22 +3,22 @@
  *
  * \brief header file for the sortasort directory data structure
  */
-#define SORTA_SLOP 100
 
 /*!
  * \internal
  * \brief a pre-marshalled directory data structure to hold strings
  *
- * A sortasort is a smallish array of strings, intended for append-only
+ * A sortasort is a smallish set of strings, intended for append-only
  * modification, and network transmission as a single byte-string.  It is
  * structured as a header followed by an array of offsets (directory) that
  * point to the actual null-terminated strings stored in the "vals" array
  * at the end of the structure.
  *
- * The directory is mostly sorted in ascending order of the vals it points
- * to, but the last < SORTA_SLOP entries are left unsorted.  Binary Search
- * is used on all but those last entries, which must be scanned. At every
- * k*SORTA_SLOP'th insert, the full directory is sorted.
+ * The directory lists the vals in insertion order.  Between the directory
+ * and the vals sits an open-addressing hash table of 2*capacity slots,
+ * each holding a directory position plus one (0 marks an empty slot),
+ * so lookups and inserts take expected constant time.  The name is
+ * historical: the directory used to be kept mostly sorted.
  * \endinternal
  */
 typedef struct {
@@ -31,11 +31,19 @@ typedef struct {
     unsigned dir[0];       /*! storage of the strings */
 } sortasort;
 
-#define SORTASORT_DATA(s)  (((char *)(s->dir)) + \
-    (s->capacity * (sizeof (s->dir[0]))))
+/*! number of hash slots for a directory of the given capacity */
+#define SORTASORT_NSLOTS(capacity) (2*(capacity))
+/*! bytes taken by the directory and hash slots of a given capacity */
+#define SORTASORT_DIR_SZ(capacity) \
+    (((capacity) + SORTASORT_NSLOTS(capacity)) * sizeof(unsigned))
+/*! total bytes of a sortasort with the given capacity and string storage */
+#define SORTASORT_SZ(capacity, storage_sz) \
+    (sizeof(sortasort) + SORTASORT_DIR_SZ(capacity) + (storage_sz))
+
+#define SORTASORT_SLOTS(s) ((s)->dir + (s)->capacity)
+#define SORTASORT_DATA(s)  (((char *)(s->dir)) + SORTASORT_DIR_SZ(s->capacity))
 #define SORTASORT_GETVAL(s, i) (SORTASORT_DATA(s) + s->dir[i])
 
 int sortasort_try_insert(sortasort *, Datum, int);
 sortasort *sortasort_init(sortasort *, size_t, size_t, int, bool);
 int sortasort_find(sortasort *, Datum);
-int sorta_cmp(const void *i, const void *j, void *thunk);
@@ -0,0 +1,722 @@
+/*!
+ * \file spacesaving.c
+ *
+ * \brief Space-Saving summaries for heavy hitters
+ */
+/*!
+ * \implementation
+ * A Space-Saving summary monitors at most k values, each with a count and
+ * the maximum amount by which that count overestimates the true frequency.
+ * A monitored value has its count incremented.  An unmonitored value takes
+ * over the counter of the least frequent monitored value: it inherits that
+ * count, plus one, as its count, and the old count as its error.  Every
+ * count is therefore an upper bound, within N/k of the true frequency after
+ * N rows, and every value occurring more than N/k times is monitored.
+ *
+ * The counters are kept in a "stream summary": buckets of equal counts in a
+ * doubly-linked list ordered by count, each with a list of its items.  An
+ * increment moves an item into the next bucket, so both updates and finding
+ * the least frequent value take constant time.  Monitored values are found
+ * through an open-addressing hash table keyed on the sketch hash of the
+ * value.  Like MFV sketches, values are compared by their binary
+ * representation.
+ *
+ * Two summaries are merged as in [2]: a value missing from one summary is
+ * counted there as that summary's minimum count (or zero if the summary
+ * is not full), which keeps the counts upper bounds, and the k values with
+ * the largest combined counts are kept.  The merged error stays within N/k
+ * of the true frequencies.
+ *
+ * \literature
+ * [1] A. Metwally, D. Agrawal and A. El Abbadi.  Efficient Computation of
+ *     Frequent and Top-k Elements in Data Streams.  ICDT 2005.
+ * [2] P. Agarwal, G. Cormode, Z. Huang, J. Phillips, Z. Wei and K. Yi.
+ *     Mergeable Summaries.  PODS 2012.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/elog.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "catalog/pg_type.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+
+#define SS_NONE           0xFFFFFFFFU /*! end of an item or bucket list */
+#define SS_VALUE_GUESS    16 /*! initial bytes per variable-length value */
+
+/*!
+ * \internal
+ * \brief a monitored value.  Its count is the count of its bucket.
+ * \endinternal
+ */
+typedef struct {
+    uint32 offset;  /*! memory offset of the value from the top of the transval */
+    uint32 len;     /*! length of the value in bytes */
+    uint32 tag;     /*! 32 bits of the hash of the value */
+    uint32 bucket;  /*! the bucket holding this item */
+    uint32 prev;    /*! previous item in the bucket */
+    uint32 next;    /*! next item in the bucket */
+    int64  error;   /*! maximum overestimate of the count */
+} ssitem;
+
+/*!
+ * \internal
+ * \brief a group of items with equal counts
+ * \endinternal
+ */
+typedef struct {
+    int64  count;   /*! count of all the items in the bucket */
+    uint32 first;   /*! first item in the bucket */
+    uint32 prev;    /*! bucket with the next smaller count */
+    uint32 next;    /*! bucket with the next larger count; links free buckets */
+} ssbucket;
+
+/*!
+ * \internal
+ * \brief transition value struct for Space-Saving summaries.
+ *
+ * It is followed by an array of capacity items, an array of capacity
+ * buckets, the hash table of nslots entries (an item index plus one, 0 for
+ * empty), and then the values themselves, at the offsets recorded in the
+ * items.  Values that are replaced leave garbage behind, which is squeezed
+ * out whenever the value space runs out.
+ * \endinternal
+ */
+typedef struct {
+    uint32 capacity;    /*! maximum number of monitored values, k */
+    uint32 nitems;      /*! number of monitored values */
+    uint32 nslots;      /*! size of the hash table, a power of two */
+    uint32 minbucket;   /*! the bucket with the smallest count */
+    uint32 freebucket;  /*! list of unused buckets */
+    uint32 next_offset; /*! next memory offset to store a value at */
+    Oid    typOid;      /*! Oid of the data type of the values */
+    int32  hashver;     /*! SKETCH_HASH_* version used to hash the values */
+    int16  typLen;      /*! length of the data type */
+    bool   typByVal;    /*! whether the type is passed by value */
+} sstransval;
+
+/*!
+ * offsets from the top of a transval are aligned so that the arrays, and
+ * values read in place by the type's output function, are aligned in memory;
+ * the transval itself starts after the varlena header
+ */
+#define SS_ALIGN(offset) (MAXALIGN(VARHDRSZ + (offset)) - VARHDRSZ)
+#define SS_ITEMS(t)   ((ssitem *)((char *)(t) + SS_ALIGN(sizeof(sstransval))))
+#define SS_BUCKETS(t) ((ssbucket *)(SS_ITEMS(t) + (t)->capacity))
+#define SS_SLOTS(t)   ((uint32 *)(SS_BUCKETS(t) + (t)->capacity))
+/*! offset of the values from the top of a transval */
+#define SS_VALUES_OFFSET(capacity, nslots) \
+    (SS_ALIGN(sizeof(sstransval)) + (capacity)*(sizeof(ssitem) + sizeof(ssbucket)) \
+     + (nslots)*sizeof(uint32))
+/*! free space remaining for values */
+#define SS_FREE_SPACE(blob) \
+    (VARSIZE(blob) - VARHDRSZ - ((sstransval *)VARDATA(blob))->next_offset)
+/*! the count of item i */
+#define SS_COUNT(t, i) (SS_BUCKETS(t)[SS_ITEMS(t)[i].bucket].count)
+
+/*!
+ * \internal
+ * \brief a value offered to a merged summary
+ * \endinternal
+ */
+typedef struct {
+    char  *valp;
+    uint32 len;
+    uint32 tag;
+    int64  count;
+    int64  error;
+} sscandidate;
+
+Datum __heavy_hitters_trans(PG_FUNCTION_ARGS);
+Datum __heavy_hitters_merge(PG_FUNCTION_ARGS);
+Datum __heavy_hitters_final(PG_FUNCTION_ARGS);
+bytea *ss_new(int, Oid, int, Size);
+bytea *ss_make_room(bytea *, Size);
+bytea *ss_set_value(bytea *, uint32, const void *, uint32, uint32);
+bytea *ss_add_item(bytea *, const void *, uint32, uint32, int64, int64);
+bytea *ss_insert(bytea *, const void *, uint32, uint32);
+uint32 ss_find(sstransval *, const void *, uint32, uint32);
+void   ss_increment(sstransval *, uint32);
+bytea *ss_merge_c(bytea *, bytea *);
+int    ss_candidate_cmp(const void *, const void *);
+
+/*! add item i to the hash table */
+static void ss_index_insert(sstransval *t, uint32 i)
+{
+    uint32 *slots = SS_SLOTS(t);
+    uint32  mask = t->nslots - 1;
+    uint32  s;
+
+    for (s = SS_ITEMS(t)[i].tag & mask; slots[s] != 0; s = (s + 1) & mask)
+        ;
+    slots[s] = i + 1;
+}
+
+/*!
+ * remove item i from the hash table, shifting the rest of its probe run
+ * back into the gap
+ */
+static void ss_index_delete(sstransval *t, uint32 i)
+{
+    uint32 *slots = SS_SLOTS(t);
+    uint32  mask = t->nslots - 1;
+    uint32  s, u, home;
+
+    for (s = SS_ITEMS(t)[i].tag & mask; slots[s] != i + 1; s = (s + 1) & mask)
+        if (slots[s] == 0)
+            elog(ERROR, "value %u missing from heavy hitters index", i);
+
+    for (u = s;;) {
+        slots[s] = 0;
+        for (;;) {
+            u = (u + 1) & mask;
+            if (slots[u] == 0)
+                return;
+            home = SS_ITEMS(t)[slots[u] - 1].tag & mask;
+            /* entries whose home lies cyclically in (s, u] stay put */
+            if (s <= u ? (s < home && home <= u) : (s < home || home <= u))
+                continue;
+            break;
+        }
+        slots[s] = slots[u];
+        s = u;
+    }
+}
+
+/*! take a bucket off the free list and link it between prev and next */
+static uint32 ss_bucket_new(sstransval *t, int64 count, uint32 prev, uint32 next)
+{
+    ssbucket *buckets = SS_BUCKETS(t);
+    uint32    b = t->freebucket;
+
+    if (b == SS_NONE)
+        elog(ERROR, "heavy hitters summary has no free buckets");
+    t->freebucket = buckets[b].next;
+    buckets[b].count = count;
+    buckets[b].first = SS_NONE;
+    buckets[b].prev = prev;
+    buckets[b].next = next;
+    if (prev == SS_NONE)
+        t->minbucket = b;
+    else
+        buckets[prev].next = b;
+    if (next != SS_NONE)
+        buckets[next].prev = b;
+    return b;
+}
+
+/*! unlink an empty bucket and return it to the free list */
+static void ss_bucket_free(sstransval *t, uint32 b)
+{
+    ssbucket *buckets = SS_BUCKETS(t);
+
+    if (buckets[b].prev == SS_NONE)
+        t->minbucket = buckets[b].next;
+    else
+        buckets[buckets[b].prev].next = buckets[b].next;
+    if (buckets[b].next != SS_NONE)
+        buckets[buckets[b].next].prev = buckets[b].prev;
+    buckets[b].next = t->freebucket;
+    t->freebucket = b;
+}
+
+/*! make item i the first item of bucket b */
+static void ss_attach(sstransval *t, uint32 i, uint32 b)
+{
+    ssitem   *items = SS_ITEMS(t);
+    ssbucket *buckets = SS_BUCKETS(t);
+
+    items[i].bucket = b;
+    items[i].prev = SS_NONE;
+    items[i].next = buckets[b].first;
+    if (buckets[b].first != SS_NONE)
+        items[buckets[b].first].prev = i;
+    buckets[b].first = i;
+}
+
+/*! unlink item i from its bucket */
+static void ss_detach(sstransval *t, uint32 i)
+{
+    ssitem   *items = SS_ITEMS(t);
+    ssbucket *buckets = SS_BUCKETS(t);
+
+    if (items[i].prev == SS_NONE)
+        buckets[items[i].bucket].first = items[i].next;
+    else
+        items[items[i].prev].next = items[i].next;
+    if (items[i].next != SS_NONE)
+        items[items[i].next].prev = items[i].prev;
+}
+
+/*!
+ * Allocate an empty Space-Saving summary
+ * \param capacity the number of values to monitor
+ * \param typOid the type of the values
+ * \param hashver the SKETCH_HASH_* version to hash values with
+ * \param valuebytes initial space for the values
+ */
+bytea *ss_new(int capacity, Oid typOid, int hashver, Size valuebytes)
+{
+    uint32      nslots;
+    Size        size;
+    bytea      *blob;
+    sstransval *t;
+    ssbucket   *buckets;
+    int         i;
+
+    if (capacity < 1)
+        elog(ERROR, "heavy_hitters needs a positive number of counters, was %d",
+             capacity);
+    if (VARHDRSZ + (float8)SS_VALUES_OFFSET((float8)capacity, 2.0*capacity)
+        + valuebytes > MaxAllocSize)
+        elog(ERROR, "heavy_hitters summary of %d counters is too large",
+             capacity);
+
+    nslots = (uint32)2 << safe_log2(2*(int64)capacity - 1);
+    size = VARHDRSZ + SS_ALIGN(SS_VALUES_OFFSET(capacity, nslots)) + valuebytes;
+    blob = (bytea *)palloc0(size);
+    SET_VARSIZE(blob, size);
+    t = (sstransval *)VARDATA(blob);
+    t->capacity = capacity;
+    t->nitems = 0;
+    t->nslots = nslots;
+    t->minbucket = SS_NONE;
+    t->next_offset = SS_ALIGN(SS_VALUES_OFFSET(capacity, nslots));
+    t->typOid = typOid;
+    t->hashver = hashver;
+    t->typLen = get_typlen(typOid);
+    t->typByVal = get_typbyval(typOid);
+
+    /* all buckets start out free */
+    buckets = SS_BUCKETS(t);
+    for (i = 0; i < capacity; i++)
+        buckets[i].next = (i + 1 < capacity) ? (uint32)i + 1 : SS_NONE;
+    t->freebucket = 0;
+
+    return blob;
+}
+
+/*!
+ * make sure the summary has room for a value of <c>need</c> bytes.  If not,
+ * copy it to a new blob with the garbage squeezed out and the space for
+ * live values doubled.
+ * \param blob a bytea holding an sstransval
+ * \param need the number of bytes needed
+ */
+bytea *ss_make_room(bytea *blob, Size need)
+{
+    sstransval *t = (sstransval *)VARDATA(blob);
+    Size        base = SS_VALUES_OFFSET(t->capacity, t->nslots);
+    Size        live = 0;
+    Size        size;
+    bytea      *newblob;
+    sstransval *newt;
+    uint32      i;
+
+    if (SS_FREE_SPACE(blob) >= need)
+        return blob;
+
+    for (i = 0; i < t->nitems; i++)
+        live += MAXALIGN(SS_ITEMS(t)[i].len);
+    need = MAXALIGN(need);
+    size = VARHDRSZ + SS_ALIGN(base) + 2*(live + need);
+    if (size > MaxAllocSize)
+        elog(ERROR, "heavy_hitters summary of %u counters is too large",
+             t->capacity);
+
+    newblob = (bytea *)palloc(size);
+    memcpy(newblob, blob, VARHDRSZ + base);
+    SET_VARSIZE(newblob, size);
+    newt = (sstransval *)VARDATA(newblob);
+    newt->next_offset = SS_ALIGN(base);
+    for (i = 0; i < t->nitems; i++) {
+        ssitem *item = &SS_ITEMS(newt)[i];
+
+        memcpy((char *)newt + newt->next_offset, (char *)t + item->offset,
+               item->len);
+        item->offset = newt->next_offset;
+        newt->next_offset += MAXALIGN(item->len);
+    }
+    return newblob;
+}
+
+/*!
+ * store the value of item i, which must not be in the hash table, and add
+ * it to the hash table
+ * \param blob a bytea holding an sstransval
+ * \param i the item
+ * \param valp pointer to the bytes of the value
+ * \param len length of the value
+ * \param tag hash tag of the value
+ */
+bytea *ss_set_value(bytea *blob, uint32 i, const void *valp, uint32 len,
+                    uint32 tag)
+{
+    sstransval *t = (sstransval *)VARDATA(blob);
+    ssitem     *item = &SS_ITEMS(t)[i];
+
+    /* overwrite in place if the new value fits, else append */
+    if (i >= t->nitems || len > item->len) {
+        blob = ss_make_room(blob, len);
+        t = (sstransval *)VARDATA(blob);
+        item = &SS_ITEMS(t)[i];
+        item->offset = t->next_offset;
+        t->next_offset += MAXALIGN(len);
+    }
+    memcpy((char *)t + item->offset, valp, len);
+    item->len = len;
+    item->tag = tag;
+    ss_index_insert(t, i);
+    return blob;
+}
+
+/*!
+ * look for a monitored value
+ * \param t an sstransval
+ * \param valp pointer to the bytes of the value
+ * \param len length of the value
+ * \param tag hash tag of the value
+ * \returns the item monitoring the value, or SS_NONE
+ */
+uint32 ss_find(sstransval *t, const void *valp, uint32 len, uint32 tag)
+{
+    uint32 *slots = SS_SLOTS(t);
+    uint32  mask = t->nslots - 1;
+    uint32  s;
+
+    for (s = tag & mask; slots[s] != 0; s = (s + 1) & mask) {
+        ssitem *item = &SS_ITEMS(t)[slots[s] - 1];
+
+        if (item->tag == tag && item->len == len
+            && !memcmp((char *)t + item->offset, valp, len))
+            return slots[s] - 1;
+    }
+    return SS_NONE;
+}
+
+/*!
+ * add one to the count of item i, moving it to the next bucket
+ * \param t an sstransval
+ * \param i the item
+ */
+void ss_increment(sstransval *t, uint32 i)
+{
+    ssbucket *buckets = SS_BUCKETS(t);
+    uint32    b = SS_ITEMS(t)[i].bucket;
+    uint32    prev = b;
+    uint32    next = buckets[b].next;
+    int64     count = buckets[b].count + 1;
+
+    ss_detach(t, i);
+    if (buckets[b].first == SS_NONE) {
+        /* free b first, so that we never need more buckets than items */
+        prev = buckets[b].prev;
+        ss_bucket_free(t, b);
+    }
+    if (next != SS_NONE && buckets[next].count == count)
+        ss_attach(t, i, next);
+    else
+        ss_attach(t, i, ss_bucket_new(t, count, prev, next));
+}
+
+/*!
+ * start monitoring a new value, with a count no bigger than that of any
+ * monitored value
+ * \param blob a bytea holding an sstransval that is not full
+ * \param valp pointer to the bytes of the value
+ * \param len length of the value
+ * \param tag hash tag of the value
+ * \param count count of the value
+ * \param error maximum overestimate of the count
+ */
+bytea *ss_add_item(bytea *blob, const void *valp, uint32 len, uint32 tag,
+                   int64 count, int64 error)
+{
+    sstransval *t = (sstransval *)VARDATA(blob);
+    uint32      i = t->nitems;
+    uint32      min;
+
+    blob = ss_set_value(blob, i, valp, len, tag);
+    t = (sstransval *)VARDATA(blob);
+    t->nitems++;
+    SS_ITEMS(t)[i].error = error;
+
+    min = t->minbucket;
+    if (min != SS_NONE && SS_BUCKETS(t)[min].count < count)
+        elog(ERROR, "heavy hitters values added out of order");
+    if (min != SS_NONE && SS_BUCKETS(t)[min].count == count)
+        ss_attach(t, i, min);
+    else
+        ss_attach(t, i, ss_bucket_new(t, count, SS_NONE, min));
+    return blob;
+}
+
+/*!
+ * count one occurrence of a value
+ * \param blob a bytea holding an sstransval
+ * \param valp pointer to the bytes of the value
+ * \param len length of the value
+ * \param tag hash tag of the value
+ */
+bytea *ss_insert(bytea *blob, const void *valp, uint32 len, uint32 tag)
+{
+    sstransval *t = (sstransval *)VARDATA(blob);
+    uint32      i = ss_find(t, valp, len, tag);
+
+    if (i != SS_NONE)
+        ss_increment(t, i);
+    else if (t->nitems < t->capacity)
+        blob = ss_add_item(blob, valp, len, tag, 1, 0);
+    else {
+        /* take over the counter of a least frequent value */
+        i = SS_BUCKETS(t)[t->minbucket].first;
+        SS_ITEMS(t)[i].error = SS_BUCKETS(t)[t->minbucket].count;
+        ss_index_delete(t, i);
+        blob = ss_set_value(blob, i, valp, len, tag);
+        ss_increment((sstransval *)VARDATA(blob), i);
+    }
+    return blob;
+}
+
+PG_FUNCTION_INFO_V1(__heavy_hitters_trans);
+
+/*!
+ * UDA transition function for heavy_hitters: the third argument is the
+ * number of counters
+ */
+Datum __heavy_hitters_trans(PG_FUNCTION_ARGS)
+{
+    bytea      *transblob = PG_GETARG_BYTEA_P(0);
+    sstransval *transval;
+    Datum       dat;
+    uint8       hash[SKETCH_HASHLEN];
+    uint32      tag;
+    Size        len;
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* ignore NULL inputs */
+    if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
+    /* initialize if this is the first call */
+    if (VARSIZE(transblob) <= VARHDRSZ) {
+        Oid element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+        int k;
+        int typlen;
+
+        if (!OidIsValid(element_type))
+            elog(ERROR, "could not determine data type of input");
+        k = PG_GETARG_INT32(2);
+        typlen = get_typlen(element_type);
+        transblob = ss_new(k, element_type, SKETCH_HASH_CURRENT,
+                           (Size)Max(k, 0)*MAXALIGN(typlen > 0 ? typlen : SS_VALUE_GUESS));
+    }
+    transval = (sstransval *)VARDATA(transblob);
+
+    /* compare and hash varlena values in their plain, uncompressed form */
+    dat = PG_GETARG_DATUM(1);
+    if (transval->typLen == -1)
+        dat = PointerGetDatum(PG_DETOAST_DATUM(dat));
+    len = ExtractDatumLen(dat, transval->typLen, transval->typByVal);
+    sketch_hash_bytes(DatumExtractPointer(dat, transval->typByVal), len,
+                      transval->hashver, hash);
+    if (transval->typLen == -2)
+        len++;  /* keep the terminating NUL of a cstring */
+
+    memcpy(&tag, hash, sizeof(tag));
+    PG_RETURN_DATUM(PointerGetDatum(
+        ss_insert(transblob, DatumExtractPointer(dat, transval->typByVal),
+                  len, tag)));
+}
+
+/*!
+ * support function to sort candidates by decreasing count, then increasing
+ * error; ties are broken on the values so that the order is deterministic
+ */
+int ss_candidate_cmp(const void *a, const void *b)
+{
+    const sscandidate *x = (const sscandidate *)a;
+    const sscandidate *y = (const sscandidate *)b;
+    int                cmp;
+
+    if (x->count != y->count)
+        return (x->count < y->count) ? 1 : -1;
+    if (x->error != y->error)
+        return (x->error < y->error) ? -1 : 1;
+    if ((cmp = memcmp(x->valp, y->valp, Min(x->len, y->len))) != 0)
+        return cmp;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/*!
+ * merge two summaries into a new one, following the notes at the top of
+ * the file
+ * \param blob1 a bytea holding an sstransval
+ * \param blob2 a bytea holding another sstransval
+ */
+bytea *ss_merge_c(bytea *blob1, bytea *blob2)
+{
+    sstransval  *t1 = (sstransval *)VARDATA(blob1);
+    sstransval  *t2 = (sstransval *)VARDATA(blob2);
+    int64        min1, min2;
+    sscandidate *cands;
+    uint32       ncands = 0;
+    uint32       i, j, n;
+    Size         live = 0;
+    bytea       *result;
+
+    if (t1->typOid != t2->typOid)
+        elog(ERROR,
+             "cannot merge heavy hitters summaries over different types: %u, %u",
+             t1->typOid, t2->typOid);
+    if (t1->hashver != t2->hashver)
+        elog(ERROR,
+             "cannot merge heavy hitters summaries built with different hash functions: %d, %d",
+             t1->hashver, t2->hashver);
+    if (t1->capacity != t2->capacity)
+        elog(ERROR,
+             "cannot merge heavy hitters summaries of different sizes: %u, %u",
+             t1->capacity, t2->capacity);
+
+    /* an unmonitored value occurs at most as often as the smallest count */
+    min1 = (t1->nitems == t1->capacity) ? SS_BUCKETS(t1)[t1->minbucket].count : 0;
+    min2 = (t2->nitems == t2->capacity) ? SS_BUCKETS(t2)[t2->minbucket].count : 0;
+
+    cands = (sscandidate *)palloc((t1->nitems + t2->nitems)*sizeof(sscandidate));
+    for (i = 0; i < t1->nitems; i++) {
+        ssitem      *item = &SS_ITEMS(t1)[i];
+        sscandidate *c = &cands[ncands++];
+
+        c->valp = (char *)t1 + item->offset;
+        c->len = item->len;
+        c->tag = item->tag;
+        c->count = SS_COUNT(t1, i);
+        c->error = item->error;
+        j = ss_find(t2, c->valp, c->len, c->tag);
+        if (j == SS_NONE) {
+            c->count += min2;
+            c->error += min2;
+        }
+        else {
+            c->count += SS_COUNT(t2, j);
+            c->error += SS_ITEMS(t2)[j].error;
+        }
+    }
+    for (j = 0; j < t2->nitems; j++) {
+        ssitem      *item = &SS_ITEMS(t2)[j];
+        sscandidate *c;
+
+        if (ss_find(t1, (char *)t2 + item->offset, item->len, item->tag)
+            != SS_NONE)
+            continue;
+        c = &cands[ncands++];
+        c->valp = (char *)t2 + item->offset;
+        c->len = item->len;
+        c->tag = item->tag;
+        c->count = SS_COUNT(t2, j) + min1;
+        c->error = item->error + min1;
+    }
+
+    /* keep the largest counts, added in decreasing order */
+    qsort(cands, ncands, sizeof(sscandidate), ss_candidate_cmp);
+    n = Min(ncands, t1->capacity);
+    for (i = 0; i < n; i++)
+        live += MAXALIGN(cands[i].len);
+    result = ss_new(t1->capacity, t1->typOid, t1->hashver, live);
+    for (i = 0; i < n; i++)
+        result = ss_add_item(result, cands[i].valp, cands[i].len, cands[i].tag,
+                             cands[i].count, cands[i].error);
+    pfree(cands);
+    return result;
+}
+
+PG_FUNCTION_INFO_V1(__heavy_hitters_merge);
+
+/*!
+ * Greenplum "prefunc" to combine Space-Saving summaries from multiple machines
+ */
+Datum __heavy_hitters_merge(PG_FUNCTION_ARGS)
+{
+    bytea *transblob1 = PG_GETARG_BYTEA_P(0);
+    bytea *transblob2 = PG_GETARG_BYTEA_P(1);
+
+    /* deal with the case where one or both items is the initial value of '' */
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    PG_RETURN_DATUM(PointerGetDatum(ss_merge_c(transblob1, transblob2)));
+}
+
+PG_FUNCTION_INFO_V1(__heavy_hitters_final);
+
+/*!
+ * UDA final function for heavy_hitters: a text array of
+ * {value, count, max_overestimate} triples in decreasing order of count
+ */
+Datum __heavy_hitters_final(PG_FUNCTION_ARGS)
+{
+    bytea       *transblob = PG_GETARG_BYTEA_P(0);
+    sstransval  *transval = (sstransval *)VARDATA(transblob);
+    sscandidate *items;
+    Datum       *elems;
+    Oid          outFuncOid;
+    bool         typIsVarlena;
+    int          dims[2], lbs[2];
+    uint32       i;
+
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+
+    items = (sscandidate *)palloc(transval->nitems*sizeof(sscandidate));
+    for (i = 0; i < transval->nitems; i++) {
+        ssitem *item = &SS_ITEMS(transval)[i];
+
+        items[i].valp = (char *)transval + item->offset;
+        items[i].len = item->len;
+        items[i].count = SS_COUNT(transval, i);
+        items[i].error = item->error;
+    }
+    qsort(items, transval->nitems, sizeof(sscandidate), ss_candidate_cmp);
+
+    getTypeOutputInfo(transval->typOid, &outFuncOid, &typIsVarlena);
+    elems = (Datum *)palloc(3*transval->nitems*sizeof(Datum));
+    for (i = 0; i < transval->nitems; i++) {
+        Datum val = 0;
+        char  buf[MAXINT8LEN + 1];
+
+        if (transval->typByVal)
+            memcpy(&val, items[i].valp, items[i].len);
+        else
+            val = PointerGetDatum(items[i].valp);
+        elems[3*i] = PointerGetDatum(cstring_to_text(
+                                         OidOutputFunctionCall(outFuncOid, val)));
+        snprintf(buf, sizeof(buf), INT64_FORMAT, items[i].count);
+        elems[3*i + 1] = PointerGetDatum(cstring_to_text(buf));
+        snprintf(buf, sizeof(buf), INT64_FORMAT, items[i].error);
+        elems[3*i + 2] = PointerGetDatum(cstring_to_text(buf));
+    }
+
+    dims[0] = transval->nitems;
+    dims[1] = 3;
+    lbs[0] = lbs[1] = 0;
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, NULL, 2, dims, lbs,
+                                             TEXTOID, -1, false, 'i'));
+}
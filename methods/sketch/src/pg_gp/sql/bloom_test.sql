@@ -0,0 +1,31 @@
+set search_path to "$user",public,madlib;
+-- no false negatives, and about 1% false positives at the expected size
+create temp table bloom_keys as
+  select bloom_build(i, 10000, 0.01) as f, bloom_build(i::text, 10000, 0.01) as t
+    from generate_series(1,10000) as R(i);
+select bool_and(bloom_contains(f, i)) from bloom_keys, generate_series(1,10000) as R(i);
+select bool_and(bloom_contains(t, i::text)) from bloom_keys, generate_series(1,10000) as R(i);
+select sum(case when bloom_contains(f, i) then 1 else 0 end) between 50 and 200
+  from bloom_keys, generate_series(10001,20000) as R(i);
+select bloom_contains(f, 'x'::text) from bloom_keys;
+drop table bloom_keys;
+-- the union of filters is the filter of the union
+create temp table bloom_days as
+  select d, bloom_build(d*100 + i, 2000, 0.01) as f
+    from generate_series(1,5) as D(d), generate_series(0,999) as R(i)
+   group by d;
+select bloom_union(f)::bytea = (select bloom_build(i, 2000, 0.01)::bytea
+                                 from generate_series(100,1499) as R(i))
+  from bloom_days;
+drop table bloom_days;
+select bloom_union(f) from
+  (select bloom_build(i, 1000, 0.01) as f from generate_series(1,100) as R(i)
+   union all
+   select bloom_build(i, 1000, 0.1) from generate_series(1,100) as R(i)) s;
+-- tests for all-NULL column and bad parameters
+select bloom_build(NULL::integer, 100, 0.01) from generate_series(1,100) as R(i);
+select bloom_build(i, 0, 0.01) from generate_series(1,100) as R(i);
+select bloom_build(i, 100, 1.5) from generate_series(1,100) as R(i);
+select bloom_build(i, 10000000000, 0.01) from generate_series(1,100) as R(i);
+-- blobs without the tag of a bloom_filter are rejected
+select bloom_contains(decode(repeat('01', 64), 'hex')::bloom_filter, 1);
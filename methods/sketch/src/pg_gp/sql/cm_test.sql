@@ -13,5 +13,126 @@ select min(i),
   from generate_series(1,10000) as R(i);
 select cmsketch_depth_histogram(i, 4) from generate_series(1,10000) as R(i);
 -- tests for all-NULL column
-select cmsketch(NULL) from generate_series(1,10000) as R(i) where i < 0;
+select cmsketch(NULL::integer) from generate_series(1,10000) as R(i) where i < 0;
 select cmsketch_centile(NULL, 2) from generate_series(1,10000) as R(i) where i < 0;
+-- stored sketches: union of per-group sketches
+DROP TABLE IF EXISTS cm_groups;
+CREATE TABLE cm_groups AS
+select (i - 1) / 1000 AS g, cmsketch(i) AS s
+  from generate_series(1,10000) as R(i)
+ group by (i - 1) / 1000;
+select cmsketch_estimate_count(cmsketch_union(s), 5) from cm_groups;
+select cmsketch_estimate_rangecount(cmsketch_union(s), 1, 1025) from cm_groups;
+select cmsketch_estimate_centile(cmsketch_union(s), 75) from cm_groups;
+select cmsketch_width_histogram(cmsketch_union(s), 1, 10000, 4) from cm_groups;
+select cmsketch_estimate_depth_histogram(cmsketch_union(s), 4) from cm_groups;
+DROP TABLE cm_groups;
+-- sketches sized from epsilon and delta
+select cmsketch_estimate_count(cmsketch(i, 0.01, 0.01), 5) from generate_series(1,10000) as R(i);
+select cmsketch_estimate_rangecount(cmsketch(i, 0.1, 1e-12), 1, 1025) from generate_series(1,10000) as R(i);
+select cmsketch(i, 0, 0.1) from generate_series(1,10000) as R(i);
+select cmsketch(i, 0.000001, 0.5) from generate_series(1,10000) as R(i);
+-- update modes: on a skewed column, conservative update halves the error
+-- of the default without ever underestimating
+select cmsketch_estimate_count(cmsketch(i, 0.01, 0.01, 'countmin'), 5) from generate_series(1,10000) as R(i);
+select sum(abs(cmsketch_estimate_count(S.s, T.v) - T.n))
+  from (select cmsketch(10000 / i::int8, 0.1, 0.01, 'countmin') AS s
+          from generate_series(1,10000) AS R(i)) AS S,
+       (select 10000 / i::int8 AS v, count(*) AS n
+          from generate_series(1,10000) AS R(i) group by 1) AS T;
+select sum(abs(cmsketch_estimate_count(S.s, T.v) - T.n))
+  from (select cmsketch(10000 / i::int8, 0.1, 0.01, 'conservative') AS s
+          from generate_series(1,10000) AS R(i)) AS S,
+       (select 10000 / i::int8 AS v, count(*) AS n
+          from generate_series(1,10000) AS R(i) group by 1) AS T;
+select sum(abs(cmsketch_estimate_count(S.s, T.v) - T.n))
+  from (select cmsketch(10000 / i::int8, 0.1, 0.01, 'countsketch') AS s
+          from generate_series(1,10000) AS R(i)) AS S,
+       (select 10000 / i::int8 AS v, count(*) AS n
+          from generate_series(1,10000) AS R(i) group by 1) AS T;
+select bool_and(cmsketch_estimate_count(S.s, T.v) >= T.n)
+  from (select cmsketch(10000 / i::int8, 0.1, 0.01, 'conservative') AS s
+          from generate_series(1,10000) AS R(i)) AS S,
+       (select 10000 / i::int8 AS v, count(*) AS n
+          from generate_series(1,10000) AS R(i) group by 1) AS T;
+select cmsketch(i, 0.1, 0.01, 'bogus') from generate_series(1,10000) as R(i);
+select cmsketch_union(s)
+  from (select cmsketch(i, 0.1, 0.01, 'conservative') AS s from generate_series(1,10) AS R(i)
+        union all
+        select cmsketch(i, 0.1, 0.01, 'countmin') from generate_series(1,10) AS R(i)) AS S;
+-- sliding window frames, which subtract the rows leaving the frame when
+-- built with MOVING_AGGREGATES; the conservative mode aggregates them again
+select array_to_string(array_agg(c order by i), ',')
+  from (select i, cmsketch_count(i % 3, 0)
+                  over (order by i rows between 4 preceding and current row) AS c
+          from generate_series(1,12) AS R(i)) AS W;
+select array_to_string(array_agg(cmsketch_estimate_count(s, 0) order by i), ',')
+  from (select i, cmsketch(i % 3, 0.1, 0.01, 'countsketch')
+                  over (order by i rows between 4 preceding and current row) AS s
+          from generate_series(1,12) AS R(i)) AS W;
+select array_to_string(array_agg(cmsketch_estimate_count(s, 0) order by i), ',')
+  from (select i, cmsketch(i % 3, 0.1, 0.01, 'conservative')
+                  over (order by i rows between 4 preceding and current row) AS s
+          from generate_series(1,12) AS R(i)) AS W;
+-- sketches over other types: floats, numerics and dates keep their order,
+-- other types are hashed and only support point counts
+select cmsketch_estimate_rangecount(cmsketch((i - 5000) / 4.0::float8), -25.5::float8, 25.5::float8)
+  from generate_series(1,10000) as R(i);
+select cmsketch_estimate_centile(cmsketch((i - 5000) / 4.0::float8), 50, NULL::float8)
+  from generate_series(1,10000) as R(i);
+select cmsketch_estimate_count(cmsketch((i - 5000) / 4.0::float8), 2)
+  from generate_series(1,10000) as R(i);
+select cmsketch_estimate_centile(cmsketch((i - 5000) / 4.0), 50, NULL::numeric)
+  from generate_series(1,10000) as R(i);
+select cmsketch_estimate_rangecount(cmsketch(date '2011-01-01' + i % 365), date '2011-01-01', date '2011-01-31')
+  from generate_series(1,10000) as R(i);
+select cmsketch_estimate_centile(cmsketch(date '2011-01-01' + i % 365), 50, NULL::date)
+  from generate_series(1,10000) as R(i);
+select cmsketch_estimate_count(cmsketch((i % 10)::text), '3'::text) from generate_series(1,10000) as R(i);
+select cmsketch_estimate_rangecount(cmsketch((i % 10)::text), '3'::text, '5'::text) from generate_series(1,10000) as R(i);
+select cmsketch_estimate_centile(cmsketch((i - 5000) / 4.0::float8), 50) from generate_series(1,10000) as R(i);
+select cmsketch_union(s)
+  from (select cmsketch(i) AS s from generate_series(1,10) AS R(i)
+        union all
+        select cmsketch(i::float8) from generate_series(1,10) AS R(i)) AS S;
+-- a sketch stored by cmsketch(int8) before sketches were tagged: 64 dyadic
+-- ranges of 8 rows of 1024 int8 counters, after a 40-byte header with the
+-- type oid.  A key is counted in row r at the counter picked by bytes 2r and
+-- 2r+1 of the md5 of its 8 bytes.  It counted 0 five times, 3 twice, and
+-- 40, 41 and 42 once.  It is read as an md5 sketch, and merges with new
+-- sketches that count keys exactly, but not with ones that hash them.
+DROP TABLE IF EXISTS cm_legacy;
+CREATE TABLE cm_legacy AS
+WITH hashed AS (
+       SELECT j, n, decode(md5(decode(string_agg(lpad(to_hex(((v >> j) >> (8*b)) & 255), 2, '0'),
+                                                 '' ORDER BY b), 'hex')), 'hex') AS h
+         FROM (VALUES (0::int8, 5), (3, 2), (40, 1), (41, 1), (42, 1)) AS V(v, n),
+              generate_series(0, 63) AS J(j), generate_series(0, 7) AS B(b)
+        GROUP BY v, n, j),
+     counted AS (
+       SELECT j, r, (get_byte(h, 2*r) + 256*get_byte(h, 2*r + 1)) % 1024 AS col, sum(n) AS n
+         FROM hashed, generate_series(0, 7) AS R(r)
+        GROUP BY 1, 2, 3)
+SELECT decode(repeat('00', 24) || 'ffffffff' || '14000000' || repeat('00', 8)
+              || string_agg(lpad(to_hex(coalesce(n, 0)::int), 2, '0') || repeat('00', 7),
+                            '' ORDER BY j, r, col), 'hex') AS sketch
+  FROM generate_series(0, 63) AS J(j)
+       CROSS JOIN generate_series(0, 7) AS R(r)
+       CROSS JOIN generate_series(0, 1023) AS C(col)
+       LEFT JOIN counted USING (j, r, col);
+select cmsketch_estimate_count(sketch::cm_sketch, 0) from cm_legacy;
+select cmsketch_estimate_rangecount(sketch::cm_sketch, 0, 99) from cm_legacy;
+select cmsketch_estimate_count(cmsketch_union(s), 0)
+  from (select sketch::cm_sketch AS s from cm_legacy
+        union all
+        select cmsketch(i::int8) from generate_series(0,9) AS R(i)) AS S;
+select cmsketch_estimate_rangecount(cmsketch_union(s), 0, 99)
+  from (select sketch::cm_sketch AS s from cm_legacy
+        union all
+        select cmsketch(i::int8) from generate_series(0,9) AS R(i)) AS S;
+select cmsketch_estimate_count(cmsketch_union(s), 0)
+  from (select sketch::cm_sketch AS s from cm_legacy
+        union all
+        select cmsketch(i::int8) from generate_series(1,20000) AS R(i)) AS S;
+DROP TABLE cm_legacy;
+select cmsketch_estimate_count(E'\\001\\002\\003\\004\\005\\006\\007\\010'::bytea::cm_sketch, 0);
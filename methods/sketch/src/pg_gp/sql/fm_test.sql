@@ -37,3 +37,15 @@ select fmsketch_dcount(T.i::text)
 
 -- tests for all-NULL column
 select fmsketch_dcount(NULL::integer) from generate_series(1,10000) as R(i);
+
+-- stored sketches: union of per-group sketches, in SMALL and BIG mode
+DROP TABLE IF EXISTS fm_groups;
+CREATE TABLE fm_groups AS
+select (T.i - 1) / 2000 AS g, fmsketch(T.i) AS s
+  from generate_series(1,20000) AS T(i)
+ group by (T.i - 1) / 2000;
+select fmsketch_estimate(fmsketch_union(s)) from fm_groups where g < 3;
+select fmsketch_estimate(fmsketch_union(s)) from fm_groups;
+DROP TABLE fm_groups;
+-- blobs without the tag of an fm_sketch are rejected
+select fmsketch_estimate(E'\\001\\002\\003\\004\\005\\006\\007\\010'::bytea::fm_sketch);
@@ -0,0 +1,10 @@
+set search_path to "$user",public,madlib;
+-- one dominant value, one frequent value, and a tail of singletons
+select heavy_hitters(CASE WHEN i % 3 = 0 THEN 7 WHEN i % 5 = 0 THEN 11 ELSE i END, 3)
+  from generate_series(1,1000) as R(i);
+select heavy_hitters(CASE WHEN i % 15 = 0 THEN 'fizzbuzz' WHEN i % 3 = 0 THEN 'fizz'
+                           WHEN i % 5 = 0 THEN 'buzz' ELSE i::text END, 4)
+  from generate_series(1,100) as R(i);
+-- tests for all-NULL column
+select heavy_hitters(NULL::integer, 10) from generate_series(1,100) as R(i);
+select heavy_hitters(i, 0) from generate_series(1,100) as R(i);
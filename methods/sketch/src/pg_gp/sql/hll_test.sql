@@ -0,0 +1,49 @@
+set search_path to "$user",public,madlib;
+-- tests for "little" tables using sparse sketches
+select hllsketch_dcount(R.i)
+  from generate_series(1,100) AS R(i),
+       generate_series(1,3) AS T(i);
+select hllsketch_dcount(CAST('2010-10-10' As date) + CAST((R.i || ' days') As interval))
+  from generate_series(1,100) AS R(i),
+       generate_series(1,3) AS T(i);
+select hllsketch_dcount(R.i::float)
+  from generate_series(1,100) AS R(i),
+       generate_series(1,3) AS T(i);
+select hllsketch_dcount(R.i::text)
+  from generate_series(1,100) AS R(i),
+       generate_series(1,3) AS T(i);
+-- tests for "big" tables using dense sketches
+select hllsketch_dcount(T.i)
+  from generate_series(1,3) AS R(i),
+       generate_series(1,20000) AS T(i);
+select hllsketch_dcount(CAST('2010-10-10' As date) + CAST((T.i || ' days') As interval))
+  from generate_series(1,3) AS R(i),
+       generate_series(1,20000) AS T(i);
+select hllsketch_dcount(T.i::float)
+  from generate_series(1,3) AS R(i),
+       generate_series(1,20000) AS T(i);
+select hllsketch_dcount(T.i::text)
+  from generate_series(1,3) AS R(i),
+       generate_series(1,20000) AS T(i);
+-- explicit precision
+select hllsketch_dcount(T.i, 10)
+  from generate_series(1,20000) AS T(i);
+-- stored sketches: the union of per-group sketches matches the direct count
+DROP TABLE IF EXISTS hll_groups;
+CREATE TABLE hll_groups AS
+select (T.i - 1) / 2000 AS g, hllsketch(T.i) AS s
+  from generate_series(1,20000) AS T(i)
+ group by (T.i - 1) / 2000;
+select hllsketch_estimate(hllsketch_union(s)) from hll_groups;
+DROP TABLE hll_groups;
+-- tests for all-NULL column
+select hllsketch_dcount(NULL::integer) from generate_series(1,10000) as R(i);
+-- illegal precision
+select hllsketch_dcount(T.i, 30) from generate_series(1,10) AS T(i);
+-- blobs without the tag of an hll_sketch are rejected
+select hllsketch_estimate(E'\\001\\002\\003\\004\\005\\006\\007\\010\\011\\012\\013\\014\\015\\016\\017\\020'::bytea::hll_sketch);
+-- text values count the same read from a table as computed by an expression
+DROP TABLE IF EXISTS hll_text;
+CREATE TABLE hll_text AS select T.i::text AS t from generate_series(1,20000) AS T(i);
+select hllsketch_dcount(t) = hllsketch_dcount(t || '') from hll_text;
+DROP TABLE hll_text;
@@ -10,3 +10,71 @@ select mfvsketch_quick_histogram(i,5)
 from (select * from generate_series(1,100) union all select * from generate_series(10,15)) as T(i);
 select mfvsketch_quick_histogram(utc_offset,5) from pg_timezone_names;
 select mfvsketch_quick_histogram(NULL::bytea,5) from generate_series(1,100);
+
+-- stored sketches: union of per-group sketches
+DROP TABLE IF EXISTS mfv_groups;
+CREATE TABLE mfv_groups AS
+select R.i % 2 AS g, mfvsketch(T.k, 3) AS s
+  from generate_series(1,10) AS T(k), generate_series(1,100) AS R(i)
+ where R.i <= T.k * T.k
+ group by R.i % 2;
+select mfvsketch_estimate_histogram(mfvsketch_union(s)) from mfv_groups;
+DROP TABLE mfv_groups;
+select mfvsketch_estimate_histogram(mfvsketch(
+           case when i % 7 = 0 then 7 when i % 5 = 0 then 5 when i % 3 = 0 then 3 else i end,
+           3, 0.00001, 0.05))
+  from generate_series(1,10000) as R(i);
+
+-- union keeps the most frequent values of either input, in either order,
+-- and ignores empty inputs
+DROP TABLE IF EXISTS mfv_parts;
+CREATE TABLE mfv_parts AS
+select 1 AS part, mfvsketch(T.v, 3) AS s
+  from (values (1, 10), (2, 9), (3, 1)) AS T(v, n), generate_series(1,20) AS R(i)
+ where R.i <= T.n
+union all
+select 2, mfvsketch(T.v, 3)
+  from (values (4, 20), (5, 2), (6, 1)) AS T(v, n), generate_series(1,20) AS R(i)
+ where R.i <= T.n
+union all
+select 3, mfvsketch(i, 3) from generate_series(1,10) AS R(i) where i < 0;
+select mfvsketch_estimate_histogram(mfvsketch_union(s))
+  from (select s from mfv_parts order by part) AS P;
+select mfvsketch_estimate_histogram(mfvsketch_union(s))
+  from (select s from mfv_parts order by part desc) AS P;
+select mfvsketch_estimate_histogram(mfvsketch_union(s)) from mfv_parts where part = 3;
+DROP TABLE mfv_parts;
+-- update modes of the CountMin sketch
+select mfvsketch_top_histogram(10000 / i, 3, 0.1, 0.01, 'countmin') from generate_series(1,10000) AS R(i);
+select mfvsketch_top_histogram(10000 / i, 3, 0.1, 0.01, 'conservative') from generate_series(1,10000) AS R(i);
+select mfvsketch_top_histogram(10000 / i, 3, 0.1, 0.01, 'countsketch') from generate_series(1,10000) AS R(i);
+-- the most frequent value of a sliding window frame
+select array_to_string(array_agg(h[0][0] || ':' || h[0][1] order by i), ',')
+  from (select i, mfvsketch_top_histogram((array[1,1,1,2,2,2,2,3,3,3,3,3])[i], 2)
+                  over (order by i rows between 4 preceding and current row) AS h
+          from generate_series(1,12) AS R(i)) AS W;
+-- counts that decay by half every unit of time before the latest time
+select mfvsketch_decayed_histogram(v, 2, t, 1)
+  from (values (1, 0), (1, 1), (1, 2), (2, 2), (2, 2)) AS T(v, t);
+select mfvsketch_decayed_histogram(v, 2, t, 1)
+  from (values (1, 0), (1, 0), (1, 0), (2, 24), (2, 25)) AS T(v, t);
+select mfvsketch_estimate_histogram(mfvsketch_union(s))
+  from (select mfvsketch_decayed(v, 2, t, 1) AS s
+          from (values (1, 0), (1, 1)) AS T(v, t)
+        union all
+        select mfvsketch_decayed(v, 2, t, 1)
+          from (values (2, 3), (1, 3), (2, 3)) AS T(v, t)) AS S;
+select mfvsketch_decayed_histogram(i, 2, i, 0) from generate_series(1,10) AS R(i);
+select mfvsketch_union(s)
+  from (select mfvsketch_decayed(i, 2, i, 1) AS s from generate_series(1,3) AS R(i)
+        union all
+        select mfvsketch(i, 2) from generate_series(1,3) AS R(i)) AS S;
+-- blobs without the tag of an mfv_sketch are rejected
+select mfvsketch_estimate_histogram(E'\\001\\002\\003\\004\\005\\006\\007\\010'::bytea::mfv_sketch);
+-- a value counts as one mfv whether read from a table or computed
+CREATE TEMP TABLE mfv_text AS
+select T.k::text AS t from generate_series(1,3) AS T(k), generate_series(1,3) AS R(i)
+ where R.i <= T.k;
+select mfvsketch_top_histogram(t, 3)
+  from (select t from mfv_text union all select t || '' from mfv_text) AS S(t);
+DROP TABLE mfv_text;
@@ -0,0 +1,25 @@
+set search_path to "$user",public,madlib;
+
+-- one profile_column per input column, in column order
+CREATE TEMP TABLE profile_data AS
+SELECT i AS id,
+       CASE WHEN i % 3 = 0 THEN NULL ELSE (i - 5000) / 4.0::float8 END AS x,
+       (i % 10)::text AS name,
+       date '2011-01-01' + i % 365 AS d,
+       NULL::int8 AS nothing,
+       (i / 100.0)::numeric AS amount
+  FROM generate_series(1,10000) AS R(i);
+
+select (p).attname, (p).atttype, (p).count, (p).nulls, (p).dcount,
+       (p).min, (p).max, (p).avg, (p).median
+  from (select unnest(profile_row(T)) AS p
+          from (select id, x, name, d, nothing from profile_data) AS T) AS S;
+
+-- numerics are ordered and averaged through float8
+select (p).min, (p).max, (p).avg, (p).median
+  from (select unnest(profile_row(T)) AS p
+          from (select amount from profile_data) AS T) AS S;
+
+-- an empty input has no profile
+select profile_row(T) is null
+  from (select id, name from profile_data where id < 0) AS T;
@@ -0,0 +1,15 @@
+set search_path to "$user",public,madlib;
+
+-- exact quantiles of the values inside brackets around them
+select __quantile_refine(i::float8, array[0, 0.25, 0.5, 0.999, 1], array[1, 240, 500, 990, 1000], array[10, 260, 500, 1000, 1000]) from generate_series(1,1000) AS R(i);
+
+-- quantiles outside their brackets are NULL
+select __quantile_refine(i::float8, array[0.5, 0.7], array[600, 600], array[700, 800]) from generate_series(1,1000) AS R(i);
+
+-- values at the ends of the brackets are counted, not kept
+select __quantile_refine((i % 4)::float8, array[0.1, 0.6, 0.9], array[0, 1, 3], array[2, 3, 3]) from generate_series(1,1000) AS R(i);
+
+-- NULLs are ignored
+select __quantile_refine(CASE WHEN i % 2 = 0 THEN NULL ELSE i END::float8, array[0.5], array[400], array[600]) from generate_series(1,1000) AS R(i);
+select __quantile_refine(NULL::float8, array[0.5], array[0], array[1]) from generate_series(1,1000) AS R(i);
+select __quantile_refine(i::float8, array[1.5], array[0], array[1]) from generate_series(1,1000) AS R(i);
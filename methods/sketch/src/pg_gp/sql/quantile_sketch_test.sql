@@ -0,0 +1,29 @@
+set search_path to "$user",public,madlib;
+-- small inputs are summarized exactly
+select quantile_sketch_estimate(quantile_sketch(i), 0.5) from generate_series(1,100) as R(i);
+select quantile_sketch_estimate(quantile_sketch(i), array[0, 0.25, 0.5, 0.99, 1])
+  from generate_series(1,100) as R(i);
+select quantile_sketch_cdf(quantile_sketch(i), 42) from generate_series(1,100) as R(i);
+-- larger inputs are within the rank error of the sketch
+select abs(quantile_sketch_estimate(quantile_sketch(i), 0.5) - 50000) <= 1700
+  from generate_series(1,100000) as R(i);
+select abs(quantile_sketch_cdf(quantile_sketch(i), 25000) - 0.25) <= 0.017
+  from generate_series(1,100000) as R(i);
+select abs(quantile_sketch_estimate(quantile_sketch(i, 20), 0.9) - 90000) <= 17000
+  from generate_series(1,100000) as R(i);
+-- numeric columns are cast to float8
+select quantile_sketch_estimate(quantile_sketch(i::numeric / 4), 0.5) between 120 and 130
+  from generate_series(1,1000) as R(i);
+-- union of stored sketches
+create temp table kll_parts as
+  select i % 4 as g, quantile_sketch(i) as s from generate_series(1,100000) as R(i) group by i % 4;
+select abs(quantile_sketch_estimate(quantile_sketch_union(s), 0.9) - 90000) <= 1700 from kll_parts;
+select abs(quantile_sketch_cdf(quantile_sketch_union(s), 25000) - 0.25) <= 0.017 from kll_parts;
+drop table kll_parts;
+-- NULLs are ignored
+select quantile_sketch_estimate(quantile_sketch(x), 0.5) from (values (1.0), (NULL), (3.0)) as R(x);
+select quantile_sketch(NULL::float8) from generate_series(1,100) as R(i);
+select quantile_sketch_estimate(quantile_sketch(i), 1.5) from generate_series(1,100) as R(i);
+select quantile_sketch(i, 4) from generate_series(1,100) as R(i);
+-- blobs without the tag of a kll_sketch are rejected
+select quantile_sketch_estimate(decode(repeat('01', 512), 'hex')::kll_sketch, 0.5);
@@ -0,0 +1,26 @@
+set search_path to "$user",public,madlib;
+-- samples have n distinct values of the column, or all of them
+select array_upper(reservoir_sample(i, 100), 1) from generate_series(1,10000) as R(i);
+select array_upper(reservoir_sample(i, 10), 1) from generate_series(1,5) as R(i);
+select array_upper(reservoir_sample(i::text, 20), 1) from generate_series(1,1000) as R(i);
+select count(distinct s.a[g.j]) from
+  (select reservoir_sample(i, 100) as a from generate_series(1,10000) as R(i)) s,
+  generate_series(1,100) as g(j);
+select avg(s.a[g.j]::int8) between 45000 and 55000 from
+  (select reservoir_sample(i, 1000) as a from generate_series(1,100000) as R(i)) s,
+  generate_series(1,1000) as g(j);
+-- weighted samples never include zero weights, and favor large ones
+select bool_and(s.a[g.j]::int4 % 2 = 0) from
+  (select weighted_reservoir_sample(i, (1 - i % 2)::float8, 50) as a
+     from generate_series(1,1000) as R(i)) s,
+  generate_series(1,50) as g(j);
+select array_upper(weighted_reservoir_sample(i, case when i <= 3 then 1 else 0 end, 10), 1)
+  from generate_series(1,1000) as R(i);
+select sum(case when s.a[g.j]::int4 % 2 = 0 then 1 else 0 end) between 55 and 95 from
+  (select weighted_reservoir_sample(i, 1 + 2*(1 - i % 2), 100) as a
+     from generate_series(1,100000) as R(i)) s,
+  generate_series(1,100) as g(j);
+-- tests for all-NULL column and bad parameters
+select reservoir_sample(NULL::integer, 10) from generate_series(1,100) as R(i);
+select reservoir_sample(i, 0) from generate_series(1,100) as R(i);
+select weighted_reservoir_sample(i, -1, 10) from generate_series(1,100) as R(i);
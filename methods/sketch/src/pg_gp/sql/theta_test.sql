@@ -0,0 +1,39 @@
+set search_path to "$user",public,madlib;
+-- counts and set operations are exact below the nominal number of entries
+select thetasketch_estimate(thetasketch(i)) from generate_series(1,1000) as R(i);
+select thetasketch_estimate(thetasketch(i::text)) from generate_series(1,1000) as R(i);
+create temp table theta_days as
+  select d, thetasketch(d*100 + i) as users
+    from generate_series(1,5) as D(d), generate_series(0,999) as R(i)
+   group by d;
+select thetasketch_estimate(thetasketch_union(users)) from theta_days;
+select thetasketch_estimate(thetasketch_intersect(users)) from theta_days;
+select thetasketch_estimate(thetasketch_union(a.users, b.users))
+  from theta_days a, theta_days b where a.d = 1 and b.d = 5;
+select thetasketch_estimate(thetasketch_intersect(a.users, b.users))
+  from theta_days a, theta_days b where a.d = 1 and b.d = 5;
+select thetasketch_estimate(thetasketch_a_not_b(a.users, b.users))
+  from theta_days a, theta_days b where a.d = 1 and b.d = 5;
+drop table theta_days;
+-- larger sets are estimated
+create temp table theta_sets as
+  select thetasketch(i) as a, thetasketch(i + 50000) as b from generate_series(1,100000) as R(i);
+select abs(thetasketch_estimate(a) - 100000) <= 5000 from theta_sets;
+select abs(thetasketch_estimate(thetasketch_intersect(a, b)) - 50000) <= 5000 from theta_sets;
+select abs(thetasketch_estimate(thetasketch_a_not_b(a, b)) - 50000) <= 5000 from theta_sets;
+select abs(thetasketch_estimate(thetasketch_union(a, b)) - 150000) <= 7500 from theta_sets;
+drop table theta_sets;
+select abs(thetasketch_estimate(thetasketch(i, 8)) - 100000) <= 20000
+  from generate_series(1,100000) as R(i);
+-- tests for all-NULL column
+select thetasketch(NULL::integer) from generate_series(1,100) as R(i);
+select thetasketch(i, 30) from generate_series(1,100) as R(i);
+select thetasketch_union(thetasketch(i), thetasketch(i::text)) from generate_series(1,100) as R(i);
+-- blobs without the tag of a theta_sketch are rejected
+select thetasketch_estimate(decode(repeat('01', 64), 'hex')::theta_sketch);
+-- text values hash the same read from a table as computed by an expression
+create temp table theta_text as
+  select i::text as t from generate_series(1,1000) as R(i);
+select thetasketch_estimate(thetasketch_intersect(a, b))
+  from (select thetasketch(t) as a, thetasketch(t || '') as b from theta_text) s;
+drop table theta_text;
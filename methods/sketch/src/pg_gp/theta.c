@@ -0,0 +1,630 @@
+/*!
+ * \file theta.c
+ *
+ * \brief Theta (KMV) sketch implementation
+ */
+/*!
+ * \implementation
+ * A Theta sketch, a refinement of the K Minimum Values (KMV) sketch, keeps
+ * every distinct hash below a threshold theta.  Hashes are 63-bit values
+ * treated as fractions of 2^63, so the sketch is a uniform sample of the
+ * distinct values at rate theta/2^63, and the number of distinct values is
+ * estimated as the number of hashes kept divided by that rate.  The
+ * standard error is about 1/sqrt(k) for a sketch of k nominal entries.
+ *
+ * While aggregating, the hashes below theta are kept in an open-addressing
+ * hash table.  Small tables double as they fill up; once the table holds
+ * 2k hashes it is rebuilt with only the k smallest, found by quickselect,
+ * and theta is lowered to the next one, so each row takes constant
+ * amortized time.  Stored sketches are "compact": just the hashes below
+ * theta in increasing order.
+ *
+ * Unlike FM and HLL sketches, Theta sketches support set operations whose
+ * results are sketches again.  Two sketches are combined at the smaller of
+ * their thetas, where both are uniform samples at the same rate:
+ *  - the union keeps the hashes in either, cut back to the k smallest;
+ *  - the intersection keeps the hashes in both;
+ *  - A and not B keeps the hashes in A but not in B.
+ * The relative error of an intersection or difference grows as the result
+ * gets small compared to its inputs.
+ *
+ * \literature
+ * [1] K. Beyer, P. Haas, B. Reinwald, Y. Sismanis and R. Gemulla.  On
+ *     Synopses for Distinct-Value Estimation Under Multiset Operations.
+ *     SIGMOD 2007.
+ * [2] A. Dasgupta, K. Lang, L. Rhodes and J. Thaler.  A Framework for
+ *     Estimating Stream Expression Cardinalities.  ICDT 2016.
+ */
+
+#include "postgres.h"
+#include "utils/elog.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include <math.h>
+
+#define THETA_DEFAULT_PRECISION 12 /*! 4096 nominal entries, about 1.6% standard error */
+#define THETA_MIN_PRECISION     4
+#define THETA_MAX_PRECISION     20
+#define THETA_INITIAL_SLOTS     32
+/*! theta of a sketch that has kept every hash, i.e. a sampling rate of 1 */
+#define THETA_MAX               (UINT64CONST(1) << 63)
+/*! marks an unused hash table slot; no 63-bit hash can take this value */
+#define THETA_EMPTY             (~UINT64CONST(0))
+
+/*!
+ * \internal
+ * \brief transition value struct for Theta sketches, also used as the
+ * serialized <c>theta_sketch</c> type.
+ *
+ * It is followed by an array of uint64 hashes.  While aggregating, the
+ * array is a hash table of nslots slots, THETA_EMPTY marking unused ones.
+ * Compact sketches have nslots == 0, and the array holds the nentries
+ * hashes in increasing order.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;      /*! SKETCH_MAGIC_THETA */
+    int32  hashver;    /*! SKETCH_HASH_* version used to build the sketch */
+    uint64 theta;      /*! every distinct hash below theta is kept */
+    Oid    typOid;     /*! Oid of the data type we are sketching */
+    uint32 nentries;   /*! number of hashes kept */
+    uint32 nslots;     /*! size of the hash table, 0 for a compact sketch */
+    uint8  precision;  /*! log2 of the nominal number of entries, k */
+} thetatransval;
+
+/*!
+ * the transval follows the varlena header after padding that aligns it,
+ * and the hashes after it, in memory
+ */
+#define THETA_TRANSVAL(blob) ((thetatransval *)((char *)(blob) + MAXALIGN(VARHDRSZ)))
+#define THETA_ENTRIES(t) ((uint64 *)((char *)(t) + MAXALIGN(sizeof(thetatransval))))
+/*! size of a Theta transval with room for n hashes */
+#define THETA_TRANSVAL_SZ(n) \
+    (MAXALIGN(VARHDRSZ) + MAXALIGN(sizeof(thetatransval)) + (n)*sizeof(uint64))
+/*! largest hash table of a sketch, at most half full with 2k hashes */
+#define THETA_MAX_SLOTS(p) ((uint32)1 << ((p) + 2))
+
+Datum __thetasketch_trans(PG_FUNCTION_ARGS);
+Datum __thetasketch_merge(PG_FUNCTION_ARGS);
+Datum __thetasketch_intersect_merge(PG_FUNCTION_ARGS);
+Datum __thetasketch_final(PG_FUNCTION_ARGS);
+Datum thetasketch_union(PG_FUNCTION_ARGS);
+Datum thetasketch_intersect(PG_FUNCTION_ARGS);
+Datum thetasketch_a_not_b(PG_FUNCTION_ARGS);
+Datum thetasketch_estimate(PG_FUNCTION_ARGS);
+bytea *theta_new(int, Oid, int, uint64, uint32, uint32);
+bytea *theta_insert_hash(bytea *, uint64);
+void   theta_check(bytea *);
+bytea *theta_union_c(bytea *, bytea *);
+bytea *theta_intersect_c(bytea *, bytea *);
+bytea *theta_a_not_b_c(bytea *, bytea *);
+float8 theta_estimate_c(thetatransval *);
+
+static int theta_cmp(const void *a, const void *b)
+{
+    uint64 x = *(const uint64 *)a;
+    uint64 y = *(const uint64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*!
+ * allocate a new Theta transval
+ * \param precision log2 of the nominal number of entries
+ * \param typOid the type to be sketched
+ * \param hashver the SKETCH_HASH_* version to build the sketch with
+ * \param theta the sampling threshold
+ * \param nslots size of the hash table, or 0 for a compact sketch
+ * \param nentries room for this many hashes in a compact sketch
+ */
+bytea *theta_new(int precision, Oid typOid, int hashver, uint64 theta,
+                 uint32 nslots, uint32 nentries)
+{
+    size_t         sz;
+    bytea         *blob;
+    thetatransval *transval;
+
+    if (precision < THETA_MIN_PRECISION || precision > THETA_MAX_PRECISION)
+        elog(ERROR, "Theta sketch precision must be between %d and %d, was %d",
+             THETA_MIN_PRECISION, THETA_MAX_PRECISION, precision);
+
+    sz = THETA_TRANSVAL_SZ(nslots > 0 ? nslots : nentries);
+    blob = (bytea *)palloc0(sz);
+    SET_VARSIZE(blob, sz);
+    transval = THETA_TRANSVAL(blob);
+    transval->magic = SKETCH_MAGIC_THETA;
+    transval->hashver = hashver;
+    transval->theta = theta;
+    transval->typOid = typOid;
+    transval->nslots = nslots;
+    transval->precision = precision;
+    if (nslots > 0)
+        memset(THETA_ENTRIES(transval), 0xFF, nslots*sizeof(uint64));
+    return blob;
+}
+
+/*! add a hash known to be below theta to a hash table with room for it */
+static void theta_table_add(thetatransval *transval, uint64 h)
+{
+    uint64 *slots = THETA_ENTRIES(transval);
+    uint32  mask = transval->nslots - 1;
+    uint32  i = (uint32)h & mask;
+
+    while (slots[i] != THETA_EMPTY) {
+        if (slots[i] == h)
+            return;
+        i = (i + 1) & mask;
+    }
+    slots[i] = h;
+    transval->nentries++;
+}
+
+/*!
+ * rearrange a so that a[k] is its k'th smallest element (counting from 0),
+ * with only smaller ones before it.  The elements must be distinct.
+ */
+static void theta_select(uint64 *a, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        uint64 pivot = a[k];
+        int    i = lo, j = hi;
+
+        do {
+            while (a[i] < pivot)
+                i++;
+            while (pivot < a[j])
+                j--;
+            if (i <= j) {
+                uint64 tmp = a[i];
+
+                a[i++] = a[j];
+                a[j--] = tmp;
+            }
+        } while (i <= j);
+        if (j < k)
+            lo = i;
+        if (k < i)
+            hi = j;
+    }
+}
+
+/*!
+ * the hashes of a sketch below its theta, in increasing order
+ * \param transval the sketch
+ */
+static uint64 *theta_sorted_entries(thetatransval *transval)
+{
+    uint64 *entries;
+    uint32  i, n = 0;
+
+    if (transval->nslots == 0)
+        return THETA_ENTRIES(transval);
+
+    entries = (uint64 *)palloc(Max(transval->nentries, 1)*sizeof(uint64));
+    for (i = 0; i < transval->nslots; i++)
+        if (THETA_ENTRIES(transval)[i] != THETA_EMPTY)
+            entries[n++] = THETA_ENTRIES(transval)[i];
+    qsort(entries, n, sizeof(uint64), theta_cmp);
+    return entries;
+}
+
+/*!
+ * rebuild the hash table of a sketch with a given number of slots.  If it
+ * holds more than k hashes, only the k smallest are kept and theta drops to
+ * the next smallest.
+ * \param blob a bytea holding a thetatransval with a hash table
+ * \param nslots the size of the new table, a power of two
+ */
+static bytea *theta_rebuild(bytea *blob, uint32 nslots)
+{
+    thetatransval *transval = THETA_TRANSVAL(blob);
+    thetatransval *newval;
+    bytea         *newblob;
+    uint64        *entries;
+    uint32         k = (uint32)1 << transval->precision;
+    uint32         i, n = 0;
+
+    entries = (uint64 *)palloc(Max(transval->nentries, 1)*sizeof(uint64));
+    for (i = 0; i < transval->nslots; i++)
+        if (THETA_ENTRIES(transval)[i] != THETA_EMPTY)
+            entries[n++] = THETA_ENTRIES(transval)[i];
+
+    newblob = theta_new(transval->precision, transval->typOid,
+                        transval->hashver, transval->theta, nslots, 0);
+    newval = THETA_TRANSVAL(newblob);
+    if (n > k) {
+        theta_select(entries, n, k);
+        newval->theta = entries[k];
+        n = k;
+    }
+    for (i = 0; i < n; i++)
+        theta_table_add(newval, entries[i]);
+    pfree(entries);
+    return newblob;
+}
+
+/*!
+ * add a hash to a sketch that is being aggregated
+ * \param blob a bytea holding a thetatransval
+ * \param hash a 64-bit hash value
+ */
+bytea *theta_insert_hash(bytea *blob, uint64 hash)
+{
+    thetatransval *transval = THETA_TRANSVAL(blob);
+    uint64         h = hash >> 1;
+
+    if (h >= transval->theta)
+        return blob;
+
+    /* a compact sketch from a merge becomes a table again */
+    if (transval->nslots == 0) {
+        uint32 nslots = THETA_INITIAL_SLOTS;
+        uint32 i;
+
+        while (nslots < 2*transval->nentries + 2)
+            nslots *= 2;
+        blob = theta_new(transval->precision, transval->typOid,
+                         transval->hashver, transval->theta, nslots, 0);
+        for (i = 0; i < transval->nentries; i++)
+            theta_table_add(THETA_TRANSVAL(blob), THETA_ENTRIES(transval)[i]);
+        transval = THETA_TRANSVAL(blob);
+    }
+
+    theta_table_add(transval, h);
+
+    /* keep the table at most half full */
+    if (2*transval->nentries > transval->nslots)
+        blob = theta_rebuild(blob, Min(2*transval->nslots,
+                                       THETA_MAX_SLOTS(transval->precision)));
+    return blob;
+}
+
+PG_FUNCTION_INFO_V1(__thetasketch_trans);
+
+/*!
+ * UDA transition function for the thetasketch aggregates.
+ * An optional third argument gives the precision of the sketch.
+ */
+Datum __thetasketch_trans(PG_FUNCTION_ARGS)
+{
+    bytea          *transblob = PG_GETARG_BYTEA_P(0);
+    sketch_typinfo *typinfo;
+    uint64          hash[SKETCH_HASHLEN/sizeof(uint64)];
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* ignore NULL inputs */
+    if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
+    /* the input type never changes between calls, so it's looked up once */
+    typinfo = sketch_arg_typinfo(fcinfo, 1);
+
+    /* initialize if this is the first call */
+    if (VARSIZE(transblob) <= VARHDRSZ) {
+        int precision = THETA_DEFAULT_PRECISION;
+
+        if (PG_NARGS() > 2 && !PG_ARGISNULL(2))
+            precision = PG_GETARG_INT32(2);
+        transblob = theta_new(precision, typinfo->typOid, SKETCH_HASH_CURRENT,
+                              THETA_MAX, THETA_INITIAL_SLOTS, 0);
+    }
+
+    sketch_hash_contents(PG_GETARG_DATUM(1), typinfo->typLen, typinfo->typByVal,
+                         THETA_TRANSVAL(transblob)->hashver, (uint8 *)hash);
+    PG_RETURN_DATUM(PointerGetDatum(theta_insert_hash(transblob, hash[0])));
+}
+
+/*!
+ * sanity-check a serialized Theta sketch, which may have come from a table.
+ * \param blob a bytea holding a thetatransval
+ */
+void theta_check(bytea *blob)
+{
+    thetatransval *transval = THETA_TRANSVAL(blob);
+
+    if (VARSIZE(blob) < THETA_TRANSVAL_SZ(0))
+        elog(ERROR, "invalid Theta sketch");
+    sketch_require_tag((char *)transval, sizeof(thetatransval),
+                       SKETCH_MAGIC_THETA, "Theta sketch");
+    if (transval->precision < THETA_MIN_PRECISION
+        || transval->precision > THETA_MAX_PRECISION
+        || transval->theta == 0 || transval->theta > THETA_MAX
+        || (transval->nslots == 0
+            && VARSIZE(blob) != THETA_TRANSVAL_SZ(transval->nentries))
+        || (transval->nslots > 0
+            && ((transval->nslots & (transval->nslots - 1)) != 0
+                || transval->nentries > transval->nslots
+                || VARSIZE(blob) != THETA_TRANSVAL_SZ(transval->nslots))))
+        elog(ERROR, "invalid Theta sketch");
+}
+
+/*!
+ * check that two sketches can be combined, and return the sampling
+ * threshold they are combined at
+ */
+static uint64 theta_compatible(bytea *blob1, bytea *blob2)
+{
+    thetatransval *transval1, *transval2;
+
+    theta_check(blob1);
+    theta_check(blob2);
+    transval1 = THETA_TRANSVAL(blob1);
+    transval2 = THETA_TRANSVAL(blob2);
+
+    if (transval1->hashver != transval2->hashver)
+        elog(ERROR,
+             "cannot combine Theta sketches built with different hash functions: %d, %d",
+             transval1->hashver, transval2->hashver);
+    if (transval1->typOid != transval2->typOid)
+        elog(ERROR,
+             "cannot combine Theta sketches computed over different types: %u, %u",
+             transval1->typOid, transval2->typOid);
+    return Min(transval1->theta, transval2->theta);
+}
+
+/*!
+ * union of two Theta sketches, as a new compact sketch with the smaller
+ * of their nominal numbers of entries
+ * \param blob1 a bytea holding a thetatransval
+ * \param blob2 a bytea holding a thetatransval
+ */
+bytea *theta_union_c(bytea *blob1, bytea *blob2)
+{
+    uint64         theta = theta_compatible(blob1, blob2);
+    thetatransval *transval1 = THETA_TRANSVAL(blob1);
+    thetatransval *transval2 = THETA_TRANSVAL(blob2);
+    int            precision = Min(transval1->precision, transval2->precision);
+    uint32         k = (uint32)1 << precision;
+    uint64        *e1 = theta_sorted_entries(transval1);
+    uint64        *e2 = theta_sorted_entries(transval2);
+    uint64        *entries;
+    bytea         *newblob;
+    uint32         i = 0, j = 0, n = 0;
+
+    newblob = theta_new(precision, transval1->typOid, transval1->hashver, theta,
+                        0, Min(transval1->nentries + transval2->nentries, k));
+    entries = THETA_ENTRIES(THETA_TRANSVAL(newblob));
+
+    /* merge the sorted hashes below theta, stopping at the k+1'st */
+    for (;;) {
+        uint64 h;
+
+        if (i < transval1->nentries && e1[i] < theta
+            && !(j < transval2->nentries && e2[j] < e1[i]))
+            h = e1[i];
+        else if (j < transval2->nentries && e2[j] < theta)
+            h = e2[j];
+        else
+            break;
+        if (i < transval1->nentries && e1[i] == h)
+            i++;
+        if (j < transval2->nentries && e2[j] == h)
+            j++;
+
+        if (n == k) {
+            theta = h;
+            break;
+        }
+        entries[n++] = h;
+    }
+
+    THETA_TRANSVAL(newblob)->theta = theta;
+    THETA_TRANSVAL(newblob)->nentries = n;
+    SET_VARSIZE(newblob, THETA_TRANSVAL_SZ(n));
+    return newblob;
+}
+
+/*!
+ * intersection of two Theta sketches, as a new compact sketch
+ * \param blob1 a bytea holding a thetatransval
+ * \param blob2 a bytea holding a thetatransval
+ */
+bytea *theta_intersect_c(bytea *blob1, bytea *blob2)
+{
+    uint64         theta = theta_compatible(blob1, blob2);
+    thetatransval *transval1 = THETA_TRANSVAL(blob1);
+    thetatransval *transval2 = THETA_TRANSVAL(blob2);
+    uint64        *e1 = theta_sorted_entries(transval1);
+    uint64        *e2 = theta_sorted_entries(transval2);
+    uint64        *entries;
+    bytea         *newblob;
+    uint32         i = 0, j = 0, n = 0;
+
+    newblob = theta_new(Min(transval1->precision, transval2->precision),
+                        transval1->typOid, transval1->hashver, theta, 0,
+                        Min(transval1->nentries, transval2->nentries));
+    entries = THETA_ENTRIES(THETA_TRANSVAL(newblob));
+
+    while (i < transval1->nentries && j < transval2->nentries
+           && e1[i] < theta && e2[j] < theta) {
+        if (e1[i] < e2[j])
+            i++;
+        else if (e2[j] < e1[i])
+            j++;
+        else {
+            entries[n++] = e1[i];
+            i++;
+            j++;
+        }
+    }
+
+    THETA_TRANSVAL(newblob)->nentries = n;
+    SET_VARSIZE(newblob, THETA_TRANSVAL_SZ(n));
+    return newblob;
+}
+
+/*!
+ * the values of one Theta sketch that are not in another, as a new
+ * compact sketch
+ * \param blob1 a bytea holding a thetatransval
+ * \param blob2 a bytea holding a thetatransval
+ */
+bytea *theta_a_not_b_c(bytea *blob1, bytea *blob2)
+{
+    uint64         theta = theta_compatible(blob1, blob2);
+    thetatransval *transval1 = THETA_TRANSVAL(blob1);
+    thetatransval *transval2 = THETA_TRANSVAL(blob2);
+    uint64        *e1 = theta_sorted_entries(transval1);
+    uint64        *e2 = theta_sorted_entries(transval2);
+    uint64        *entries;
+    bytea         *newblob;
+    uint32         i, j = 0, n = 0;
+
+    newblob = theta_new(Min(transval1->precision, transval2->precision),
+                        transval1->typOid, transval1->hashver, theta, 0,
+                        transval1->nentries);
+    entries = THETA_ENTRIES(THETA_TRANSVAL(newblob));
+
+    for (i = 0; i < transval1->nentries && e1[i] < theta; i++) {
+        while (j < transval2->nentries && e2[j] < e1[i])
+            j++;
+        if (j == transval2->nentries || e2[j] != e1[i])
+            entries[n++] = e1[i];
+    }
+
+    THETA_TRANSVAL(newblob)->nentries = n;
+    SET_VARSIZE(newblob, THETA_TRANSVAL_SZ(n));
+    return newblob;
+}
+
+PG_FUNCTION_INFO_V1(__thetasketch_merge);
+
+/*!
+ * Greenplum "prefunc" to combine Theta sketches from multiple machines,
+ * and transition function of the thetasketch_union aggregate.
+ */
+Datum __thetasketch_merge(PG_FUNCTION_ARGS)
+{
+    bytea *transblob1 = PG_GETARG_SKETCH_P(0);
+    bytea *transblob2 = PG_GETARG_SKETCH_P(1);
+
+    /* deal with the case where one or both items is the initial value of '' */
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    PG_RETURN_DATUM(PointerGetDatum(theta_union_c(transblob1, transblob2)));
+}
+
+PG_FUNCTION_INFO_V1(__thetasketch_intersect_merge);
+
+/*!
+ * transition function and Greenplum "prefunc" of the thetasketch_intersect
+ * aggregate.  The initial value of '' stands for the set of all values.
+ */
+Datum __thetasketch_intersect_merge(PG_FUNCTION_ARGS)
+{
+    bytea *transblob1 = PG_GETARG_SKETCH_P(0);
+    bytea *transblob2 = PG_GETARG_SKETCH_P(1);
+
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    if (VARSIZE(transblob2) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob1));
+
+    PG_RETURN_DATUM(PointerGetDatum(theta_intersect_c(transblob1, transblob2)));
+}
+
+PG_FUNCTION_INFO_V1(__thetasketch_final);
+
+/*!
+ * UDA final function producing a storable theta_sketch: at most k hashes
+ * below theta, in increasing order.
+ */
+Datum __thetasketch_final(PG_FUNCTION_ARGS)
+{
+    bytea         *transblob = PG_GETARG_BYTEA_P(0);
+    thetatransval *transval = THETA_TRANSVAL(transblob);
+    bytea         *retval;
+    uint64        *entries;
+    uint64         theta;
+    uint32         n, k;
+
+    /* nothing was ever aggregated */
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+
+    if (transval->nslots == 0)
+        PG_RETURN_BYTEA_P(transblob);
+
+    entries = theta_sorted_entries(transval);
+    theta = transval->theta;
+    n = transval->nentries;
+    k = (uint32)1 << transval->precision;
+    if (n > k) {
+        theta = entries[k];
+        n = k;
+    }
+    retval = theta_new(transval->precision, transval->typOid, transval->hashver,
+                       theta, 0, n);
+    THETA_TRANSVAL(retval)->nentries = n;
+    memcpy(THETA_ENTRIES(THETA_TRANSVAL(retval)), entries, n*sizeof(uint64));
+    PG_RETURN_BYTEA_P(retval);
+}
+
+PG_FUNCTION_INFO_V1(thetasketch_union);
+
+/*! scalar function for the union of two stored theta_sketches */
+Datum thetasketch_union(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BYTEA_P(theta_union_c(PG_GETARG_SKETCH_P(0), PG_GETARG_SKETCH_P(1)));
+}
+
+PG_FUNCTION_INFO_V1(thetasketch_intersect);
+
+/*! scalar function for the intersection of two stored theta_sketches */
+Datum thetasketch_intersect(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BYTEA_P(theta_intersect_c(PG_GETARG_SKETCH_P(0),
+                                        PG_GETARG_SKETCH_P(1)));
+}
+
+PG_FUNCTION_INFO_V1(thetasketch_a_not_b);
+
+/*!
+ * scalar function for the values of a stored theta_sketch that are not
+ * in another
+ */
+Datum thetasketch_a_not_b(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BYTEA_P(theta_a_not_b_c(PG_GETARG_SKETCH_P(0),
+                                      PG_GETARG_SKETCH_P(1)));
+}
+
+/*!
+ * estimate the number of distinct values in a Theta sketch
+ * \param transval the sketch
+ */
+float8 theta_estimate_c(thetatransval *transval)
+{
+    if (transval->theta == THETA_MAX)
+        return transval->nentries;
+    return transval->nentries / ldexp((float8)transval->theta, -63);
+}
+
+PG_FUNCTION_INFO_V1(thetasketch_estimate);
+
+/*! scalar function to get count(distinct) out of a stored theta_sketch */
+Datum thetasketch_estimate(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_SKETCH_P(0);
+
+    theta_check(blob);
+    PG_RETURN_INT64((int64)rint(theta_estimate_c(THETA_TRANSVAL(blob))));
+}
@@ -47,7 +47,8 @@ PG_FUNCTION_INFO_V1( svec_dimension );
 
 Datum svec_dimension(PG_FUNCTION_ARGS)
 {
-	SvecType *svec = PG_GETARG_SVECTYPE_P(0);
+	/* Only the dimension is needed, so don't detoast the whole vector */
+	SvecType *svec = PG_GETARG_SVECTYPE_P_SLICE(0,0,sizeof(int4));
 	if (svec->dimension == -1) PG_RETURN_INT32(1);
 	else PG_RETURN_INT32(svec->dimension);
 }
@@ -168,6 +169,86 @@ Datum svec_append(PG_FUNCTION_ARGS)
 }
 
 
+/**
+ * Fetches only the header of a (possibly toasted) svec: the dimension,
+ * the SparseDataStruct and the StringInfoData structs for the values and
+ * the index, but none of the data areas.
+ */
+static SvecType *svec_slice_header(Datum d)
+{
+	return (SvecType *) PG_DETOAST_DATUM_SLICE(d,0,SVEC_SLICE_HDRSIZE);
+}
+
+/**
+ * Fetches the runs of a (possibly toasted) svec that cover the elements
+ * lo..hi (1-based, inclusive), without detoasting the rest of the values.
+ * The RLE index is read to locate the runs, then only the values of those
+ * runs are sliced out.
+ *
+ * @param d The svec datum
+ * @param hdr The header of d, as returned by svec_slice_header()
+ * @param lo,hi The range of elements needed, 0 < lo <= hi <= dimension
+ * @param offset Set to the number of elements preceding the first run
+ *        returned, i.e. element i of d is element i-offset of the result
+ * @return A SparseData holding just the runs covering lo..hi
+ */
+static SparseData svec_slice_runs(Datum d, SvecType *hdr, int lo, int hi,
+		int *offset)
+{
+	SparseData sdata = (SparseData)SVEC_SDATAPTR(hdr);
+	int index_size = SVEC_INDEX_SIZE(hdr);
+	char *index;
+	char *ix, *first_ix = NULL;
+	int first, last, read, index_len;
+	char *vals;
+	int vals_len;
+
+	/*
+	 * Every run has an entry in the index, so only an svec with no runs
+	 * has none.  Nothing is gained by slicing that, so detoast it whole.
+	 */
+	if (index_size == 0)
+	{
+		*offset = 0;
+		return sdata_from_svec((SvecType *)PG_DETOAST_DATUM(d));
+	}
+
+	/* The index is small compared to the values, so read all of it */
+	index = VARDATA(PG_DETOAST_DATUM_SLICE(d,
+			SVEC_SLICE_INDEX_OFFSET(hdr),index_size));
+	ix = index;
+	first = -1;
+	last = sdata->unique_value_count-1;
+	read = 0;
+	for (int i=0; i<sdata->unique_value_count; i++)
+	{
+		int64 run_len = compword_to_int8(ix);
+		if (first < 0 && read + run_len >= lo)
+		{
+			first = i;
+			first_ix = ix;
+			*offset = read;
+		}
+		read += run_len;
+		ix += int8compstoragesize(ix);
+		if (read >= hi)
+		{
+			last = i;
+			break;
+		}
+	}
+	index_len = ix - first_ix;
+
+	/* copy the values out of the slice to get them properly aligned */
+	vals_len = (last-first+1)*sizeof(float8);
+	vals = (char *)palloc(vals_len);
+	memcpy(vals,VARDATA(PG_DETOAST_DATUM_SLICE(d,
+			SVEC_SLICE_HDRSIZE+first*sizeof(float8),vals_len)),vals_len);
+
+	return makeInplaceSparseData(vals,first_ix,vals_len,index_len,
+			sdata->type_of_data,last-first+1,read-*offset);
+}
+
 /**
  *  svec_proj - projects onto an element of an svec
  */
@@ -178,15 +259,23 @@ Datum svec_proj(PG_FUNCTION_ARGS)
 	if (PG_ARGISNULL(0))
 		PG_RETURN_NULL();
 
-	SvecType * sv = PG_GETARG_SVECTYPE_P(0);
+	Datum svdatum = PG_GETARG_DATUM(0);
+	SvecType * hdr = svec_slice_header(svdatum);
 	int idx = PG_GETARG_INT32(1);
+	int offset;
 
-	SparseData in = sdata_from_svec(sv);
-	double ret = sd_proj(in,idx);
+	/* error checking */
+	if (0 >= idx || idx > SVEC_TOTAL_VALCNT(hdr))
+		ereport(ERROR, 
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("Index out of bounds.")));
+
+	SparseData in = svec_slice_runs(svdatum,hdr,idx,idx,&offset);
+	double ret = sd_proj(in,idx-offset);
 
 	if (IS_NVP(ret)) PG_RETURN_NULL();
 
-	PG_RETURN_FLOAT8(sd_proj(in,idx));
+	PG_RETURN_FLOAT8(ret);
 }
 
 /**
@@ -199,12 +288,23 @@ Datum svec_subvec(PG_FUNCTION_ARGS)
 	if (PG_ARGISNULL(0))
 		PG_RETURN_NULL();
 
-	SvecType * sv = PG_GETARG_SVECTYPE_P(0);
+	Datum svdatum = PG_GETARG_DATUM(0);
+	SvecType * hdr = svec_slice_header(svdatum);
 	int start = PG_GETARG_INT32(1);
 	int end   = PG_GETARG_INT32(2);
+	int lo = Min(start,end);
+	int hi = Max(start,end);
+	int offset;
 
-	SparseData in = sdata_from_svec(sv);
-	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(subarr(in,start,end),true));
+	/* error checking */
+	if (0 >= lo || hi > SVEC_TOTAL_VALCNT(hdr))
+		ereport(ERROR, 
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("Array index out of bounds.")));
+
+	SparseData in = svec_slice_runs(svdatum,hdr,lo,hi,&offset);
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(
+				subarr(in,start-offset,end-offset),true));
 }
 
 /**
@@ -1461,9 +1561,6 @@ compar_float8(const void *left,const void *right)
 	else { return 1; }
 }
 
-static int
-real_index_calc_dense(const int idx,const char **lists,const size_t nlists,const size_t *widths) {return idx;}
-
 static int
 real_index_calc_sparse_RLE(const int idx,const char **lists,const size_t nlists,const size_t *widths)
 {
@@ -1479,16 +1576,174 @@ real_index_calc_sparse_RLE(const int idx,const char **lists,const size_t nlists,
 	return (index);
 }
 
+/*
+ * Introselect on a private, dense array of float8s.
+ *
+ * The generic partition_select() above moves every value through memcpy
+ * on a list of lists and draws a random() pivot each round.  For the dense
+ * case we know the values are plain doubles, so we use a 3-way (Dijkstra)
+ * partition around a median-of-3 pivot, which also copes with long runs of
+ * equal values.  If the recursion gets deeper than 2*log2(n) we fall back to
+ * sorting the remaining range, which bounds the worst case at O(n log n).
+ *
+ * NaNs do not compare, so float8_select_prepare() moves them to the end of
+ * the array first; they are ordered after every other value, as with
+ * compar_float8().
+ */
+#define FLOAT8_SWAP(a,i,j)	{ float8 tmp_ = (a)[i]; (a)[i] = (a)[j]; (a)[j] = tmp_; }
+
+static inline float8
+float8_median3(float8 a, float8 b, float8 c)
+{
+	if (a < b)
+	{
+		if (b < c) return b;
+		return (a < c) ? c : a;
+	}
+	if (a < c) return a;
+	return (b < c) ? c : b;
+}
+
+/*
+ * Rearranges array[lo..hi] so that for every k in ks[0..nks-1] (sorted
+ * ascending, all within lo..hi) array[k] holds the value of rank k, with
+ * smaller values to its left and larger ones to its right.  Partitions are
+ * shared between the requested ranks.
+ */
+static void
+float8_multiselect(float8 *array, int lo, int hi, const int *ks, int nks,
+		int depth)
+{
+	while (nks > 0 && lo < hi)
+	{
+		if (depth-- <= 0)
+		{
+			qsort(array+lo,hi-lo+1,sizeof(float8),compar_float8);
+			return;
+		}
+
+		float8 pivot = float8_median3(array[lo],array[lo+(hi-lo)/2],array[hi]);
+		int lt = lo, gt = hi, i = lo;
+
+		/* array[lo..lt-1] < pivot, array[lt..gt] == pivot, array[gt+1..hi] > pivot */
+		while (i <= gt)
+		{
+			if (array[i] < pivot)
+			{
+				FLOAT8_SWAP(array,lt,i);
+				lt++; i++;
+			} else if (array[i] > pivot)
+			{
+				FLOAT8_SWAP(array,i,gt);
+				gt--;
+			} else i++;
+		}
+
+		/* split the requested ranks between the left and right parts */
+		int nleft = 0, nright = 0;
+		while (nleft < nks && ks[nleft] < lt) nleft++;
+		while (nright < nks-nleft && ks[nks-1-nright] > gt) nright++;
+
+		/* recurse on the smaller side, loop on the other */
+		if (nleft <= nright)
+		{
+			float8_multiselect(array,lo,lt-1,ks,nleft,depth);
+			ks += nks-nright;
+			nks = nright;
+			lo = gt+1;
+		} else
+		{
+			float8_multiselect(array,gt+1,hi,ks+nks-nright,nright,depth);
+			nks = nleft;
+			hi = lt-1;
+		}
+	}
+}
+
+/*
+ * Moves NaNs to the end of the array and returns the number of other values.
+ */
+static int
+float8_select_prepare(float8 *array, int len)
+{
+	int n = len;
+
+	for (int i=0; i<n; i++)
+	{
+		if (isnan(array[i]))
+		{
+			n--;
+			FLOAT8_SWAP(array,i,n);
+			i--;
+		}
+	}
+	return(n);
+}
+
+static inline int
+float8_select_depth(int len)
+{
+	int depth = 0;
+	for (; len > 1; len >>= 1) depth += 2;
+	return(depth);
+}
+
+/*
+ * Partially orders array so that array[k] holds its value of rank k, and
+ * returns k.
+ */
 static int
 float8arr_partition_internal(float8 *array,int len,int k)
 {
-	size_t width=sizeof(float8);
-	char *list = (char *)array;
-	int index = partition_select(&list,1,&width,
-				0,len-1,
-			   	k,compar_float8,
-				real_index_calc_dense);
-	return (index);
+	int n = float8_select_prepare(array,len);
+
+	if (k < n)
+		float8_multiselect(array,0,n-1,&k,1,float8_select_depth(n));
+	return (k);
+}
+
+/*
+ * Raises an error unless array is a float8[] of at most one dimension;
+ * fname names the caller in the message.
+ */
+static void
+float8arr_check(ArrayType *array, const char *fname)
+{
+	if (ARR_ELEMTYPE(array) != FLOAT8OID)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("%s only defined over float8[]",fname)));
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("%s only defined over 1 dimensional arrays",fname)));
+}
+
+/*
+ * Copies the values of a float8[] into a private buffer for selection.
+ * Returns NULL if the array contains NULLs or NVPs.
+ */
+static float8 *
+float8arr_select_buffer(ArrayType *array, int *len)
+{
+	int num = ArrayGetNItems(ARR_NDIM(array),ARR_DIMS(array));
+	float8 *vals = (float8 *)ARR_DATA_PTR(array);
+	float8 *buf;
+
+	*len = num;
+	if (ARR_HASNULL(array))
+		return(NULL);
+	buf = (float8 *)palloc(sizeof(float8)*Max(num,1));
+	for (int i=0; i<num; i++)
+	{
+		if (IS_NVP(vals[i]))
+		{
+			pfree(buf);
+			return(NULL);
+		}
+		buf[i] = vals[i];
+	}
+	return(buf);
 }
 
 /**
@@ -1500,25 +1755,95 @@ PG_FUNCTION_INFO_V1( float8arr_median);
 
 Datum
 float8arr_median(PG_FUNCTION_ARGS) {
-	ArrayType *array  = PG_GETARG_ARRAYTYPE_P_COPY(0);
-	SparseData sdata = sdata_uncompressed_from_float8arr_internal(array);
-	int index,median_index = (sdata->total_value_count-1)/2;
+	ArrayType *array  = PG_GETARG_ARRAYTYPE_P(0);
+	int len;
+	float8 *vals;
+	int index;
 	float8 ret;
 
-	double * vals = (double *)(sdata->vals->data); 
-	for (int i=0; i<sdata->unique_value_count; i++)
-		if (IS_NVP(vals[i])) 
-			PG_RETURN_NULL();
+	float8arr_check(array,"vec_median");
+	vals = float8arr_select_buffer(array,&len);
+	if (vals == NULL || len == 0)
+		PG_RETURN_NULL();
 
-	index = float8arr_partition_internal((double *)(sdata->vals->data),
-					     sdata->total_value_count,
-					     median_index);
+	index = float8arr_partition_internal(vals,len,(len-1)/2);
 
-	ret = ((float8 *)(sdata->vals->data))[index];
+	ret = vals[index];
+	pfree(vals);
 	if (IS_NVP(ret)) PG_RETURN_NULL();
 	PG_RETURN_FLOAT8(ret);
 }
 
+static int
+compar_int(const void *left,const void *right)
+{
+	return (*(int *)left - *(int *)right);
+}
+
+/**
+ * Computes several quantiles of an array of float8s in one pass of
+ * selection.  The quantile q of n values is the value of rank
+ * floor(q*(n-1)), so that q = 0.5 agrees with vec_median().
+ */
+Datum float8arr_quantiles(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1( float8arr_quantiles);
+
+Datum
+float8arr_quantiles(PG_FUNCTION_ARGS) {
+	ArrayType *array  = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType *qarray = PG_GETARG_ARRAYTYPE_P(1);
+	int len, n, nq, nks;
+	float8 *vals;
+	float8 *qs;
+	float8 *ret;
+	int *ranks, *ks;
+
+	float8arr_check(array,"vec_quantiles");
+	float8arr_check(qarray,"vec_quantiles");
+	if (ARR_HASNULL(qarray))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("quantiles cannot be NULL")));
+	vals = float8arr_select_buffer(array,&len);
+	if (vals == NULL || len == 0)
+		PG_RETURN_NULL();
+
+	nq = ArrayGetNItems(ARR_NDIM(qarray),ARR_DIMS(qarray));
+	qs = (float8 *)ARR_DATA_PTR(qarray);
+	ranks = (int *)palloc(sizeof(int)*Max(nq,1));
+	ks = (int *)palloc(sizeof(int)*Max(nq,1));
+	for (int i=0; i<nq; i++)
+	{
+		if (!(qs[i] >= 0 && qs[i] <= 1))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("quantiles must be between 0 and 1, was %f",qs[i])));
+		ranks[i] = ks[i] = (int)floor(qs[i]*(len-1));
+	}
+
+	/* select all the distinct ranks at once */
+	qsort(ks,nq,sizeof(int),compar_int);
+	nks = 0;
+	for (int i=0; i<nq; i++)
+		if (nks == 0 || ks[nks-1] != ks[i])
+			ks[nks++] = ks[i];
+
+	n = float8_select_prepare(vals,len);
+	while (nks > 0 && ks[nks-1] >= n) nks--;
+	float8_multiselect(vals,0,n-1,ks,nks,float8_select_depth(n));
+
+	ret = (float8 *)palloc(sizeof(float8)*Max(nq,1));
+	for (int i=0; i<nq; i++)
+		ret[i] = vals[ranks[i]];
+
+	pfree(vals);
+	pfree(ranks);
+	pfree(ks);
+	PG_RETURN_ARRAYTYPE_P(construct_array((Datum *)ret,nq,FLOAT8OID,
+			sizeof(float8),true,'d'));
+}
+
 /**
  * Computes the median of a sparse vector
  */
@@ -26,6 +26,8 @@ typedef struct {
 #define DatumGetSvecTypePCopy(X)       ((SvecType *) PG_DETOAST_DATUM_COPY(X))
 #define PG_GETARG_SVECTYPE_P(n)        DatumGetSvecTypeP(PG_GETARG_DATUM(n))
 #define PG_GETARG_SVECTYPE_P_COPY(n)   DatumGetSvecTypePCopy(PG_GETARG_DATUM(n))
+#define PG_GETARG_SVECTYPE_P_SLICE(n,off,len) \
+	((SvecType *) PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(n),(off),(len)))
 #define PG_RETURN_SVECTYPE_P(x)        PG_RETURN_POINTER(x)
 
 /* Below are the locations of the SparseData values within the serialized
@@ -47,6 +49,15 @@ typedef struct {
 #define SVEC_INDEX_SIZE(x) 	(SDATA_INDEX_SIZE(SVEC_SDATAPTR(x)))
 #define SVEC_INDEX_PTR(x) 	(SDATA_INDEX_PTR(SVEC_SDATAPTR(x)))
 
+/* Offsets used when fetching only part of a toasted svec with
+ * PG_DETOAST_DATUM_SLICE.  Slice offsets do not count the varlena header.
+ *
+ * SVEC_SLICE_HDRSIZE covers the dimension, the SparseDataStruct and the two
+ * StringInfoData structs, i.e. everything up to the start of the values.
+ */
+#define SVEC_SLICE_HDRSIZE	(sizeof(int4)+SIZEOF_SPARSEDATAHDR+2*sizeof(StringInfoData))
+#define SVEC_SLICE_INDEX_OFFSET(x)	(SVEC_SLICE_HDRSIZE+SVEC_DATA_SIZE(x))
+
 /** @return True if input is a scalar */
 #define IS_SCALAR(x)	(((x)->dimension) < 0 ? 1 : 0 )
 